@@ -0,0 +1,415 @@
+/*
+    delaunay
+    Delaunay triangulation of the ELAS support points
+    Copyright (C) 2010 Bob Mottram
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "delaunay.h"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+Delaunay::Delaunay () {
+	no_of_points = 0;
+	complete = false;
+	valid = false;
+	last = 0;
+	mark = 0;
+}
+
+// twice the signed area of triangle abc, positive if c is to the left of a->b
+inline int64_t Delaunay::orient (int32_t a,int32_t b,int32_t c) const {
+	return (int64_t)(px[b]-px[a])*(py[c]-py[a]) - (int64_t)(py[b]-py[a])*(px[c]-px[a]);
+}
+
+// positive if d lies inside the circumcircle of the positively oriented triangle abc.
+// With coordinate differences below DELAUNAY_MAX_RANGE every term fits within 64 bits
+inline int64_t Delaunay::incircle (int32_t a,int32_t b,int32_t c,int32_t d) const {
+	int64_t adx = px[a]-px[d], ady = py[a]-py[d];
+	int64_t bdx = px[b]-px[d], bdy = py[b]-py[d];
+	int64_t cdx = px[c]-px[d], cdy = py[c]-py[d];
+	return (adx*adx+ady*ady)*(bdx*cdy-cdx*bdy) +
+	       (bdx*bdx+bdy*bdy)*(cdx*ady-adx*cdy) +
+	       (cdx*cdx+cdy*cdy)*(adx*bdy-bdx*ady);
+}
+
+// index of the vertex at infinity of face f, or 3 for a solid triangle
+inline int32_t Delaunay::infinite (int32_t f) const {
+	const face &F = faces[f];
+	return F.v[0]<0 ? 0 : F.v[1]<0 ? 1 : F.v[2]<0 ? 2 : 3;
+}
+
+inline void Delaunay::replaceNeighbour (int32_t f,int32_t old_face,int32_t new_face) {
+	face &F = faces[f];
+	for (int32_t k=0; k<3; k++)
+		if (F.n[k]==old_face)
+			F.n[k] = new_face;
+}
+
+// whether inserting point p removes face f
+bool Delaunay::conflict (int32_t f,int32_t p) const {
+	const face &F = faces[f];
+	for (int32_t k=0; k<3; k++) {
+		if (F.v[k]>=0) continue;
+
+		// ghost triangle, which is removed if p can see its hull edge from outside,
+		// or lies on the edge between its ends
+		int32_t a = F.v[(k+1)%3];
+		int32_t b = F.v[(k+2)%3];
+		int64_t o = orient(a,b,p);
+		if (o!=0) return o>0;
+		int64_t dot = (int64_t)(px[p]-px[a])*(px[b]-px[a]) + (int64_t)(py[p]-py[a])*(py[b]-py[a]);
+		int64_t len = (int64_t)(px[b]-px[a])*(px[b]-px[a]) + (int64_t)(py[b]-py[a])*(py[b]-py[a]);
+		return dot>0 && dot<len;
+	}
+	return incircle(F.v[0],F.v[1],F.v[2],p)>0;
+}
+
+// returns a face which is removed when p is inserted, walking from the last
+// inserted point, or -1 if p is a duplicate of an existing vertex
+int32_t Delaunay::locate (int32_t p) {
+	int32_t f = last;
+	for (;;) {
+		const face &F = faces[f];
+		int32_t i;
+		for (i=0; i<3; i++)
+			if (orient(F.v[(i+1)%3],F.v[(i+2)%3],p)<0)
+				break;
+
+		// p lies inside or on the edges of this triangle
+		if (i==3) {
+			for (int32_t k=0; k<3; k++)
+				if (px[F.v[k]]==px[p] && py[F.v[k]]==py[p])
+					return -1;
+			return f;
+		}
+
+		// p lies outside of the hull, beyond this edge
+		f = F.n[i];
+		if (infinite(f)<3)
+			return f;
+	}
+}
+
+void Delaunay::insert (int32_t p) {
+
+	int32_t start = locate(p);
+	if (start<0) {
+		complete = false;
+		return;
+	}
+
+	// collect the faces whose circumcircles contain p, and the edges around them
+	mark++;
+	cavity.clear();
+	boundary.clear();
+	visited[start] = mark;
+	cavity.push_back(start);
+	for (int32_t k=0; k<(int32_t)cavity.size(); k++) {
+		int32_t f = cavity[k];
+		for (int32_t i=0; i<3; i++) {
+			int32_t g = faces[f].n[i];
+			if (visited[g]==mark) continue;
+			if (conflict(g,p)) {
+				visited[g] = mark;
+				cavity.push_back(g);
+			} else {
+				edge e;
+				e.a = faces[f].v[(i+1)%3];
+				e.b = faces[f].v[(i+2)%3];
+				e.outside = g;
+				for (e.side=0; faces[g].n[e.side]!=f; e.side++);
+				boundary.push_back(e);
+			}
+		}
+	}
+
+	// join p to every boundary edge, reusing the removed faces.  There are always
+	// two more new faces than removed ones
+	int32_t removed = cavity.size();
+	for (int32_t k=0; k<(int32_t)boundary.size(); k++) {
+		int32_t f;
+		if (k<removed) {
+			f = cavity[k];
+		} else {
+			f = faces.size();
+			faces.push_back(face());
+			visited.push_back(0);
+			cavity.push_back(f);
+		}
+		const edge &e = boundary[k];
+		face &F = faces[f];
+		F.v[0] = p;
+		F.v[1] = e.a;
+		F.v[2] = e.b;
+		F.n[0] = e.outside;
+		faces[e.outside].n[e.side] = f;
+		from[e.a<0 ? no_of_points : e.a] = f;
+		to[e.b<0 ? no_of_points : e.b] = f;
+	}
+
+	// link the new faces around p
+	for (int32_t k=0; k<(int32_t)boundary.size(); k++) {
+		face &F = faces[cavity[k]];
+		F.n[1] = from[F.v[2]<0 ? no_of_points : F.v[2]];
+		F.n[2] = to[F.v[1]<0 ? no_of_points : F.v[1]];
+		if (F.v[1]>=0 && F.v[2]>=0)
+			last = cavity[k];
+	}
+}
+
+bool Delaunay::triangulate (const int32_t* x,const int32_t* y,int32_t n) {
+
+	no_of_points = n;
+	complete = true;
+	valid = false;
+	faces.clear();
+	visited.clear();
+	px.assign(x,x+n);
+	py.assign(y,y+n);
+	if (n<3) return false;
+
+	int32_t x_min = *min_element(x,x+n), x_max = *max_element(x,x+n);
+	int32_t y_min = *min_element(y,y+n), y_max = *max_element(y,y+n);
+	if (x_max-x_min>=DELAUNAY_MAX_RANGE || y_max-y_min>=DELAUNAY_MAX_RANGE)
+		return false;
+
+	// insert the points column by column, alternately downwards and upwards,
+	// so that each point is close to the previous one and the walk in locate is short
+	int32_t columns = (int32_t)sqrt((float)n);
+	int32_t column_width = (x_max-x_min)/columns+1;
+	// using keys which hold the column, the row and the index of each point
+	keys.resize(n);
+	order.resize(n);
+	for (int32_t i=0; i<n; i++) {
+		uint64_t column = (px[i]-x_min)/column_width;
+		uint64_t row = (column&1) ? y_max-py[i] : py[i]-y_min;
+		keys[i] = (column<<48) | (row<<32) | (uint32_t)i;
+	}
+	sort(keys.begin(),keys.end());
+	for (int32_t i=0; i<n; i++)
+		order[i] = (int32_t)(keys[i]&0xffffffff);
+
+	// but start with the extreme points in each diagonal direction.  For the near grid
+	// layout of the support points these span most of the hull, so that few points are
+	// inserted outside of it, where they would be joined to long runs of hull edges
+	int32_t extreme[4] = {order[0],order[0],order[0],order[0]};
+	for (int32_t i=0; i<n; i++) {
+		int32_t e = order[i];
+		if (px[e]+py[e]<px[extreme[0]]+py[extreme[0]]) extreme[0] = e;
+		if (px[e]-py[e]>px[extreme[1]]-py[extreme[1]]) extreme[1] = e;
+		if (px[e]+py[e]>px[extreme[2]]+py[extreme[2]]) extreme[2] = e;
+		if (px[e]-py[e]<px[extreme[3]]-py[extreme[3]]) extreme[3] = e;
+	}
+	int32_t first = 0;
+	for (int32_t k=0; k<4; k++) {
+		int32_t pos = find(order.begin()+first,order.end(),extreme[k])-order.begin();
+		if (pos<n) {
+			rotate(order.begin()+first,order.begin()+pos,order.begin()+pos+1);
+			first++;
+		}
+	}
+
+	// first triangle, from the first points which aren't collinear
+	int32_t a = order[0], b = -1, c = -1;
+	int32_t ib, ic;
+	for (ib=1; ib<n; ib++)
+		if (px[order[ib]]!=px[a] || py[order[ib]]!=py[a])
+			break;
+	if (ib==n) return false;
+	b = order[ib];
+	for (ic=ib+1; ic<n; ic++)
+		if (orient(a,b,order[ic])!=0)
+			break;
+	if (ic==n) return false;
+	c = order[ic];
+	if (orient(a,b,c)<0)
+		swap(b,c);
+
+	// the triangle and the three ghost triangles around it
+	const int32_t corners[4][3] = {{a,b,c},{b,a,-1},{c,b,-1},{a,c,-1}};
+	faces.resize(4);
+	visited.assign(4,0);
+	for (int32_t f=0; f<4; f++)
+		for (int32_t k=0; k<3; k++)
+			faces[f].v[k] = corners[f][k];
+	for (int32_t f=0; f<4; f++)
+		for (int32_t i=0; i<3; i++)
+			for (int32_t g=0; g<4; g++)
+				for (int32_t j=0; j<3; j++)
+					if (faces[f].v[(i+1)%3]==faces[g].v[(j+2)%3] && faces[f].v[(i+2)%3]==faces[g].v[(j+1)%3])
+						faces[f].n[i] = g;
+	last = 0;
+
+	from.resize(n+1);
+	to.resize(n+1);
+	for (int32_t k=1; k<n; k++)
+		if (k!=ib && k!=ic)
+			insert(order[k]);
+
+	valid = true;
+	return true;
+}
+
+// replaces edge i of face f by the other diagonal of the quadrilateral
+// formed with its neighbour, if that is needed for the Delaunay property
+void Delaunay::flip (int32_t f,int32_t i) {
+
+	int32_t g = faces[f].n[i];
+	if (infinite(f)<3 || infinite(g)<3) return;
+
+	face &F = faces[f];
+	face &G = faces[g];
+	int32_t j;
+	for (j=0; G.n[j]!=f; j++);
+
+	int32_t a = F.v[i], b = F.v[(i+1)%3], c = F.v[(i+2)%3], d = G.v[j];
+	if (incircle(a,b,c,d)<=0) return;
+
+	int32_t n_ca = F.n[(i+1)%3], n_ab = F.n[(i+2)%3];
+	int32_t n_bd = G.n[(j+1)%3], n_dc = G.n[(j+2)%3];
+
+	// abc + dcb become abd + adc
+	F.v[0] = a; F.v[1] = b; F.v[2] = d;
+	F.n[0] = n_bd; F.n[1] = g; F.n[2] = n_ab;
+	G.v[0] = a; G.v[1] = d; G.v[2] = c;
+	G.n[0] = n_dc; G.n[1] = n_ca; G.n[2] = f;
+	replaceNeighbour(n_bd,g,f);
+	replaceNeighbour(n_ca,f,g);
+
+	pending.push_back(f); pending.push_back(0);
+	pending.push_back(f); pending.push_back(2);
+	pending.push_back(g); pending.push_back(0);
+	pending.push_back(g); pending.push_back(1);
+}
+
+// if the hull turns inwards at the end of ghost triangle g then the notch is
+// covered by a triangle.  Returns false if that would overlap another part of the hull
+bool Delaunay::fillNotch (int32_t g) {
+
+	int32_t k = infinite(g);
+	if (k==3) return true;
+	int32_t a = faces[g].v[(k+1)%3], b = faces[g].v[(k+2)%3];
+	int32_t h = faces[g].n[(k+1)%3];
+	int32_t l = infinite(h);
+	int32_t c = faces[h].v[(l+2)%3];
+
+	int64_t o = orient(a,b,c);
+	if (o<0) return true;
+	if (o==0)
+		return (int64_t)(px[b]-px[a])*(px[c]-px[b]) + (int64_t)(py[b]-py[a])*(py[c]-py[b]) > 0;
+
+	// no other hull vertex may lie within triangle abc
+	for (int32_t e=faces[h].n[(l+1)%3]; e!=g; ) {
+		int32_t m = infinite(e);
+		int32_t p = faces[e].v[(m+1)%3];
+		if (p!=a && p!=c && orient(a,b,p)>=0 && orient(b,c,p)>=0 && orient(c,a,p)>=0)
+			return false;
+		e = faces[e].n[(m+1)%3];
+	}
+
+	// ghost triangles ab and bc become triangle abc and ghost triangle ac
+	int32_t s_ab = faces[g].n[k], prev = faces[g].n[(k+2)%3];
+	int32_t s_bc = faces[h].n[l], next = faces[h].n[(l+1)%3];
+	face &T = faces[g];
+	T.v[0] = a; T.v[1] = b; T.v[2] = c;
+	T.n[0] = s_bc; T.n[1] = h; T.n[2] = s_ab;
+	face &G = faces[h];
+	G.v[0] = a; G.v[1] = c; G.v[2] = -1;
+	G.n[0] = next; G.n[1] = prev; G.n[2] = g;
+	replaceNeighbour(s_bc,h,g);
+	replaceNeighbour(prev,g,h);
+
+	// the hull may now turn inwards at a or c
+	pending.push_back(prev);
+	pending.push_back(h);
+	return true;
+}
+
+bool Delaunay::moveVertices (const int32_t* x,const int32_t* y) {
+
+	if (!valid || !complete) return false;
+	valid = false;
+	px.assign(x,x+no_of_points);
+	py.assign(y,y+no_of_points);
+	if (*max_element(px.begin(),px.end())-*min_element(px.begin(),px.end())>=DELAUNAY_MAX_RANGE ||
+	    *max_element(py.begin(),py.end())-*min_element(py.begin(),py.end())>=DELAUNAY_MAX_RANGE)
+		return false;
+
+	// every triangle must keep its orientation
+	for (int32_t f=0; f<(int32_t)faces.size(); f++)
+		if (infinite(f)==3 && orient(faces[f].v[0],faces[f].v[1],faces[f].v[2])<=0)
+			return false;
+
+	// the hull has to be convex again
+	pending.clear();
+	for (int32_t f=0; f<(int32_t)faces.size(); f++)
+		if (infinite(f)<3)
+			pending.push_back(f);
+	while (!pending.empty()) {
+		int32_t g = pending.back(); pending.pop_back();
+		if (!fillNotch(g))
+			return false;
+	}
+
+	// and go round once, otherwise the triangles have been folded over each other
+	int32_t turns = 0;
+	for (int32_t f=0; f<(int32_t)faces.size(); f++) {
+		int32_t k = infinite(f);
+		if (k==3) continue;
+		int32_t a = faces[f].v[(k+1)%3], b = faces[f].v[(k+2)%3];
+		int32_t h = faces[f].n[(k+1)%3];
+		int32_t c = faces[h].v[(infinite(h)+2)%3];
+		bool up_ab = py[b]>py[a] || (py[b]==py[a] && px[b]>px[a]);
+		bool up_bc = py[c]>py[b] || (py[c]==py[b] && px[c]>px[b]);
+		if (up_ab && !up_bc) turns++;
+	}
+	if (turns!=1)
+		return false;
+
+	// Lawson's flip algorithm, starting from every interior edge
+	pending.clear();
+	for (int32_t f=0; f<(int32_t)faces.size(); f++)
+		for (int32_t i=0; i<3; i++)
+			if (f<faces[f].n[i]) {
+				pending.push_back(f);
+				pending.push_back(i);
+			}
+	while (!pending.empty()) {
+		int32_t i = pending.back(); pending.pop_back();
+		int32_t f = pending.back(); pending.pop_back();
+		flip(f,i);
+	}
+
+	for (last=0; infinite(last)<3; last++);
+	valid = true;
+	return true;
+}
+
+void Delaunay::getTriangles (vector<int32_t> &corners) const {
+	if (!valid) return;
+	for (int32_t f=0; f<(int32_t)faces.size(); f++) {
+		const face &F = faces[f];
+		if (F.v[0]>=0 && F.v[1]>=0 && F.v[2]>=0) {
+			corners.push_back(F.v[0]);
+			corners.push_back(F.v[1]);
+			corners.push_back(F.v[2]);
+		}
+	}
+}
@@ -0,0 +1,104 @@
+/*
+    delaunay
+    Delaunay triangulation of the ELAS support points
+    Copyright (C) 2010 Bob Mottram
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DELAUNAY_H_
+#define DELAUNAY_H_
+
+#include <stdint.h>
+#include <vector>
+
+// coordinates must lie within this distance of each other, so that the
+// incircle test can be evaluated exactly using 64 bit integers
+#define DELAUNAY_MAX_RANGE     16384
+
+// Incremental (Bowyer-Watson) Delaunay triangulation of points with integer
+// coordinates.  The hull edges are joined to a vertex at infinity by "ghost"
+// triangles, so that points outside of the hull are inserted in the same way
+// as points inside it, and the predicates are exact, so degenerate layouts such
+// as the regular grid of support points are handled without special cases.
+// Buffers are kept between calls, so once they have grown to the number of
+// support points no further memory is allocated.
+class Delaunay {
+
+public:
+
+  Delaunay ();
+
+  // triangulates the points (x[i],y[i]), i<n.  Duplicates of earlier points are left out.
+  // returns false if there are fewer than three points which are not collinear, in which
+  // case there are no triangles
+  bool triangulate (const int32_t* x,const int32_t* y,int32_t n);
+
+  // moves the points of the last triangulation to (x[i],y[i]), covers any notches
+  // that have opened up in the hull and restores the Delaunay property by flipping
+  // edges.  Returns false, leaving the triangulation invalid, if a triangle would be
+  // turned over or the hull would fold over itself, in which case triangulate has
+  // to be used instead
+  bool moveVertices (const int32_t* x,const int32_t* y);
+
+  // appends the corner indices of the triangles, three per triangle,
+  // in the order which gives a positive orientation
+  void getTriangles (std::vector<int32_t> &corners) const;
+
+private:
+
+  // corners of a triangle, the vertex at infinity being -1, and the triangles
+  // across the edges opposite each corner
+  struct face {
+    int32_t v[3];
+    int32_t n[3];
+  };
+
+  // edge on the boundary of the region retriangulated when a point is inserted
+  struct edge {
+    int32_t a,b;      // ends of the edge
+    int32_t outside;  // triangle outside of the region
+    int32_t side;     // index of the edge within the outside triangle
+  };
+
+  inline int64_t orient (int32_t a,int32_t b,int32_t c) const;
+  inline int64_t incircle (int32_t a,int32_t b,int32_t c,int32_t d) const;
+  inline int32_t infinite (int32_t f) const;
+  inline void    replaceNeighbour (int32_t f,int32_t old_face,int32_t new_face);
+  bool    conflict (int32_t f,int32_t p) const;
+  int32_t locate (int32_t p);
+  void    insert (int32_t p);
+  void    flip (int32_t f,int32_t i);
+  bool    fillNotch (int32_t g);
+
+  int32_t no_of_points;
+  bool    complete;                 // all points are part of the triangulation
+  bool    valid;                    // the faces form a triangulation of the current points
+  int32_t last;                     // solid triangle from which the next search starts
+  int32_t mark;                     // current value used to flag faces in visited
+
+  std::vector<int32_t> px,py;       // point coordinates
+  std::vector<uint64_t> keys;       // sort keys giving the insertion order
+  std::vector<int32_t> order;       // order in which the points are inserted
+  std::vector<face>    faces;
+  std::vector<int32_t> visited;     // faces belonging to the region being retriangulated
+  std::vector<int32_t> cavity;      // faces which are removed by an insertion
+  std::vector<edge>    boundary;    // edges around the removed faces
+  std::vector<int32_t> from,to;     // new face starting or ending at each vertex
+  std::vector<int32_t> pending;     // ghost triangles to be checked for notches, then face and
+                                    // edge index pairs to be checked for flipping
+};
+
+#endif
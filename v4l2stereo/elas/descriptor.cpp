@@ -23,22 +23,122 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 #include "filter.h"
 #include <emmintrin.h>
 
+// the AVX2 descriptor layout is compiled for that target individually and only used if the CPU supports it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <immintrin.h>
+  #define DESCRIPTOR_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
 using namespace std;
 
-Descriptor::Descriptor(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution) {
-  I_desc        = (uint8_t*)_mm_malloc(16*width*height*sizeof(uint8_t),16);
-  uint8_t* I_du = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-  uint8_t* I_dv = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-  filter::sobel3x3(I,I_du,I_dv,bpl,height);
-  createDescriptor(I_du,I_dv,width,height,bpl,half_resolution);
-  _mm_free(I_du);
-  _mm_free(I_dv);
+Descriptor::Descriptor(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution) :
+  I_desc(NULL), I_du(NULL), I_dv(NULL), I_temp_du(NULL), I_temp_dv(NULL), alloc_width(0), alloc_height(0), alloc_bpl(0) {
+  use_avx2 = filter::cpu_supports_avx2();
+  compute(I,width,height,bpl,half_resolution);
+}
+
+Descriptor::Descriptor() :
+  I_desc(NULL), I_du(NULL), I_dv(NULL), I_temp_du(NULL), I_temp_dv(NULL), alloc_width(0), alloc_height(0), alloc_bpl(0) {
+  use_avx2 = filter::cpu_supports_avx2();
 }
 
 Descriptor::~Descriptor() {
-  _mm_free(I_desc);
+  release();
+}
+
+void Descriptor::release() {
+  if (I_desc!=NULL) _mm_free(I_desc);
+  if (I_du!=NULL)   _mm_free(I_du);
+  if (I_dv!=NULL)   _mm_free(I_dv);
+  if (I_temp_du!=NULL) _mm_free(I_temp_du);
+  if (I_temp_dv!=NULL) _mm_free(I_temp_dv);
+  I_desc = I_du = I_dv = NULL;
+  I_temp_du = I_temp_dv = NULL;
+  alloc_width = alloc_height = alloc_bpl = 0;
+}
+
+void Descriptor::compute(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution) {
+
+  // allocate memory only if the image size has changed
+  if (width!=alloc_width || height!=alloc_height || bpl!=alloc_bpl) {
+    release();
+    I_desc = (uint8_t*)_mm_malloc(16*width*height*sizeof(uint8_t),16);
+    I_du   = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    I_dv   = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    I_temp_du = (int16_t*)_mm_malloc(bpl*height*sizeof(int16_t),16);
+    I_temp_dv = (int16_t*)_mm_malloc(bpl*height*sizeof(int16_t),16);
+
+    // the border is never written by createDescriptor, so clear it once
+    memset(I_desc,0,16*width*height*sizeof(uint8_t));
+    alloc_width  = width;
+    alloc_height = height;
+    alloc_bpl    = bpl;
+  }
+
+  filter::sobel3x3(I,I_du,I_dv,I_temp_du,I_temp_dv,bpl,height,use_avx2);
+  createDescriptor(I_du,I_dv,width,height,bpl,half_resolution);
+}
+
+#ifdef DESCRIPTOR_AVX2_TARGET
+
+// creates the descriptors of one line, 32 pixels at a time. The 16 filter
+// responses making up the descriptors of 16 neighbouring pixels are loaded
+// as 16 rows of 16 bytes, which are transposed so that each row becomes the
+// descriptor of one pixel. Each 128 bit lane holds a separate block of 16 pixels.
+// returns the first pixel which has not been done
+DESCRIPTOR_AVX2_TARGET
+static int32_t createDescriptorLineAVX2 (uint8_t* I_desc,uint8_t* I_du,uint8_t* I_dv,int32_t width,int32_t v,int32_t bpl) {
+
+  uint8_t* du = I_du+v*bpl;
+  uint8_t* dv = I_dv+v*bpl;
+
+  // filter responses in the same order as the scalar version
+  const uint8_t* src[16] = {
+    du-2*bpl+0, du-bpl-2, du-bpl+0, du-bpl+2,
+    du-1,       du+0,     du+0,     du+1,
+    du+bpl-2,   du+bpl+0, du+bpl+2, du+2*bpl+0,
+    dv-bpl+0,   dv-1,     dv+1,     dv+bpl+0 };
+
+  int32_t u = 3;
+  for (; u+32<=width-3; u+=32) {
+    __m256i a[16],b[16];
+    for (int32_t i=0; i<16; i++)
+      a[i] = _mm256_loadu_si256((const __m256i*)(src[i]+u));
+
+    // transpose each lane as a 16x16 matrix of bytes
+    for (int32_t i=0; i<8; i++) {
+      b[i]   = _mm256_unpacklo_epi8(a[2*i],a[2*i+1]);
+      b[i+8] = _mm256_unpackhi_epi8(a[2*i],a[2*i+1]);
+    }
+    for (int32_t i=0; i<4; i++) {
+      a[i]    = _mm256_unpacklo_epi16(b[2*i],b[2*i+1]);
+      a[i+4]  = _mm256_unpackhi_epi16(b[2*i],b[2*i+1]);
+      a[i+8]  = _mm256_unpacklo_epi16(b[2*i+8],b[2*i+9]);
+      a[i+12] = _mm256_unpackhi_epi16(b[2*i+8],b[2*i+9]);
+    }
+    for (int32_t i=0; i<8; i++) {
+      b[2*i]   = _mm256_unpacklo_epi32(a[(i/2)*4+(i%2)*2],a[(i/2)*4+(i%2)*2+1]);
+      b[2*i+1] = _mm256_unpackhi_epi32(a[(i/2)*4+(i%2)*2],a[(i/2)*4+(i%2)*2+1]);
+    }
+
+    // pixel offsets of the transposed rows within each block of 16 pixels
+    static const int32_t offset[8] = {0,2,4,6,8,10,12,14};
+    uint8_t* desc = I_desc+(v*width+u)*16;
+    for (int32_t i=0; i<8; i++) {
+      __m256i lo = _mm256_unpacklo_epi64(b[i/2*4+i%2],b[i/2*4+i%2+2]);
+      __m256i hi = _mm256_unpackhi_epi64(b[i/2*4+i%2],b[i/2*4+i%2+2]);
+      _mm_storeu_si128((__m128i*)(desc+offset[i]*16),         _mm256_castsi256_si128(lo));
+      _mm_storeu_si128((__m128i*)(desc+(offset[i]+1)*16),     _mm256_castsi256_si128(hi));
+      _mm_storeu_si128((__m128i*)(desc+(offset[i]+16)*16),    _mm256_extracti128_si256(lo,1));
+      _mm_storeu_si128((__m128i*)(desc+(offset[i]+17)*16),    _mm256_extracti128_si256(hi,1));
+    }
+  }
+  return u;
 }
 
+#endif
+
+
 void Descriptor::createDescriptor (uint8_t* I_du,uint8_t* I_dv,int32_t width,int32_t height,int32_t bpl,bool half_resolution) {
 
   uint8_t *I_desc_curr;  
@@ -56,7 +156,14 @@ void Descriptor::createDescriptor (uint8_t* I_du,uint8_t* I_dv,int32_t width,int
       addr_v3 = addr_v2+1*bpl;
       addr_v4 = addr_v2+2*bpl;
 
-      for (int32_t u=3; u<width-3; u++) {
+      // the AVX2 version does as much of the line as it can
+      int32_t u_start = 3;
+#ifdef DESCRIPTOR_AVX2_TARGET
+      if (use_avx2)
+        u_start = createDescriptorLineAVX2(I_desc,I_du,I_dv,width,v,bpl);
+#endif
+
+      for (int32_t u=u_start; u<width-3; u++) {
         I_desc_curr = I_desc+(v*width+u)*16;
         *(I_desc_curr++) = *(I_du+addr_v0+u+0);
         *(I_desc_curr++) = *(I_du+addr_v1+u-2);
@@ -89,7 +196,14 @@ void Descriptor::createDescriptor (uint8_t* I_du,uint8_t* I_dv,int32_t width,int
       addr_v3 = addr_v2+1*bpl;
       addr_v4 = addr_v2+2*bpl;
 
-      for (int32_t u=3; u<width-3; u++) {
+      // the AVX2 version does as much of the line as it can
+      int32_t u_start = 3;
+#ifdef DESCRIPTOR_AVX2_TARGET
+      if (use_avx2)
+        u_start = createDescriptorLineAVX2(I_desc,I_du,I_dv,width,v,bpl);
+#endif
+
+      for (int32_t u=u_start; u<width-3; u++) {
         I_desc_curr = I_desc+(v*width+u)*16;
         *(I_desc_curr++) = *(I_du+addr_v0+u+0);
         *(I_desc_curr++) = *(I_du+addr_v1+u-2);
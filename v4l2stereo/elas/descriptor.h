@@ -52,15 +52,37 @@ public:
   
   // constructor creates filters
   Descriptor(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution);
+
+  // constructor without an image, call compute() to create the descriptors
+  Descriptor();
   
   // deconstructor releases memory
   ~Descriptor();
+
+  // creates the descriptors of an image, reusing the memory of the
+  // previous call if the image size has not changed
+  void compute(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution);
   
   // descriptors accessible from outside
   uint8_t* I_desc;
   
 private:
 
+  // filter images, 16 bit filter temporaries and the size they were allocated for
+  uint8_t *I_du,*I_dv;
+  int16_t *I_temp_du,*I_temp_dv;
+  int32_t  alloc_width,alloc_height,alloc_bpl;
+
+  // whether the AVX2 versions of the filters and descriptor layout are used
+  bool use_avx2;
+
+  // releases the descriptor and filter images
+  void release();
+
+  // not copyable
+  Descriptor(const Descriptor&);
+  Descriptor& operator=(const Descriptor&);
+
   // build descriptor I_desc from I_du and I_dv
   void createDescriptor(uint8_t* I_du,uint8_t* I_dv,int32_t width,int32_t height,int32_t bpl,bool half_resolution);
 
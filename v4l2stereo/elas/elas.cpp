@@ -23,119 +23,458 @@
 
 #include <math.h>
 #include "descriptor.h"
-#include "triangle.h"
 #include "matrix.h"
+#include "filter.h"
+#include <omp.h>
+
+// AVX2 matching kernels are compiled for that target individually and only used if the CPU supports them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ELAS_AVX2_TARGET __attribute__((target("avx2")))
+#endif
 
 using namespace std;
 
-void Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t* dims){
+const char* const Elas::stage_names[Elas::NO_OF_STAGES] = {
+	"input","descriptor","support_matches","triangulation","planes","grid","matching","lr_check",
+	"small_segments","gap_interpolation","adaptive_mean","median" };
+
+Elas::Elas (parameters param) : param(param), timer(stage_names,NO_OF_STAGES) {
+	I1 = I2 = NULL;
+	width = height = bpl = 0;
+	ws_width = ws_height = 0;
+	I1_buf = I2_buf = NULL;
+	grid_width = grid_height = 0;
+	disparity_grid_1 = disparity_grid_2 = NULL;
+	grid_temp_1 = grid_temp_2 = NULL;
+	D_can = D_can_prev = NULL;
+	D_can_width = D_can_height = 0;
+	D_can_prev_valid = false;
+	support_frames = 0;
+	D_temp1 = D_temp2 = NULL;
+	seg_parent = seg_size = NULL;
+	band_height = band_window = band_grid_height = 0;
+	use_avx2 = filter::cpu_supports_avx2();
+}
+
+Elas::~Elas () {
+	releaseWorkspace();
+}
+
+void Elas::allocateWorkspace () {
+
+	// nothing to do if the image size has not changed
+	if (width==ws_width && height==ws_height)
+		return;
+	releaseWorkspace();
+
+	// aligned copies of the input images
+	I1_buf = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+	I2_buf = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+
+	// disparity grid dimensions
+	grid_width       = (int32_t)ceil((float)width/(float)param.grid_size);
+	grid_height      = (int32_t)ceil((float)height/(float)param.grid_size);
+
+	// prior, which only depends upon the number of disparities
+	float two_sigma_squared = 2*param.sigma*param.sigma;
+	prior.resize(param.disp_max+1);
+	for (int32_t delta_d=0; delta_d<param.disp_max+1; delta_d++)
+		prior[delta_d] = (int32_t)((-log(param.gamma+exp(-delta_d*delta_d/two_sigma_squared))+log(param.gamma))/param.beta);
+
+	// disparity candidates
+	// (at half resolution only data from every second line is needed)
+	int32_t D_candidate_stepsize = param.candidate_stepsize;
+	if (param.subsampling)
+		D_candidate_stepsize += D_candidate_stepsize%2;
+	D_can_width  = 0;
+	D_can_height = 0;
+	for (int32_t u=0; u<width;  u+=D_candidate_stepsize) D_can_width++;
+	for (int32_t v=0; v<height; v+=D_candidate_stepsize) D_can_height++;
+	D_can      = (int16_t*)malloc(D_can_width*D_can_height*sizeof(int16_t));
+	D_can_prev = (int16_t*)malloc(D_can_width*D_can_height*sizeof(int16_t));
+	D_can_prev_valid = false;
+
+	// the image is matched at once unless that needs more memory than the budget allows,
+	// in which case it is split into bands made up of whole rows of support point tiles
+	int32_t tile_rows = ELAS_TEMPORAL_TILE*D_candidate_stepsize;
+	band_height = height;
+	if (param.memory_budget>0 && matchingMemory(height)>param.memory_budget) {
+		int32_t threads = omp_get_max_threads();
+		band_height = tile_rows;
+		for (int32_t rows=tile_rows*((height-1)/tile_rows); rows>tile_rows; rows-=tile_rows) {
+			if (min(threads,(height+rows-1)/rows)*matchingMemory(rows)<=param.memory_budget) {
+				band_height = rows;
+				break;
+			}
+		}
+		band_height = min(band_height,height);
+	}
+
+	if (band_height<height) {
+
+		// descriptors and grids for each band which is matched at the same time
+		band_window      = min(height,band_height+2*ELAS_TILE_HALO+height%2);
+		band_grid_height = min(grid_height,(band_height-1)/param.grid_size+2);
+		int32_t temp_height = min(grid_height,band_grid_height+4);
+		int32_t no_of_bands = min(omp_get_max_threads(),(height+band_height-1)/band_height);
+		for (int32_t i=0; i<no_of_bands; i++) {
+			band_workspace* b = new band_workspace;
+			b->grid_1      = (int32_t*)malloc((param.disp_max+2)*band_grid_height*grid_width*sizeof(int32_t));
+			b->grid_2      = (int32_t*)malloc((param.disp_max+2)*band_grid_height*grid_width*sizeof(int32_t));
+			b->grid_temp_1 = (int32_t*)malloc(2*(param.disp_max+1)*temp_height*grid_width*sizeof(int32_t));
+			b->grid_temp_2 = (int32_t*)malloc(2*(param.disp_max+1)*temp_height*grid_width*sizeof(int32_t));
+			bands.push_back(b);
+		}
+
+	} else {
+
+		// disparity grids
+		disparity_grid_1 = (int32_t*)malloc((param.disp_max+2)*grid_height*grid_width*sizeof(int32_t));
+		disparity_grid_2 = (int32_t*)malloc((param.disp_max+2)*grid_height*grid_width*sizeof(int32_t));
+		// (one pair of temporary grids each for the left and right image, so that both can be created concurrently)
+		grid_temp_1      = (int32_t*)malloc(2*(param.disp_max+1)*grid_height*grid_width*sizeof(int32_t));
+		grid_temp_2      = (int32_t*)malloc(2*(param.disp_max+1)*grid_height*grid_width*sizeof(int32_t));
+	}
+
+	// postprocessing, sized for the full resolution disparity image
+	D_temp1    = (float*)malloc(width*height*sizeof(float));
+	D_temp2    = (float*)malloc(width*height*sizeof(float));
+	seg_parent = (int32_t*)malloc(width*height*sizeof(int32_t));
+	seg_size   = (int32_t*)malloc(width*height*sizeof(int32_t));
+
+	ws_width  = width;
+	ws_height = height;
+}
+
+void Elas::releaseWorkspace () {
+	if (I1_buf!=NULL) _mm_free(I1_buf);
+	if (I2_buf!=NULL) _mm_free(I2_buf);
+	free(disparity_grid_1);
+	free(disparity_grid_2);
+	free(grid_temp_1);
+	free(grid_temp_2);
+	for (size_t i=0; i<bands.size(); i++) {
+		free(bands[i]->grid_1);
+		free(bands[i]->grid_2);
+		free(bands[i]->grid_temp_1);
+		free(bands[i]->grid_temp_2);
+		delete bands[i];
+	}
+	bands.clear();
+	free(D_can);
+	free(D_can_prev);
+	free(D_temp1);
+	free(D_temp2);
+	free(seg_parent);
+	free(seg_size);
+	I1_buf = I2_buf = NULL;
+	disparity_grid_1 = disparity_grid_2 = NULL;
+	grid_temp_1 = grid_temp_2 = NULL;
+	D_can = D_can_prev = NULL;
+	D_can_prev_valid = false;
+	D_temp1 = D_temp2 = NULL;
+	seg_parent = seg_size = NULL;
+	ws_width = ws_height = 0;
+	band_height = band_window = band_grid_height = 0;
+}
+
+// bytes of descriptors, with their filter images, and disparity grids used when matching bands of the given number of rows
+int64_t Elas::matchingMemory (int32_t rows) {
+	int32_t window    = height;
+	int32_t grid_rows = grid_height;
+	int32_t temp_rows = grid_height;
+	if (rows<height) {
+		window    = min(height,rows+2*ELAS_TILE_HALO+height%2);
+		grid_rows = min(grid_height,(rows-1)/param.grid_size+2);
+		temp_rows = min(grid_height,grid_rows+4);
+	}
+	int64_t descriptors = 2*(16*(int64_t)width*window+2*(int64_t)bpl*window*(1+sizeof(int16_t)));
+	int64_t grids       = 2*(int64_t)grid_width*sizeof(int32_t)*((param.disp_max+2)*grid_rows+2*(param.disp_max+1)*temp_rows);
+	return descriptors+grids;
+}
+
+// first image row for which the descriptors of the band starting at row v_begin are
+// computed.  All windows have the same size, so the descriptors are never reallocated
+int32_t Elas::bandWindow (int32_t v_begin) {
+	return min(max(v_begin-ELAS_TILE_HALO,0)&~1,height-band_window);
+}
+
+void Elas::computeSupportMatchesTiled (vector<support_pt> &p_support) {
+
+	int32_t D_candidate_stepsize = param.candidate_stepsize;
+	if (param.subsampling)
+		D_candidate_stepsize += D_candidate_stepsize%2;
+
+	// bands of whole rows of candidate tiles
+	int32_t tiles_y     = (D_can_height-1+ELAS_TEMPORAL_TILE-1)/ELAS_TEMPORAL_TILE;
+	int32_t band_tiles  = band_height/(ELAS_TEMPORAL_TILE*D_candidate_stepsize);
+	int32_t no_of_bands = (tiles_y+band_tiles-1)/band_tiles;
+
+	bool temporal = startSupportMatches();
+
+    #pragma omp parallel for schedule(dynamic) num_threads(bands.size())
+	for (int32_t band=0; band<no_of_bands; band++) {
+		band_workspace* b = bands[omp_get_thread_num()];
+		int32_t tile_row_begin = band*band_tiles;
+		int32_t tile_row_end   = min(tile_row_begin+band_tiles,tiles_y);
+
+		// descriptors around the rows of the first candidates, addressed by image row
+		int32_t window = bandWindow((1+tile_row_begin*ELAS_TEMPORAL_TILE)*D_candidate_stepsize);
+		b->desc1.compute(I1+window*bpl,width,band_window,bpl,param.subsampling);
+		b->desc2.compute(I2+window*bpl,width,band_window,bpl,param.subsampling);
+		matchSupportCandidates(b->desc1.I_desc-16*width*window,b->desc2.I_desc-16*width*window,
+		                       tile_row_begin,tile_row_end,temporal);
+	}
+
+	finishSupportMatches(temporal,p_support);
+}
+
+template <typename disp_type>
+void Elas::computeDisparityTiled (disp_type* D1,disp_type* D2) {
+
+	int32_t grid_dims[3] = {param.disp_max+2,grid_width,grid_height};
+	int32_t no_of_bands  = (height+band_height-1)/band_height;
+
+	// each band computes its own descriptors and the grid rows it needs, then
+	// matches both images within its rows
+    #pragma omp parallel for schedule(dynamic) num_threads(bands.size())
+	for (int32_t band=0; band<no_of_bands; band++) {
+		band_workspace* b = bands[omp_get_thread_num()];
+		int32_t v_begin = band*band_height;
+		int32_t v_end   = min(v_begin+band_height,height);
+
+		// descriptors and grids are addressed by image and grid row
+		int32_t window = bandWindow(v_begin);
+		b->desc1.compute(I1+window*bpl,width,band_window,bpl,param.subsampling);
+		b->desc2.compute(I2+window*bpl,width,band_window,bpl,param.subsampling);
+		uint8_t* I1_desc = b->desc1.I_desc-16*width*window;
+		uint8_t* I2_desc = b->desc2.I_desc-16*width*window;
+
+		int32_t  y_begin = v_begin/param.grid_size;
+		int32_t  y_end   = (v_end-1)/param.grid_size+1;
+		int32_t* grid_1  = b->grid_1-y_begin*grid_width*(param.disp_max+2);
+		int32_t* grid_2  = b->grid_2-y_begin*grid_width*(param.disp_max+2);
+		createGrid(p_support,grid_1,grid_dims,0,b->grid_temp_1,y_begin,y_end);
+		createGrid(p_support,grid_2,grid_dims,1,b->grid_temp_2,y_begin,y_end);
+
+		computeDisparity(p_support,tri_1,grid_1,grid_dims,I1_desc,I2_desc,0,D1,v_begin,v_end);
+		computeDisparity(p_support,tri_2,grid_2,grid_dims,I1_desc,I2_desc,1,D2,v_begin,v_end);
+	}
+}
+
+void Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t* dims) {
+	processImages(I1_,I2_,1,0,D1,D2,dims);
+}
+
+void Elas::process (uint8_t* I1_,uint8_t* I2_,int16_t* D1,int16_t* D2,const int32_t* dims) {
+	processImages(I1_,I2_,1,0,D1,D2,dims);
+}
+
+void Elas::process (uint8_t* I1_,uint8_t* I2_,int32_t channels,int32_t channel,float* D1,float* D2,const int32_t* dims) {
+	processImages(I1_,I2_,channels,channel,D1,D2,dims);
+}
+
+void Elas::process (uint8_t* I1_,uint8_t* I2_,int32_t channels,int32_t channel,int16_t* D1,int16_t* D2,const int32_t* dims) {
+	processImages(I1_,I2_,channels,channel,D1,D2,dims);
+}
+
+// copies one channel of an interleaved image into the aligned gray image I_gray,
+// 16 pixels at a time for the common layouts of 1 to 4 channels
+void Elas::extractChannel (const uint8_t* I,int32_t stride,int32_t channels,int32_t channel,uint8_t* I_gray) {
+
+	int32_t width16 = width-width%16;
+	__m128i mask16  = _mm_set1_epi16(0x00FF);
+	__m128i mask32  = _mm_set1_epi32(0x000000FF);
+
+	for (int32_t v=0; v<height; v++) {
+		const uint8_t* src = I+v*stride;
+		uint8_t*       dst = I_gray+v*bpl;
+		int32_t        u   = 0;
+
+		if (channels==1) {
+			memcpy(dst,src,width*sizeof(uint8_t));
+			continue;
+		}
+
+		if (channels==2) {
+			for (; u<width16; u+=16) {
+				__m128i a = _mm_loadu_si128((const __m128i*)(src+2*u));
+				__m128i b = _mm_loadu_si128((const __m128i*)(src+2*u+16));
+				if (channel) {
+					a = _mm_srli_epi16(a,8);
+					b = _mm_srli_epi16(b,8);
+				} else {
+					a = _mm_and_si128(a,mask16);
+					b = _mm_and_si128(b,mask16);
+				}
+				_mm_store_si128((__m128i*)(dst+u),_mm_packus_epi16(a,b));
+			}
+		} else if (channels==3) {
+			// deinterleaves 16 pixels by repeatedly interleaving the low and high halves
+			for (; u<width16; u+=16) {
+				__m128i t00 = _mm_loadu_si128((const __m128i*)(src+3*u));
+				__m128i t01 = _mm_loadu_si128((const __m128i*)(src+3*u+16));
+				__m128i t02 = _mm_loadu_si128((const __m128i*)(src+3*u+32));
+				for (int32_t i=0; i<4; i++) {
+					__m128i t10 = _mm_unpacklo_epi8(t00,_mm_unpackhi_epi64(t01,t01));
+					__m128i t11 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t00,t00),t02);
+					__m128i t12 = _mm_unpacklo_epi8(t01,_mm_unpackhi_epi64(t02,t02));
+					t00 = t10; t01 = t11; t02 = t12;
+				}
+				__m128i c = channel==0 ? t00 : (channel==1 ? t01 : t02);
+				_mm_store_si128((__m128i*)(dst+u),c);
+			}
+		} else if (channels==4) {
+			for (; u<width16; u+=16) {
+				__m128i a = _mm_loadu_si128((const __m128i*)(src+4*u));
+				__m128i b = _mm_loadu_si128((const __m128i*)(src+4*u+16));
+				__m128i c = _mm_loadu_si128((const __m128i*)(src+4*u+32));
+				__m128i d = _mm_loadu_si128((const __m128i*)(src+4*u+48));
+				__m128i shift = _mm_cvtsi32_si128(8*channel);
+				a = _mm_and_si128(_mm_srl_epi32(a,shift),mask32);
+				b = _mm_and_si128(_mm_srl_epi32(b,shift),mask32);
+				c = _mm_and_si128(_mm_srl_epi32(c,shift),mask32);
+				d = _mm_and_si128(_mm_srl_epi32(d,shift),mask32);
+				_mm_store_si128((__m128i*)(dst+u),_mm_packus_epi16(_mm_packs_epi32(a,b),_mm_packs_epi32(c,d)));
+			}
+		}
+
+		for (; u<width; u++)
+			dst[u] = src[u*channels+channel];
+	}
+}
+
+template <typename disp_type>
+void Elas::processImages (uint8_t* I1_,uint8_t* I2_,int32_t channels,int32_t channel,disp_type* D1,disp_type* D2,const int32_t* dims) {
+
+	timer.start(INPUT);
 
 	// get width, height and bytes per line
 	width  = dims[0];
 	height = dims[1];
-	bpl    = width + 15-(width-1)%16;
-
-	// copy images to byte aligned memory
-	I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-	I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-	if (bpl==dims[2]) {
-		memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
-		memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
+	bpl    = bytesPerLine(width);
+
+	// reuse the buffers of the previous frame if the size is unchanged
+	allocateWorkspace();
+
+	// aligned gray images with the expected stride are used directly,
+	// otherwise the channel being matched is copied to byte aligned memory
+	if (channels==1 && bpl==dims[2] && ((uintptr_t)I1_&15)==0 && ((uintptr_t)I2_&15)==0) {
+		I1 = I1_;
+		I2 = I2_;
 	} else {
-		for (int32_t v=0; v<height; v++) {
-			memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
-			memcpy(I2+v*bpl,I2_+v*dims[2],width*sizeof(uint8_t));
+		I1 = I1_buf;
+		I2 = I2_buf;
+		if (channels==1 && bpl==dims[2]) {
+			memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
+			memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
+		} else {
+    #pragma omp parallel sections
+			{
+        #pragma omp section
+				extractChannel(I1_,dims[2],channels,channel,I1);
+        #pragma omp section
+				extractChannel(I2_,dims[2],channels,channel,I2);
+			}
 		}
 	}
 
-	// allocate memory for disparity grid
-	int32_t grid_width   = (int32_t)ceil((float)width/(float)param.grid_size);
-	int32_t grid_height  = (int32_t)ceil((float)height/(float)param.grid_size);
 	int32_t grid_dims[3] = {param.disp_max+2,grid_width,grid_height};
-	int32_t* disparity_grid_1 = (int32_t*)malloc((param.disp_max+2)*grid_height*grid_width*sizeof(int32_t));
-	int32_t* disparity_grid_2 = (int32_t*)malloc((param.disp_max+2)*grid_height*grid_width*sizeof(int32_t));
 
-#ifdef PROFILE
-	timer.start("Descriptor");
-#endif
-	Descriptor desc1(I1,width,height,bpl,param.subsampling);
-	Descriptor desc2(I2,width,height,bpl,param.subsampling);
+	// in tiled mode the descriptors are computed band by band, during support matching and again during matching
+	bool tiled = band_height<height;
 
-#ifdef PROFILE
-	timer.start("Support Matches");
-#endif
-	vector<support_pt> p_support = computeSupportMatches(desc1.I_desc,desc2.I_desc);
+	if (tiled) {
+		timer.start(SUPPORT_MATCHES);
+		computeSupportMatchesTiled(p_support);
+	} else {
+		timer.start(DESCRIPTOR);
+    #pragma omp parallel sections
+		{
+        #pragma omp section
+			desc1.compute(I1,width,height,bpl,param.subsampling);
+        #pragma omp section
+			desc2.compute(I2,width,height,bpl,param.subsampling);
+		}
 
-#ifdef PROFILE
-	timer.start("Delaunay Triangulation");
-#endif
-	vector<triangle> tri_1 = computeDelaunayTriangulation(p_support,0);
-	vector<triangle> tri_2 = computeDelaunayTriangulation(p_support,1);
+		timer.start(SUPPORT_MATCHES);
+		computeSupportMatches(desc1.I_desc,desc2.I_desc,p_support);
+	}
 
-#ifdef PROFILE
-	timer.start("Disparity Planes");
-#endif
-	computeDisparityPlanes(p_support,tri_1,0);
-	computeDisparityPlanes(p_support,tri_2,1);
+	timer.start(TRIANGULATION);
+	// the right image triangulation is derived from the left one, so they are done in order
+	computeDelaunayTriangulation(p_support,0,tri_1);
+	computeDelaunayTriangulation(p_support,1,tri_2);
+
+	timer.start(PLANES);
+    #pragma omp parallel sections
+	{
+        #pragma omp section
+		computeDisparityPlanes(p_support,tri_1,0);
+        #pragma omp section
+		computeDisparityPlanes(p_support,tri_2,1);
+	}
 
-#ifdef PROFILE
-	timer.start("Grid");
-#endif
-	createGrid(p_support,disparity_grid_1,grid_dims,0);
-	createGrid(p_support,disparity_grid_2,grid_dims,1);
+	if (!tiled) {
+		timer.start(GRID);
+    #pragma omp parallel sections
+		{
+        #pragma omp section
+			createGrid(p_support,disparity_grid_1,grid_dims,0,grid_temp_1,0,grid_height);
+        #pragma omp section
+			createGrid(p_support,disparity_grid_2,grid_dims,1,grid_temp_2,0,grid_height);
+		}
+	}
 
-#ifdef PROFILE
-	timer.start("Matching");
-#endif
-	computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1.I_desc,desc2.I_desc,0,D1);
-	computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1.I_desc,desc2.I_desc,1,D2);
+	timer.start(MATCHING);
+	if (tiled) {
+		computeDisparityTiled(D1,D2);
+	} else {
 
-#ifdef PROFILE
-	timer.start("L/R Consistency Check");
-#endif
+		// the left and right images are split into horizontal bands which are matched
+		// concurrently.  Every band visits the triangles in the same order, so pixels
+		// on shared triangle edges get the same value as when matched serially
+		int32_t no_of_bands = (height+ELAS_BAND_HEIGHT-1)/ELAS_BAND_HEIGHT;
+    #pragma omp parallel for schedule(dynamic)
+		for (int32_t job=0; job<2*no_of_bands; job++) {
+			int32_t v_begin = (job%no_of_bands)*ELAS_BAND_HEIGHT;
+			int32_t v_end   = min(v_begin+ELAS_BAND_HEIGHT,height);
+			if (job<no_of_bands)
+				computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1.I_desc,desc2.I_desc,0,D1,v_begin,v_end);
+			else
+				computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1.I_desc,desc2.I_desc,1,D2,v_begin,v_end);
+		}
+	}
+
+	timer.start(LR_CHECK);
 	leftRightConsistencyCheck(D1,D2);
 
-#ifdef PROFILE
-	timer.start("Remove Small Segments");
-#endif
+	timer.start(SMALL_SEGMENTS);
 	removeSmallSegments(D1);
 	if (!param.postprocess_only_left)
 		removeSmallSegments(D2);
 
-#ifdef PROFILE
-	timer.start("Gap Interpolation");
-#endif
+	timer.start(GAP_INTERPOLATION);
 	gapInterpolation(D1);
 	if (!param.postprocess_only_left)
 		gapInterpolation(D2);
 
 	if (param.filter_adaptive_mean) {
-#ifdef PROFILE
-		timer.start("Adaptive Mean");
-#endif
+		timer.start(ADAPTIVE_MEAN);
 		adaptiveMean(D1);
 		if (!param.postprocess_only_left)
 			adaptiveMean(D2);
 	}
 
 	if (param.filter_median) {
-#ifdef PROFILE
-		timer.start("Median");
-#endif
+		timer.start(MEDIAN);
 		median(D1);
 		if (!param.postprocess_only_left)
 			median(D2);
 	}
 
-#ifdef PROFILE
-	timer.plot();
-#endif
-
-	// release memory
-	free(disparity_grid_1);
-	free(disparity_grid_2);
-	_mm_free(I1);
-	_mm_free(I2);
+	timer.stop();
 }
 
 void Elas::removeInconsistentSupportPoints (int16_t* D_can,int32_t D_can_width,int32_t D_can_height) {
@@ -254,6 +593,66 @@ void Elas::addCornerSupportPoints(vector<support_pt> &p_support) {
 		p_support.push_back(p_border[i]);
 }
 
+#ifdef ELAS_AVX2_TARGET
+
+// keeps the best and second best support match energy, as in computeMatchingDisparity
+static inline void updateSupportMinimum (int32_t sum,int16_t d,int16_t &min_1_E,int16_t &min_1_d,int16_t &min_2_E,int16_t &min_2_d) {
+	if (sum<min_1_E) {
+		min_1_E = sum;
+		min_1_d = d;
+	} else if (sum<min_2_E) {
+		min_2_E = sum;
+		min_2_d = d;
+	}
+}
+
+// AVX2 version of the search over disparities in computeMatchingDisparity.
+// The descriptors of neighbouring disparities are next to each other, so the
+// energies of two disparities are computed from one 32 byte load per descriptor
+ELAS_AVX2_TARGET
+static void supportMatchSearchAVX2 (uint8_t* I1_block_addr,uint8_t* I2_line_addr,const int32_t* desc_offset,
+                                    int32_t u,int32_t disp_min_valid,int32_t disp_max_valid,bool right_image,
+                                    int16_t &min_1_E,int16_t &min_1_d,int16_t &min_2_E,int16_t &min_2_d) {
+
+	__m256i xmm[4];
+	for (int32_t i=0; i<4; i++)
+		xmm[i] = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i*)(I1_block_addr+desc_offset[i])));
+
+	int16_t d = disp_min_valid;
+	for (; d<disp_max_valid; d+=2) {
+
+		// descriptors of d and d+1, lowest address first
+		uint8_t* I2_block_addr;
+		if (!right_image) I2_block_addr = I2_line_addr+16*(u-d-1);
+		else              I2_block_addr = I2_line_addr+16*(u+d);
+
+		__m256i sad = _mm256_sad_epu8(xmm[0],_mm256_loadu_si256((__m256i*)(I2_block_addr+desc_offset[0])));
+		for (int32_t i=1; i<4; i++)
+			sad = _mm256_add_epi16(_mm256_sad_epu8(xmm[i],_mm256_loadu_si256((__m256i*)(I2_block_addr+desc_offset[i]))),sad);
+		int32_t sum_lo = _mm256_extract_epi16(sad,0)+_mm256_extract_epi16(sad,4);
+		int32_t sum_hi = _mm256_extract_epi16(sad,8)+_mm256_extract_epi16(sad,12);
+
+		if (!right_image) {
+			updateSupportMinimum(sum_hi,d,min_1_E,min_1_d,min_2_E,min_2_d);
+			updateSupportMinimum(sum_lo,d+1,min_1_E,min_1_d,min_2_E,min_2_d);
+		} else {
+			updateSupportMinimum(sum_lo,d,min_1_E,min_1_d,min_2_E,min_2_d);
+			updateSupportMinimum(sum_hi,d+1,min_1_E,min_1_d,min_2_E,min_2_d);
+		}
+	}
+
+	// last disparity if the number of disparities is odd
+	if (d==disp_max_valid) {
+		uint8_t* I2_block_addr = I2_line_addr+16*(right_image ? u+d : u-d);
+		__m128i sad = _mm_sad_epu8(_mm256_castsi256_si128(xmm[0]),_mm_load_si128((__m128i*)(I2_block_addr+desc_offset[0])));
+		for (int32_t i=1; i<4; i++)
+			sad = _mm_add_epi16(_mm_sad_epu8(_mm256_castsi256_si128(xmm[i]),_mm_load_si128((__m128i*)(I2_block_addr+desc_offset[i]))),sad);
+		updateSupportMinimum(_mm_extract_epi16(sad,0)+_mm_extract_epi16(sad,4),d,min_1_E,min_1_d,min_2_E,min_2_d);
+	}
+}
+
+#endif
+
 inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image) {
 
 	const int32_t u_step      = 2;
@@ -317,6 +716,14 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
 		if (disp_max_valid-disp_min_valid<10)
 			return -1;
 
+#ifdef ELAS_AVX2_TARGET
+		const int32_t desc_offset[4] = {desc_offset_1,desc_offset_2,desc_offset_3,desc_offset_4};
+		if (use_avx2)
+			supportMatchSearchAVX2(I1_block_addr,I2_line_addr,desc_offset,u,disp_min_valid,disp_max_valid,right_image,
+			                       min_1_E,min_1_d,min_2_E,min_2_d);
+		else
+#endif
+
 		// for all disparities do
 		for (int16_t d=disp_min_valid; d<=disp_max_valid; d++) {
 
@@ -358,7 +765,114 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
 		return -1;
 }
 
-vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc) {
+inline int16_t Elas::computeMatchingDisparityNear (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,
+                                                   const bool &right_image,const int32_t &d_near) {
+
+	const int32_t u_step      = 2;
+	const int32_t v_step      = 2;
+	const int32_t window_size = 3;
+
+	int32_t desc_offset_1 = -16*u_step-16*width*v_step;
+	int32_t desc_offset_2 = +16*u_step-16*width*v_step;
+	int32_t desc_offset_3 = -16*u_step+16*width*v_step;
+	int32_t desc_offset_4 = +16*u_step+16*width*v_step;
+
+	__m128i xmm1,xmm2,xmm3,xmm4,xmm5,xmm6;
+
+	// check if we are inside the image region
+	if (u<window_size+u_step || u>width-window_size-1-u_step || v<window_size+v_step || v>height-window_size-1-v_step)
+		return -1;
+
+	// compute desc and start addresses
+	int32_t  line_offset = 16*width*v;
+	uint8_t *I1_line_addr,*I2_line_addr;
+	if (!right_image) {
+		I1_line_addr = I1_desc+line_offset;
+		I2_line_addr = I2_desc+line_offset;
+	} else {
+		I1_line_addr = I2_desc+line_offset;
+		I2_line_addr = I1_desc+line_offset;
+	}
+
+	// compute I1 block start addresses
+	uint8_t* I1_block_addr = I1_line_addr+16*u;
+	uint8_t* I2_block_addr;
+
+	// we require at least some texture
+	int32_t sum = 0;
+	for (int32_t i=0; i<16; i++)
+		sum += abs((int32_t)(*(I1_block_addr+i))-128);
+	if (sum<param.support_texture)
+		return -1;
+
+	// get valid disparity range, as for the full search
+	int32_t disp_min_valid = max(param.disp_min,0);
+	int32_t disp_max_valid = param.disp_max;
+	if (!right_image) disp_max_valid = min(param.disp_max,u-window_size-u_step);
+	else              disp_max_valid = min(param.disp_max,width-u-window_size-u_step);
+	if (disp_max_valid-disp_min_valid<10)
+		return -1;
+
+	// window around the expected disparity
+	int32_t d_min = max(d_near-param.temporal_range,disp_min_valid);
+	int32_t d_max = min(d_near+param.temporal_range,disp_max_valid);
+	if (d_min>d_max)
+		return -1;
+
+	// load first blocks to xmm registers
+	xmm1 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_1));
+	xmm2 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_2));
+	xmm3 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_3));
+	xmm4 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_4));
+
+	// best match within the window
+	int32_t min_E = 32767;
+	int32_t min_d = -1;
+	for (int32_t d=d_min; d<=d_max; d++) {
+		if (!right_image) I2_block_addr = I2_line_addr+16*(u-d);
+		else              I2_block_addr = I2_line_addr+16*(u+d);
+		xmm6 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_1));
+		xmm6 = _mm_sad_epu8(xmm1,xmm6);
+		xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_2));
+		xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm2,xmm5),xmm6);
+		xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_3));
+		xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm3,xmm5),xmm6);
+		xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_4));
+		xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm4,xmm5),xmm6);
+		sum  = _mm_extract_epi16(xmm6,0)+_mm_extract_epi16(xmm6,4);
+		if (sum<min_E) {
+			min_E = sum;
+			min_d = d;
+		}
+	}
+
+	// a minimum on the edge of the window, which doesn't coincide with the edge
+	// of the valid range, may only be the slope towards a match further away
+	if ((min_d==d_min && d_min>disp_min_valid) || (min_d==d_max && d_max<disp_max_valid))
+		return -1;
+	return min_d;
+}
+
+void Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc,vector<support_pt> &p_support) {
+	int32_t tiles_y = (D_can_height-1+ELAS_TEMPORAL_TILE-1)/ELAS_TEMPORAL_TILE;
+	bool temporal = startSupportMatches();
+	matchSupportCandidates(I1_desc,I2_desc,0,tiles_y,temporal);
+	finishSupportMatches(temporal,p_support);
+}
+
+// clears the disparity candidates, returning whether the support points of the previous frame are searched for
+bool Elas::startSupportMatches () {
+
+	// clear matrix for saving disparity candidates
+	memset(D_can,0,D_can_width*D_can_height*sizeof(int16_t));
+
+	// in temporal mode support points of the previous frame are only searched for
+	// near their previous disparity, with a full search every temporal_refresh frames
+	return param.temporal_support && D_can_prev_valid && support_frames<param.temporal_refresh;
+}
+
+// matches the candidates within the given rows of tiles
+void Elas::matchSupportCandidates (uint8_t* I1_desc,uint8_t* I2_desc,int32_t tile_row_begin,int32_t tile_row_end,bool temporal) {
 
 	// be sure that at half resolution we only need data
 	// from every second line!
@@ -366,37 +880,91 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
 	if (param.subsampling)
 		D_candidate_stepsize += D_candidate_stepsize%2;
 
-	// create matrix for saving disparity candidates
-	int32_t D_can_width  = 0;
-	int32_t D_can_height = 0;
-	for (int32_t u=0; u<width;  u+=D_candidate_stepsize) D_can_width++;
-	for (int32_t v=0; v<height; v+=D_candidate_stepsize) D_can_height++;
-	int16_t* D_can = (int16_t*)calloc(D_can_width*D_can_height,sizeof(int16_t));
-
-	// loop variables
-	int32_t u,v;
-	int16_t d,d2;
+	// candidates are matched in tiles, so that the tiles in which any support point
+	// of the previous frame is not found again can be searched in full
+	int32_t tiles_x = (D_can_width-1+ELAS_TEMPORAL_TILE-1)/ELAS_TEMPORAL_TILE;
 
 	// for all point candidates in image 1 do
-	for (int32_t u_can=1; u_can<D_can_width; u_can++) {
-		u = u_can*D_candidate_stepsize;
-		for (int32_t v_can=1; v_can<D_can_height; v_can++) {
-			v = v_can*D_candidate_stepsize;
-
-			// initialize disparity candidate to invalid
-			*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = -1;
-
-			// find forwards
-			d = computeMatchingDisparity(u,v,I1_desc,I2_desc,false);
-			if (d>=0) {
-
-				// find backwards
-				d2 = computeMatchingDisparity(u-d,v,I1_desc,I2_desc,true);
-				if (d2>=0 && abs(d-d2)<=param.lr_threshold)
-					*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = d;
+    #pragma omp parallel for schedule(dynamic)
+	for (int32_t tile=tile_row_begin*tiles_x; tile<tile_row_end*tiles_x; tile++) {
+		int32_t u_can_min = 1+(tile%tiles_x)*ELAS_TEMPORAL_TILE;
+		int32_t v_can_min = 1+(tile/tiles_x)*ELAS_TEMPORAL_TILE;
+		int32_t u_can_max = min(u_can_min+ELAS_TEMPORAL_TILE,D_can_width);
+		int32_t v_can_max = min(v_can_min+ELAS_TEMPORAL_TILE,D_can_height);
+		int32_t u,v;
+		int16_t d,d2,d_prev;
+
+		// re-validate the support points of the previous frame
+		bool full_search = true;
+		if (temporal) {
+			full_search = false;
+			bool seeded  = false;
+			for (int32_t u_can=u_can_min; u_can<u_can_max && !full_search; u_can++) {
+				u = u_can*D_candidate_stepsize;
+				for (int32_t v_can=v_can_min; v_can<v_can_max; v_can++) {
+					v = v_can*D_candidate_stepsize;
+					*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = -1;
+					d_prev = *(D_can_prev+getAddressOffsetImage(u_can,v_can,D_can_width));
+					if (d_prev<0) continue;
+					seeded = true;
+
+					// find forwards and backwards near the previous disparity
+					d = computeMatchingDisparityNear(u,v,I1_desc,I2_desc,false,d_prev);
+					if (d>=0) {
+						d2 = computeMatchingDisparityNear(u-d,v,I1_desc,I2_desc,true,d);
+						if (d2>=0 && abs(d-d2)<=param.lr_threshold) {
+							*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = d;
+							continue;
+						}
+					}
+					full_search = true;
+					break;
+				}
+			}
+
+			// tiles without any previous support points are searched in full, which
+			// is cheap where there is too little texture for support points
+			if (!seeded) full_search = true;
+		}
+
+		if (full_search) {
+			for (int32_t u_can=u_can_min; u_can<u_can_max; u_can++) {
+				u = u_can*D_candidate_stepsize;
+				for (int32_t v_can=v_can_min; v_can<v_can_max; v_can++) {
+					v = v_can*D_candidate_stepsize;
+
+					// initialize disparity candidate to invalid
+					*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = -1;
+
+					// find forwards
+					d = computeMatchingDisparity(u,v,I1_desc,I2_desc,false);
+					if (d>=0) {
+
+						// find backwards
+						d2 = computeMatchingDisparity(u-d,v,I1_desc,I2_desc,true);
+						if (d2>=0 && abs(d-d2)<=param.lr_threshold)
+							*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = d;
+					}
+				}
 			}
 		}
 	}
+}
+
+// removes inconsistent and redundant candidates and collects the remaining support points
+void Elas::finishSupportMatches (bool temporal,vector<support_pt> &p_support) {
+
+	int32_t D_candidate_stepsize = param.candidate_stepsize;
+	if (param.subsampling)
+		D_candidate_stepsize += D_candidate_stepsize%2;
+
+	// keep the candidates for the next frame, before any are removed below
+	if (param.temporal_support) {
+		memcpy(D_can_prev,D_can,D_can_width*D_can_height*sizeof(int16_t));
+		D_can_prev_valid = true;
+		if (temporal) support_frames++;
+		else          support_frames = 1;
+	}
 
 	// remove inconsistent support points
 	removeInconsistentSupportPoints(D_can,D_can_width,D_can_height);
@@ -408,7 +976,7 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
 	removeRedundantSupportPoints(D_can,D_can_width,D_can_height,5,1,false);
 
 	// move support points from image representation into a vector representation
-	vector<support_pt> p_support;
+	p_support.clear();
 	for (int32_t u_can=1; u_can<D_can_width; u_can++)
 		for (int32_t v_can=1; v_can<D_can_height; v_can++)
 			if (*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width))>=0)
@@ -420,77 +988,36 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
 	// with the same disparity as the nearest neighbor support point
 	if (param.add_corners)
 		addCornerSupportPoints(p_support);
-
-	// free memory
-	free(D_can);
-
-	// return support point vector
-	return p_support;
 }
 
-vector<Elas::triangle> Elas::computeDelaunayTriangulation (vector<support_pt> p_support,int32_t right_image) {
-
-	// input/output structure for triangulation
-	struct triangulateio in, out;
-	int32_t k;
-
-	// inputs
-	in.numberofpoints = p_support.size();
-	in.pointlist = (float*)malloc(in.numberofpoints*2*sizeof(float));
-	k=0;
-	if (!right_image) {
-		for (int32_t i = 0; i < (int32_t)p_support.size(); i++) {
-			in.pointlist[k++] = p_support[i].u;
-			in.pointlist[k++] = p_support[i].v;
-		}
-	} else {
-		for (int32_t i = 0; i < (int32_t)p_support.size(); i++) {
-			in.pointlist[k++] = p_support[i].u-p_support[i].d;
-			in.pointlist[k++] = p_support[i].v;
-		}
-	}
-	in.numberofpointattributes = 0;
-	in.pointattributelist      = NULL;
-	in.pointmarkerlist         = NULL;
-	in.numberofsegments        = 0;
-	in.numberofholes           = 0;
-	in.numberofregions         = 0;
-	in.regionlist              = NULL;
-
-	// outputs
-	out.pointlist              = NULL;
-	out.pointattributelist     = NULL;
-	out.pointmarkerlist        = NULL;
-	out.trianglelist           = NULL;
-	out.triangleattributelist  = NULL;
-	out.neighborlist           = NULL;
-	out.segmentlist            = NULL;
-	out.segmentmarkerlist      = NULL;
-	out.edgelist               = NULL;
-	out.edgemarkerlist         = NULL;
-
-	// do triangulation (z=zero-based, n=neighbors, Q=quiet, B=no boundary markers)
-	char parameters[] = "zQB";
-	vector<triangle> tri;
-	if (triangulate(parameters, &in, &out, NULL)==-1) return tri;
-
-	// put resulting triangles into vector tri
-	k=0;
-	for (int32_t i=0; i<out.numberoftriangles; i++) {
-		tri.push_back(triangle(out.trianglelist[k],out.trianglelist[k+1],out.trianglelist[k+2]));
-		k+=3;
+void Elas::computeDelaunayTriangulation (const vector<support_pt> &p_support,int32_t right_image,vector<triangle> &tri) {
+
+	// support point coordinates in the left or right image
+	int32_t n = p_support.size();
+	tri.clear();
+	if (n==0) return;
+	delaunay_u.resize(n);
+	delaunay_v.resize(n);
+	for (int32_t i=0; i<n; i++) {
+		delaunay_u[i] = right_image ? p_support[i].u-p_support[i].d : p_support[i].u;
+		delaunay_v[i] = p_support[i].v;
 	}
 
-	// free memory used for triangulation
-	free(in.pointlist);
-	free(out.pointlist);
-	free(out.trianglelist);
+	// the right image points are the left ones shifted by their disparities, which
+	// usually leaves the left triangulation valid with only a few edges to flip,
+	// so it is only triangulated from scratch if a triangle has been turned over
+	if (!right_image || !delaunay.moveVertices(&delaunay_u[0],&delaunay_v[0]))
+		if (!delaunay.triangulate(&delaunay_u[0],&delaunay_v[0],n))
+			return;
 
-	// return triangles
-	return tri;
+	// put resulting triangles into vector tri
+	delaunay_corners.clear();
+	delaunay.getTriangles(delaunay_corners);
+	for (int32_t k=0; k<(int32_t)delaunay_corners.size(); k+=3)
+		tri.push_back(triangle(delaunay_corners[k],delaunay_corners[k+1],delaunay_corners[k+2]));
 }
 
-void Elas::computeDisparityPlanes (vector<support_pt> p_support,vector<triangle> &tri,int32_t right_image) {
+void Elas::computeDisparityPlanes (const vector<support_pt> &p_support,vector<triangle> &tri,int32_t right_image) {
 
 	// init matrices
 	Matrix A(3,3);
@@ -562,15 +1089,24 @@ void Elas::computeDisparityPlanes (vector<support_pt> p_support,vector<triangle>
 	}
 }
 
-void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image) {
+// creates the grid rows y_begin to y_end-1, which are addressed by their row within the whole grid
+void Elas::createGrid(const vector<support_pt> &p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image,
+                      int32_t* grid_temp,int32_t y_begin,int32_t y_end) {
 
 	// get grid dimensions
 	int32_t grid_width  = grid_dims[1];
 	int32_t grid_height = grid_dims[2];
 
-	// allocate temporary memory
-	int32_t* temp1 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
-	int32_t* temp2 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
+	// the temporary grids hold two more rows either side of those created, since
+	// the diffusion below wraps around from the end of one row to the next
+	int32_t temp_begin  = max(y_begin-2,0);
+	int32_t temp_height = min(y_end+2,grid_height)-temp_begin;
+
+	// clear temporary memory
+	int32_t* temp1 = grid_temp;
+	int32_t* temp2 = grid_temp+(param.disp_max+1)*temp_height*grid_width;
+	memset(temp1,0,(param.disp_max+1)*temp_height*grid_width*sizeof(int32_t));
+	memset(temp2,0,(param.disp_max+1)*temp_height*grid_width*sizeof(int32_t));
 
 	// for all support points do
 	for (int32_t i = 0; i < (int32_t)p_support.size(); i++) {
@@ -589,10 +1125,10 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
 				x = floor((float)(x_curr/param.grid_size));
 			else
 				x = floor((float)(x_curr-d_curr)/(float)param.grid_size);
-			int32_t y = floor((float)y_curr/(float)param.grid_size);
+			int32_t y = floor((float)y_curr/(float)param.grid_size)-temp_begin;
 
 			// point may potentially lay outside (corner points)
-			if (x>=0 && x<grid_width &&y>=0 && y<grid_height) {
+			if (x>=0 && x<grid_width &&y>=0 && y<temp_height) {
 				int32_t addr = getAddressOffsetGrid(x,y,d,grid_width,param.disp_max+1);
 				*(temp1+addr) = 1;
 			}
@@ -611,7 +1147,7 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
 	const int32_t* br = temp1 + (2*grid_width+2)*(param.disp_max+1);
 
 	int32_t* result    = temp2 + (1*grid_width+1)*(param.disp_max+1);
-	int32_t* end_input = temp1 + grid_width*grid_height*(param.disp_max+1);
+	int32_t* end_input = temp1 + grid_width*temp_height*(param.disp_max+1);
 
 	// diffuse temporary grid
 	for( ; br != end_input; tl++, tc++, tr++, cl++, cc++, cr++, bl++, bc++, br++, result++ )
@@ -619,7 +1155,7 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
 
 	// for all grid positions create disparity grid
 	for (int32_t x=0; x<grid_width; x++) {
-		for (int32_t y=0; y<grid_height; y++) {
+		for (int32_t y=y_begin; y<y_end; y++) {
 
 			// start with second value (first is reserved for count)
 			int32_t curr_ind = 1;
@@ -628,7 +1164,7 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
 			for (int32_t d=0; d<=param.disp_max; d++) {
 
 				// if yes => add this disparity to current cell
-				if (*(temp2+getAddressOffsetGrid(x,y,d,grid_width,param.disp_max+1))>0) {
+				if (*(temp2+getAddressOffsetGrid(x,y-temp_begin,d,grid_width,param.disp_max+1))>0) {
 					*(disparity_grid+getAddressOffsetGrid(x,y,curr_ind,grid_width,param.disp_max+2))=d;
 					curr_ind++;
 				}
@@ -638,10 +1174,6 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
 			*(disparity_grid+getAddressOffsetGrid(x,y,0,grid_width,param.disp_max+2))=curr_ind-1;
 		}
 	}
-
-	// release temporary memory
-	free(temp1);
-	free(temp2);
 }
 
 inline void Elas::updatePosteriorMinimum(__m128i* I2_block_addr,const int32_t &d,const int32_t &w,
@@ -666,9 +1198,10 @@ inline void Elas::updatePosteriorMinimum(__m128i* I2_block_addr,const int32_t &d
 	}
 }
 
+template <typename disp_type>
 inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,float &plane_c,
                             int32_t* disparity_grid,int32_t *grid_dims,uint8_t* I1_desc,uint8_t* I2_desc,
-                            int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D){
+                            int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,disp_type* D){
 
 	// get image width and height
 	const int32_t disp_num    = grid_dims[0]-1;
@@ -761,34 +1294,31 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
 	}
 
 	// set disparity value
-	if (min_d>=0) *(D+d_addr) = min_d; // MAP value (min neg-Log probability)
-	else          *(D+d_addr) = -1;    // invalid disparity
+	if (min_d>=0) *(D+d_addr) = min_d*disparityScale(D); // MAP value (min neg-Log probability)
+	else          *(D+d_addr) = -disparityScale(D);      // invalid disparity
 }
 
 // TODO: %2 => more elegantly
-void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,int32_t* disparity_grid,int32_t *grid_dims,
-                            uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D) {
-
-	// number of disparities
-	const int32_t disp_num  = grid_dims[0]-1;
+template <typename disp_type>
+void Elas::computeDisparity(const vector<support_pt> &p_support,const vector<triangle> &tri,int32_t* disparity_grid,int32_t *grid_dims,
+                            uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,disp_type* D,
+                            int32_t v_begin,int32_t v_end) {
 
 	// descriptor window_size
 	//int32_t window_size = 2;
 
-	// init disparity image to -10
+	// init disparity image rows within the band to -10
+	const disp_type invalid = -10*disparityScale(D);
 	if (param.subsampling) {
-		for (int32_t i=0; i<(width/2)*(height/2); i++)
-			*(D+i) = -10;
+		for (int32_t i=((v_begin+1)/2)*(width/2); i<min((v_end+1)/2,height/2)*(width/2); i++)
+			*(D+i) = invalid;
 	} else {
-		for (int32_t i=0; i<width*height; i++)
-			*(D+i) = -10;
+		for (int32_t i=v_begin*width; i<v_end*width; i++)
+			*(D+i) = invalid;
 	}
 
-	// pre-compute prior
-	float two_sigma_squared = 2*param.sigma*param.sigma;
-	int32_t* P = new int32_t[disp_num];
-	for (int32_t delta_d=0; delta_d<disp_num; delta_d++)
-		P[delta_d] = (int32_t)((-log(param.gamma+exp(-delta_d*delta_d/two_sigma_squared))+log(param.gamma))/param.beta);
+	// pre-computed prior
+	int32_t* P = &prior[0];
 	int32_t plane_radius = (int32_t)max((float)ceil(param.sigma*param.sradius),(float)2.0);
 
 	// loop variables
@@ -817,6 +1347,12 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
 		c2 = tri[i].c2;
 		c3 = tri[i].c3;
 
+		// skip triangles outside of the band, allowing a row either side for rounding
+		int32_t tri_v_min = min(p_support[c1].v,min(p_support[c2].v,p_support[c3].v));
+		int32_t tri_v_max = max(p_support[c1].v,max(p_support[c2].v,p_support[c3].v));
+		if (tri_v_max+1<v_begin || tri_v_min-1>=v_end)
+			continue;
+
 		// sort triangle corners wrt. u (ascending)
 		float tri_u[3];
 		if (!right_image) {
@@ -863,7 +1399,7 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
 				if (!param.subsampling || u%2==0) {
 					int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
 					int32_t v_2 = (uint32_t)(AB_a*(float)u+AB_b);
-					for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++)
+					for (int32_t v=max(min(v_1,v_2),v_begin); v<min(max(v_1,v_2),v_end); v++)
 						if (!param.subsampling || v%2==0) {
 							findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
 									  I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
@@ -878,7 +1414,7 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
 				if (!param.subsampling || u%2==0) {
 					int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
 					int32_t v_2 = (uint32_t)(BC_a*(float)u+BC_b);
-					for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++)
+					for (int32_t v=max(min(v_1,v_2),v_begin); v<min(max(v_1,v_2),v_end); v++)
 						if (!param.subsampling || v%2==0) {
 							findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
 									  I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
@@ -888,11 +1424,10 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
 		}
 
 	}
-
-	delete[] P;
 }
 
-void Elas::leftRightConsistencyCheck(float* D1,float* D2) {
+template <typename disp_type>
+void Elas::leftRightConsistencyCheck(disp_type* D1,disp_type* D2) {
 
 	// get disparity image dimensions
 	int32_t D_width  = width;
@@ -902,11 +1437,17 @@ void Elas::leftRightConsistencyCheck(float* D1,float* D2) {
 		D_height = height/2;
 	}
 
+	// disparity units per pixel, scaled for half resolution
+	const int32_t   scale     = disparityScale(D1);
+	const float     u_scale   = param.subsampling ? 2*scale : scale;
+	const float     threshold = param.lr_threshold*scale;
+	const disp_type invalid   = -10*scale;
+
 	// make a copy of both images
-	float* D1_copy = (float*)malloc(D_width*D_height*sizeof(float));
-	float* D2_copy = (float*)malloc(D_width*D_height*sizeof(float));
-	memcpy(D1_copy,D1,D_width*D_height*sizeof(float));
-	memcpy(D2_copy,D2,D_width*D_height*sizeof(float));
+	disp_type* D1_copy = (disp_type*)D_temp1;
+	disp_type* D2_copy = (disp_type*)D_temp2;
+	memcpy(D1_copy,D1,D_width*D_height*sizeof(disp_type));
+	memcpy(D2_copy,D2,D_width*D_height*sizeof(disp_type));
 
 	// loop variables
 	uint32_t addr,addr_warp;
@@ -920,13 +1461,8 @@ void Elas::leftRightConsistencyCheck(float* D1,float* D2) {
 			addr     = getAddressOffsetImage(u,v,D_width);
 			d1       = *(D1_copy+addr);
 			d2       = *(D2_copy+addr);
-			if (param.subsampling) {
-				u_warp_1 = (float)u-d1/2;
-				u_warp_2 = (float)u+d2/2;
-			} else {
-				u_warp_1 = (float)u-d1;
-				u_warp_2 = (float)u+d2;
-			}
+			u_warp_1 = (float)u-d1/u_scale;
+			u_warp_2 = (float)u+d2/u_scale;
 
 
 			// check if left disparity is valid
@@ -936,12 +1472,12 @@ void Elas::leftRightConsistencyCheck(float* D1,float* D2) {
 				addr_warp = getAddressOffsetImage((int32_t)u_warp_1,v,D_width);
 
 				// if check failed
-				if (fabs(*(D2_copy+addr_warp)-d1)>param.lr_threshold)
-					*(D1+addr) = -10;
+				if (fabs(*(D2_copy+addr_warp)-d1)>threshold)
+					*(D1+addr) = invalid;
 
 				// set invalid
 			} else
-				*(D1+addr) = -10;
+				*(D1+addr) = invalid;
 
 			// check if right disparity is valid
 			if (d2>=0 && u_warp_2>=0 && u_warp_2<D_width) {
@@ -950,21 +1486,41 @@ void Elas::leftRightConsistencyCheck(float* D1,float* D2) {
 				addr_warp = getAddressOffsetImage((int32_t)u_warp_2,v,D_width);
 
 				// if check failed
-				if (fabs(*(D1_copy+addr_warp)-d2)>param.lr_threshold)
-					*(D2+addr) = -10;
+				if (fabs(*(D1_copy+addr_warp)-d2)>threshold)
+					*(D2+addr) = invalid;
 
 				// set invalid
 			} else
-				*(D2+addr) = -10;
+				*(D2+addr) = invalid;
 		}
 	}
+}
 
-	// release memory
-	free(D1_copy);
-	free(D2_copy);
+// root of the segment of pixel i.  Roots are always the first pixel of their segment
+// in raster order, and the path is halved on the way
+static inline int32_t segmentRoot (int32_t* parent,int32_t i) {
+	while (parent[i]!=i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
 }
 
-void Elas::removeSmallSegments (float* D) {
+// joins the segments of pixels i and j
+static inline void joinSegments (int32_t* parent,int32_t i,int32_t j) {
+	i = segmentRoot(parent,i);
+	j = segmentRoot(parent,j);
+	if (i<j) parent[j] = i;
+	else     parent[i] = j;
+}
+
+// segments are the 4-connected regions of valid pixels whose neighbouring disparities
+// differ by no more than speckle_sim_threshold, as found by the flood fill this replaces.
+// They are labelled in two passes: bands of rows are labelled concurrently using union-find,
+// then joined along the band edges, after which a raster pass resolves each pixel to its root
+// and counts the pixels of each segment.  Invalid pixels are segments of their own
+template <typename disp_type>
+void Elas::removeSmallSegments (disp_type* D) {
 
 	// get disparity image dimensions
 	int32_t D_width        = width;
@@ -975,116 +1531,82 @@ void Elas::removeSmallSegments (float* D) {
 		D_height       = height/2;
 		D_speckle_size = sqrt((float)param.speckle_size)*2;
 	}
+	const int32_t scale         = disparityScale(D);
+	const float   sim_threshold = param.speckle_sim_threshold*scale;
+
+	// label each band of rows
+	int32_t no_of_bands = (D_height+ELAS_BAND_HEIGHT-1)/ELAS_BAND_HEIGHT;
+    #pragma omp parallel for schedule(dynamic)
+	for (int32_t band=0; band<no_of_bands; band++) {
+		int32_t v_begin = band*ELAS_BAND_HEIGHT;
+		int32_t v_end   = min(v_begin+ELAS_BAND_HEIGHT,D_height);
+		for (int32_t v=v_begin; v<v_end; v++) {
+			for (int32_t u=0; u<D_width; u++) {
+				int32_t addr = getAddressOffsetImage(u,v,D_width);
+				seg_parent[addr] = addr;
+				if (D[addr]<0) continue;
+				if (u>0 && D[addr-1]>=0 && fabs(D[addr]-D[addr-1])<=sim_threshold)
+					joinSegments(seg_parent,addr,addr-1);
+				if (v>v_begin && D[addr-D_width]>=0 && fabs(D[addr]-D[addr-D_width])<=sim_threshold)
+					joinSegments(seg_parent,addr,addr-D_width);
+			}
+		}
+	}
 
-	// allocate memory on heap for dynamic programming arrays
-	int32_t *D_done     = (int32_t*)calloc(D_width*D_height,sizeof(int32_t));
-	int32_t *seg_list_u = (int32_t*)calloc(D_width*D_height,sizeof(int32_t));
-	int32_t *seg_list_v = (int32_t*)calloc(D_width*D_height,sizeof(int32_t));
-	int32_t seg_list_count;
-	int32_t seg_list_curr;
-	int32_t u_neighbor[4];
-	int32_t v_neighbor[4];
-	int32_t u_seg_curr;
-	int32_t v_seg_curr;
-
-	// declare loop variables
-	int32_t addr_start, addr_curr, addr_neighbor;
-
-	// for all pixels do
-	for (int32_t u=0; u<D_width; u++) {
-		for (int32_t v=0; v<D_height; v++) {
-
-			// get address of first pixel in this segment
-			addr_start = getAddressOffsetImage(u,v,D_width);
-
-			// if this pixel has not already been processed
-			if (*(D_done+addr_start)==0) {
-
-				// init segment list (add first element
-				// and set it to be the next element to check)
-				*(seg_list_u+0) = u;
-				*(seg_list_v+0) = v;
-				seg_list_count  = 1;
-				seg_list_curr   = 0;
-
-				// add neighboring segments as long as there
-				// are none-processed pixels in the seg_list;
-				// none-processed means: seg_list_curr<seg_list_count
-				while (seg_list_curr<seg_list_count) {
-
-					// get current position from seg_list
-					u_seg_curr = *(seg_list_u+seg_list_curr);
-					v_seg_curr = *(seg_list_v+seg_list_curr);
-
-					// get address of current pixel in this segment
-					addr_curr = getAddressOffsetImage(u_seg_curr,v_seg_curr,D_width);
-
-					// fill list with neighbor positions
-					u_neighbor[0] = u_seg_curr-1; v_neighbor[0] = v_seg_curr;
-					u_neighbor[1] = u_seg_curr+1; v_neighbor[1] = v_seg_curr;
-					u_neighbor[2] = u_seg_curr;   v_neighbor[2] = v_seg_curr-1;
-					u_neighbor[3] = u_seg_curr;   v_neighbor[3] = v_seg_curr+1;
-
-					// for all neighbors do
-					for (int32_t i=0; i<4; i++) {
-
-						// check if neighbor is inside image
-						if (u_neighbor[i]>=0 && v_neighbor[i]>=0 && u_neighbor[i]<D_width && v_neighbor[i]<D_height) {
-
-							// get neighbor pixel address
-							addr_neighbor = getAddressOffsetImage(u_neighbor[i],v_neighbor[i],D_width);
-
-							// check if neighbor has not been added yet and if it is valid
-							if (*(D_done+addr_neighbor)==0 && *(D+addr_neighbor)>=0) {
-
-								// is the neighbor similar to the current pixel
-								// (=belonging to the current segment)
-								if (fabs(*(D+addr_curr)-*(D+addr_neighbor))<=param.speckle_sim_threshold) {
-
-									// add neighbor coordinates to segment list
-									*(seg_list_u+seg_list_count) = u_neighbor[i];
-									*(seg_list_v+seg_list_count) = v_neighbor[i];
-									seg_list_count++;
-
-									// set neighbor pixel in I_done to "done"
-									// (otherwise a pixel may be added 2 times to the list, as
-									//  neighbor of one pixel and as neighbor of another pixel)
-									*(D_done+addr_neighbor) = 1;
-								}
-							}
-
-						}
-					}
-
-					// set current pixel in seg_list to "done"
-					seg_list_curr++;
+	// join the segments across the edges between bands
+	for (int32_t v=ELAS_BAND_HEIGHT; v<D_height; v+=ELAS_BAND_HEIGHT) {
+		for (int32_t u=0; u<D_width; u++) {
+			int32_t addr = getAddressOffsetImage(u,v,D_width);
+			if (D[addr]>=0 && D[addr-D_width]>=0 && fabs(D[addr]-D[addr-D_width])<=sim_threshold)
+				joinSegments(seg_parent,addr,addr-D_width);
+		}
+	}
 
-					// set current pixel in I_done to "done"
-					*(D_done+addr_curr) = 1;
+	// resolve the roots in raster order, in which each root comes before the rest of its segment
+	for (int32_t addr=0; addr<D_width*D_height; addr++) {
+		int32_t root = seg_parent[seg_parent[addr]];
+		seg_parent[addr] = root;
+		if (root==addr) seg_size[addr] = 1;
+		else            seg_size[root]++;
+	}
 
-				} // end: while (seg_list_curr<seg_list_count)
+	// invalidate the pixels of segments which are not large enough
+	const disp_type invalid = -10*scale;
+    #pragma omp parallel for
+	for (int32_t v=0; v<D_height; v++)
+		for (int32_t addr=v*D_width; addr<(v+1)*D_width; addr++)
+			if (seg_size[seg_parent[addr]]<D_speckle_size)
+				D[addr] = invalid;
+}
 
-				// if segment NOT large enough => invalidate pixels
-				if (seg_list_count<D_speckle_size) {
+// mask of the valid disparities among the eight from D, as 16 bit lanes
+static inline __m128i validMask (const float* D) {
+	__m128 xconst0 = _mm_setzero_ps();
+	return _mm_packs_epi32(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(D),xconst0)),
+	                       _mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(D+4),xconst0)));
+}
+static inline __m128i validMask (const int16_t* D) {
+	return _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*)D),_mm_set1_epi16(-1));
+}
 
-					// for all pixels in current segment invalidate pixels
-					for (int32_t i=0; i<seg_list_count; i++) {
-						addr_curr = getAddressOffsetImage(*(seg_list_u+i),*(seg_list_v+i),D_width);
-						*(D+addr_curr) = -10;
-					}
-				}
-			} // end: if (*(I_done+addr_start)==0)
+// sets the gap between D[first*step] and D[last*step] from the valid disparities either side
+template <typename disp_type>
+static inline void fillGap (disp_type* D,int32_t step,int32_t first,int32_t last,float discon_threshold) {
 
-		}
-	}
+	// compute mean disparity
+	disp_type d1 = *(D+(first-1)*step);
+	disp_type d2 = *(D+(last+1)*step);
+	disp_type d_ipol;
+	if (fabs(d1-d2)<discon_threshold) d_ipol = (d1+d2)/2;
+	else                              d_ipol = min(d1,d2);
 
-	// free memory
-	free(D_done);
-	free(seg_list_u);
-	free(seg_list_v);
+	// set all values to d_ipol
+	for (int32_t i=first; i<=last; i++)
+		*(D+i*step) = d_ipol;
 }
 
-void Elas::gapInterpolation(float* D) {
+template <typename disp_type>
+void Elas::gapInterpolation(disp_type* D) {
 
 	// get disparity image dimensions
 	int32_t D_width          = width;
@@ -1097,16 +1619,16 @@ void Elas::gapInterpolation(float* D) {
 	}
 
 	// discontinuity threshold
-	float discon_threshold = 3.0;
-
-	// declare loop variables
-	int32_t count,addr,v_first,v_last,u_first,u_last;
-	float   d1,d2,d_ipol;
+	float discon_threshold = 3.0*disparityScale(D);
 
 	// 1. Row-wise:
-	// for each row do
+	// rows are independent, and runs of eight valid disparities which don't end a gap are skipped
+    #pragma omp parallel for
 	for (int32_t v=0; v<D_height; v++) {
 
+		// declare loop variables
+		int32_t count,addr;
+
 		// init counter
 		count = 0;
 
@@ -1116,31 +1638,18 @@ void Elas::gapInterpolation(float* D) {
 			// get address of this location
 			addr = getAddressOffsetImage(u,v,D_width);
 
+			// nothing to do for eight valid disparities which don't end a gap
+			if (count==0 && u+8<=D_width && _mm_movemask_epi8(validMask(D+addr))==0xFFFF) {
+				u += 7;
+				continue;
+			}
+
 			// if disparity valid
 			if (*(D+addr)>=0) {
 
-				// check if speckle is small enough
-				if (count>=1 && count<=D_ipol_gap_width) {
-
-					// first and last value for interpolation
-					u_first = u-count;
-					u_last  = u-1;
-
-					// if value in range
-					if (u_first>0 && u_last<D_width-1) {
-
-						// compute mean disparity
-						d1 = *(D+getAddressOffsetImage(u_first-1,v,D_width));
-						d2 = *(D+getAddressOffsetImage(u_last+1,v,D_width));
-						if (fabs(d1-d2)<discon_threshold) d_ipol = (d1+d2)/2;
-						else                              d_ipol = min(d1,d2);
-
-						// set all values to d_ipol
-						for (int32_t u_curr=u_first; u_curr<=u_last; u_curr++)
-							*(D+getAddressOffsetImage(u_curr,v,D_width)) = d_ipol;
-					}
-
-				}
+				// check if speckle is small enough and in range
+				if (count>=1 && count<=D_ipol_gap_width && u-count>0 && u-1<D_width-1)
+					fillGap(D+v*D_width,1,u-count,u-1,discon_threshold);
 
 				// reset counter
 				count = 0;
@@ -1185,57 +1694,184 @@ void Elas::gapInterpolation(float* D) {
 	}
 
 	// 2. Column-wise:
-	// for each column do
-	for (int32_t u=0; u<D_width; u++) {
-
-		// init counter
-		count = 0;
-
-		// for each element of the column do
+	// columns are done in blocks, going down all of them together so that memory is read
+	// in order.  The lengths of the gaps in eight columns are counted at once
+	__m128i xone = _mm_set1_epi16(1);
+	__m128i xgap = _mm_set1_epi16(min(D_ipol_gap_width,32766)+1);
+    #pragma omp parallel for schedule(dynamic)
+	for (int32_t u_begin=0; u_begin<D_width; u_begin+=ELAS_GAP_COLUMNS) {
+		int32_t u_end     = min(u_begin+ELAS_GAP_COLUMNS,D_width);
+		int32_t u_vec_end = u_begin+(u_end-u_begin)/8*8;
+
+		// counters of the columns done eight at a time, and of any left over
+		__m128i xcount[ELAS_GAP_COLUMNS/8];
+		int32_t count[8];
+		for (int32_t i=0; i<ELAS_GAP_COLUMNS/8; i++)
+			xcount[i] = _mm_setzero_si128();
+		memset(count,0,sizeof(count));
+
+		// for each row of the block do
 		for (int32_t v=0; v<D_height; v++) {
+			for (int32_t u=u_begin; u<u_vec_end; u+=8) {
+				__m128i &x    = xcount[(u-u_begin)/8];
+				__m128i xmask = validMask(D+getAddressOffsetImage(u,v,D_width));
+
+				// valid disparities ending a gap which is small enough
+				int32_t fill = _mm_movemask_epi8(_mm_and_si128(xmask,_mm_and_si128(_mm_cmpgt_epi16(x,_mm_setzero_si128()),
+				                                                                   _mm_cmpgt_epi16(xgap,x))));
+				if (fill) {
+					int16_t c[8];
+					_mm_storeu_si128((__m128i*)c,x);
+					for (int32_t i=0; i<8; i++)
+						if ((fill>>(2*i))&1 && v-c[i]>0 && v-1<D_height-1)
+							fillGap(D+u+i,D_width,v-c[i],v-1,discon_threshold);
+				}
 
-			// get address of this location
-			addr = getAddressOffsetImage(u,v,D_width);
-
-			// if disparity valid
-			if (*(D+addr)>=0) {
+				// reset the counters of valid disparities, otherwise increment them
+				x = _mm_andnot_si128(xmask,_mm_adds_epi16(x,xone));
+			}
+			for (int32_t u=u_vec_end; u<u_end; u++) {
+				int32_t &c = count[u-u_vec_end];
+				if (*(D+getAddressOffsetImage(u,v,D_width))>=0) {
+					if (c>=1 && c<=D_ipol_gap_width && v-c>0 && v-1<D_height-1)
+						fillGap(D+u,D_width,v-c,v-1,discon_threshold);
+					c = 0;
+				} else {
+					c++;
+				}
+			}
+		}
+	}
+}
 
-				// check if gap is small enough
-				if (count>=1 && count<=D_ipol_gap_width) {
+// SSE vectors of disparities and the operations the filters below need, overloaded
+// for single disparities so that the same code does the pixels at the end of a row
+template <typename disp_type> struct sse_vector;
+template <> struct sse_vector<float>   { typedef __m128  type; static const int32_t width = 4; };
+template <> struct sse_vector<int16_t> { typedef __m128i type; static const int32_t width = 8; };
+
+static inline __m128  loadDisparities (const float* D)   { return _mm_loadu_ps(D); }
+static inline __m128i loadDisparities (const int16_t* D) { return _mm_loadu_si128((const __m128i*)D); }
+static inline void storeDisparities (float* D,const __m128 &x)    { _mm_storeu_ps(D,x); }
+static inline void storeDisparities (int16_t* D,const __m128i &x) { _mm_storeu_si128((__m128i*)D,x); }
+
+static inline float   minDisparity (float a,float b)                 { return a<b ? a : b; }
+static inline int16_t minDisparity (int16_t a,int16_t b)             { return a<b ? a : b; }
+static inline __m128  minDisparity (const __m128 &a,const __m128 &b)   { return _mm_min_ps(a,b); }
+static inline __m128i minDisparity (const __m128i &a,const __m128i &b) { return _mm_min_epi16(a,b); }
+static inline float   maxDisparity (float a,float b)                 { return a<b ? b : a; }
+static inline int16_t maxDisparity (int16_t a,int16_t b)             { return a<b ? b : a; }
+static inline __m128  maxDisparity (const __m128 &a,const __m128 &b)   { return _mm_max_ps(a,b); }
+static inline __m128i maxDisparity (const __m128i &a,const __m128i &b) { return _mm_max_epi16(a,b); }
+
+// returns x where d is valid, otherwise d
+static inline __m128 selectValid (const __m128 &d,const __m128 &x) {
+	__m128 mask = _mm_cmpge_ps(d,_mm_setzero_ps());
+	return _mm_or_ps(_mm_and_ps(mask,x),_mm_andnot_ps(mask,d));
+}
+static inline __m128i selectValid (const __m128i &d,const __m128i &x) {
+	__m128i mask = _mm_cmpgt_epi16(d,_mm_set1_epi16(-1));
+	return _mm_or_si128(_mm_and_si128(mask,x),_mm_andnot_si128(mask,d));
+}
 
-					// first and last value for interpolation
-					v_first = v-count;
-					v_last  = v-1;
+// orders a pair of values
+template <typename T>
+static inline void sortPair (T &a,T &b) {
+	T t = minDisparity(a,b);
+	b   = maxDisparity(a,b);
+	a   = t;
+}
 
-					// if value in range
-					if (v_first>0 && v_last<D_height-1) {
+// median of seven values, using a 16 comparator sorting network
+template <typename T>
+static inline T median7 (T* x) {
+	sortPair(x[0],x[6]); sortPair(x[2],x[3]); sortPair(x[4],x[5]);
+	sortPair(x[0],x[2]); sortPair(x[1],x[4]); sortPair(x[3],x[6]);
+	sortPair(x[0],x[1]); sortPair(x[2],x[5]); sortPair(x[3],x[4]);
+	sortPair(x[1],x[2]); sortPair(x[4],x[6]);
+	sortPair(x[2],x[3]); sortPair(x[4],x[5]);
+	sortPair(x[1],x[2]); sortPair(x[3],x[4]); sortPair(x[5],x[6]);
+	return x[3];
+}
 
-						// compute mean disparity
-						d1 = *(D+getAddressOffsetImage(u,v_first-1,D_width));
-						d2 = *(D+getAddressOffsetImage(u,v_last+1,D_width));
-						if (fabs(d1-d2)<discon_threshold) d_ipol = (d1+d2)/2;
-						else                              d_ipol = min(d1,d2);
+// weighted means of four neighbouring pixels and of the taps-1 pixels before each of them,
+// step apart.  The weights fall linearly from 4 for equal disparities to 0 for a difference of 4.
+// The current pixel always has full weight, so the sum of the weights is never zero
+static inline void adaptiveMeanVector (const float* src,float* dst,int32_t step,int32_t taps) {
+
+	__m128 xconst0     = _mm_setzero_ps();
+	__m128 xconst4     = _mm_set1_ps(4);
+	__m128 xabsmask    = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 xcurr       = _mm_loadu_ps(src);
+	__m128 xweight_sum = xconst0;
+	__m128 xfactor_sum = xconst0;
+
+	for (int32_t t=0; t<taps; t++) {
+		__m128 xval    = _mm_loadu_ps(src-t*step);
+		__m128 xweight = _mm_and_ps(_mm_sub_ps(xval,xcurr),xabsmask);
+		xweight     = _mm_max_ps(xconst0,_mm_sub_ps(xconst4,xweight));
+		xweight_sum = _mm_add_ps(xweight_sum,xweight);
+		xfactor_sum = _mm_add_ps(xfactor_sum,_mm_mul_ps(xval,xweight));
+	}
+	_mm_storeu_ps(dst,_mm_div_ps(xfactor_sum,xweight_sum));
+}
 
-						// set all values to d_ipol
-						for (int32_t v_curr=v_first; v_curr<=v_last; v_curr++)
-							*(D+getAddressOffsetImage(u,v_curr,D_width)) = d_ipol;
-					}
+static inline void adaptiveMeanScalar (const float* src,float* dst,int32_t step,int32_t taps) {
+	float weight_sum = 0;
+	float factor_sum = 0;
+	for (int32_t t=0; t<taps; t++) {
+		float val    = *(src-t*step);
+		float weight = max(0.0f,4-fabsf(val-*src));
+		weight_sum += weight;
+		factor_sum += val*weight;
+	}
+	*dst = factor_sum/weight_sum;
+}
 
-				}
+// fixed point version, eight pixels at a time.  The weights are in 1/ELAS_DISPARITY_SCALE
+// pixel units, so that the products fit within _mm_madd_epi16
+static inline void adaptiveMeanVector (const int16_t* src,int16_t* dst,int32_t step,int32_t taps) {
+
+	__m128i xconst0     = _mm_setzero_si128();
+	__m128i xconst4     = _mm_set1_epi16(4*ELAS_DISPARITY_SCALE);
+	__m128i xcurr       = _mm_loadu_si128((const __m128i*)src);
+	__m128i xweight_sum = xconst0;
+	__m128i xfactor_lo  = xconst0;
+	__m128i xfactor_hi  = xconst0;
+
+	for (int32_t t=0; t<taps; t++) {
+		__m128i xval    = _mm_loadu_si128((const __m128i*)(src-t*step));
+		__m128i xweight = _mm_sub_epi16(xval,xcurr);
+		xweight     = _mm_max_epi16(xweight,_mm_sub_epi16(xconst0,xweight));
+		xweight     = _mm_max_epi16(xconst0,_mm_sub_epi16(xconst4,xweight));
+		xweight_sum = _mm_add_epi16(xweight_sum,xweight);
+		xfactor_lo  = _mm_add_epi32(xfactor_lo,_mm_madd_epi16(_mm_unpacklo_epi16(xval,xconst0),_mm_unpacklo_epi16(xweight,xconst0)));
+		xfactor_hi  = _mm_add_epi32(xfactor_hi,_mm_madd_epi16(_mm_unpackhi_epi16(xval,xconst0),_mm_unpackhi_epi16(xweight,xconst0)));
+	}
 
-				// reset counter
-				count = 0;
+	__m128 xmean_lo = _mm_div_ps(_mm_cvtepi32_ps(xfactor_lo),_mm_cvtepi32_ps(_mm_unpacklo_epi16(xweight_sum,xconst0)));
+	__m128 xmean_hi = _mm_div_ps(_mm_cvtepi32_ps(xfactor_hi),_mm_cvtepi32_ps(_mm_unpackhi_epi16(xweight_sum,xconst0)));
+	_mm_storeu_si128((__m128i*)dst,_mm_packs_epi32(_mm_cvtps_epi32(xmean_lo),_mm_cvtps_epi32(xmean_hi)));
+}
 
-				// otherwise increment counter
-			} else {
-				count++;
-			}
-		}
+static inline void adaptiveMeanScalar (const int16_t* src,int16_t* dst,int32_t step,int32_t taps) {
+	int32_t weight_sum = 0;
+	int32_t factor_sum = 0;
+	for (int32_t t=0; t<taps; t++) {
+		int32_t val    = *(src-t*step);
+		int32_t weight = max(0,4*ELAS_DISPARITY_SCALE-abs(val-*src));
+		weight_sum += weight;
+		factor_sum += val*weight;
 	}
+	*dst = _mm_cvtss_si32(_mm_set_ss((float)factor_sum/(float)weight_sum));
 }
 
-// implements approximation to bilateral filtering
-void Elas::adaptiveMean (float* D) {
+// implements approximation to bilateral filtering, as separable horizontal and vertical
+// passes which each filter a vector of neighbouring pixels at once.  The taps are summed
+// in order, so float results may differ from summing across the lanes of one vector per
+// pixel by rounding, which stays below 1e-5 pixel
+template <typename disp_type>
+void Elas::adaptiveMean (disp_type* D) {
 
 	// get disparity image dimensions
 	int32_t D_width          = width;
@@ -1244,191 +1880,49 @@ void Elas::adaptiveMean (float* D) {
 		D_width          = width/2;
 		D_height         = height/2;
 	}
+	const int32_t n = sse_vector<disp_type>::width;
 
-	// allocate temporary memory
-	float* D_copy = (float*)malloc(D_width*D_height*sizeof(float));
-	float* D_tmp  = (float*)malloc(D_width*D_height*sizeof(float));
-	memcpy(D_copy,D,D_width*D_height*sizeof(float));
+	// temporary memory
+	disp_type* D_copy = (disp_type*)D_temp1;
+	disp_type* D_tmp  = (disp_type*)D_temp2;
+	memcpy(D_copy,D,D_width*D_height*sizeof(disp_type));
 
 	// zero disparity map
+	const disp_type invalid = -10*disparityScale(D);
 	for (int32_t i=0; i<D_width*D_height; i++) {
-		*(D_tmp+i) = -10;
-		*(D+i)     = -10;
+		*(D_tmp+i) = invalid;
+		*(D+i)     = invalid;
 	}
 
-	__m128 xconst0 = _mm_set1_ps(0);
-	__m128 xconst4 = _mm_set1_ps(4);
-	__m128 xval,xweight1,xweight2,xfactor1,xfactor2;
-
-	float *val    = (float*)_mm_malloc(8*sizeof(float),16);
-	float *weight = (float*)_mm_malloc(4*sizeof(float),16);
-	float *factor = (float*)_mm_malloc(4*sizeof(float),16);
-
-	// set absolute mask
-	val[0] = 0x7FFFFFFF; val[1] = 0x7FFFFFFF;
-	val[2] = 0x7FFFFFFF; val[3] = 0x7FFFFFFF;
-	__m128 xabsmask = _mm_load_ps(val);
-
-	// when doing subsampling: 4 pixel bilateral filter width
-	if (param.subsampling) {
-
-		// horizontal filter
-		for (int32_t v=3; v<D_height-3; v++) {
-
-			// init
-			for (int32_t u=0; u<3; u++)
-				val[u] = *(D_copy+v*D_width+u);
-
-			// loop
-			for (int32_t u=3; u<D_width; u++) {
-
-				// set
-				float val_curr = *(D_copy+v*D_width+u);
-				val[u%4] = val_curr;
-
-				xval     = _mm_load_ps(val);
-				xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-				xweight1 = _mm_and_ps(xweight1,xabsmask);
-				xweight1 = _mm_sub_ps(xconst4,xweight1);
-				xweight1 = _mm_max_ps(xconst0,xweight1);
-				xfactor1 = _mm_mul_ps(xval,xweight1);
-
-				_mm_store_ps(weight,xweight1);
-				_mm_store_ps(factor,xfactor1);
-
-				float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-				float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
-				if (weight_sum>0)
-					*(D_tmp+v*D_width+u) = factor_sum/weight_sum;
-			}
-		}
-
-		// vertical filter
-		for (int32_t u=3; u<D_width-3; u++) {
-
-			// init
-			for (int32_t v=0; v<3; v++)
-				val[v] = *(D_tmp+v*D_width+u);
-
-			// loop
-			for (int32_t v=3; v<D_height; v++) {
-
-				// set
-				float val_curr = *(D_tmp+v*D_width+u);
-				val[v%4] = val_curr;
-
-				xval     = _mm_load_ps(val);
-				xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-				xweight1 = _mm_and_ps(xweight1,xabsmask);
-				xweight1 = _mm_sub_ps(xconst4,xweight1);
-				xweight1 = _mm_max_ps(xconst0,xweight1);
-				xfactor1 = _mm_mul_ps(xval,xweight1);
-
-				_mm_store_ps(weight,xweight1);
-				_mm_store_ps(factor,xfactor1);
-
-				float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-				float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
-				if (weight_sum>0)
-					*(D+v*D_width+u) = factor_sum/weight_sum;
-			}
-		}
-
-		// full resolution: 8 pixel bilateral filter width
-	} else {
-
-		// horizontal filter
-		for (int32_t v=3; v<D_height-3; v++) {
-
-			// init
-			for (int32_t u=0; u<7; u++)
-				val[u] = *(D_copy+v*D_width+u);
-
-			// loop
-			for (int32_t u=7; u<D_width; u++) {
-
-				// set
-				float val_curr = *(D_copy+v*D_width+u);
-				val[u%8] = val_curr;
-
-				xval     = _mm_load_ps(val);
-				xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-				xweight1 = _mm_and_ps(xweight1,xabsmask);
-				xweight1 = _mm_sub_ps(xconst4,xweight1);
-				xweight1 = _mm_max_ps(xconst0,xweight1);
-				xfactor1 = _mm_mul_ps(xval,xweight1);
-
-				xval     = _mm_load_ps(val+4);
-				xweight2 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-				xweight2 = _mm_and_ps(xweight2,xabsmask);
-				xweight2 = _mm_sub_ps(xconst4,xweight2);
-				xweight2 = _mm_max_ps(xconst0,xweight2);
-				xfactor2 = _mm_mul_ps(xval,xweight2);
-
-				xweight1 = _mm_add_ps(xweight1,xweight2);
-				xfactor1 = _mm_add_ps(xfactor1,xfactor2);
-
-				_mm_store_ps(weight,xweight1);
-				_mm_store_ps(factor,xfactor1);
-
-				float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-				float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
-				if (weight_sum>0)
-					*(D_tmp+v*D_width+u) = factor_sum/weight_sum;
-			}
-		}
-
-		// vertical filter
-		for (int32_t u=3; u<D_width-3; u++) {
-
-			// init
-			for (int32_t v=0; v<7; v++)
-				val[v] = *(D_tmp+v*D_width+u);
-
-			// loop
-			for (int32_t v=7; v<D_height; v++) {
-
-				// set
-				float val_curr = *(D_tmp+v*D_width+u);
-				val[v%8] = val_curr;
-
-				xval     = _mm_load_ps(val);
-				xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-				xweight1 = _mm_and_ps(xweight1,xabsmask);
-				xweight1 = _mm_sub_ps(xconst4,xweight1);
-				xweight1 = _mm_max_ps(xconst0,xweight1);
-				xfactor1 = _mm_mul_ps(xval,xweight1);
-
-				xval     = _mm_load_ps(val+4);
-				xweight2 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-				xweight2 = _mm_and_ps(xweight2,xabsmask);
-				xweight2 = _mm_sub_ps(xconst4,xweight2);
-				xweight2 = _mm_max_ps(xconst0,xweight2);
-				xfactor2 = _mm_mul_ps(xval,xweight2);
-
-				xweight1 = _mm_add_ps(xweight1,xweight2);
-				xfactor1 = _mm_add_ps(xfactor1,xfactor2);
-
-				_mm_store_ps(weight,xweight1);
-				_mm_store_ps(factor,xfactor1);
-
-				float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-				float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
-				if (weight_sum>0)
-					*(D+v*D_width+u) = factor_sum/weight_sum;
-			}
-		}
+	// when doing subsampling: 4 pixel bilateral filter width,
+	// full resolution: 8 pixel bilateral filter width
+	int32_t taps = param.subsampling ? 4 : 8;
+
+	// horizontal filter
+    #pragma omp parallel for
+	for (int32_t v=3; v<D_height-3; v++) {
+		int32_t u = taps-1;
+		for (; u+n<=D_width; u+=n)
+			adaptiveMeanVector(D_copy+v*D_width+u,D_tmp+v*D_width+u,1,taps);
+		for (; u<D_width; u++)
+			adaptiveMeanScalar(D_copy+v*D_width+u,D_tmp+v*D_width+u,1,taps);
 	}
 
-	// free memory
-	_mm_free(val);
-	_mm_free(weight);
-	_mm_free(factor);
-	free(D_copy);
-	free(D_tmp);
+	// vertical filter
+    #pragma omp parallel for
+	for (int32_t v=taps-1; v<D_height; v++) {
+		int32_t u = 3;
+		for (; u+n<=D_width-3; u+=n)
+			adaptiveMeanVector(D_tmp+v*D_width+u,D+v*D_width+u,D_width,taps);
+		for (; u<D_width-3; u++)
+			adaptiveMeanScalar(D_tmp+v*D_width+u,D+v*D_width+u,D_width,taps);
+	}
 }
 
-void Elas::median (float* D) {
+// 7 pixel median, as separable horizontal and vertical passes.  The sorting network gives
+// the same medians as sorting each window, so the results are unchanged
+template <typename disp_type>
+void Elas::median (disp_type* D) {
 
 	// get disparity image dimensions
 	int32_t D_width          = width;
@@ -1437,61 +1931,53 @@ void Elas::median (float* D) {
 		D_width          = width/2;
 		D_height         = height/2;
 	}
+	typedef typename sse_vector<disp_type>::type disp_vector;
+	const int32_t n = sse_vector<disp_type>::width;
 
 	// temporary memory
-	float *D_temp = (float*)calloc(D_width*D_height,sizeof(float));
-
-	int32_t window_size = 3;
-
-	float *vals = new float[window_size*2+1];
-	int32_t i,j;
-	float temp;
-
-	// first step: horizontal median filter
-	for (int32_t u=window_size; u<D_width-window_size; u++) {
-		for (int32_t v=window_size; v<D_height-window_size; v++) {
-			if (*(D+getAddressOffsetImage(u,v,D_width))>=0) {
-				j = 0;
-				for (int32_t u2=u-window_size; u2<=u+window_size; u2++) {
-					temp = *(D+getAddressOffsetImage(u2,v,D_width));
-					i = j-1;
-					while (i>=0 && *(vals+i)>temp) {
-						*(vals+i+1) = *(vals+i);
-						i--;
-					}
-					*(vals+i+1) = temp;
-					j++;
-				}
-				*(D_temp+getAddressOffsetImage(u,v,D_width)) = *(vals+window_size);
-			} else {
-				*(D_temp+getAddressOffsetImage(u,v,D_width)) = *(D+getAddressOffsetImage(u,v,D_width));
-			}
+	disp_type *D_temp = (disp_type*)D_temp1;
+	memset(D_temp,0,D_width*D_height*sizeof(disp_type));
+
+	const int32_t window_size = 3;
 
+	// first step: horizontal median filter of the valid pixels
+    #pragma omp parallel for
+	for (int32_t v=window_size; v<D_height-window_size; v++) {
+		disp_type* src = D+v*D_width;
+		disp_type* dst = D_temp+v*D_width;
+		int32_t u = window_size;
+		for (; u+n<=D_width-window_size; u+=n) {
+			disp_vector x[2*window_size+1];
+			for (int32_t i=0; i<2*window_size+1; i++)
+				x[i] = loadDisparities(src+u-window_size+i);
+			disp_vector d = x[window_size];
+			storeDisparities(dst+u,selectValid(d,median7(x)));
+		}
+		for (; u<D_width-window_size; u++) {
+			disp_type x[2*window_size+1];
+			for (int32_t i=0; i<2*window_size+1; i++)
+				x[i] = src[u-window_size+i];
+			dst[u] = src[u]>=0 ? median7(x) : src[u];
 		}
 	}
 
 	// second step: vertical median filter
-	for (int32_t u=window_size; u<D_width-window_size; u++) {
-		for (int32_t v=window_size; v<D_height-window_size; v++) {
-			if (*(D+getAddressOffsetImage(u,v,D_width))>=0) {
-				j = 0;
-				for (int32_t v2=v-window_size; v2<=v+window_size; v2++) {
-					temp = *(D_temp+getAddressOffsetImage(u,v2,D_width));
-					i = j-1;
-					while (i>=0 && *(vals+i)>temp) {
-						*(vals+i+1) = *(vals+i);
-						i--;
-					}
-					*(vals+i+1) = temp;
-					j++;
-				}
-				*(D+getAddressOffsetImage(u,v,D_width)) = *(vals+window_size);
-			} else {
-				*(D+getAddressOffsetImage(u,v,D_width)) = *(D+getAddressOffsetImage(u,v,D_width));
-			}
+    #pragma omp parallel for
+	for (int32_t v=window_size; v<D_height-window_size; v++) {
+		disp_type* src = D_temp+(v-window_size)*D_width;
+		disp_type* dst = D+v*D_width;
+		int32_t u = window_size;
+		for (; u+n<=D_width-window_size; u+=n) {
+			disp_vector x[2*window_size+1];
+			for (int32_t i=0; i<2*window_size+1; i++)
+				x[i] = loadDisparities(src+i*D_width+u);
+			storeDisparities(dst+u,selectValid(loadDisparities(dst+u),median7(x)));
+		}
+		for (; u<D_width-window_size; u++) {
+			disp_type x[2*window_size+1];
+			for (int32_t i=0; i<2*window_size+1; i++)
+				x[i] = src[i*D_width+u];
+			if (dst[u]>=0) dst[u] = median7(x);
 		}
 	}
-
-	free(D_temp);
-	free(vals);
 }
@@ -45,15 +45,41 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
   typedef unsigned __int64  uint64_t;
 #endif
 
-#ifdef PROFILE
+#include "descriptor.h"
+#include "delaunay.h"
 #include "timer.h"
-#endif
+
+// number of image rows within each band matched by a thread
+#define ELAS_BAND_HEIGHT 16
+
+// number of columns which gap interpolation goes down together (a multiple of 8)
+#define ELAS_GAP_COLUMNS 64
+
+// width and height of the tiles of support point candidates which are
+// searched in full if temporal support points can't be found again
+#define ELAS_TEMPORAL_TILE 4
+
+// fixed point disparities are in units of 1/ELAS_DISPARITY_SCALE pixel,
+// with invalid pixels set to the scaled float value of -10
+#define ELAS_DISPARITY_SCALE 16
+#define ELAS_INVALID_FIXED   (-10*ELAS_DISPARITY_SCALE)
+
+// image rows above and below each band which are included when its descriptors
+// are computed in tiled mode: support matching looks two rows up and down, and the
+// descriptor of a row depends upon three rows either side.  Kept even so that
+// subsampled descriptors are computed for the same rows as for the whole image
+#define ELAS_TILE_HALO 6
 
 class Elas {
   
 public:
   
   enum setting {ROBOTICS,MIDDLEBURY};
+
+  // stages of process which are timed.  In tiled mode the descriptors and grids
+  // are computed within the support matches and matching stages
+  enum stage {INPUT,DESCRIPTOR,SUPPORT_MATCHES,TRIANGULATION,PLANES,GRID,MATCHING,LR_CHECK,
+              SMALL_SEGMENTS,GAP_INTERPOLATION,ADAPTIVE_MEAN,MEDIAN,NO_OF_STAGES};
   
   // parameter settings
   struct parameters {
@@ -82,6 +108,12 @@ public:
     bool    subsampling;            // saves time by only computing disparities for each 2nd pixel
                                     // note: for this option D1 and D2 must be passed with size
                                     //       width/2 x height/2 (rounded towards zero)
+    bool    temporal_support;       // for video, search for support points near those of the previous frame
+    int32_t temporal_range;         // disparity search radius around a previous support point
+    int32_t temporal_refresh;       // number of frames between full support point searches
+    int64_t memory_budget;          // max. bytes used for descriptors and disparity grids, 0 = no limit.
+                                    // images which need more are matched in overlapping horizontal
+                                    // bands, as many at once as there are threads
     
     // constructor
     parameters (setting s=ROBOTICS) {
@@ -113,6 +145,10 @@ public:
         filter_adaptive_mean  = 1;
         postprocess_only_left = 1;
         subsampling           = 0;
+        temporal_support      = 0;
+        temporal_range        = 2;
+        temporal_refresh      = 10;
+        memory_budget         = 0;
         
       // default settings for middlebury benchmark
       // (interpolate all missing disparities)
@@ -140,15 +176,19 @@ public:
         filter_adaptive_mean  = 0;
         postprocess_only_left = 0;
         subsampling           = 0;
+        temporal_support      = 0;
+        temporal_range        = 2;
+        temporal_refresh      = 10;
+        memory_budget         = 0;
       }
     }
   };
 
   // constructor, input: parameters  
-  Elas (parameters param) : param(param) {}
+  Elas (parameters param);
 
-  // deconstructor
-  ~Elas () {}
+  // deconstructor, releases the workspace
+  ~Elas ();
   
   // matching function
   // inputs: pointers to left (I1) and right (I2) intensity image (uint8, input)
@@ -159,7 +199,29 @@ public:
   //         note: D1 and D2 must be allocated before (bytes per line = width)
   //               if subsampling is not active their size is width x height,
   //               otherwise width/2 x height/2 (rounded towards zero)
+  //         note: if dims[2] equals bytesPerLine(width) and I1 and I2 are 16 byte
+  //               aligned (e.g. allocated with _mm_malloc) they are used without copying
+  //         note: buffers are kept between calls and only reallocated when the image size changes
   void process (uint8_t* I1,uint8_t* I2,float* D1,float* D2,const int32_t* dims);
+
+  // as above, but the disparities are written as 16 bit fixed point values in units of
+  // 1/ELAS_DISPARITY_SCALE pixel, invalid pixels being ELAS_INVALID_FIXED.  Postprocessing
+  // works on the fixed point values directly, so this moves half as much memory
+  void process (uint8_t* I1,uint8_t* I2,int16_t* D1,int16_t* D2,const int32_t* dims);
+
+  // as above, but I1 and I2 are interleaved images of which one channel is matched,
+  // e.g. channels=3 for BGR, or channels=2 and channel=0 for the luma of YUYV, and
+  // dims[2] is their bytes per line.  The channel is extracted straight into the
+  // aligned buffers used for matching, within the input stage
+  void process (uint8_t* I1,uint8_t* I2,int32_t channels,int32_t channel,float* D1,float* D2,const int32_t* dims);
+  void process (uint8_t* I1,uint8_t* I2,int32_t channels,int32_t channel,int16_t* D1,int16_t* D2,const int32_t* dims);
+
+  // durations of the stages of recent calls to process
+  const Timer& getTimer () const { return timer; }
+  void resetTimer () { timer.reset(); }
+
+  // bytes per line of the aligned images used internally
+  static int32_t bytesPerLine (int32_t width) { return width + 15-(width-1)%16; }
   
 private:
   
@@ -170,6 +232,13 @@ private:
     support_pt(int32_t u,int32_t v,int32_t d):u(u),v(v),d(d){}
   };
 
+  // descriptors and disparity grids of one band of the image in tiled mode
+  struct band_workspace {
+    Descriptor desc1,desc2;
+    int32_t    *grid_1,*grid_2;             // grid rows covered by the band
+    int32_t    *grid_temp_1,*grid_temp_2;   // temporary memory for createGrid
+  };
+
   struct triangle {
     int32_t c1,c2,c3;
     float   t1a,t1b,t1c;
@@ -177,6 +246,10 @@ private:
     triangle(int32_t c1,int32_t c2,int32_t c3):c1(c1),c2(c2),c3(c3){}
   };
 
+  // units per pixel of the disparity types written by process
+  static inline int32_t disparityScale (const float*)   { return 1; }
+  static inline int32_t disparityScale (const int16_t*) { return ELAS_DISPARITY_SCALE; }
+
   inline uint32_t getAddressOffsetImage (const int32_t& u,const int32_t& v,const int32_t& width) {
     return v*width+u;
   }
@@ -191,34 +264,63 @@ private:
                                      int32_t redun_max_dist, int32_t redun_threshold, bool vertical);
   void addCornerSupportPoints (std::vector<support_pt> &p_support);
   inline int16_t computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image);
-  std::vector<support_pt> computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc);
+  inline int16_t computeMatchingDisparityNear (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,
+                                               const bool &right_image,const int32_t &d_near);
+  void computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc,std::vector<support_pt> &p_support);
+  bool startSupportMatches ();
+  void matchSupportCandidates (uint8_t* I1_desc,uint8_t* I2_desc,int32_t tile_row_begin,int32_t tile_row_end,bool temporal);
+  void finishSupportMatches (bool temporal,std::vector<support_pt> &p_support);
 
   // triangulation & grid
-  std::vector<triangle> computeDelaunayTriangulation (std::vector<support_pt> p_support,int32_t right_image);
-  void computeDisparityPlanes (std::vector<support_pt> p_support,std::vector<triangle> &tri,int32_t right_image);
-  void createGrid (std::vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image);
+  void computeDelaunayTriangulation (const std::vector<support_pt> &p_support,int32_t right_image,std::vector<triangle> &tri);
+  void computeDisparityPlanes (const std::vector<support_pt> &p_support,std::vector<triangle> &tri,int32_t right_image);
+  void createGrid (const std::vector<support_pt> &p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image,
+                   int32_t* grid_temp,int32_t y_begin,int32_t y_end);
 
   // matching
   inline void updatePosteriorMinimum (__m128i* I2_block_addr,const int32_t &d,const int32_t &w,
                                       const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d);
   inline void updatePosteriorMinimum (__m128i* I2_block_addr,const int32_t &d,
                                       const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d);
+  template <typename disp_type>
   inline void findMatch (int32_t &u,int32_t &v,float &plane_a,float &plane_b,float &plane_c,
                          int32_t* disparity_grid,int32_t *grid_dims,uint8_t* I1_desc,uint8_t* I2_desc,
-                         int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D);
-  void computeDisparity (std::vector<support_pt> p_support,std::vector<triangle> tri,int32_t* disparity_grid,int32_t* grid_dims,
-                         uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D);
+                         int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,disp_type* D);
+  template <typename disp_type>
+  void computeDisparity (const std::vector<support_pt> &p_support,const std::vector<triangle> &tri,int32_t* disparity_grid,int32_t* grid_dims,
+                         uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,disp_type* D,int32_t v_begin,int32_t v_end);
+
+  // matching and postprocessing for either type of disparity image
+  template <typename disp_type>
+  void processImages (uint8_t* I1,uint8_t* I2,int32_t channels,int32_t channel,disp_type* D1,disp_type* D2,const int32_t* dims);
+  void extractChannel (const uint8_t* I,int32_t stride,int32_t channels,int32_t channel,uint8_t* I_gray);
+
+  // tiled mode
+  int64_t matchingMemory (int32_t rows);
+  int32_t bandWindow (int32_t v_begin);
+  void    computeSupportMatchesTiled (std::vector<support_pt> &p_support);
+  template <typename disp_type>
+  void    computeDisparityTiled (disp_type* D1,disp_type* D2);
 
   // L/R consistency check
-  void leftRightConsistencyCheck (float* D1,float* D2);
+  template <typename disp_type>
+  void leftRightConsistencyCheck (disp_type* D1,disp_type* D2);
   
   // postprocessing
-  void removeSmallSegments (float* D);
-  void gapInterpolation (float* D);
+  template <typename disp_type>
+  void removeSmallSegments (disp_type* D);
+  template <typename disp_type>
+  void gapInterpolation (disp_type* D);
 
   // optional postprocessing
-  void adaptiveMean (float* D);
-  void median (float* D);
+  template <typename disp_type>
+  void adaptiveMean (disp_type* D);
+  template <typename disp_type>
+  void median (disp_type* D);
+
+  // workspace
+  void allocateWorkspace ();
+  void releaseWorkspace ();
   
   // parameter set
   parameters param;
@@ -226,11 +328,38 @@ private:
   // memory aligned input images + dimensions
   uint8_t *I1,*I2;
   int32_t width,height,bpl;
+
+  // whether the AVX2 support matching kernel is used
+  bool use_avx2;
+
+  // workspace, reused between frames while the image size stays the same
+  int32_t    ws_width,ws_height;          // image size the workspace was allocated for
+  uint8_t    *I1_buf,*I2_buf;             // aligned copies of input images which can't be used directly
+  Descriptor desc1,desc2;                 // descriptor images
+  int32_t    grid_width,grid_height;      // disparity grid dimensions
+  int32_t    *disparity_grid_1,*disparity_grid_2;
+  int32_t    *grid_temp_1,*grid_temp_2;   // temporary memory for createGrid, left and right image
+  std::vector<int32_t> prior;             // prior for each disparity difference from the plane
+  int16_t    *D_can;                      // disparity candidates
+  int32_t    D_can_width,D_can_height;
+  int16_t    *D_can_prev;                 // disparity candidates of the previous frame (temporal_support)
+  bool       D_can_prev_valid;
+  int32_t    support_frames;              // frames since the last full support point search
+  float      *D_temp1,*D_temp2;           // disparity copies used by the consistency check and filters,
+                                          // also used for fixed point disparities
+  int32_t    *seg_parent,*seg_size;       // segment labelling in removeSmallSegments
+  std::vector<support_pt> p_support;
+  std::vector<triangle>   tri_1,tri_2;
+  Delaunay   delaunay;                    // triangulation of the support points
+  std::vector<int32_t> delaunay_u,delaunay_v,delaunay_corners;
+  int32_t    band_height;                 // image rows per band, equal to height unless tiled
+  int32_t    band_window;                 // image rows for which the descriptors of a band are computed
+  int32_t    band_grid_height;            // max. number of grid rows covered by a band
+  std::vector<band_workspace*> bands;     // one for each band matched at the same time
   
-  // profiling timer
-#ifdef PROFILE
+  // stage timing
+  static const char* const stage_names[NO_OF_STAGES];
   Timer timer;
-#endif
 };
 
 #endif
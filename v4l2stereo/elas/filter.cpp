@@ -25,6 +25,13 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 
 #include "filter.h"
 
+// AVX2 versions of the 3x3 sobel filter are compiled for that target individually
+// and only used if the CPU supports them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <immintrin.h>
+  #define FILTER_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
 // define fixed-width datatypes for Visual Studio projects
 #ifndef _MSC_VER
   #include <stdint.h>
@@ -405,14 +412,130 @@ namespace filter {
     }
   }
 
-  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h ) {
+#ifdef FILTER_AVX2_TARGET
+  namespace detail {
+
+    // AVX2 version of convolve_cols_3x3, 32 pixels at a time with the remainder done one pixel at a time
+    FILTER_AVX2_TARGET
+    static void convolve_cols_3x3_avx2( const unsigned char* in, int16_t* out_v, int16_t* out_h, int w, int h ) {
+      assert( w % 16 == 0 && "width must be multiple of 16!" );
+      const int n = w*(h-2);
+      int16_t* result_h = out_h + w;
+      int16_t* result_v = out_v + w;
+      int i = 0;
+      for( ; i+32 <= n; i += 32 ) {
+        __m256i i0 = _mm256_loadu_si256( (const __m256i*)( in+i ) );
+        __m256i i1 = _mm256_loadu_si256( (const __m256i*)( in+i+w ) );
+        __m256i i2 = _mm256_loadu_si256( (const __m256i*)( in+i+2*w ) );
+        __m256i i0_lo = _mm256_cvtepu8_epi16( _mm256_castsi256_si128( i0 ) );
+        __m256i i0_hi = _mm256_cvtepu8_epi16( _mm256_extracti128_si256( i0, 1 ) );
+        __m256i i1_lo = _mm256_cvtepu8_epi16( _mm256_castsi256_si128( i1 ) );
+        __m256i i1_hi = _mm256_cvtepu8_epi16( _mm256_extracti128_si256( i1, 1 ) );
+        __m256i i2_lo = _mm256_cvtepu8_epi16( _mm256_castsi256_si128( i2 ) );
+        __m256i i2_hi = _mm256_cvtepu8_epi16( _mm256_extracti128_si256( i2, 1 ) );
+        _mm256_storeu_si256( (__m256i*)( result_h+i ),    _mm256_sub_epi16( i0_lo, i2_lo ) );
+        _mm256_storeu_si256( (__m256i*)( result_h+i+16 ), _mm256_sub_epi16( i0_hi, i2_hi ) );
+        _mm256_storeu_si256( (__m256i*)( result_v+i ),
+                             _mm256_add_epi16( _mm256_add_epi16( i0_lo, i2_lo ), _mm256_add_epi16( i1_lo, i1_lo ) ) );
+        _mm256_storeu_si256( (__m256i*)( result_v+i+16 ),
+                             _mm256_add_epi16( _mm256_add_epi16( i0_hi, i2_hi ), _mm256_add_epi16( i1_hi, i1_hi ) ) );
+      }
+      for( ; i < n; i++ ) {
+        result_h[i] = (int16_t)( in[i] - in[i+2*w] );
+        result_v[i] = (int16_t)( in[i] + 2*in[i+w] + in[i+2*w] );
+      }
+    }
+
+    // packs two registers of 16 bit values into one of 8 bit values, keeping them in order
+    FILTER_AVX2_TARGET
+    static inline __m256i pack_16bit_to_8bit_saturate_avx2( const __m256i a0, const __m256i a1 ) {
+      return _mm256_permute4x64_epi64( _mm256_packus_epi16( a0, a1 ), 0xD8 );
+    }
+
+    // AVX2 version of convolve_121_row_3x3_16bit, covering the same pixels
+    FILTER_AVX2_TARGET
+    static void convolve_121_row_3x3_16bit_avx2( const int16_t* in, uint8_t* out, int w, int h ) {
+      assert( w % 16 == 0 && "width must be multiple of 16!" );
+      const int n = ((w*h-2)/16)*16;
+      uint8_t* result = out + 1;
+      const __m256i offs = _mm256_set1_epi16( 128 );
+      int i = 0;
+      for( ; i+32 <= n; i += 32 ) {
+        __m256i lo = _mm256_add_epi16( _mm256_loadu_si256( (const __m256i*)( in+i ) ),
+                                       _mm256_loadu_si256( (const __m256i*)( in+i+2 ) ) );
+        __m256i hi = _mm256_add_epi16( _mm256_loadu_si256( (const __m256i*)( in+i+16 ) ),
+                                       _mm256_loadu_si256( (const __m256i*)( in+i+18 ) ) );
+        __m256i i1_lo = _mm256_loadu_si256( (const __m256i*)( in+i+1 ) );
+        __m256i i1_hi = _mm256_loadu_si256( (const __m256i*)( in+i+17 ) );
+        lo = _mm256_add_epi16( _mm256_srai_epi16( _mm256_add_epi16( lo, _mm256_add_epi16( i1_lo, i1_lo ) ), 2 ), offs );
+        hi = _mm256_add_epi16( _mm256_srai_epi16( _mm256_add_epi16( hi, _mm256_add_epi16( i1_hi, i1_hi ) ), 2 ), offs );
+        _mm256_storeu_si256( (__m256i*)( result+i ), pack_16bit_to_8bit_saturate_avx2( lo, hi ) );
+      }
+      for( ; i < n; i++ ) {
+        int v = ((in[i] + 2*in[i+1] + in[i+2]) >> 2) + 128;
+        result[i] = (uint8_t)( v < 0 ? 0 : (v > 255 ? 255 : v) );
+      }
+    }
+
+    // AVX2 version of convolve_101_row_3x3_16bit, covering the same pixels
+    FILTER_AVX2_TARGET
+    static void convolve_101_row_3x3_16bit_avx2( const int16_t* in, uint8_t* out, int w, int h ) {
+      assert( w % 16 == 0 && "width must be multiple of 16!" );
+      const int n = ((w*h-2)/16)*16;
+      uint8_t* result = out + 1;
+      const __m256i offs = _mm256_set1_epi16( 128 );
+      int i = 0;
+      for( ; i+32 <= n; i += 32 ) {
+        __m256i lo = _mm256_sub_epi16( _mm256_loadu_si256( (const __m256i*)( in+i ) ),
+                                       _mm256_loadu_si256( (const __m256i*)( in+i+2 ) ) );
+        __m256i hi = _mm256_sub_epi16( _mm256_loadu_si256( (const __m256i*)( in+i+16 ) ),
+                                       _mm256_loadu_si256( (const __m256i*)( in+i+18 ) ) );
+        lo = _mm256_add_epi16( _mm256_srai_epi16( lo, 2 ), offs );
+        hi = _mm256_add_epi16( _mm256_srai_epi16( hi, 2 ), offs );
+        _mm256_storeu_si256( (__m256i*)( result+i ), pack_16bit_to_8bit_saturate_avx2( lo, hi ) );
+      }
+      for( ; i < n; i++ ) {
+        int v = ((in[i] - in[i+2]) >> 2) + 128;
+        result[i] = (uint8_t)( v < 0 ? 0 : (v > 255 ? 255 : v) );
+      }
+
+      // the last pixels are not saturated, as in the SSE2 version
+      for( ; i < w*h-2; i++ ) {
+        result[i] = ((in[i] - in[i+2])>>2)+128;
+      }
+    }
+  }
+#endif
+
+  bool cpu_supports_avx2() {
+#ifdef FILTER_AVX2_TARGET
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" ) != 0;
+#else
+    return false;
+#endif
+  }
+
+  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h, bool use_avx2 ) {
     int16_t* temp_h = (int16_t*)( _mm_malloc( w*h*sizeof( int16_t ), 16 ) );
     int16_t* temp_v = (int16_t*)( _mm_malloc( w*h*sizeof( int16_t ), 16 ) );
+    sobel3x3( in, out_v, out_h, temp_v, temp_h, w, h, use_avx2 );
+    _mm_free( temp_h );
+    _mm_free( temp_v );
+  }
+
+  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int16_t* temp_v, int16_t* temp_h, int w, int h, bool use_avx2 ) {
+#ifdef FILTER_AVX2_TARGET
+    if( use_avx2 ) {
+      detail::convolve_cols_3x3_avx2( in, temp_v, temp_h, w, h );
+      detail::convolve_101_row_3x3_16bit_avx2( temp_v, out_v, w, h );
+      detail::convolve_121_row_3x3_16bit_avx2( temp_h, out_h, w, h );
+      return;
+    }
+#endif
     detail::convolve_cols_3x3( in, temp_v, temp_h, w, h );
     detail::convolve_101_row_3x3_16bit( temp_v, out_v, w, h );
     detail::convolve_121_row_3x3_16bit( temp_h, out_h, w, h );
-    _mm_free( temp_h );
-    _mm_free( temp_v );
   }
 
   void sobel5x5( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h ) {
@@ -77,7 +77,13 @@ namespace filter {
     void convolve_cols_3x3( const unsigned char* in, int16_t* out_v, int16_t* out_h, int w, int h );
   }
 
-  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h );
+  // true if the AVX2 versions of the filters can be used on this CPU
+  bool cpu_supports_avx2();
+
+  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h, bool use_avx2=false );
+
+  // as above, using caller-supplied temporaries of w*h 16 bit values, aligned to 16 bytes
+  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int16_t* temp_v, int16_t* temp_h, int w, int h, bool use_avx2=false );
 
   void sobel5x5( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h );
 
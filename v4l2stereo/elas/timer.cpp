@@ -0,0 +1,146 @@
+/*
+Copyright 2011. All rights reserved.
+Institute of Measurement and Control Systems
+Karlsruhe Institute of Technology, Germany
+
+This file is part of libelas.
+Authors: Andreas Geiger
+
+libelas is free software; you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation; either version 3 of the License, or any later version.
+
+libelas is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+libelas; if not, write to the Free Software Foundation, Inc., 51 Franklin
+Street, Fifth Floor, Boston, MA 02110-1301, USA 
+*/
+
+#include "timer.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+Timer::Timer (const char* const* names,int32_t no_of_stages) {
+  stages.resize(no_of_stages+1);
+  for (int32_t i=0; i<no_of_stages; i++)
+    stages[i].name = names[i];
+  stages[no_of_stages].name = "total";
+  reset();
+}
+
+void Timer::reset () {
+  for (size_t i=0; i<stages.size(); i++) {
+    stages[i].count = 0;
+    memset(stages[i].histogram,0,sizeof(stages[i].histogram));
+  }
+  current = -1;
+}
+
+int64_t Timer::now () {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return (int64_t)t.tv_sec*1000000+t.tv_nsec/1000;
+}
+
+// histogram bin of a duration in microseconds
+int32_t Timer::bin (int32_t us) {
+  if (us<1) return 0;
+  return min((int32_t)(2*log2((float)us)),TIMER_BINS-1);
+}
+
+void Timer::addSample (int32_t s,int32_t us) {
+  stage &st = stages[s];
+  int32_t i = st.count%TIMER_WINDOW;
+  if (st.count>=TIMER_WINDOW)
+    st.histogram[bin(st.samples[i])]--;
+  st.samples[i] = us;
+  st.histogram[bin(us)]++;
+  st.count++;
+}
+
+void Timer::start (int32_t stage) {
+  int64_t t = now();
+  if (current>=0) addSample(current,t-current_start);
+  else            run_start = t;
+  current       = stage;
+  current_start = t;
+}
+
+void Timer::stop () {
+  if (current<0) return;
+  int64_t t = now();
+  addSample(current,t-current_start);
+  addSample(stages.size()-1,t-run_start);
+  current = -1;
+}
+
+void Timer::getStatistics (vector<statistics> &stats) const {
+  stats.clear();
+  vector<int32_t> window;
+  for (size_t s=0; s<stages.size(); s++) {
+    const stage &st = stages[s];
+    if (st.count==0) continue;
+
+    statistics r;
+    r.name    = st.name;
+    r.count   = st.count;
+    r.samples = min(st.count,(int64_t)TIMER_WINDOW);
+    r.last_ms = st.samples[(st.count-1)%TIMER_WINDOW]*1e-3f;
+    memcpy(r.histogram,st.histogram,sizeof(r.histogram));
+
+    window.assign(st.samples,st.samples+r.samples);
+    sort(window.begin(),window.end());
+    int64_t sum = 0;
+    for (int32_t i=0; i<r.samples; i++) sum += window[i];
+    r.mean_ms   = sum*1e-3f/r.samples;
+    r.min_ms    = window[0]*1e-3f;
+    r.max_ms    = window[r.samples-1]*1e-3f;
+    r.median_ms = window[r.samples/2]*1e-3f;
+    r.p90_ms    = window[(r.samples*9)/10]*1e-3f;
+    r.p99_ms    = window[(r.samples*99)/100]*1e-3f;
+    stats.push_back(r);
+  }
+}
+
+void Timer::writeJSON (FILE* file) const {
+  vector<statistics> stats;
+  getStatistics(stats);
+  fprintf(file,"{\"window\": %d, \"stages\": [",TIMER_WINDOW);
+  for (size_t s=0; s<stats.size(); s++) {
+    const statistics &r = stats[s];
+    fprintf(file,"%s\n  {\"name\": \"%s\", \"count\": %lld, \"samples\": %d, "
+            "\"last_ms\": %.3f, \"mean_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, "
+            "\"median_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"histogram\": [",
+            s>0 ? "," : "",r.name.c_str(),(long long)r.count,r.samples,
+            r.last_ms,r.mean_ms,r.min_ms,r.max_ms,r.median_ms,r.p90_ms,r.p99_ms);
+    for (int32_t i=0; i<TIMER_BINS; i++)
+      fprintf(file,i>0 ? ",%d" : "%d",r.histogram[i]);
+    fprintf(file,"]}");
+  }
+  fprintf(file,"\n]}\n");
+}
+
+void Timer::writeCSV (FILE* file) const {
+  vector<statistics> stats;
+  getStatistics(stats);
+  fprintf(file,"stage,count,samples,last_ms,mean_ms,min_ms,max_ms,median_ms,p90_ms,p99_ms");
+  for (int32_t i=0; i<TIMER_BINS; i++)
+    fprintf(file,",bin_%.1f_us",pow(2.0,i/2.0));
+  fprintf(file,"\n");
+  for (size_t s=0; s<stats.size(); s++) {
+    const statistics &r = stats[s];
+    fprintf(file,"%s,%lld,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f",
+            r.name.c_str(),(long long)r.count,r.samples,
+            r.last_ms,r.mean_ms,r.min_ms,r.max_ms,r.median_ms,r.p90_ms,r.p99_ms);
+    for (int32_t i=0; i<TIMER_BINS; i++)
+      fprintf(file,",%d",r.histogram[i]);
+    fprintf(file,"\n");
+  }
+}
@@ -22,14 +22,10 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
-#include <iostream>
-#include <iomanip>
 #include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <vector>
 #include <string>
-#include <sys/time.h>
+#include <vector>
+#include <time.h>
 
 // Define fixed-width datatypes for Visual Studio projects
 #ifndef _MSC_VER
@@ -45,63 +41,69 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
   typedef unsigned __int64  uint64_t;
 #endif
 
+// number of most recent frames the statistics of each stage are taken over
+#define TIMER_WINDOW 256
+
+// histogram bins of half an octave each, from 1 microsecond to about 1 second
+#define TIMER_BINS   40
+
+// Times the stages of a repeated computation, such as each frame matched by Elas.
+// The durations of the last TIMER_WINDOW runs of each stage are kept, together
+// with a histogram of them which is updated as samples enter and leave the window.
+// Timing costs two clock reads per stage, so it is always on.  Not thread safe:
+// query the statistics from the thread which does the timing.
 class Timer {
   
 public:
-  
-  Timer() {}
-  
-  ~Timer() {}
-  
-  void start (std::string title) {
-    desc.push_back(title);
-    push_back_time();
-  }
-  
-  void stop () {
-    if (time.size()<=desc.size())
-      push_back_time();
-  }
-  
-  void plot () {
-    stop();
-    float total_time = 0;
-    for (int32_t i=0; i<desc.size(); i++) {
-      float curr_time = getTimeDifferenceMilliseconds(time[i],time[i+1]);
-      total_time += curr_time;
-      std::cout.width(30);
-      std::cout << desc[i] << " ";
-      std::cout << std::fixed << std::setprecision(1) << std::setw(6);
-      std::cout << curr_time;
-      std::cout << " ms" << std::endl;
-    }
-    std::cout << "========================================" << std::endl;
-    std::cout << "                    Total time ";
-    std::cout << std::fixed << std::setprecision(1) << std::setw(6);
-    std::cout << total_time;
-    std::cout << " ms" << std::endl << std::endl;
-  }
-  
-  void reset () {
-    desc.clear();
-    time.clear();
-  }
-  
+
+  struct statistics {
+    std::string name;
+    int64_t     count;                 // runs since the last reset
+    int32_t     samples;               // runs within the window
+    float       last_ms;               // duration of the most recent run
+    float       mean_ms,min_ms,max_ms; // over the window
+    float       median_ms,p90_ms,p99_ms;
+    int32_t     histogram[TIMER_BINS]; // runs within the window by duration, bin i
+                                       // holding durations from 2^(i/2) microseconds
+  };
+
+  // the stages are numbered in the order of their names.  A further stage named
+  // "total" times each run from the first start to stop
+  Timer (const char* const* names,int32_t no_of_stages);
+
+  // ends the current stage, if any, and starts timing the given one
+  void start (int32_t stage);
+
+  // ends the current stage and the run
+  void stop ();
+
+  // clears all samples
+  void reset ();
+
+  // statistics of the stages which have been run within the window
+  void getStatistics (std::vector<statistics> &stats) const;
+
+  // writes the statistics as a JSON object, or as CSV with a header line
+  void writeJSON (FILE* file) const;
+  void writeCSV (FILE* file) const;
+
 private:
-  
-  std::vector<std::string>  desc;
-  std::vector<timeval>      time;
-  
-  void push_back_time () {
-    timeval curr_time;
-    gettimeofday(&curr_time,0);
-    time.push_back(curr_time);
-  }
-  
-  float getTimeDifferenceMilliseconds(timeval a,timeval b) {
-    return ((float)(b.tv_sec -a.tv_sec ))*1e+3 +
-           ((float)(b.tv_usec-a.tv_usec))*1e-3;
-  }
+
+  struct stage {
+    std::string name;
+    int64_t     count;
+    int32_t     samples[TIMER_WINDOW];  // durations in microseconds, a ring buffer
+    int32_t     histogram[TIMER_BINS];
+  };
+
+  static int64_t now ();
+  static int32_t bin (int32_t us);
+  void addSample (int32_t stage,int32_t us);
+
+  std::vector<stage> stages;
+  int32_t current;                      // stage being timed, or -1
+  int64_t current_start;                // times in microseconds
+  int64_t run_start;
 };
 
 #endif
@@ -19,6 +19,35 @@
 
 #include "linefit.h"
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+linefit::linefit(int width, int height) {
+	imgWidth = width;
+	imgHeight = height;
+
+	/* lines through vertically oriented features span
+	   -height..width+height, and horizontally oriented
+	   ones -width..height+width */
+	bucket_width = width + (2*height);
+	if (height + (2*width) > bucket_width) bucket_width = height + (2*width);
+	bucket_width = (bucket_width / LINE_SAMPLING) + 1;
+
+	/* pad each slope to a multiple of four buckets for the peak search */
+	bucket_width = (bucket_width + 3) & ~3;
+	bucket = new unsigned int[(LINE_SLOPES*2+1) * bucket_width];
+
+	feature_position = NULL;
+	max_features = 0;
+	line_horizontal[0] = 0;
+	line_vertical[0] = 0;
+}
+
+linefit::~linefit() {
+	delete[] bucket;
+	if (feature_position != NULL) delete[] feature_position;
+}
 
 void linefit::parallel(
     int* lines,
@@ -61,42 +90,165 @@ void linefit::parallel(
 	}
 }
 
+/*!
+ * \brief finds the strongest lines within the accumulator, storing
+ *        up to MAX_LINES (votes, bucket index) pairs within best_lines
+ * \param minimum_edges minimum number of edges on a line
+ * \return number of lines found
+ */
+int linefit::find_peaks(
+	unsigned int minimum_edges)
+{
+	int i, j, k, n, max = (LINE_SLOPES*2+1) * bucket_width;
+	unsigned int avg = 0, hits = 0, v, threshold;
+
+	/* average of the non-zero buckets */
+	for (n = 0; n < max; n++) {
+		if (bucket[n] > 0) {
+			hits++;
+			avg += bucket[n];
+		}
+	}
+	if (hits == 0) return (0);
+
+	memset((void*)best_lines, '\0', MAX_LINES*2*sizeof(unsigned int));
+	avg /= hits;
+	if (avg < minimum_edges) avg = minimum_edges;
+
+	/* A bucket is inserted into the list of best lines if it is above
+	 * the average and beats the weakest line so far.  Blocks of buckets
+	 * are only examined individually if one of them exceeds both */
+	i = 0;
+	threshold = avg;
+	for (n = 0; n < max; n += 4) {
+#ifdef __SSE2__
+		/* vote counts are always less than 2^31, so a signed compare is safe */
+		__m128i votes = _mm_loadu_si128((__m128i*)&bucket[n]);
+		if (_mm_movemask_epi8(_mm_cmpgt_epi32(votes, _mm_set1_epi32((int)threshold))) == 0)
+			continue;
+#endif
+		for (k = n; k < n + 4; k++) {
+			v = bucket[k];
+			if (v > threshold) {
+				for (j = 0; j < MAX_LINES; j++) {
+					if (best_lines[j*2] < v) {
+						memmove((void*)&best_lines[(j+1)*2], (void*)&best_lines[j*2],
+								(MAX_LINES-1-j)*2*sizeof(unsigned int));
+						best_lines[j*2] = v;
+						best_lines[j*2 + 1] = k;
+						i++;
+						break;
+					}
+				}
+				if (best_lines[(MAX_LINES-1)*2] > avg)
+					threshold = best_lines[(MAX_LINES-1)*2];
+			}
+		}
+	}
+	if (i > MAX_LINES) i = MAX_LINES;
+	return (i);
+}
+
+/*!
+ * \brief fits lines to the features stored within feature_position
+ * \param no_of_feats number of features
+ * \param vertical non-zero for vertically oriented features
+ * \param minimum_edges minimum number of edges on a line
+ * \param lines returned lines
+ */
+void linefit::fit(
+	int no_of_feats,
+	int vertical,
+	int minimum_edges,
+	int* lines)
+{
+	int f, b, j, n, lines_found, offset;
+	int tx=0, ty=0, bx=0, by=0;
+
+	/* clear number of lines */
+	lines[0] = 0;
+
+	/* the first coordinate of each feature is along the line,
+	   the second is the one which is sheared */
+	int p0 = 0, p1 = 1;
+	offset = imgHeight / LINE_SAMPLING;
+	if (vertical == 0) {
+		p0 = 1;
+		p1 = 0;
+		offset = imgWidth / LINE_SAMPLING;
+	}
+
+	/* populate buckets.  Each slope is voted on independently */
+#pragma omp parallel for
+	for (int s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
+		unsigned int* slope_bucket = &bucket[(s + LINE_SLOPES) * bucket_width];
+		memset((void*)slope_bucket, '\0', bucket_width * sizeof(unsigned int));
+		for (int f = 0; f < no_of_feats; f++) {
+			int bucket_index = offset + ((feature_position[f*2 + p0] +
+				(s * feature_position[f*2 + p1] / LINE_SLOPES)) / LINE_SAMPLING);
+			if ((bucket_index >= 0) &&
+				(bucket_index < bucket_width)) {
+				slope_bucket[bucket_index]++;
+			}
+		}
+	}
+
+	lines_found = find_peaks(minimum_edges);
+
+	for (j = 0; j < lines_found; j++) {
+		n = best_lines[j*2+1];
+		b = n % bucket_width;
+		int s = (n / bucket_width) - LINE_SLOPES;
+
+		/* find the extent of the line */
+		tx = -1;
+		for (f = 0; f < no_of_feats; f++) {
+			if (offset + ((feature_position[f*2 + p0] +
+				(s * feature_position[f*2 + p1] / LINE_SLOPES)) / LINE_SAMPLING) == b) {
+				if (tx == -1) {
+					tx = feature_position[f*2];
+					ty = feature_position[f*2 + 1];
+				}
+				bx = feature_position[f*2];
+				by = feature_position[f*2 + 1];
+			}
+		}
+
+		n = lines[0];
+		lines[n*5+1] = tx;
+		lines[n*5+2] = ty;
+		lines[n*5+3] = bx;
+		lines[n*5+4] = by;
+		lines[n*5+5] = s;
+		lines[0]++;
+		if (lines[0] == MAX_LINES) break;
+	}
+	parallel(lines,LINE_SLOPES*15/100);
+}
+
 void linefit::vertically_oriented(
 	int no_of_feats,
 	short int* feature_x,
 	unsigned short int* features_per_row,
 	int vertical_sampling,
-	int minimum_edges)
+	int minimum_edges,
+	int sub_pixel)
 {
-	int x,y,f,s,b,i,j,k,n, bucket_index,row;
-	int offset = LINE_MAX_IMAGE_WIDTH/LINE_SAMPLING;
-	int max_bucket = 3*LINE_MAX_IMAGE_WIDTH/LINE_SAMPLING;
-	int feats_remaining, tx=0,ty=0,bx=0,by=0;
-	unsigned int avg, hits, v;
+	int f, row, feats_remaining;
 
-	/* clear number of lines */
-	line_vertical[0] = 0;
-
-	/* clear the buckets */
-	for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-	    memset((void*)bucket[s + LINE_SLOPES], '\0', max_bucket * sizeof(unsigned int));
+	if (no_of_feats > max_features) {
+		if (feature_position != NULL) delete[] feature_position;
+		max_features = no_of_feats;
+		feature_position = new int[max_features*2];
 	}
 
-	/* populate buckets */
+	/* position of each feature */
 	row = 0;
 	feats_remaining = features_per_row[row];
 	for (f = 0; f < no_of_feats; f++, feats_remaining--) {
 
-		x = (int)feature_x[f];
-		y = 4 + (row * vertical_sampling);
-
-		for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-            bucket_index = offset + ((x + (s * y / LINE_SLOPES)) / LINE_SAMPLING);
-            if ((bucket_index >= 0) &&
-            	(bucket_index < max_bucket)) {
-                bucket[LINE_SLOPES + s][bucket_index]++;
-            }
-		}
+		feature_position[f*2] = (int)feature_x[f] / sub_pixel;
+		feature_position[f*2 + 1] = 4 + (row * vertical_sampling);
 
 		/* move to the next row */
 		if (feats_remaining <= 0) {
@@ -105,84 +257,7 @@ void linefit::vertically_oriented(
 		}
 	}
 
-	hits = 0;
-	avg = 0;
-	for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-	    for (b = 0; b < max_bucket; b++) {
-		    if (bucket[s + LINE_SLOPES][b] > 0) {
-		    	//if (bucket[s + LINE_SLOPES][b] > 1000) printf("bucket %d: %d\n", b, bucket[s + LINE_SLOPES][b]);
-		    	hits++;
-		    	avg += bucket[s + LINE_SLOPES][b];
-		    }
-	    }
-	}
-	if (hits > 0) {
-		i = 0;
-		memset((void*)best_lines, '\0', MAX_LINES*2*sizeof(unsigned int));
-		avg /= hits;
-		if ((int)avg < minimum_edges) avg = minimum_edges;
-		n = 0;
-		for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-		    for (b = 0; b < max_bucket; b++, n++) {
-		    	v = bucket[s + LINE_SLOPES][b];
-			    if (v > avg) {
-			    	if (bucket[s + LINE_SLOPES][b] > 1000) printf("v: %d\n", v);
-                    for (j = 0; j < MAX_LINES; j++) {
-                        if (best_lines[j*2] < v) {
-                            for (k = MAX_LINES-1; k > j; k--) {
-                            	best_lines[k*2] = best_lines[(k-1)*2];
-                            	best_lines[k*2 + 1] = best_lines[(k-1)*2 + 1];
-                            }
-                            best_lines[j*2] = v;
-                            best_lines[j*2 + 1] = n;
-                            i++;
-                            break;
-                        }
-                    }
-			    }
-		    }
-		}
-		if (i > MAX_LINES) i = MAX_LINES;
-		for (j = 0; j < i; j++) {
-			n = best_lines[j*2+1];
-			b = n % max_bucket;
-			s = ((n - b) / max_bucket) - LINE_SLOPES;
-
-			tx = -1;
-			row = 0;
-			feats_remaining = features_per_row[row];
-			for (f = 0; f < no_of_feats; f++, feats_remaining--) {
-
-				x = (int)feature_x[f];
-				y = 4 + (row * vertical_sampling);
-
-	            if (offset + ((x + (s * y / LINE_SLOPES)) / LINE_SAMPLING) == b) {
-	            	if (tx == -1) {
-            		    tx = x;
-            		    ty = y;
-	            	}
-	            	bx = x;
-	            	by = y;
-	            }
-
-				/* move to the next row */
-				if (feats_remaining <= 0) {
-					row++;
-					feats_remaining = features_per_row[row];
-				}
-			}
-
-			n = line_vertical[0];
-			line_vertical[n*5+1] = tx;
-			line_vertical[n*5+2] = ty;
-			line_vertical[n*5+3] = bx;
-			line_vertical[n*5+4] = by;
-			line_vertical[n*5+5] = s;
-			line_vertical[0]++;
-			if (line_vertical[0] == MAX_LINES) break;
-		}
-	}
-	parallel(line_vertical,LINE_SLOPES*15/100);
+	fit(no_of_feats, 1, minimum_edges, line_vertical);
 }
 
 void linefit::horizontally_oriented(
@@ -192,117 +267,28 @@ void linefit::horizontally_oriented(
 	int horizontal_sampling,
 	int minimum_edges)
 {
-	int x,y,f,s,b,i,j,k,n, bucket_index,col;
-	int offset = LINE_MAX_IMAGE_WIDTH/LINE_SAMPLING;
-	int max_bucket = 3*LINE_MAX_IMAGE_WIDTH/LINE_SAMPLING;
-	int feats_remaining, tx=0,ty=0,bx=0,by=0;
-	unsigned int avg, hits, v;
+	int f, col, feats_remaining;
 
-	/* clear number of lines */
-	line_horizontal[0] = 0;
-
-	/* clear the buckets */
-	for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-	    memset((void*)bucket[s + LINE_SLOPES], '\0', max_bucket * sizeof(unsigned int));
+	if (no_of_feats > max_features) {
+		if (feature_position != NULL) delete[] feature_position;
+		max_features = no_of_feats;
+		feature_position = new int[max_features*2];
 	}
 
-	/* populate buckets */
+	/* position of each feature */
 	col = 0;
 	feats_remaining = features_per_col[col];
 	for (f = 0; f < no_of_feats; f++, feats_remaining--) {
 
-		x = 4 + (col * horizontal_sampling);
-		y = (int)feature_y[f];
-
-		for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-            bucket_index = offset + ((y + (s * x / LINE_SLOPES)) / LINE_SAMPLING);
-            if ((bucket_index >= 0) &&
-            	(bucket_index < max_bucket)) {
-                bucket[LINE_SLOPES + s][bucket_index]++;
-            }
-		}
+		feature_position[f*2] = 4 + (col * horizontal_sampling);
+		feature_position[f*2 + 1] = (int)feature_y[f];
 
-		/* move to the next row */
+		/* move to the next column */
 		if (feats_remaining <= 0) {
 			col++;
 			feats_remaining = features_per_col[col];
 		}
 	}
 
-	hits = 0;
-	avg = 0;
-	for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-	    for (b = 0; b < max_bucket; b++) {
-		    if (bucket[s + LINE_SLOPES][b] > 0) {
-		    	hits++;
-		    	avg += bucket[s + LINE_SLOPES][b];
-		    }
-	    }
-	}
-	if (hits > 0) {
-		i = 0;
-		memset((void*)best_lines, '\0', MAX_LINES*2*sizeof(unsigned int));
-		avg /= hits;
-		if ((int)avg < minimum_edges) avg = minimum_edges;
-		n = 0;
-		for (s = -LINE_SLOPES; s <= LINE_SLOPES; s++) {
-		    for (b = 0; b < max_bucket; b++, n++) {
-		    	v = bucket[s + LINE_SLOPES][b];
-			    if (v > avg) {
-                    for (j = 0; j < MAX_LINES; j++) {
-                        if (best_lines[j*2] < v) {
-                            for (k = MAX_LINES-1; k > j; k--) {
-                            	best_lines[k*2] = best_lines[(k-1)*2];
-                            	best_lines[k*2 + 1] = best_lines[(k-1)*2 + 1];
-                            }
-                            best_lines[j*2] = v;
-                            best_lines[j*2 + 1] = n;
-                            i++;
-                            break;
-                        }
-                    }
-			    }
-		    }
-		}
-		if (i > MAX_LINES) i = MAX_LINES;
-		for (j = 0; j < i; j++) {
-			n = best_lines[j*2+1];
-			b = n % max_bucket;
-			s = ((n - b) / max_bucket) - LINE_SLOPES;
-
-			tx = -1;
-			col = 0;
-			feats_remaining = features_per_col[col];
-			for (f = 0; f < no_of_feats; f++, feats_remaining--) {
-
-				x = 4 + (col * horizontal_sampling);
-				y = (int)feature_y[f];
-
-	            if (offset + ((y + (s * x / LINE_SLOPES)) / LINE_SAMPLING) == b) {
-	            	if (tx == -1) {
-	            		tx = x;
-	            		ty = y;
-	            	}
-	            	bx = x;
-	            	by = y;
-	            }
-
-				/* move to the next row */
-				if (feats_remaining <= 0) {
-					col++;
-					feats_remaining = features_per_col[col];
-				}
-			}
-
-			n = line_horizontal[0];
-			line_horizontal[n*5+1] = tx;
-			line_horizontal[n*5+2] = ty;
-			line_horizontal[n*5+3] = bx;
-			line_horizontal[n*5+4] = by;
-			line_horizontal[n*5+5] = s;
-			line_horizontal[0]++;
-			if (line_horizontal[0] == MAX_LINES) break;
-		}
-	}
-	parallel(line_horizontal,LINE_SLOPES*15/100);
+	fit(no_of_feats, 0, minimum_edges, line_horizontal);
 }
@@ -23,13 +23,32 @@
 #include <stdio.h>
 
 #define LINE_SLOPES           20
-#define LINE_MAX_IMAGE_WIDTH  640
 #define LINE_SAMPLING         1
 #define MAX_LINES             10
 
 class linefit {
+protected:
+    int imgWidth, imgHeight;
+
+    /* coordinates of each feature */
+    int* feature_position;
+    int max_features;
+
+    void fit(
+        int no_of_feats,
+        int vertical,
+        int minimum_edges,
+        int* lines);
+
+    int find_peaks(
+        unsigned int minimum_edges);
+
 public:
-	unsigned int bucket[LINE_SLOPES*2+1][3*LINE_MAX_IMAGE_WIDTH/LINE_SAMPLING];
+    /* Hough accumulator with bucket_width buckets for each slope,
+       sized so that lines anywhere in the image can be found */
+    unsigned int* bucket;
+    int bucket_width;
+
     int line_horizontal[1 + (MAX_LINES*5)];
     int line_vertical[1 + (MAX_LINES*5)];
     unsigned int best_lines[MAX_LINES*2];
@@ -43,7 +62,8 @@ public:
 		short int* feature_x,
 		unsigned short int* features_per_row,
 		int vertical_sampling,
-		int minimum_edges);
+		int minimum_edges,
+		int sub_pixel = 1);
 
 	void horizontally_oriented(
 		int no_of_feats,
@@ -51,6 +71,9 @@ public:
 		unsigned short int* features_per_col,
 		int horizontal_sampling,
 		int minimum_edges);
+
+    linefit(int width, int height);
+    ~linefit();
 };
 
 #endif
@@ -51,7 +51,11 @@
 #include <cv.h>
 #include <highgui.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include <sstream>
+#include <signal.h>
 #include <omp.h>
 
 #ifdef GSTREAMER
@@ -68,6 +72,7 @@
 
 #include "camcalib.h"
 #include "elas/elas.h"
+#include "sgm.h"
 #include "pointcloud.h"
 //#include "gridmap3d.h"
 
@@ -129,34 +134,86 @@ void expand(
     }
 }
 
+/* set by SIGUSR1 to request that the ELAS stage timings are written */
+static volatile sig_atomic_t elas_profile_requested = 0;
+
+static void request_elas_profile(int)
+{
+    elas_profile_requested = 1;
+}
+
+/*!
+ * \brief writes the stage timings of ELAS as CSV if the filename ends in .csv, otherwise as JSON
+ * \param elas matcher whose timings are written
+ * \param filename file to be written
+ */
+void write_elas_profile(
+    Elas * elas,
+    std::string filename)
+{
+    FILE * file = fopen(filename.c_str(), "w");
+    if (file == NULL) {
+        printf("Unable to write ELAS profile to %s\n", filename.c_str());
+        return;
+    }
+    if ((filename.size() > 4) &&
+        (filename.compare(filename.size()-4, 4, ".csv") == 0))
+        elas->getTimer().writeCSV(file);
+    else
+        elas->getTimer().writeJSON(file);
+    fclose(file);
+}
+
 void elas_disparity_map(
     unsigned char * left_image,
     unsigned char * right_image,
     int image_width,
     int image_height,
-    uint8_t * &I1,
-    uint8_t * &I2,
     float * &left_disparities,
     float * &right_disparities,
+    bool temporal_support,
+    int memory_budget_mb,
     Elas * &elas)
 {
     if (elas==NULL) {
         Elas::parameters param;
+        param.temporal_support = temporal_support;
+        param.memory_budget = (int64_t)memory_budget_mb*1024*1024;
         elas = new Elas(param);
-        I1 = new uint8_t[image_width*image_height];
-        I2 = new uint8_t[image_width*image_height];
         left_disparities = new float[image_width*image_height];
         right_disparities = new float[image_width*image_height];
     }
 
-    // convert to single byte format
-    for (int i = 0; i < image_width*image_height; i++) {
-        I1[i] = (uint8_t)left_image[i*3+2];
-        I2[i] = (uint8_t)right_image[i*3+2];
+    // the red channel of the BGR images is matched, being extracted
+    // by Elas directly into its aligned buffers
+    const int32_t dims[3] = {image_width, image_height, image_width*3};
+    elas->process(left_image,right_image,3,2,left_disparities,right_disparities,dims);
+}
+
+void sgm_disparity_map(
+    unsigned char * left_image,
+    unsigned char * right_image,
+    int image_width,
+    int image_height,
+    int max_disparity_percent,
+    int paths,
+    float * &left_disparities,
+    float * &right_disparities,
+    sgm * &matcher)
+{
+    if (matcher==NULL) {
+        sgm::parameters param;
+        param.disp_max = max_disparity_percent * image_width / 100;
+        param.paths = paths;
+        matcher = new sgm(param);
+        left_disparities = new float[image_width*image_height];
+        right_disparities = new float[image_width*image_height];
     }
 
-    const int32_t dims[3] = {image_width, image_height, image_width};
-    elas->process(I1,I2,left_disparities,right_disparities,dims);
+    // the red channel of the BGR images is matched, being read
+    // directly by the census transform
+    const int32_t dims[3] = {image_width, image_height, image_width*3};
+    matcher->process(left_image,right_image,3,2,left_disparities,right_disparities,dims);
 }
 
 int main(int argc, char* argv[]) {
@@ -175,6 +232,11 @@ int main(int argc, char* argv[]) {
     bool show_histogram = false;
     bool show_lines = false;
     bool show_disparity_map = false;
+    bool semi_global_matching = false;
+    int sgm_paths = 8;
+    bool elas_temporal = false;
+    int elas_memory_mb = 0;
+    std::string elas_profile_filename = "";
     bool rectify_images = false;
     bool show_FAST = false;
     bool colour_disparity_map = true;
@@ -197,11 +259,10 @@ int main(int argc, char* argv[]) {
     float * background_disparity_map = NULL;
     int * background_disparity_map_hits = NULL;
 
-    uint8_t * I1 = NULL;
-    uint8_t * I2 = NULL;
     float * left_disparities = NULL;
     float * right_disparities = NULL;
     Elas * elas = NULL;
+    sgm * matcher = NULL;
 
     camcalib * camera_calibration = new camcalib();
     camera_calibration->ParseCalibrationFile("calibration.txt");
@@ -268,6 +329,12 @@ int main(int argc, char* argv[]) {
     opt->addUsage( "     --features            Show stereo features");
     opt->addUsage( "     --disparitymap        Show dense disparity map (colour)");
     opt->addUsage( "     --disparitymapmono    Show dense disparity map (monochrome)");
+    opt->addUsage( "     --sgm                 Use semi-global matching rather than ELAS for the disparity map");
+    opt->addUsage( "     --sgmpaths            Number of semi-global matching paths, 4 or 8");
+    opt->addUsage( "     --elastemporal        Reuse ELAS support points from the previous frame");
+    opt->addUsage( "     --elasmemory          Memory budget for ELAS matching in megabytes");
+    opt->addUsage( "     --elasprofile         Filename to write ELAS stage timings to on SIGUSR1 and");
+    opt->addUsage( "                           on exit, as JSON or as CSV if it ends in .csv");
     opt->addUsage( "     --background          Background image filename");
     opt->addUsage( "     --learnbackground     Filename to save background disparity map");
     opt->addUsage( "     --backgroundmodel     Loads a background disparity map");
@@ -289,7 +356,7 @@ int main(int argc, char* argv[]) {
     opt->addUsage( " -s  --skip                Skip this number of frames");
     opt->addUsage( " -i  --input               Loads stereo matches from the given output file");
     opt->addUsage( " -o  --output              Saves stereo matches to the given output file");
-    opt->addUsage( "     --log                 Logs stereo matches to the given output file (only when no file exists)");
+    opt->addUsage( "     --log                 Appends stereo matches for every frame to the given log file");
     opt->addUsage( " -V  --version             Show version number");
     opt->addUsage( "     --save                Save raw images");
     opt->addUsage( "     --savex3d             Save mesh model in X3D format");
@@ -309,6 +376,9 @@ int main(int argc, char* argv[]) {
     opt->setOption( "background" );
     opt->setOption( "learnbackground" );
     opt->setOption( "backgroundmodel" );
+    opt->setOption( "sgmpaths" );
+    opt->setOption( "elasmemory" );
+    opt->setOption( "elasprofile" );
     opt->setOption( "pose" );
     opt->setOption( "camera" );
     opt->setOption( "calibrate" );
@@ -365,6 +435,8 @@ int main(int argc, char* argv[]) {
     opt->setFlag( "headless" );
     opt->setFlag( "disparitymap" );
     opt->setFlag( "disparitymapmono" );
+    opt->setFlag( "sgm" );
+    opt->setFlag( "elastemporal" );
     opt->setFlag( "equal" );
     opt->setFlag( "overhead" );
     opt->setFlag( "vcamera" );
@@ -541,6 +613,41 @@ int main(int argc, char* argv[]) {
         colour_disparity_map = false;
     }
 
+    if( opt->getFlag( "sgm" ) ) {
+        semi_global_matching = true;
+    }
+
+    if( opt->getValue( "sgmpaths" ) != NULL ) {
+        semi_global_matching = true;
+        sgm_paths = atoi(opt->getValue("sgmpaths"));
+        if (sgm_paths != 4) sgm_paths = 8;
+    }
+
+    if( opt->getFlag( "elastemporal" ) ) {
+        elas_temporal = true;
+    }
+
+    if( opt->getValue( "elasmemory" ) != NULL ) {
+        // whole megabytes which fit an int, converted to bytes in 64 bits
+        const char * memory_str = opt->getValue("elasmemory");
+        char * memory_end = NULL;
+        errno = 0;
+        long memory_mb = strtol(memory_str, &memory_end, 10);
+        if ((memory_end == memory_str) || (*memory_end != '\0') || (errno == ERANGE) ||
+            (memory_mb < 0) || (memory_mb > INT_MAX)) {
+            std::cout << "The ELAS memory budget should be a whole number of ";
+            std::cout << "megabytes between 0 and " << INT_MAX << "\n";
+            delete opt;
+            return 0;
+        }
+        elas_memory_mb = (int)memory_mb;
+    }
+
+    if( opt->getValue( "elasprofile" ) != NULL ) {
+        elas_profile_filename = opt->getValue("elasprofile");
+        signal(SIGUSR1, request_elas_profile);
+    }
+
     if (opt->getFlag("features")) {
         show_regions = false;
         show_features = true;
@@ -901,7 +1008,7 @@ int main(int argc, char* argv[]) {
     delete opt;
 
     if ((show_disparity_map) && (!rectify_images) ) {
-        std::cout << "Images need to be rectified before using ELAS.  You may need to recalibrate using --calibrate.\n";
+        std::cout << "Images need to be rectified before computing a dense disparity map.  You may need to recalibrate using --calibrate.\n";
         return 0;
     }
 
@@ -924,7 +1031,12 @@ int main(int argc, char* argv[]) {
     if (show_depthmap) left_image_title = "Depth map";
     if (show_histogram) right_image_title = "Disparity histograms (L/R/All)";
     if (show_anaglyph) left_image_title = "Anaglyph";
-    if (show_disparity_map) left_image_title = "Disparity map (ELAS)";
+    if (show_disparity_map) {
+        if (semi_global_matching)
+            left_image_title = "Disparity map (SGM)";
+        else
+            left_image_title = "Disparity map (ELAS)";
+    }
     if (background_image!=NULL) left_image_title = "Background substitution";
     if (overhead_view) left_image_title = "Overhead";
     if (virtual_camera_view) left_image_title = "Virtual Camera";
@@ -953,6 +1065,10 @@ int main(int argc, char* argv[]) {
     IplImage *r=cvCreateImage(cvSize(ww, hh), 8, 3);
     unsigned char *r_=(unsigned char *)r->imageData;
 
+    /* mono images used for feature detection */
+    unsigned char *l_gray = new unsigned char[ww*hh];
+    unsigned char *r_gray = new unsigned char[ww*hh];
+
     /* feature detection params */
     int inhibition_radius = 6;
     unsigned int minimum_response = 25;
@@ -976,7 +1092,8 @@ int main(int argc, char* argv[]) {
     unsigned char* buffer = NULL;
     unsigned char* depthmap_buffer = NULL;
 
-    linefit *lines = new linefit();
+    /* line fitting for each camera, since both are processed in parallel */
+    linefit *line_fitting[2] = { new linefit(ww, hh), new linefit(ww, hh) };
 
 #ifdef GSTREAMER
     /*
@@ -1156,33 +1273,41 @@ int main(int argc, char* argv[]) {
                 int calib_offset_x = 0;
                 int calib_offset_y = 0;
                 unsigned char* rectified_frame_buf = NULL;
+                unsigned char* gray_frame_buf = NULL;
                 int no_of_feats = 0;
                 int no_of_feats_horizontal = 0;
                 svs* stereocam = NULL;
                 if (cam == 0) {
                     rectified_frame_buf = l_;
+                    gray_frame_buf = l_gray;
                     stereocam = lcam;
                     calib_offset_x = 0;
                     calib_offset_y = 0;
                 }
                 else {
                     rectified_frame_buf = r_;
+                    gray_frame_buf = r_gray;
                     stereocam = rcam;
                     calib_offset_x = calibration_offset_x;
                     calib_offset_y = calibration_offset_y;
                 }
 
-                no_of_feats = stereocam->get_features_vertical(
-                                  rectified_frame_buf,
+                /* edges are found on the red channel, as by the BGR feature detector,
+                   and descriptors are made from all three channels of the frame */
+                svs::extract_channel(rectified_frame_buf, gray_frame_buf, ww, hh, 2);
+
+                no_of_feats = stereocam->get_features_vertical_mono(
+                                  gray_frame_buf,
                                   inhibition_radius,
                                   minimum_response,
                                   calib_offset_x,
                                   calib_offset_y,
-                                  0);
+                                  0,
+                                  rectified_frame_buf);
 
                 if ((cam == 0) || (show_features) || (show_lines)) {
-                    no_of_feats_horizontal = stereocam->get_features_horizontal(
-                                                 rectified_frame_buf,
+                    no_of_feats_horizontal = stereocam->get_features_horizontal_mono(
+                                                 gray_frame_buf,
                                                  inhibition_radius,
                                                  minimum_response,
                                                  calib_offset_x,
@@ -1191,12 +1316,14 @@ int main(int argc, char* argv[]) {
                 }
 
                 if (show_lines) {
+                    linefit *lines = line_fitting[cam];
                     lines->vertically_oriented(
                         no_of_feats,
                         stereocam->feature_x,
                         stereocam->features_per_row,
                         SVS_VERTICAL_SAMPLING,
-                        10*320/SVS_MAX_IMAGE_WIDTH);
+                        10*320/SVS_MAX_IMAGE_WIDTH,
+                        SVS_SUB_PIXEL);
                     lines->horizontally_oriented(
                         no_of_feats_horizontal,
                         stereocam->feature_y,
@@ -1302,7 +1429,10 @@ int main(int argc, char* argv[]) {
         if (show_regions) {
             lcam->enable_segmentation = 1;
             if (lcam->low_contrast != NULL) {
-                lcam->segment(l_, matches);
+                /* the left red channel was extracted before any features were drawn */
+                if (!((show_features) || (show_matches)))
+                    svs::extract_channel(l_, l_gray, ww, hh, 2);
+                lcam->segment_mono(l_gray, matches);
                 memset((void*)l_, '\0', ww*hh*3);
                 int min_vol = ww*hh/500;
                 int r=255, g=0, b=0;
@@ -1506,7 +1636,15 @@ int main(int argc, char* argv[]) {
         }
 
         if (show_disparity_map) {
-            elas_disparity_map(l_, r_, ww, hh, I1, I2, left_disparities, right_disparities, elas);
+            if (semi_global_matching)
+                sgm_disparity_map(l_, r_, ww, hh, max_disparity_percent, sgm_paths, left_disparities, right_disparities, matcher);
+            else {
+                elas_disparity_map(l_, r_, ww, hh, left_disparities, right_disparities, elas_temporal, elas_memory_mb, elas);
+                if ((elas_profile_requested) && (elas_profile_filename != "")) {
+                    elas_profile_requested = 0;
+                    write_elas_profile(elas, elas_profile_filename);
+                }
+            }
 
             if (learn_background_filename != "") {
                 for (int i = 0; i < ww*hh; i++) {
@@ -1908,9 +2046,7 @@ int main(int argc, char* argv[]) {
 
         /* log stereo matches */
         if ((log_stereo_matches_filename != "")) {
-            if (lcam->log_matches(log_stereo_matches_filename, l_, matches, true)) {
-                printf("%d stereo matches logged to %s\n", matches, log_stereo_matches_filename.c_str());
-            }
+            lcam->log_matches(log_stereo_matches_filename, l_, matches, true);
         }
 
         if (skip_frames == 0) {
@@ -2081,15 +2217,22 @@ int main(int argc, char* argv[]) {
 
     cvReleaseImage(&l);
     cvReleaseImage(&r);
+    delete [] l_gray;
+    delete [] r_gray;
     if (hist_image0 != NULL) cvReleaseImage(&hist_image0);
     if (hist_image1 != NULL) cvReleaseImage(&hist_image1);
     if (disparity_image != NULL) cvReleaseImage(&disparity_image);
     if (points_image != NULL) cvReleaseImage(&points_image);
 
+    if ((lcam->match_log != NULL) && (lcam->match_log->frames_dropped() > 0)) {
+        printf("%u frames were dropped from the match log\n", lcam->match_log->frames_dropped());
+    }
+
     delete lcam;
     delete rcam;
     delete corners_left;
-    delete lines;
+    delete line_fitting[0];
+    delete line_fitting[1];
     if (background_disparity_map != NULL) delete [] background_disparity_map;
     if (background_disparity_map_hits != NULL) delete [] background_disparity_map_hits;
     if (buffer != NULL) delete [] buffer;
@@ -2097,10 +2240,14 @@ int main(int argc, char* argv[]) {
     if (disparity_space != NULL) delete [] disparity_space;
     if (disparity_map != NULL) delete [] disparity_map;
 
-    if (elas!=NULL) {
-        delete elas;
-        delete [] I1;
-        delete [] I2;
+    if ((elas!=NULL) || (matcher!=NULL)) {
+        if (elas!=NULL) {
+            if (elas_profile_filename != "") write_elas_profile(elas, elas_profile_filename);
+            delete elas;
+        }
+        if (matcher!=NULL) {
+            delete matcher;
+        }
         delete [] left_disparities;
         delete [] right_disparities;
     }
@@ -0,0 +1,370 @@
+/*
+    matchlog
+    Binary logging of sparse stereo matches
+    Copyright (C) 2009 Bob Mottram and Giacomo Spigler
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "matchlog.h"
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* little endian serialisation helpers */
+static inline void put16(unsigned char* buf, unsigned int v) {
+	buf[0] = (unsigned char)(v & 255);
+	buf[1] = (unsigned char)((v >> 8) & 255);
+}
+
+static inline void put32(unsigned char* buf, unsigned int v) {
+	put16(buf, v & 65535);
+	put16(&buf[2], v >> 16);
+}
+
+static inline unsigned int get16(unsigned char* buf) {
+	return ((unsigned int)buf[0] | ((unsigned int)buf[1] << 8));
+}
+
+static inline unsigned int get32(unsigned char* buf) {
+	return (get16(buf) | (get16(&buf[2]) << 16));
+}
+
+matchlogwriter::matchlogwriter() {
+	file = NULL;
+	colour = false;
+	imgWidth = 0;
+	imgHeight = 0;
+	sub_pixel = 1;
+	frame_index = 0;
+	dropped_frames = 0;
+	pending_bytes = 0;
+	stopping = false;
+}
+
+matchlogwriter::~matchlogwriter() {
+	close();
+}
+
+/*!
+ * \brief opens a log file and starts the writer thread
+ * \param filename name of the log file
+ * \param width width of the image
+ * \param height height of the image
+ * \param sub_pixel multiplier used for sub-pixel x coordinates and disparities
+ * \param colour whether to save the colour of each match
+ * \param append if true and a compatible log already exists then frames are added to the end of it
+ * \return true if the file was opened
+ */
+bool matchlogwriter::open(
+	std::string filename,
+	int width,
+	int height,
+	int sub_pixel,
+	bool colour,
+	bool append)
+{
+	unsigned char header[MATCHLOG_HEADER_BYTES];
+
+	close();
+
+	this->colour = colour;
+	this->sub_pixel = sub_pixel;
+	imgWidth = width;
+	imgHeight = height;
+	frame_index = 0;
+	dropped_frames = 0;
+
+	put32(header, MATCHLOG_MAGIC);
+	put16(&header[4], MATCHLOG_VERSION);
+	put16(&header[6], colour ? MATCHLOG_COLOUR : 0);
+	put16(&header[8], width);
+	put16(&header[10], height);
+	put16(&header[12], sub_pixel);
+	put16(&header[14], 0);
+
+	if (append) {
+		file = fopen(filename.c_str(), "r+b");
+		if (file != NULL) {
+			unsigned char existing[MATCHLOG_HEADER_BYTES];
+			if ((fread(existing, 1, MATCHLOG_HEADER_BYTES, file) != MATCHLOG_HEADER_BYTES) ||
+				(memcmp(existing, header, MATCHLOG_HEADER_BYTES) != 0)) {
+				printf("%s is not a compatible match log\n", filename.c_str());
+				fclose(file);
+				file = NULL;
+				return (false);
+			}
+
+			/* skip over the existing frames to find the next frame index.
+			 * An incomplete final frame is overwritten */
+			fseek(file, 0, SEEK_END);
+			long size = ftell(file);
+			long pos = MATCHLOG_HEADER_BYTES;
+			unsigned char frame_header[MATCHLOG_FRAME_BYTES];
+			while (pos + MATCHLOG_FRAME_BYTES <= size) {
+				fseek(file, pos, SEEK_SET);
+				if (fread(frame_header, 1, MATCHLOG_FRAME_BYTES, file) != MATCHLOG_FRAME_BYTES) break;
+				long next = pos + 4 + (long)get32(frame_header);
+				if (next > size) break;
+				frame_index = get32(&frame_header[4]) + 1;
+				pos = next;
+			}
+			fflush(file);
+			if (ftruncate(fileno(file), pos) != 0) {
+				fclose(file);
+				file = NULL;
+				return (false);
+			}
+			fseek(file, pos, SEEK_SET);
+		}
+	}
+
+	if (file == NULL) {
+		file = fopen(filename.c_str(), "wb");
+		if (file == NULL) return (false);
+		fwrite(header, 1, MATCHLOG_HEADER_BYTES, file);
+	}
+
+	setvbuf(file, NULL, _IOFBF, 1024*1024);
+	stopping = false;
+	pending_bytes = 0;
+	writer = std::thread(&matchlogwriter::write_loop, this);
+	return (true);
+}
+
+/*!
+ * \brief writes queued frames to disk until the log is closed
+ */
+void matchlogwriter::write_loop()
+{
+	std::unique_lock<std::mutex> lock(queue_mutex);
+	while (true) {
+		if (queue.empty()) {
+			if (stopping) break;
+
+			/* flush whenever the queue is drained, so that
+			 * the log can be read while it is being written */
+			lock.unlock();
+			fflush(file);
+			lock.lock();
+			queue_changed.wait(lock, [this] { return (stopping || !queue.empty()); });
+			continue;
+		}
+
+		std::vector<unsigned char> frame;
+		frame.swap(queue.front());
+		queue.pop_front();
+
+		/* write without holding the lock, so that the
+		 * processing loop can continue to add frames */
+		lock.unlock();
+		fwrite(&frame[0], 1, frame.size(), file);
+		lock.lock();
+		pending_bytes -= (unsigned int)frame.size();
+	}
+	lock.unlock();
+	fflush(file);
+}
+
+/*!
+ * \brief adds a frame of stereo matches to the log.  Matches with zero probability are not saved.
+ * \param svs_matches array of matches (probability, x, y, disparity, plane)
+ * \param no_of_matches number of matches
+ * \param rectified_frame_buf colour image used to look up the colour of each match
+ * \return false if the frame could not be queued
+ */
+bool matchlogwriter::write_frame(
+	unsigned int* svs_matches,
+	int no_of_matches,
+	unsigned char* rectified_frame_buf)
+{
+	if (file == NULL) return (false);
+
+	int i, n, valid = 0;
+	for (i = 0; i < no_of_matches; i++)
+		if (svs_matches[i * 5] > 0) valid++;
+
+	int match_bytes = MATCHLOG_MATCH_BYTES;
+	if (colour) match_bytes += MATCHLOG_COLOUR_BYTES;
+	unsigned int bytes = MATCHLOG_FRAME_BYTES + (valid * match_bytes);
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	unsigned long long timestamp =
+		((unsigned long long)tv.tv_sec * 1000000ULL) + (unsigned long long)tv.tv_usec;
+
+	std::vector<unsigned char> frame(bytes);
+	unsigned char* buf = &frame[0];
+	put32(buf, bytes - 4);
+	put32(&buf[4], frame_index);
+	put32(&buf[8], (unsigned int)(timestamp & 0xffffffffULL));
+	put32(&buf[12], (unsigned int)(timestamp >> 32));
+	put32(&buf[16], valid);
+	buf += MATCHLOG_FRAME_BYTES;
+
+	for (i = 0; i < no_of_matches; i++) {
+		if (svs_matches[i * 5] == 0) continue;
+		unsigned int x = svs_matches[i * 5 + 1];
+		unsigned int y = svs_matches[i * 5 + 2];
+		put16(buf, svs_matches[i * 5]);
+		put16(&buf[2], x);
+		put16(&buf[4], y);
+		put16(&buf[6], svs_matches[i * 5 + 3]);
+		if (colour) {
+			n = ((y * imgWidth) + (x / sub_pixel)) * 3;
+			buf[8] = rectified_frame_buf[n + 2];
+			buf[9] = rectified_frame_buf[n + 1];
+			buf[10] = rectified_frame_buf[n];
+			buf[11] = 0;
+		}
+		buf += match_bytes;
+	}
+	frame_index++;
+
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (pending_bytes + bytes > MATCHLOG_MAX_PENDING) {
+			/* the disk can't keep up, so drop the frame rather than stalling */
+			dropped_frames++;
+			return (false);
+		}
+		pending_bytes += bytes;
+		queue.push_back(std::vector<unsigned char>());
+		queue.back().swap(frame);
+	}
+	queue_changed.notify_one();
+	return (true);
+}
+
+/*!
+ * \brief writes any queued frames and closes the log
+ */
+void matchlogwriter::close()
+{
+	if (file == NULL) return;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		stopping = true;
+	}
+	queue_changed.notify_one();
+	if (writer.joinable()) writer.join();
+	fclose(file);
+	file = NULL;
+	queue.clear();
+	pending_bytes = 0;
+}
+
+matchlogreader::matchlogreader() {
+	file = NULL;
+	imgWidth = 0;
+	imgHeight = 0;
+	sub_pixel = 1;
+	colour = false;
+}
+
+matchlogreader::~matchlogreader() {
+	close();
+}
+
+/*!
+ * \brief opens a match log for reading
+ * \param filename name of the log file
+ * \return true if the file is a valid match log
+ */
+bool matchlogreader::open(
+	std::string filename)
+{
+	unsigned char header[MATCHLOG_HEADER_BYTES];
+
+	close();
+	file = fopen(filename.c_str(), "rb");
+	if (file == NULL) return (false);
+
+	if ((fread(header, 1, MATCHLOG_HEADER_BYTES, file) != MATCHLOG_HEADER_BYTES) ||
+		(get32(header) != MATCHLOG_MAGIC) ||
+		(get16(&header[4]) > MATCHLOG_VERSION)) {
+		close();
+		return (false);
+	}
+	colour = ((get16(&header[6]) & MATCHLOG_COLOUR) != 0);
+	imgWidth = (int)get16(&header[8]);
+	imgHeight = (int)get16(&header[10]);
+	sub_pixel = (int)get16(&header[12]);
+	return (true);
+}
+
+/*!
+ * \brief reads the next frame from the log
+ * \param frame_index returned index of the frame
+ * \param timestamp returned time at which the frame was logged, in microseconds since the epoch
+ * \param matches returned matches
+ * \return false at the end of the log, or if the frame is incomplete
+ */
+bool matchlogreader::read_frame(
+	unsigned int& frame_index,
+	unsigned long long& timestamp,
+	std::vector<matchlogentry>& matches)
+{
+	unsigned char length[4];
+
+	matches.clear();
+	if (file == NULL) return (false);
+	if (fread(length, 1, 4, file) != 4) return (false);
+
+	unsigned int bytes = get32(length);
+	if (bytes < MATCHLOG_FRAME_BYTES - 4) return (false);
+	std::vector<unsigned char> frame(bytes);
+	if (fread(&frame[0], 1, bytes, file) != bytes) return (false);
+
+	unsigned char* buf = &frame[0];
+	frame_index = get32(buf);
+	timestamp = (unsigned long long)get32(&buf[4]) |
+		((unsigned long long)get32(&buf[8]) << 32);
+	unsigned int no_of_matches = get32(&buf[12]);
+
+	unsigned int match_bytes = MATCHLOG_MATCH_BYTES;
+	if (colour) match_bytes += MATCHLOG_COLOUR_BYTES;
+	if ((MATCHLOG_FRAME_BYTES - 4) + (no_of_matches * match_bytes) > bytes) return (false);
+
+	buf += MATCHLOG_FRAME_BYTES - 4;
+	matches.resize(no_of_matches);
+	for (unsigned int i = 0; i < no_of_matches; i++, buf += match_bytes) {
+		matchlogentry &m = matches[i];
+		m.probability = (unsigned short int)get16(buf);
+		m.x = (unsigned short int)get16(&buf[2]);
+		m.y = (unsigned short int)get16(&buf[4]);
+		m.disparity = (unsigned short int)get16(&buf[6]);
+		if (colour) {
+			m.r = buf[8];
+			m.g = buf[9];
+			m.b = buf[10];
+		}
+		else {
+			m.r = m.g = m.b = 0;
+		}
+	}
+	return (true);
+}
+
+/*!
+ * \brief closes the log
+ */
+void matchlogreader::close()
+{
+	if (file != NULL) {
+		fclose(file);
+		file = NULL;
+	}
+}
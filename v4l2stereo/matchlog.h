@@ -0,0 +1,130 @@
+/*
+    matchlog
+    Binary logging of sparse stereo matches
+    Copyright (C) 2009 Bob Mottram and Giacomo Spigler
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    File layout (all values little endian)
+
+    header, 16 bytes:
+        uint32  MATCHLOG_MAGIC
+        uint16  MATCHLOG_VERSION
+        uint16  flags (MATCHLOG_COLOUR if matches include colour)
+        uint16  image width
+        uint16  image height
+        uint16  sub-pixel multiplier used for x and disparity
+        uint16  reserved
+
+    followed by one record per frame:
+        uint32  length of the rest of the record in bytes
+        uint32  frame index
+        uint64  timestamp in microseconds since the epoch
+        uint32  number of matches
+        per match:
+            uint16  probability
+            uint16  x (sub-pixel)
+            uint16  y
+            uint16  disparity (sub-pixel)
+            uint8   r, g, b, unused     (only if MATCHLOG_COLOUR)
+
+    Readers should use the record length to skip to the next frame,
+    so that fields can be appended to records in later versions.
+*/
+
+#ifndef MATCHLOG_H_
+#define MATCHLOG_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define MATCHLOG_MAGIC           0x474c4d53
+#define MATCHLOG_VERSION         1
+#define MATCHLOG_COLOUR          1
+#define MATCHLOG_HEADER_BYTES    16
+#define MATCHLOG_FRAME_BYTES     20
+#define MATCHLOG_MATCH_BYTES     8
+#define MATCHLOG_COLOUR_BYTES    4
+
+/* maximum number of bytes waiting to be written before frames are dropped */
+#define MATCHLOG_MAX_PENDING     (16*1024*1024)
+
+struct matchlogentry {
+    unsigned short int probability;
+    unsigned short int x;
+    unsigned short int y;
+    unsigned short int disparity;
+    unsigned char r, g, b;
+};
+
+/* appends frames of stereo matches to a log file.
+   Frames are serialised by the caller and written to disk by a
+   background thread, so that logging does not block on file I/O */
+class matchlogwriter {
+protected:
+    FILE* file;
+    bool colour;
+    int imgWidth, imgHeight;
+    int sub_pixel;
+    unsigned int frame_index;
+    unsigned int dropped_frames;
+
+    std::thread writer;
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::deque<std::vector<unsigned char> > queue;
+    unsigned int pending_bytes;
+    bool stopping;
+
+    void write_loop();
+
+public:
+    bool open(std::string filename, int width, int height, int sub_pixel, bool colour, bool append);
+    bool is_open() { return (file != NULL); }
+    bool write_frame(unsigned int* svs_matches, int no_of_matches, unsigned char* rectified_frame_buf);
+    void close();
+
+    unsigned int frames_dropped() { return (dropped_frames); }
+
+    matchlogwriter();
+    ~matchlogwriter();
+};
+
+/* reads frames of stereo matches from a log file */
+class matchlogreader {
+protected:
+    FILE* file;
+
+public:
+    int imgWidth, imgHeight;
+    int sub_pixel;
+    bool colour;
+
+    bool open(std::string filename);
+    bool read_frame(unsigned int& frame_index, unsigned long long& timestamp, std::vector<matchlogentry>& matches);
+    void close();
+
+    matchlogreader();
+    ~matchlogreader();
+};
+
+#endif
@@ -0,0 +1,767 @@
+/*
+    sgm
+    Semi-global matching dense stereo
+    For a description of this algorithm see:
+        Heiko Hirschmuller, Stereo Processing by Semiglobal Matching and
+        Mutual Information, IEEE Transactions on Pattern Analysis and
+        Machine Intelligence, 30(2), 2008
+    Copyright (C) 2010 Bob Mottram
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sgm.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// popcnt and AVX2 kernels are compiled for those targets individually and only used if the CPU supports them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SGM_POPCNT_TARGET __attribute__((target("popcnt")))
+#ifdef __SSE2__
+#include <immintrin.h>
+#define SGM_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+// offset of the first disparity within the path costs for each pixel.
+// The values either side of the range are set to SGM_MAX_PATH_COST
+#define SGM_PATH_OFFSET        8
+
+sgm::sgm(
+	parameters param)
+{
+	this->param = param;
+	if (this->param.paths != 4) this->param.paths = 8;
+	if (this->param.disp_max < 1) this->param.disp_max = 1;
+	if (this->param.P1 < 0) this->param.P1 = 0;
+	if (this->param.P2 < this->param.P1) this->param.P2 = this->param.P1;
+	if (this->param.P2 > SGM_MAX_PENALTY) this->param.P2 = SGM_MAX_PENALTY;
+	if (this->param.P1 > SGM_MAX_PENALTY) this->param.P1 = SGM_MAX_PENALTY;
+	width = 0;
+	height = 0;
+	no_of_disparities = 0;
+	disparity_stride = 0;
+	census_left = NULL;
+	census_right = NULL;
+	cost = NULL;
+	aggregated = NULL;
+	path_rows = NULL;
+	path_minimum = NULL;
+	path_start = NULL;
+
+	use_popcnt = false;
+	use_avx2 = false;
+#ifdef SGM_POPCNT_TARGET
+	__builtin_cpu_init();
+	use_popcnt = (__builtin_cpu_supports("popcnt") != 0);
+#ifdef SGM_AVX2_TARGET
+	use_avx2 = (__builtin_cpu_supports("avx2") != 0);
+#endif
+#endif
+}
+
+sgm::~sgm()
+{
+	release();
+}
+
+/*!
+ * \brief frees the buffers
+ */
+void sgm::release()
+{
+	if (census_left != NULL) {
+		delete [] census_left;
+		delete [] census_right;
+		delete [] cost;
+		delete [] aggregated;
+		delete [] path_rows;
+		delete [] path_minimum;
+		delete [] path_start;
+		census_left = NULL;
+	}
+	width = 0;
+	height = 0;
+}
+
+/*!
+ * \brief allocates buffers for the given image size.  Buffers are kept between frames.
+ * \param img_width width of the image
+ * \param img_height height of the image
+ */
+void sgm::allocate(
+	int img_width,
+	int img_height)
+{
+	if ((census_left != NULL) && (img_width == width) && (img_height == height)) return;
+	release();
+
+	width = img_width;
+	height = img_height;
+	no_of_disparities = ((param.disp_max + SGM_DISPARITY_BLOCK) / SGM_DISPARITY_BLOCK) * SGM_DISPARITY_BLOCK;
+	disparity_stride = no_of_disparities + (SGM_PATH_OFFSET*2);
+
+	int img_pixels = width*height;
+	census_left = new uint64_t[img_pixels];
+	census_right = new uint64_t[img_pixels];
+	cost = new uint8_t[img_pixels*no_of_disparities];
+	aggregated = new int16_t[img_pixels*no_of_disparities];
+
+	// two rows of path costs for each of the three paths followed
+	// along the image columns, with guard values either side of each pixel
+	int path_row_values = width*disparity_stride;
+	path_rows = new int16_t[path_row_values*2*3];
+	for (int i = 0; i < width*2*3; i++) {
+		int16_t* p = &path_rows[i*disparity_stride];
+		p[SGM_PATH_OFFSET - 1] = SGM_MAX_PATH_COST;
+		p[SGM_PATH_OFFSET + no_of_disparities] = SGM_MAX_PATH_COST;
+	}
+	path_minimum = new int16_t[width*2*3];
+
+	// path costs before the first pixel on each path
+	path_start = new int16_t[disparity_stride];
+	memset((void*)path_start, '\0', disparity_stride*sizeof(int16_t));
+}
+
+/*!
+ * \brief copies one channel of a row of an interleaved image
+ * \param src row of the image
+ * \param width number of pixels
+ * \param channels number of bytes per pixel
+ * \param channel index of the channel within each pixel
+ * \param dest returned intensities
+ */
+static void extract_row(
+	uint8_t* src,
+	int width,
+	int channels,
+	int channel,
+	uint8_t* dest)
+{
+	if (channels == 1) {
+		memcpy((void*)dest, (void*)src, width);
+		return;
+	}
+
+	int x = 0;
+#ifdef __SSE2__
+	if (channels == 2) {
+		__m128i mask = _mm_set1_epi16(0x00ff);
+		for (; x + 16 <= width; x += 16) {
+			__m128i a = _mm_loadu_si128((__m128i*)&src[x*2]);
+			__m128i b = _mm_loadu_si128((__m128i*)&src[x*2 + 16]);
+			if (channel == 0) {
+				a = _mm_and_si128(a, mask);
+				b = _mm_and_si128(b, mask);
+			}
+			else {
+				a = _mm_srli_epi16(a, 8);
+				b = _mm_srli_epi16(b, 8);
+			}
+			_mm_storeu_si128((__m128i*)&dest[x], _mm_packus_epi16(a, b));
+		}
+	}
+	else if (channels == 3) {
+		// deinterleave 16 pixels by repeatedly interleaving the low and high halves
+		for (; x + 16 <= width; x += 16) {
+			__m128i c0 = _mm_loadu_si128((__m128i*)&src[x*3]);
+			__m128i c1 = _mm_loadu_si128((__m128i*)&src[x*3 + 16]);
+			__m128i c2 = _mm_loadu_si128((__m128i*)&src[x*3 + 32]);
+			for (int i = 0; i < 4; i++) {
+				__m128i t0 = _mm_unpacklo_epi8(c0, _mm_unpackhi_epi64(c1, c1));
+				__m128i t1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(c0, c0), c2);
+				__m128i t2 = _mm_unpacklo_epi8(c1, _mm_unpackhi_epi64(c2, c2));
+				c0 = t0;
+				c1 = t1;
+				c2 = t2;
+			}
+			_mm_storeu_si128((__m128i*)&dest[x], (channel == 0) ? c0 : ((channel == 1) ? c1 : c2));
+		}
+	}
+#endif
+	for (; x < width; x++) {
+		dest[x] = src[x*channels + channel];
+	}
+}
+
+/*!
+ * \brief census transform of one channel of an image.  Each bit of the census word for a pixel
+ *        is set if a pixel within the surrounding window is darker than the centre pixel.
+ *        Pixels beyond the edge of the image take the value of the nearest edge pixel.
+ * \param img image
+ * \param bytes_per_line bytes per line of the image
+ * \param channels number of bytes per pixel, 1 for an intensity image
+ * \param channel index of the channel used within each pixel
+ * \param census returned census words, one per pixel
+ */
+void sgm::census_transform(
+	uint8_t* img,
+	int bytes_per_line,
+	int channels,
+	int channel,
+	uint64_t* census)
+{
+	const int rx = SGM_CENSUS_WIDTH/2;
+	const int ry = SGM_CENSUS_HEIGHT/2;
+	int padded_width = width + (rx*2);
+
+    #pragma omp parallel
+	{
+		// padded copy of the rows within the window
+		uint8_t* rows = new uint8_t[padded_width*SGM_CENSUS_HEIGHT];
+		int previous_y = -2;
+
+        #pragma omp for schedule(static)
+		for (int y = 0; y < height; y++) {
+
+			// following on from the row above, the window moves up and only its last row is read
+			int first_dy = -ry;
+			if (y == previous_y + 1) {
+				memmove((void*)rows, (void*)&rows[padded_width], padded_width*(SGM_CENSUS_HEIGHT-1));
+				first_dy = ry;
+			}
+			previous_y = y;
+
+			for (int dy = first_dy; dy <= ry; dy++) {
+				int yy = y + dy;
+				if (yy < 0) yy = 0;
+				if (yy > height-1) yy = height-1;
+				uint8_t* dest = &rows[(dy+ry)*padded_width];
+				extract_row(&img[yy*bytes_per_line], width, channels, channel, &dest[rx]);
+				memset((void*)dest, dest[rx], rx);
+				memset((void*)&dest[rx+width], dest[rx+width-1], rx);
+			}
+
+			uint64_t* c = &census[y*width];
+			uint8_t* centre = &rows[ry*padded_width + rx];
+			memset((void*)c, '\0', width*sizeof(uint64_t));
+			for (int dy = -ry; dy <= ry; dy++) {
+				for (int dx = -rx; dx <= rx; dx++) {
+					if ((dx == 0) && (dy == 0)) continue;
+					uint8_t* v = &centre[dy*padded_width + dx];
+					for (int x = 0; x < width; x++) {
+						c[x] = (c[x] << 1) | (uint64_t)(v[x] < centre[x]);
+					}
+				}
+			}
+		}
+		delete [] rows;
+	}
+}
+
+/* matching costs for one row, as the Hamming distance between census words */
+static void row_costs_scalar(
+	uint64_t* left,
+	uint64_t* right,
+	int width,
+	int no_of_disparities,
+	uint8_t* cost)
+{
+	for (int x = 0; x < width; x++, cost += no_of_disparities) {
+		int d = 0;
+		for (; (d < no_of_disparities) && (d <= x); d++) {
+			uint64_t v = left[x] ^ right[x-d];
+			int bits = 0;
+			for (; v != 0; bits++) v &= v - 1;
+			cost[d] = (uint8_t)bits;
+		}
+		for (; d < no_of_disparities; d++) {
+			cost[d] = SGM_CENSUS_BITS;
+		}
+	}
+}
+
+#ifdef SGM_POPCNT_TARGET
+
+SGM_POPCNT_TARGET
+static void row_costs_popcnt(
+	uint64_t* left,
+	uint64_t* right,
+	int width,
+	int no_of_disparities,
+	uint8_t* cost)
+{
+	for (int x = 0; x < width; x++, cost += no_of_disparities) {
+		int d = 0;
+		for (; (d < no_of_disparities) && (d <= x); d++) {
+			cost[d] = (uint8_t)__builtin_popcountll(left[x] ^ right[x-d]);
+		}
+		for (; d < no_of_disparities; d++) {
+			cost[d] = SGM_CENSUS_BITS;
+		}
+	}
+}
+
+#endif
+
+/*!
+ * \brief calculates the matching cost for every pixel and disparity
+ */
+void sgm::matching_costs()
+{
+    #pragma omp parallel for
+	for (int y = 0; y < height; y++) {
+		uint64_t* left = &census_left[y*width];
+		uint64_t* right = &census_right[y*width];
+		uint8_t* c = &cost[y*width*no_of_disparities];
+#ifdef SGM_POPCNT_TARGET
+		if (use_popcnt) {
+			row_costs_popcnt(left, right, width, no_of_disparities, c);
+			continue;
+		}
+#endif
+		row_costs_scalar(left, right, width, no_of_disparities, c);
+	}
+}
+
+/*!
+ * \brief updates the path costs for a pixel from those of the previous pixel along the path,
+ *        and adds them to the aggregated costs
+ * \param cost matching costs for the pixel
+ * \param previous path costs for the previous pixel, with guard values either side
+ * \param previous_minimum smallest of the path costs for the previous pixel
+ * \param current returned path costs for the pixel
+ * \param aggregated aggregated costs for the pixel
+ * \param no_of_disparities number of disparities, a multiple of SGM_DISPARITY_BLOCK
+ * \param P1 penalty for a disparity change of one pixel
+ * \param P2 penalty for larger disparity changes
+ * \param first true if this is the first path, in which case the aggregated costs are set rather than added to
+ * \return smallest of the path costs for the pixel
+ */
+static inline int16_t path_update(
+	uint8_t* cost,
+	int16_t* previous,
+	int16_t previous_minimum,
+	int16_t* current,
+	int16_t* aggregated,
+	int no_of_disparities,
+	int P1,
+	int P2,
+	bool first)
+{
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i p1 = _mm_set1_epi16((int16_t)P1);
+	__m128i jump = _mm_set1_epi16((int16_t)(previous_minimum + P2));
+	__m128i minimum_previous = _mm_set1_epi16(previous_minimum);
+	__m128i minimum = _mm_set1_epi16(SGM_MAX_PATH_COST);
+	for (int d = 0; d < no_of_disparities; d += 8) {
+		__m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)&cost[d]), zero);
+		__m128i same = _mm_loadu_si128((__m128i*)&previous[d]);
+		__m128i lower = _mm_adds_epi16(_mm_loadu_si128((__m128i*)&previous[d-1]), p1);
+		__m128i higher = _mm_adds_epi16(_mm_loadu_si128((__m128i*)&previous[d+1]), p1);
+		__m128i m = _mm_min_epi16(_mm_min_epi16(same, jump), _mm_min_epi16(lower, higher));
+		__m128i v = _mm_adds_epi16(c, _mm_sub_epi16(m, minimum_previous));
+		_mm_storeu_si128((__m128i*)&current[d], v);
+		if (first)
+			_mm_storeu_si128((__m128i*)&aggregated[d], v);
+		else
+			_mm_storeu_si128((__m128i*)&aggregated[d], _mm_adds_epi16(_mm_loadu_si128((__m128i*)&aggregated[d]), v));
+		minimum = _mm_min_epi16(minimum, v);
+	}
+
+	// minimum across the vector
+	minimum = _mm_min_epi16(minimum, _mm_srli_si128(minimum, 8));
+	minimum = _mm_min_epi16(minimum, _mm_srli_si128(minimum, 4));
+	minimum = _mm_min_epi16(minimum, _mm_srli_si128(minimum, 2));
+	return((int16_t)_mm_cvtsi128_si32(minimum));
+#else
+	int jump = previous_minimum + P2;
+	int minimum = SGM_MAX_PATH_COST;
+	for (int d = 0; d < no_of_disparities; d++) {
+		int m = previous[d];
+		if (previous[d-1] + P1 < m) m = previous[d-1] + P1;
+		if (previous[d+1] + P1 < m) m = previous[d+1] + P1;
+		if (jump < m) m = jump;
+		int v = cost[d] + m - previous_minimum;
+		current[d] = (int16_t)v;
+		if (first)
+			aggregated[d] = (int16_t)v;
+		else
+			aggregated[d] += (int16_t)v;
+		if (v < minimum) minimum = v;
+	}
+	return((int16_t)minimum);
+#endif
+}
+
+#ifdef SGM_AVX2_TARGET
+
+SGM_AVX2_TARGET
+static int16_t path_update_avx2(
+	uint8_t* cost,
+	int16_t* previous,
+	int16_t previous_minimum,
+	int16_t* current,
+	int16_t* aggregated,
+	int no_of_disparities,
+	int P1,
+	int P2,
+	bool first)
+{
+	__m256i p1 = _mm256_set1_epi16((int16_t)P1);
+	__m256i jump = _mm256_set1_epi16((int16_t)(previous_minimum + P2));
+	__m256i minimum_previous = _mm256_set1_epi16(previous_minimum);
+	__m256i minimum = _mm256_set1_epi16(SGM_MAX_PATH_COST);
+	for (int d = 0; d < no_of_disparities; d += 16) {
+		__m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)&cost[d]));
+		__m256i same = _mm256_loadu_si256((__m256i*)&previous[d]);
+		__m256i lower = _mm256_adds_epi16(_mm256_loadu_si256((__m256i*)&previous[d-1]), p1);
+		__m256i higher = _mm256_adds_epi16(_mm256_loadu_si256((__m256i*)&previous[d+1]), p1);
+		__m256i m = _mm256_min_epi16(_mm256_min_epi16(same, jump), _mm256_min_epi16(lower, higher));
+		__m256i v = _mm256_adds_epi16(c, _mm256_sub_epi16(m, minimum_previous));
+		_mm256_storeu_si256((__m256i*)&current[d], v);
+		if (first)
+			_mm256_storeu_si256((__m256i*)&aggregated[d], v);
+		else
+			_mm256_storeu_si256((__m256i*)&aggregated[d], _mm256_adds_epi16(_mm256_loadu_si256((__m256i*)&aggregated[d]), v));
+		minimum = _mm256_min_epi16(minimum, v);
+	}
+
+	// minimum across the vector.  Path costs are never negative
+	__m128i m = _mm_min_epi16(_mm256_castsi256_si128(minimum), _mm256_extracti128_si256(minimum, 1));
+	return((int16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(m)));
+}
+
+#endif
+
+/* dispatch to the selected instruction set */
+static inline int16_t update_path(
+	bool use_avx2,
+	uint8_t* cost,
+	int16_t* previous,
+	int16_t previous_minimum,
+	int16_t* current,
+	int16_t* aggregated,
+	int no_of_disparities,
+	int P1,
+	int P2,
+	bool first)
+{
+#ifdef SGM_AVX2_TARGET
+	if (use_avx2) {
+		return(path_update_avx2(cost, previous, previous_minimum, current, aggregated, no_of_disparities, P1, P2, first));
+	}
+#endif
+	return(path_update(cost, previous, previous_minimum, current, aggregated, no_of_disparities, P1, P2, first));
+}
+
+/*!
+ * \brief aggregates costs along the paths from left to right and right to left.
+ *        Each row is independent, so rows are processed in parallel.
+ */
+void sgm::aggregate_horizontal()
+{
+    #pragma omp parallel
+	{
+		// path costs for the previous and current pixels
+		int16_t* buffer = new int16_t[disparity_stride*2];
+		for (int i = 0; i < 2; i++) {
+			int16_t* p = &buffer[i*disparity_stride];
+			p[SGM_PATH_OFFSET - 1] = SGM_MAX_PATH_COST;
+			p[SGM_PATH_OFFSET + no_of_disparities] = SGM_MAX_PATH_COST;
+		}
+
+        #pragma omp for
+		for (int y = 0; y < height; y++) {
+			for (int direction = 0; direction < 2; direction++) {
+				int16_t* previous = &path_start[SGM_PATH_OFFSET];
+				int16_t previous_minimum = 0;
+				for (int i = 0; i < width; i++) {
+					int x = i;
+					if (direction == 1) x = width-1-i;
+					int n = (y*width + x)*no_of_disparities;
+					int16_t* current = &buffer[(i & 1)*disparity_stride + SGM_PATH_OFFSET];
+					previous_minimum = update_path(
+						use_avx2, &cost[n], previous, previous_minimum, current, &aggregated[n],
+						no_of_disparities, param.P1, param.P2, (direction == 0));
+					previous = current;
+				}
+			}
+		}
+		delete [] buffer;
+	}
+}
+
+/*!
+ * \brief aggregates costs along the paths running down or up the image.
+ *        Rows are processed in turn, with the pixels along each row processed in parallel.
+ * \param downwards if true then paths run from the top of the image to the bottom
+ */
+void sgm::aggregate_vertical(
+	bool downwards)
+{
+	// horizontal step along each path.  With four paths only the vertical one is used
+	const int path_dx[3] = { 0, -1, 1 };
+	int no_of_paths = 1;
+	if (param.paths == 8) no_of_paths = 3;
+	int path_row_values = width*disparity_stride;
+
+    #pragma omp parallel
+	{
+		for (int i = 0; i < height; i++) {
+			int y = i;
+			if (!downwards) y = height-1-i;
+			int current_row = i & 1;
+			int previous_row = 1 - current_row;
+
+            #pragma omp for schedule(static)
+			for (int x = 0; x < width; x++) {
+				int n = (y*width + x)*no_of_disparities;
+				for (int path = 0; path < no_of_paths; path++) {
+					int16_t* rows = &path_rows[path*path_row_values*2];
+					int16_t* minimum = &path_minimum[path*width*2];
+
+					// previous pixel along the path
+					int16_t* previous = &path_start[SGM_PATH_OFFSET];
+					int16_t previous_minimum = 0;
+					int x_previous = x - path_dx[path];
+					if ((i > 0) && (x_previous >= 0) && (x_previous < width)) {
+						previous = &rows[previous_row*path_row_values + x_previous*disparity_stride + SGM_PATH_OFFSET];
+						previous_minimum = minimum[previous_row*width + x_previous];
+					}
+
+					minimum[current_row*width + x] = update_path(
+						use_avx2, &cost[n], previous, previous_minimum,
+						&rows[current_row*path_row_values + x*disparity_stride + SGM_PATH_OFFSET],
+						&aggregated[n], no_of_disparities, param.P1, param.P2, false);
+				}
+			}
+		}
+	}
+}
+
+/*!
+ * \brief finds the disparity with the smallest aggregated cost for a pixel
+ * \param aggregated aggregated costs for the pixel
+ * \param max_disparity largest disparity to be considered
+ * \param no_of_disparities number of disparities, a multiple of SGM_DISPARITY_BLOCK
+ * \param uniqueness percentage by which the best cost must be lower than any other non-adjacent cost
+ * \param unique returned true if the best disparity is unique
+ * \return best disparity
+ */
+static inline int best_disparity(
+	int16_t* aggregated,
+	int max_disparity,
+	int no_of_disparities,
+	int uniqueness,
+	bool &unique)
+{
+	int best = 0;
+	unique = true;
+#ifdef __SSE2__
+	// smallest cost, with disparities beyond the maximum excluded
+	__m128i limit = _mm_set1_epi16((int16_t)(max_disparity+1));
+	__m128i index = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i step = _mm_set1_epi16(8);
+	__m128i excluded = _mm_set1_epi16(SGM_MAX_PATH_COST*2);
+	__m128i minimum = excluded;
+	int blocks = (max_disparity / 8) + 1;
+	for (int i = 0; i < blocks; i++, index = _mm_add_epi16(index, step)) {
+		__m128i valid = _mm_cmplt_epi16(index, limit);
+		__m128i v = _mm_loadu_si128((__m128i*)&aggregated[i*8]);
+		v = _mm_or_si128(_mm_and_si128(valid, v), _mm_andnot_si128(valid, excluded));
+		minimum = _mm_min_epi16(minimum, v);
+	}
+	minimum = _mm_min_epi16(minimum, _mm_srli_si128(minimum, 8));
+	minimum = _mm_min_epi16(minimum, _mm_srli_si128(minimum, 4));
+	minimum = _mm_min_epi16(minimum, _mm_srli_si128(minimum, 2));
+	int best_cost = (int16_t)_mm_cvtsi128_si32(minimum);
+	while (aggregated[best] != best_cost) best++;
+
+	// are there any costs close to the best, other than those adjacent to it?
+	int close = ((best_cost*100) + (100 - uniqueness) - 1) / (100 - uniqueness);
+	__m128i close_cost = _mm_set1_epi16((int16_t)close);
+	index = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i adjacent_low = _mm_set1_epi16((int16_t)(best-1));
+	__m128i adjacent_high = _mm_set1_epi16((int16_t)(best+1));
+	for (int i = 0; i < blocks; i++, index = _mm_add_epi16(index, step)) {
+		__m128i candidate = _mm_and_si128(
+			_mm_cmplt_epi16(_mm_loadu_si128((__m128i*)&aggregated[i*8]), close_cost),
+			_mm_cmplt_epi16(index, limit));
+		candidate = _mm_and_si128(candidate,
+			_mm_or_si128(_mm_cmplt_epi16(index, adjacent_low), _mm_cmpgt_epi16(index, adjacent_high)));
+		if (_mm_movemask_epi8(candidate) != 0) {
+			unique = false;
+			break;
+		}
+	}
+#else
+	for (int d = 1; d <= max_disparity; d++) {
+		if (aggregated[d] < aggregated[best]) best = d;
+	}
+	int threshold = aggregated[best]*100;
+	for (int d = 0; d <= max_disparity; d++) {
+		if (((d < best-1) || (d > best+1)) &&
+			(aggregated[d]*(100 - uniqueness) < threshold)) {
+			unique = false;
+			break;
+		}
+	}
+#endif
+	return(best);
+}
+
+/*!
+ * \brief selects the disparity with the smallest aggregated cost for each pixel of the left and
+ *        right images, then removes left image disparities which are not consistent with the right
+ * \param D1 returned left image disparities
+ * \param D2 returned right image disparities
+ */
+void sgm::select_disparities(
+	float* D1,
+	float* D2)
+{
+	int disp_max = param.disp_max;
+	if (disp_max > no_of_disparities-1) disp_max = no_of_disparities-1;
+
+    #pragma omp parallel
+	{
+		// best cost and disparity for each pixel of the right image
+		int16_t* right_cost = new int16_t[width];
+		int16_t* right_best = new int16_t[width];
+
+        #pragma omp for
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				right_cost[x] = SGM_MAX_PATH_COST*2;
+				right_best[x] = 0;
+			}
+
+			for (int x = 0; x < width; x++) {
+				int16_t* s = &aggregated[(y*width + x)*no_of_disparities];
+				int max_d = disp_max;
+				if (max_d > x) max_d = x;
+
+				// best disparity for the left image
+				bool unique;
+				int best = best_disparity(s, max_d, no_of_disparities, param.uniqueness, unique);
+				float disparity = SGM_INVALID;
+				if (unique) {
+					disparity = (float)best;
+					if ((param.sub_pixel) && (best > 0) && (best < max_d)) {
+						int denominator = s[best-1] + s[best+1] - (2*s[best]);
+						if (denominator > 0) {
+							disparity += (float)(s[best-1] - s[best+1]) / (float)(2*denominator);
+						}
+					}
+				}
+				D1[y*width + x] = disparity;
+
+				// each disparity of this left image pixel corresponds to a
+				// different right image pixel.  Smaller disparities win ties
+				int16_t* rc = &right_cost[x];
+				int16_t* rb = &right_best[x];
+				int d = 0;
+#ifdef __SSE2__
+				__m128i reversed_index = _mm_set_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+				for (; d + 7 <= max_d; d += 8) {
+					// costs in order of increasing right image x coordinate
+					__m128i v = _mm_loadu_si128((__m128i*)&s[d]);
+					v = _mm_shufflelo_epi16(_mm_shufflehi_epi16(v, 0x1b), 0x1b);
+					v = _mm_shuffle_epi32(v, 0x4e);
+					__m128i c = _mm_loadu_si128((__m128i*)&rc[-d-7]);
+					__m128i b = _mm_loadu_si128((__m128i*)&rb[-d-7]);
+					__m128i better = _mm_cmplt_epi16(v, c);
+					__m128i index = _mm_add_epi16(reversed_index, _mm_set1_epi16((int16_t)d));
+					_mm_storeu_si128((__m128i*)&rc[-d-7], _mm_or_si128(_mm_and_si128(better, v), _mm_andnot_si128(better, c)));
+					_mm_storeu_si128((__m128i*)&rb[-d-7], _mm_or_si128(_mm_and_si128(better, index), _mm_andnot_si128(better, b)));
+				}
+#endif
+				for (; d <= max_d; d++) {
+					if (s[d] < rc[-d]) {
+						rc[-d] = s[d];
+						rb[-d] = (int16_t)d;
+					}
+				}
+			}
+
+			for (int x = 0; x < width; x++) {
+				D2[y*width + x] = (float)right_best[x];
+			}
+		}
+		delete [] right_cost;
+		delete [] right_best;
+	}
+
+	// left/right consistency check
+    #pragma omp parallel for
+	for (int y = 0; y < height; y++) {
+		float* left = &D1[y*width];
+		float* right = &D2[y*width];
+		for (int x = 0; x < width; x++) {
+			if (left[x] < 0) continue;
+			int x_right = x - (int)(left[x] + 0.5f);
+			if ((x_right < 0) ||
+				(fabsf(right[x_right] - left[x]) > (float)param.lr_threshold)) {
+				left[x] = SGM_INVALID;
+			}
+		}
+	}
+}
+
+/*!
+ * \brief calculates disparity maps for the left and right images
+ * \param I1 left intensity image
+ * \param I2 right intensity image
+ * \param D1 returned left image disparities, with SGM_INVALID where there is no valid match
+ * \param D2 returned right image disparities
+ * \param dims width, height and bytes per line of the images
+ */
+void sgm::process(
+	uint8_t* I1,
+	uint8_t* I2,
+	float* D1,
+	float* D2,
+	const int32_t* dims)
+{
+	process(I1, I2, 1, 0, D1, D2, dims);
+}
+
+/*!
+ * \brief calculates disparity maps for the left and right images from one channel of interleaved images,
+ *        which is read directly by the census transform
+ * \param I1 left image
+ * \param I2 right image
+ * \param channels number of bytes per pixel, e.g. 3 for BGR or 2 for YUYV
+ * \param channel index of the channel which is matched, e.g. 2 for the red channel of BGR or 0 for the luma of YUYV
+ * \param D1 returned left image disparities, with SGM_INVALID where there is no valid match
+ * \param D2 returned right image disparities
+ * \param dims width, height and bytes per line of the images
+ */
+void sgm::process(
+	uint8_t* I1,
+	uint8_t* I2,
+	int channels,
+	int channel,
+	float* D1,
+	float* D2,
+	const int32_t* dims)
+{
+	allocate(dims[0], dims[1]);
+
+	census_transform(I1, dims[2], channels, channel, census_left);
+	census_transform(I2, dims[2], channels, channel, census_right);
+	matching_costs();
+
+	// the first path sets the aggregated costs, and the others add to them
+	aggregate_horizontal();
+	aggregate_vertical(true);
+	aggregate_vertical(false);
+
+	select_disparities(D1, D2);
+}
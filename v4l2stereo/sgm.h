@@ -0,0 +1,121 @@
+/*
+    sgm
+    Semi-global matching dense stereo
+    For a description of this algorithm see:
+        Heiko Hirschmuller, Stereo Processing by Semiglobal Matching and
+        Mutual Information, IEEE Transactions on Pattern Analysis and
+        Machine Intelligence, 30(2), 2008
+    Copyright (C) 2010 Bob Mottram
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SGM_H_
+#define SGM_H_
+
+#include <omp.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// size of the window used for the census transform, giving one bit per pixel other than the centre
+#define SGM_CENSUS_WIDTH       9
+#define SGM_CENSUS_HEIGHT      7
+#define SGM_CENSUS_BITS        ((SGM_CENSUS_WIDTH*SGM_CENSUS_HEIGHT)-1)
+
+// disparity given to pixels without a valid match, the same as ELAS
+#define SGM_INVALID            -10
+
+// the number of disparities is rounded up to a multiple of this, so that the vector kernels need no remainder
+#define SGM_DISPARITY_BLOCK    16
+
+// path cost used for the disparities either side of the range
+#define SGM_MAX_PATH_COST      0x3fff
+
+// largest penalty, so that the sum of the path costs fits within 16 bits
+#define SGM_MAX_PENALTY        2048
+
+class sgm {
+public:
+
+	// parameter settings
+	struct parameters {
+		int disp_max;          // max disparity
+		int paths;             // number of aggregation paths, 4 or 8
+		int P1;                // penalty for a disparity change of one pixel between neighbours
+		int P2;                // penalty for larger disparity changes between neighbours
+		int uniqueness;        // percentage by which the best cost must be lower than any other non-adjacent cost
+		int lr_threshold;      // disparity threshold for left/right consistency check
+		bool sub_pixel;        // fit a parabola to the costs either side of the best disparity
+
+		parameters () {
+			disp_max     = 63;
+			paths        = 8;
+			P1           = 10;
+			P2           = 120;
+			uniqueness   = 5;
+			lr_threshold = 2;
+			sub_pixel    = true;
+		}
+	};
+
+	// matching function, with the same conventions as Elas::process
+	// inputs: pointers to left (I1) and right (I2) intensity image (uint8, input)
+	//         pointers to left (D1) and right (D2) disparity image (float, output)
+	//         dims[0] = width of I1 and I2
+	//         dims[1] = height of I1 and I2
+	//         dims[2] = bytes per line of I1 and I2
+	//         note: D1 and D2 must be allocated before, with width x height values
+	void process(uint8_t* I1, uint8_t* I2, float* D1, float* D2, const int32_t* dims);
+
+	// as above, but I1 and I2 are interleaved images of which one channel is matched,
+	// e.g. channels=3 and channel=2 for the red channel of BGR, or channels=2 and channel=0
+	// for the luma of YUYV.  dims[2] is their bytes per line.  The channel is read directly
+	// by the census transform, so no intensity images need to be made
+	void process(uint8_t* I1, uint8_t* I2, int channels, int channel, float* D1, float* D2, const int32_t* dims);
+
+	sgm(parameters param);
+	~sgm();
+
+protected:
+
+	parameters param;
+	int width;
+	int height;
+	int no_of_disparities;
+	int disparity_stride;
+	bool use_popcnt;
+	bool use_avx2;
+
+	uint64_t* census_left;
+	uint64_t* census_right;
+	uint8_t* cost;
+	int16_t* aggregated;
+	int16_t* path_rows;
+	int16_t* path_minimum;
+	int16_t* path_start;
+
+	void allocate(int img_width, int img_height);
+	void release();
+
+	void census_transform(uint8_t* img, int bytes_per_line, int channels, int channel, uint64_t* census);
+	void matching_costs();
+	void aggregate_horizontal();
+	void aggregate_vertical(bool downwards);
+	void select_disparities(float* D1, float* D2);
+};
+
+#endif
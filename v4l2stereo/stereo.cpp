@@ -20,6 +20,10 @@
 
 #include "stereo.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* offsets of pixels to be compared within the patch region
  * arranged into a roughly rectangular structure */
 const int pixel_offsets[] = { -2, -4, -1, -4, 1, -4, 2, -4, -5, -2, -4, -2, -3,
@@ -58,6 +62,11 @@ svs::svs(int width, int height) {
   disparity_histogram_plane = new int[(SVS_MAX_IMAGE_WIDTH/SVS_FILTER_SAMPLING)*(SVS_MAX_IMAGE_WIDTH / 2)];
   disparity_plane_fit = new int[SVS_MAX_IMAGE_WIDTH / SVS_FILTER_SAMPLING];
   plane = new int[15*9];
+  plane_histogram = NULL;
+  plane_histogram_fit = NULL;
+
+  /* zero gives a different sequence of plane fitting baselines each time */
+  plane_fit_seed = 0;
 
   calibration_map = NULL;
 
@@ -93,6 +102,15 @@ svs::svs(int width, int height) {
   region_colour = NULL;
   region_disparity = NULL;
   no_of_regions = 0;
+  region_run = NULL;
+  max_region_runs = 0;
+  region_run_parent = NULL;
+  region_run_stats = NULL;
+  region_grid_start = NULL;
+  region_grid_entry = NULL;
+
+  /* log of stereo matches, opened on the first call to log_matches */
+  match_log = NULL;
 
   /* array stores matching probabilities (prob,x,y,disp) */
   svs_matches = NULL;
@@ -127,6 +145,15 @@ svs::~svs() {
     delete[] region_bounding_box;
   if (region_colour != NULL)
     delete[] region_colour;
+  if (region_run != NULL) {
+    delete[] region_run;
+    delete[] region_run_parent;
+    delete[] region_run_stats;
+  }
+  if (region_grid_start != NULL) {
+    delete[] region_grid_start;
+    delete[] region_grid_entry;
+  }
   if (svs_matches != NULL)
     delete[] svs_matches;
   if (valid_quadrants != NULL)
@@ -137,8 +164,14 @@ svs::~svs() {
     delete[] disparity_histogram_plane;
   if (disparity_plane_fit != NULL)
     delete[] disparity_plane_fit;
+  if (plane_histogram != NULL) {
+    delete[] plane_histogram;
+    delete[] plane_histogram_fit;
+  }
   if (calibration_map != NULL)
     delete[] calibration_map;
+  if (match_log != NULL)
+    delete match_log;
 }
 
 /*!
@@ -170,33 +203,81 @@ void svs::histogram_equalise(
   }
 }
 
+/*!
+ * \brief copies one channel of a colour image into a planar 8 bit image, for use with the _mono
+ *        feature detection and segmentation functions.  Channel 2 (red) is the one which the
+ *        BGR versions of those functions use for edges, so it gives the same feature positions
+ *        and regions.  Descriptors of colour images sum all three channels, so the BGR frame
+ *        should also be passed to get_features_vertical_mono
+ * \param bgr colour image
+ * \param gray returned planar image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param channel index of the channel within each pixel
+ */
+void svs::extract_channel(
+		      unsigned char* bgr,
+		      unsigned char* gray,
+		      int img_width,
+		      int img_height,
+		      int channel)
+{
+#pragma omp parallel for
+  for (int y = 0; y < img_height; y++) {
+    unsigned char* src = &bgr[y * img_width * 3];
+    unsigned char* dst = &gray[y * img_width];
+    int x = 0;
+#ifdef __SSE2__
+    /* deinterleave 16 pixels at a time by repeatedly
+       interleaving the low and high halves of the rows */
+    for (; x + 16 <= img_width; x += 16) {
+      __m128i c0 = _mm_loadu_si128((const __m128i*)&src[x * 3]);
+      __m128i c1 = _mm_loadu_si128((const __m128i*)&src[x * 3 + 16]);
+      __m128i c2 = _mm_loadu_si128((const __m128i*)&src[x * 3 + 32]);
+      for (int i = 0; i < 4; i++) {
+        __m128i t0 = _mm_unpacklo_epi8(c0, _mm_unpackhi_epi64(c1, c1));
+        __m128i t1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(c0, c0), c2);
+        __m128i t2 = _mm_unpacklo_epi8(c1, _mm_unpackhi_epi64(c2, c2));
+        c0 = t0;
+        c1 = t1;
+        c2 = t2;
+      }
+      _mm_storeu_si128((__m128i*)&dst[x], channel == 0 ? c0 : (channel == 1 ? c1 : c2));
+    }
+#endif
+    for (; x < img_width; x++)
+      dst[x] = src[x * 3 + channel];
+  }
+}
+
 /* Updates sliding sums and edge response values along a single row or column
  * Returns the mean luminance along the row or column */
 int svs::update_sums(int cols, /* if non-zero we're dealing with columns not rows */
                      int i, /* row or column index */
                      unsigned char* rectified_frame_buf, /* image data */
-                     int segment) { /* if non zero update low contrast areas used for segmentation */
+                     int segment, /* if non zero update low contrast areas used for segmentation */
+                     int bytes_per_pixel) { /* 3 for BGR images, 1 for mono */
 
   int j, k, x, y, idx, max, sum = 0, mean = 0;
 
   if (cols == 0) {
     /* compute sums along the row */
     y = i;
-    idx = imgWidth * y * 3 + 2;
+    idx = imgWidth * y * bytes_per_pixel + bytes_per_pixel - 1;
     max = (int) imgWidth;
 
     row_sum[0] = rectified_frame_buf[idx];
-    for (x = 1; x < max; x++, idx += 3) {
+    for (x = 1; x < max; x++, idx += bytes_per_pixel) {
       sum += rectified_frame_buf[idx];
       row_sum[x] = sum;
     }
 
   } else {
     /* compute sums along the column */
-    idx = i * 3 + 2;
+    idx = i * bytes_per_pixel + bytes_per_pixel - 1;
     x = i;
     max = (int) imgHeight;
-    int stride = (int) imgWidth * 3;
+    int stride = (int) imgWidth * bytes_per_pixel;
 
     row_sum[0] = rectified_frame_buf[idx];
     for (y = 1; y < max; y++, idx += stride) {
@@ -320,39 +401,48 @@ void svs::non_max(int cols, /* if non-zero we're dealing with columns not rows *
 /* creates a binary descriptor for a feature at the given coordinate
    which can subsequently be used for matching */
 int svs::compute_descriptor(int px, int py, unsigned char* rectified_frame_buf,
-			    int no_of_features, int row_mean) {
+			    int no_of_features, int row_mean, int bytes_per_pixel) {
 
   unsigned char bit_count = 0;
   int pixel_offset_idx, ix, bit;
   int meanval = 0;
   unsigned int desc = 0;
+  int patch[SVS_DESCRIPTOR_PIXELS];
+
+  /* find the luminance of each pixel in the patch.  For colour images
+   * this is the sum of the three channels */
+  if (bytes_per_pixel == 3) {
+    for (pixel_offset_idx = 0; pixel_offset_idx < SVS_DESCRIPTOR_PIXELS * 2; pixel_offset_idx
+	   += 2) {
+      ix = pixindex((px + pixel_offsets[pixel_offset_idx]), (py + pixel_offsets[pixel_offset_idx + 1]));
+      patch[pixel_offset_idx / 2] = rectified_frame_buf[ix + 2] + rectified_frame_buf[ix + 1]
+	+ rectified_frame_buf[ix];
+    }
+  }
+  else {
+    for (pixel_offset_idx = 0; pixel_offset_idx < SVS_DESCRIPTOR_PIXELS * 2; pixel_offset_idx
+	   += 2) {
+      ix = (py + pixel_offsets[pixel_offset_idx + 1]) * imgWidth + px + pixel_offsets[pixel_offset_idx];
+      patch[pixel_offset_idx / 2] = rectified_frame_buf[ix];
+    }
+  }
 
   /* find the mean luminance for the patch */
-  for (pixel_offset_idx = 0; pixel_offset_idx < SVS_DESCRIPTOR_PIXELS * 2; pixel_offset_idx
-	 += 2) {
-    ix
-      = rectified_frame_buf[pixindex((px + pixel_offsets[pixel_offset_idx]), (py + pixel_offsets[pixel_offset_idx + 1]))];
-    meanval += rectified_frame_buf[ix + 2] + rectified_frame_buf[ix + 1]
-      + rectified_frame_buf[ix];
-  }
+  for (ix = 0; ix < SVS_DESCRIPTOR_PIXELS; ix++)
+    meanval += patch[ix];
   meanval /= SVS_DESCRIPTOR_PIXELS;
 
   /* binarise */
   bit = 1;
-  for (pixel_offset_idx = 0; pixel_offset_idx < SVS_DESCRIPTOR_PIXELS * 2; pixel_offset_idx
-	 += 2, bit *= 2) {
-
-    ix
-      = rectified_frame_buf[pixindex((px + pixel_offsets[pixel_offset_idx]), (py + pixel_offsets[pixel_offset_idx + 1]))];
-    if (rectified_frame_buf[ix + 2] + rectified_frame_buf[ix + 1]
-	+ rectified_frame_buf[ix] > meanval) {
+  for (ix = 0; ix < SVS_DESCRIPTOR_PIXELS; ix++, bit *= 2) {
+    if (patch[ix] > meanval) {
       desc |= bit;
       bit_count++;
     }
   }
 
   if ((bit_count > 3) && (bit_count < SVS_DESCRIPTOR_PIXELS - 3)) {
-    meanval /= 3;
+    if (bytes_per_pixel == 3) meanval /= 3;
 
     /* adjust the patch luminance relative to the mean
      * luminance for the entire row.  This helps to ensure
@@ -381,10 +471,20 @@ int svs::get_features_vertical(unsigned char* rectified_frame_buf, /* image data
 			       unsigned int minimum_response, /* minimum threshold */
 			       int calibration_offset_x, /* calibration x offset in pixels */
 			       int calibration_offset_y, /* calibration y offset in pixels */
-			       int segment) { /* if non zero update low contrast areas used for segmentation */
+			       int segment, /* if non zero update low contrast areas used for segmentation */
+			       int bytes_per_pixel, /* 3 for BGR images, 1 for mono */
+			       unsigned char* colour_frame_buf) { /* optional BGR image used for descriptors */
 
   unsigned short int no_of_feats;
   int x, y, row_mean, start_x, prev_x, mid_x, grad;
+
+  /* descriptors of colour images are made from the sum of the three channels */
+  unsigned char* descriptor_frame_buf = rectified_frame_buf;
+  int descriptor_bytes_per_pixel = bytes_per_pixel;
+  if (colour_frame_buf != NULL) {
+    descriptor_frame_buf = colour_frame_buf;
+    descriptor_bytes_per_pixel = 3;
+  }
   int no_of_features = 0;
   int row_idx = 0;
 
@@ -402,7 +502,7 @@ int svs::get_features_vertical(unsigned char* rectified_frame_buf, /* image data
 
     if ((y >= 4) && (y <= (int) imgHeight - 4)) {
 
-      row_mean = update_sums(0, y, rectified_frame_buf, segment);
+      row_mean = update_sums(0, y, rectified_frame_buf, segment, bytes_per_pixel);
       non_max(0, inhibition_radius, minimum_response);
 
       /* store the features */
@@ -410,8 +510,8 @@ int svs::get_features_vertical(unsigned char* rectified_frame_buf, /* image data
       for (x = start_x; x > 15; x--) {
 	if (row_peaks[x] > 0) {
 
-	  if (compute_descriptor(x, y, rectified_frame_buf,
-				 no_of_features, row_mean) == 0) {
+	  if (compute_descriptor(x, y, descriptor_frame_buf,
+				 no_of_features, row_mean, descriptor_bytes_per_pixel) == 0) {
 
 	    mid_x = prev_x + ((x - prev_x)/2);
 	    if (x != prev_x) {
@@ -466,7 +566,8 @@ int svs::get_features_horizontal(unsigned char* rectified_frame_buf, /* image da
 				 unsigned int minimum_response, /* minimum threshold */
 				 int calibration_offset_x, /* calibration x offset in pixels */
 				 int calibration_offset_y, /* calibration y offset in pixels */
-				 int segment) { /* if non zero update low contrast areas used for segmentation */
+				 int segment, /* if non zero update low contrast areas used for segmentation */
+				 int bytes_per_pixel) { /* 3 for BGR images, 1 for mono */
   unsigned short int no_of_feats;
   int x, y, start_y;
   int no_of_features = 0;
@@ -493,7 +594,7 @@ int svs::get_features_horizontal(unsigned char* rectified_frame_buf, /* image da
 
     if ((x >= 4) && (x <= (int) imgWidth - 4)) {
 
-      if (update_sums(1, x, rectified_frame_buf, segment)!=9999999) {
+      if (update_sums(1, x, rectified_frame_buf, segment, bytes_per_pixel)!=9999999) {
 	non_max(1, inhibition_radius, minimum_response);
       }
 
@@ -522,6 +623,29 @@ int svs::get_features_horizontal(unsigned char* rectified_frame_buf, /* image da
   return (no_of_features);
 }
 
+/* returns a set of vertically oriented edge features from a planar mono image */
+int svs::get_features_vertical_mono(unsigned char* gray_frame_buf, /* mono image data */
+				    int inhibition_radius, /* radius for non-maximal supression */
+				    unsigned int minimum_response, /* minimum threshold */
+				    int calibration_offset_x, /* calibration x offset in pixels */
+				    int calibration_offset_y, /* calibration y offset in pixels */
+				    int segment, /* if non zero update low contrast areas used for segmentation */
+				    unsigned char* colour_frame_buf) { /* optional BGR image used for descriptors */
+  return (get_features_vertical(gray_frame_buf, inhibition_radius, minimum_response,
+				calibration_offset_x, calibration_offset_y, segment, 1, colour_frame_buf));
+}
+
+/* returns a set of horizontally oriented features from a planar mono image */
+int svs::get_features_horizontal_mono(unsigned char* gray_frame_buf, /* mono image data */
+				      int inhibition_radius, /* radius for non-maximal supression */
+				      unsigned int minimum_response, /* minimum threshold */
+				      int calibration_offset_x, /* calibration x offset in pixels */
+				      int calibration_offset_y, /* calibration y offset in pixels */
+				      int segment) { /* if non zero update low contrast areas used for segmentation */
+  return (get_features_horizontal(gray_frame_buf, inhibition_radius, minimum_response,
+				  calibration_offset_x, calibration_offset_y, segment, 1));
+}
+
 /* Match features from this camera with features from the opposite one.
  * It is assumed that matching is performed on the left camera CPU */
 int svs::match(svs* other, int ideal_no_of_matches, /* ideal number of matches to be returned */
@@ -980,13 +1104,16 @@ void svs::filter_plane(
 		       int no_of_possible_matches, /* the number of stereo matches */
 		       int max_disparity_pixels) /*maximum disparity in pixels */
 {
-  int i, hf, hist_max, w = SVS_FILTER_SAMPLING, w2, n, horizontal = 0;
+  int i, hf, w = SVS_FILTER_SAMPLING, horizontal = 0;
   unsigned int x, y, disp, tx = 0, ty = 0, bx = 0, by = 0;
-  int hist_thresh, hist_mean, hist_mean_hits, mass, disp2;
-  int min_ww, max_ww, m, ww, d;
-  int ww0, ww1, disp0, disp1, cww, dww, ddisp;
+  int ww, disp2;
   no_of_planes = 0;
 
+  /* zone bounds and the line fitted within each zone */
+  unsigned int zone_tx[15], zone_ty[15], zone_bx[15], zone_by[15];
+  int zone_w[15], zone_horizontal[15];
+  int zone_ww0[15], zone_disp0[15], zone_dww[15], zone_ddisp[15];
+
   /* clear quadrants */
   memset(valid_quadrants, 0, no_of_possible_matches * sizeof(unsigned char));
 
@@ -994,8 +1121,9 @@ void svs::filter_plane(
   for (i = no_of_possible_matches-1; i >= 0; i--)
     svs_matches[i * 5 + 4] = 9999;
 
-  /* create disparity histograms within different
-   * zones of the image */
+  /* define the zones of the image within which
+   * disparity histograms are created.  Some zones
+   * inherit bounds from the preceding one */
   for (hf = 0; hf < 15; hf++) {
 
     switch (hf) {
@@ -1141,34 +1269,70 @@ void svs::filter_plane(
 
     }
 
-    /* clear the histogram */
-    w2 = w / SVS_FILTER_SAMPLING;
+    zone_tx[hf] = tx;
+    zone_ty[hf] = ty;
+    zone_bx[hf] = bx;
+    zone_by[hf] = by;
+    zone_w[hf] = w;
+    zone_horizontal[hf] = horizontal;
+  }
+
+  /* each zone has its own histogram, so the line fits
+   * can be computed in parallel */
+  if (plane_histogram == NULL) {
+    plane_histogram = new int[15*SVS_PLANE_HISTOGRAM_SIZE];
+    plane_histogram_fit = new int[15*(SVS_MAX_IMAGE_WIDTH / SVS_FILTER_SAMPLING)];
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int zone = 0; zone < 15; zone++) {
+    int * hist = &plane_histogram[zone*SVS_PLANE_HISTOGRAM_SIZE];
+    int * plane_fit = &plane_histogram_fit[zone*(SVS_MAX_IMAGE_WIDTH / SVS_FILTER_SAMPLING)];
+    unsigned int ztx = zone_tx[zone];
+    unsigned int zty = zone_ty[zone];
+    unsigned int zbx = zone_bx[zone];
+    unsigned int zby = zone_by[zone];
+    int zhorizontal = zone_horizontal[zone];
+    int hist_max, hist_thresh, hist_mean, hist_mean_hits, mass, d, m;
+    int min_ww, max_ww, cww, zw, zn, zdisp2;
+    unsigned int zx, zy, zdisp;
+
+    /* clear the histogram, including any bins beyond
+     * the zone width which matches may fall into */
+    int w2 = zone_w[zone] / SVS_FILTER_SAMPLING;
     if (w2 < 1)
       w2 = 1;
-    memset((void*) disparity_histogram_plane, '\0', w2
-	   * max_disparity_pixels * sizeof(int));
-    memset((void*) disparity_plane_fit, '\0', w2 * sizeof(int));
+    int span = (zhorizontal != 0) ? (int)(zbx - ztx) : (int)(zby - zty);
+    int bins = (span > 0) ? ((span - 1) / SVS_FILTER_SAMPLING) + 1 : 0;
+    if (bins < w2)
+      bins = w2;
+    if ((max_disparity_pixels > 0) &&
+	(bins * max_disparity_pixels > SVS_PLANE_HISTOGRAM_SIZE))
+      bins = SVS_PLANE_HISTOGRAM_SIZE / max_disparity_pixels;
+    memset((void*) hist, '\0', bins * max_disparity_pixels * sizeof(int));
+    memset((void*) plane_fit, '\0', w2 * sizeof(int));
     hist_max = 0;
 
     /* update the disparity histogram */
-    n = 0;
-    for (i = no_of_possible_matches-1; i >= 0; i--) {
-      x = svs_matches[i * 5 + 1]/SVS_SUB_PIXEL;
-      if ((x > tx) && (x < bx)) {
-	y = svs_matches[i * 5 + 2];
-	if ((y > ty) && (y < by)) {
-	  disp = svs_matches[i * 5 + 3]/SVS_SUB_PIXEL;
-	  if ((int) disp < max_disparity_pixels) {
-	    if (horizontal != 0) {
-	      n = (((x - tx) / SVS_FILTER_SAMPLING)
-		   * max_disparity_pixels) + disp;
+    for (int j = no_of_possible_matches-1; j >= 0; j--) {
+      zx = svs_matches[j * 5 + 1]/SVS_SUB_PIXEL;
+      if ((zx > ztx) && (zx < zbx)) {
+	zy = svs_matches[j * 5 + 2];
+	if ((zy > zty) && (zy < zby)) {
+	  zdisp = svs_matches[j * 5 + 3]/SVS_SUB_PIXEL;
+	  if ((int) zdisp < max_disparity_pixels) {
+	    if (zhorizontal != 0) {
+	      zn = (((zx - ztx) / SVS_FILTER_SAMPLING)
+		    * max_disparity_pixels) + zdisp;
 	    } else {
-	      n = (((y - ty) / SVS_FILTER_SAMPLING)
-		   * max_disparity_pixels) + disp;
+	      zn = (((zy - zty) / SVS_FILTER_SAMPLING)
+		    * max_disparity_pixels) + zdisp;
+	    }
+	    if (zn < bins * max_disparity_pixels) {
+	      hist[zn]++;
+	      if (hist[zn] > hist_max)
+		hist_max = hist[zn];
 	    }
-	    disparity_histogram_plane[n]++;
-	    if (disparity_histogram_plane[n] > hist_max)
-	      hist_max = disparity_histogram_plane[n];
 	  }
 	}
       }
@@ -1178,56 +1342,50 @@ void svs::filter_plane(
     hist_thresh = hist_max / 4;
     hist_mean = 0;
     hist_mean_hits = 0;
-    disp2 = 0;
     min_ww = w2;
     max_ww = 0;
-    for (ww = 0; ww < (int) w2; ww++) {
+    for (zw = 0; zw < w2; zw++) {
       mass = 0;
-      disp2 = 0;
+      zdisp2 = 0;
       for (d = 1; d < max_disparity_pixels - 1; d++) {
-	n = ww * max_disparity_pixels + d;
-	if (disparity_histogram_plane[n] > hist_thresh) {
-	  m = disparity_histogram_plane[n]
-	    + disparity_histogram_plane[n - 1]
-	    + disparity_histogram_plane[n + 1];
+	zn = zw * max_disparity_pixels + d;
+	if (hist[zn] > hist_thresh) {
+	  m = hist[zn] + hist[zn - 1] + hist[zn + 1];
 	  mass += m;
-	  disp2 += m * d;
+	  zdisp2 += m * d;
 	}
-	if (disparity_histogram_plane[n] > 0) {
-	  hist_mean += disparity_histogram_plane[n];
+	if (hist[zn] > 0) {
+	  hist_mean += hist[zn];
 	  hist_mean_hits++;
 	}
       }
       if (mass > 0) {
 	// peak disparity at this position
-	disparity_plane_fit[ww] = disp2 / mass;
-	if (min_ww == (int) w2)
-	  min_ww = ww;
-	if (ww > max_ww)
-	  max_ww = ww;
+	plane_fit[zw] = zdisp2 / mass;
+	if (min_ww == w2)
+	  min_ww = zw;
+	if (zw > max_ww)
+	  max_ww = zw;
       }
     }
     if (hist_mean_hits > 0)
       hist_mean /= hist_mean_hits;
 
     /* fit a line to the disparity values */
-    ww0 = 0;
-    ww1 = 0;
-    disp0 = 0;
-    disp1 = 0;
-    int hits0,hits1;
+    int ww0 = 0, ww1 = 0, disp0 = 0, disp1 = 0;
+    int hits0, hits1;
     if (max_ww >= min_ww) {
       cww = min_ww + ((max_ww - min_ww) / 2);
       hits0 = 0;
       hits1 = 0;
-      for (ww = min_ww; ww <= max_ww; ww++) {
-	if (ww < cww) {
-	  disp0 += disparity_plane_fit[ww];
-	  ww0 += ww;
+      for (zw = min_ww; zw <= max_ww; zw++) {
+	if (zw < cww) {
+	  disp0 += plane_fit[zw];
+	  ww0 += zw;
 	  hits0++;
 	} else {
-	  disp1 += disparity_plane_fit[ww];
-	  ww1 += ww;
+	  disp1 += plane_fit[zw];
+	  ww1 += zw;
 	  hits1++;
 	}
       }
@@ -1240,10 +1398,25 @@ void svs::filter_plane(
 	ww1 /= hits1;
       }
     }
-    dww = ww1 - ww0;
-    ddisp = disp1 - disp0;
+    zone_ww0[zone] = ww0;
+    zone_disp0[zone] = disp0;
+    zone_dww[zone] = ww1 - ww0;
+    zone_ddisp[zone] = disp1 - disp0;
+  }
+
+  /* find inliers.  Zones are visited in order, since
+   * each match is assigned to the first plane it fits */
+  for (hf = 0; hf < 15; hf++) {
+    tx = zone_tx[hf];
+    ty = zone_ty[hf];
+    bx = zone_bx[hf];
+    by = zone_by[hf];
+    horizontal = zone_horizontal[hf];
+    int ww0 = zone_ww0[hf];
+    int disp0 = zone_disp0[hf];
+    int dww = zone_dww[hf];
+    int ddisp = zone_ddisp[hf];
 
-    /* find inliers */
     int plane_tx = imgWidth;
     int plane_ty = 0;
     int plane_bx = imgHeight;
@@ -1261,10 +1434,8 @@ void svs::filter_plane(
 
 	    if (horizontal != 0) {
 	      ww = (x - tx) / SVS_FILTER_SAMPLING;
-	      n = ww * max_disparity_pixels + disp;
 	    } else {
 	      ww = (y - ty) / SVS_FILTER_SAMPLING;
-	      n = ww * max_disparity_pixels + disp;
 	    }
 
 	    if (dww > 0) {
@@ -1581,62 +1752,17 @@ void svs::make_map_int(long centre_of_distortion_x, /* centre of distortion x co
   }
 }
 
-/* saves stereo matches to file for use by other programs */
+/* saves stereo matches to file for use by other programs.
+   The file is a match log (see matchlog.h) containing a single frame */
 void svs::save_matches(std::string filename, /* filename to save as */
 		       unsigned char* rectified_frame_buf, /* left image data */
 		       int no_of_matches, /* number of stereo matches */
 		       bool colour) { /* whether to additionally save colour of each match */
 
-  FILE *file = fopen(filename.c_str(), "wb");
-  if (file != NULL) {
-
-    if (!colour) {
-
-      struct MatchData {
-	unsigned short int probability;
-	unsigned short int x;
-	unsigned short int y;
-	unsigned short int disparity;
-      };
-
-      MatchData *m = new MatchData[no_of_matches];
-      for (int i = 0; i < no_of_matches; i++) {
-	m[i].probability = (unsigned short int)svs_matches[i * 5];
-	m[i].x = (unsigned short int)svs_matches[i * 5 + 1];
-	m[i].y = (unsigned short int)svs_matches[i * 5 + 2];
-	m[i].disparity = (unsigned short int)svs_matches[i * 5 + 3];
-      }
-
-      fwrite(m, sizeof(MatchData), no_of_matches, file);
-      delete[] m;
-    } else {
-      struct MatchDataColour {
-	unsigned short int probability;
-	unsigned short int x;
-	unsigned short int y;
-	unsigned short int disparity;
-	unsigned char r, g, b;
-	unsigned char pack;
-      };
-
-      int n;
-      MatchDataColour *m = new MatchDataColour[no_of_matches];
-      for (int i = 0; i < no_of_matches; i++) {
-	m[i].probability = (unsigned short int)svs_matches[i * 5];
-	m[i].x = (unsigned short int)svs_matches[i * 5 + 1];
-	m[i].y = (unsigned short int)svs_matches[i * 5 + 2];
-	m[i].disparity = (unsigned short int)svs_matches[i * 5 + 3];
-	n = ((m[i].y * imgWidth) + m[i].x) * 3;
-	m[i].r = rectified_frame_buf[n + 2];
-	m[i].g = rectified_frame_buf[n + 1];
-	m[i].b = rectified_frame_buf[n];
-      }
-
-      fwrite(m, sizeof(MatchDataColour), no_of_matches, file);
-      delete[] m;
-    }
-
-    fclose(file);
+  matchlogwriter log;
+  if (log.open(filename, imgWidth, imgHeight, SVS_SUB_PIXEL, colour, false)) {
+    log.write_frame(svs_matches, no_of_matches, rectified_frame_buf);
+    log.close();
   }
 }
 
@@ -1656,199 +1782,189 @@ bool svs::FileExists(
   return(flag);
 }
 
-/* logs stereo matches to file for use by other programs */
+/* logs stereo matches to file for use by other programs.
+   Each call appends a frame to the log, which is written to disk
+   by a background thread.  Returns false if the frame wasn't logged */
 bool svs::log_matches(std::string filename, /* filename to save as */
 		      unsigned char* rectified_frame_buf, /* left image data */
 		      int no_of_matches, /* number of stereo matches */
 		      bool colour) { /* whether to additionally save colour of each match */
 
-  bool logged = false;
-
-  if (!FileExists(filename)) {
-    FILE *file = fopen(filename.c_str(), "wb");
-    if (file != NULL) {
-
-      if (!colour) {
-
-	struct MatchData {
-	  unsigned short int probability;
-	  unsigned short int x;
-	  unsigned short int y;
-	  unsigned short int disparity;
-	};
-
-	MatchData *m = new MatchData[no_of_matches];
-	for (int i = 0; i < no_of_matches; i++) {
-	  m[i].probability = (unsigned short int)svs_matches[i * 5];
-	  m[i].x = (unsigned short int)svs_matches[i * 5 + 1];
-	  m[i].y = (unsigned short int)svs_matches[i * 5 + 2];
-	  m[i].disparity = (unsigned short int)svs_matches[i * 5 + 3];
-	}
-
-	fwrite(m, sizeof(MatchData), no_of_matches, file);
-	delete[] m;
-      } else {
-	struct MatchDataColour {
-	  unsigned short int probability;
-	  unsigned short int x;
-	  unsigned short int y;
-	  unsigned short int disparity;
-	  unsigned char r, g, b;
-	  unsigned char pack;
-	};
-
-	int n;
-	MatchDataColour *m = new MatchDataColour[no_of_matches];
-	for (int i = 0; i < no_of_matches; i++) {
-	  m[i].probability = (unsigned short int)svs_matches[i * 5];
-	  m[i].x = (unsigned short int)svs_matches[i * 5 + 1];
-	  m[i].y = (unsigned short int)svs_matches[i * 5 + 2];
-	  m[i].disparity = (unsigned short int)svs_matches[i * 5 + 3];
-	  n = ((m[i].y * imgWidth) + m[i].x) * 3;
-	  m[i].r = rectified_frame_buf[n + 2];
-	  m[i].g = rectified_frame_buf[n + 1];
-	  m[i].b = rectified_frame_buf[n];
-	}
-
-	fwrite(m, sizeof(MatchDataColour), no_of_matches, file);
-	delete[] m;
-      }
-
-      fclose(file);
-      logged = true;
-    }
+  if (match_log == NULL) {
+    match_log = new matchlogwriter();
+    if (!match_log->open(filename, imgWidth, imgHeight, SVS_SUB_PIXEL, colour, true))
+      printf("Unable to open match log %s\n", filename.c_str());
   }
-  return(logged);
+  return (match_log->write_frame(svs_matches, no_of_matches, rectified_frame_buf));
 }
 
+/* hash used to pick the baseline for a given plane fitting sample,
+   so that each sample can be generated independently of the others */
+static inline unsigned int plane_fit_random(unsigned int seed, unsigned int sample) {
+  unsigned int v = seed ^ (sample * 0x9E3779B9u);
+  v ^= v >> 16;
+  v *= 0x7FEB352Du;
+  v ^= v >> 15;
+  v *= 0x846CA68Bu;
+  v ^= v >> 16;
+  return (v);
+}
 
-/* experimental plane fitting */
+/* experimental plane fitting.
+   Baselines are tested in batches, with the hypotheses in each
+   batch scored in parallel.  Fitting stops early once enough
+   samples have been tried to find an all inlier baseline with
+   SVS_PLANE_FIT_CONFIDENCE probability */
 int svs::fit_plane(int no_of_matches, int max_deviation, int no_of_samples) {
-  /*
-  int x_x0 = 0, x_y0 = 0, x_x1 = 0, x_y1 = 0;
-  int y_x0 = 0, y_y0 = 0, y_x1 = 0, y_y1 = 0;
-  */
   int max_hits = 0;
-  int idx0, idx1, xx0, yy0, xx1, yy1, dx, dy, abs_dx, abs_dy, hits;
-  int grad_x, grad_y, index0, index1, sample, horizontal, deviation_sum;
-  int best_index0, min_deviation, min_deviation_hits = 0,
-    edge_sample;
-  int axis, edge_x, edge_y, deviation, predicted_edge_x, predicted_edge_y;
+  int batch, batch_size, b, axis;
+  int best_index0, best_hits, min_deviation, min_deviation_hits;
+  int batch_hits[SVS_PLANE_FIT_BATCH];
+  int batch_deviation[SVS_PLANE_FIT_BATCH];
+  int batch_index0[SVS_PLANE_FIT_BATCH];
+
+  /* a seed of zero gives a different sequence of baselines on each call */
+  unsigned int seed = plane_fit_seed;
+  if (seed == 0) seed = (unsigned int)rand();
+
+  /* number of edges tested against each baseline */
+  int edges_tested = (no_of_matches + 1) / 2;
 
   if (no_of_matches > 40) {
     /* fit to x and y axes */
     for (axis = 0; axis < 2; axis++) {
       min_deviation = 999999;
+      min_deviation_hits = 0;
       best_index0 = -1;
+      best_hits = 0;
+      int required_samples = no_of_samples;
 
       /* try a number of baselines */
-      for (sample = 0; sample < no_of_samples; sample++) {
-	// pick the baseline
-	index0 = rand() % no_of_matches;
-	index1 = rand() % no_of_matches;
-	if (index0 != index1) {
+      for (batch = 0; batch < required_samples; batch += SVS_PLANE_FIT_BATCH) {
+	batch_size = required_samples - batch;
+	if (batch_size > SVS_PLANE_FIT_BATCH) batch_size = SVS_PLANE_FIT_BATCH;
+
+#pragma omp parallel for
+	for (b = 0; b < batch_size; b++) {
+	  int idx0, idx1, xx0, yy0, xx1, yy1, dx, dy, abs_dx, abs_dy, hits;
+	  int grad_x, grad_y, index0, index1, horizontal, deviation_sum;
+	  int edge_sample, edge_x, edge_y, deviation;
+	  unsigned int s = (unsigned int)(((axis * no_of_samples) + batch + b) * 2);
+
+	  // pick the baseline
+	  index0 = (int)(plane_fit_random(seed, s) % (unsigned int)no_of_matches);
+	  index1 = (int)(plane_fit_random(seed, s + 1) % (unsigned int)no_of_matches);
 	  hits = 0;
 	  deviation_sum = 0;
-	  idx0 = index0 * 5;
-	  idx1 = index1 * 5;
-	  if (axis == 0) {
-	    /* oriented along the x axis */
-	    xx0 = svs_matches[idx0 + 1]/SVS_SUB_PIXEL;
-	    xx1 = svs_matches[idx1 + 1]/SVS_SUB_PIXEL;
-	  } else {
-	    /* oriented along the y axis */
-	    xx0 = svs_matches[idx0 + 2];
-	    xx1 = svs_matches[idx1 + 2];
-	  }
-	  yy0 = svs_matches[idx0 + 3];
-	  yy1 = svs_matches[idx1 + 3];
-	  dx = xx1 - xx0;
-	  dy = yy1 - yy0;
-	  if (dx >= 0)
-	    abs_dx = dx;
-	  else
-	    abs_dx = -dx;
-	  if (dy >= 0)
-	    abs_dy = dy;
-	  else
-	    abs_dy = -dy;
-
-	  // is the baseline horizontally oriented ?
-	  horizontal = 1;
-	  if (abs_dy > abs_dx) {
-	    horizontal = 0;
-	    grad_x = dx;
-	    grad_y = dy;
-	  } else {
-	    grad_x = dy;
-	    grad_y = dx;
-	  }
+	  if (index0 != index1) {
+	    idx0 = index0 * 5;
+	    idx1 = index1 * 5;
+	    if (axis == 0) {
+	      /* oriented along the x axis */
+	      xx0 = svs_matches[idx0 + 1]/SVS_SUB_PIXEL;
+	      xx1 = svs_matches[idx1 + 1]/SVS_SUB_PIXEL;
+	    } else {
+	      /* oriented along the y axis */
+	      xx0 = svs_matches[idx0 + 2];
+	      xx1 = svs_matches[idx1 + 2];
+	    }
+	    yy0 = svs_matches[idx0 + 3];
+	    yy1 = svs_matches[idx1 + 3];
+	    dx = xx1 - xx0;
+	    dy = yy1 - yy0;
+	    if (dx >= 0)
+	      abs_dx = dx;
+	    else
+	      abs_dx = -dx;
+	    if (dy >= 0)
+	      abs_dy = dy;
+	    else
+	      abs_dy = -dy;
+
+	    // is the baseline horizontally oriented ?
+	    horizontal = 1;
+	    if (abs_dy > abs_dx) {
+	      horizontal = 0;
+	      grad_x = dx;
+	      grad_y = dy;
+	    } else {
+	      grad_x = dy;
+	      grad_y = dx;
+	    }
 
-	  if (grad_y != 0) {
-	    for (edge_sample = 0; edge_sample < no_of_matches; edge_sample
-		   += 2) {
-	      edge_x = svs_matches[edge_sample * 5 + 1]/SVS_SUB_PIXEL;
-	      edge_y = svs_matches[edge_sample * 5 + 2];
-	      deviation = 0;
-
-	      if (horizontal == 1) {
-		predicted_edge_y = yy0 + ((edge_x - xx0)
-					  * grad_x / grad_y);
-		deviation = predicted_edge_y - edge_y;
-	      } else {
-		predicted_edge_x = xx0 + ((edge_y - yy0)
-					  * grad_x / grad_y);
-		deviation = predicted_edge_x - edge_x;
-	      }
+	    if (grad_y != 0) {
+	      for (edge_sample = 0; edge_sample < no_of_matches; edge_sample
+		     += 2) {
+		edge_x = svs_matches[edge_sample * 5 + 1]/SVS_SUB_PIXEL;
+		edge_y = svs_matches[edge_sample * 5 + 2];
 
-	      if ((deviation > -max_deviation) && (deviation
-						   < max_deviation)) {
-		hits++;
-		if (deviation < 0)
-		  deviation = -deviation;
-		deviation_sum += deviation;
+		if (horizontal == 1) {
+		  deviation = yy0 + ((edge_x - xx0) * grad_x / grad_y) - edge_y;
+		} else {
+		  deviation = xx0 + ((edge_y - yy0) * grad_x / grad_y) - edge_x;
+		}
+
+		if ((deviation > -max_deviation) && (deviation
+						     < max_deviation)) {
+		  hits++;
+		  if (deviation < 0)
+		    deviation = -deviation;
+		  deviation_sum += deviation;
+		}
 	      }
 	    }
+	  }
+	  batch_hits[b] = hits;
+	  batch_deviation[b] = deviation_sum;
+	  batch_index0[b] = index0;
+	}
 
-	    if (hits > 0) {
-	      // pick the line with the maximum number of edges within the max deviation range
-	      if (hits > max_hits) {
-		best_index0 = index0;
-		max_hits = hits;
-		min_deviation = deviation_sum;
-	      } else {
-		// if there is a tie choose the result with the lowest deviation
-		if (hits == max_hits) {
-		  if (deviation_sum < min_deviation) {
-		    best_index0 = index0;
-		    min_deviation = deviation_sum;
-		    min_deviation_hits = hits;
-		  }
-		}
+	/* pick the best baseline in sample order, so that the
+	 * result does not depend upon the number of threads */
+	for (b = 0; b < batch_size; b++) {
+	  if (batch_hits[b] > 0) {
+	    // pick the line with the maximum number of edges within the max deviation range
+	    if (batch_hits[b] > best_hits) {
+	      best_index0 = batch_index0[b];
+	      best_hits = batch_hits[b];
+	      min_deviation = batch_deviation[b];
+	      min_deviation_hits = batch_hits[b];
+	    } else {
+	      // if there is a tie choose the result with the lowest deviation
+	      if ((batch_hits[b] == best_hits) &&
+		  (batch_deviation[b] < min_deviation)) {
+		best_index0 = batch_index0[b];
+		min_deviation = batch_deviation[b];
+		min_deviation_hits = batch_hits[b];
 	      }
 	    }
 	  }
 	}
+
+	/* update the number of samples needed to be confident
+	 * of having tried a baseline made of two inliers */
+	if (best_hits > 0) {
+	  double inlier_ratio = best_hits / (double)edges_tested;
+	  if (inlier_ratio >= 1.0) {
+	    required_samples = 0;
+	  }
+	  else {
+	    double n = log(1.0 - SVS_PLANE_FIT_CONFIDENCE) /
+	      log(1.0 - (inlier_ratio * inlier_ratio));
+	    if (n < (double)required_samples)
+	      required_samples = (int)ceil(n);
+	  }
+	}
       }
 
+      if (best_hits > max_hits)
+	max_hits = best_hits;
+
       if (min_deviation_hits > 3) {
 
 	min_deviation /= min_deviation_hits;
 
 	if (best_index0 > -1) {
-	  /*
-	  if (axis == 0) {
-	    x_x0 = svs_matches[best_index0 + 1];
-	    x_y0 = svs_matches[best_index0 + 3];
-	    x_x1 = svs_matches[best_index1 + 1];
-	    x_y1 = svs_matches[best_index1 + 3];
-	  } else {
-	    y_x0 = svs_matches[best_index0 + 2];
-	    y_y0 = svs_matches[best_index0 + 3];
-	    y_x1 = svs_matches[best_index1 + 2];
-	    y_y1 = svs_matches[best_index1 + 3];
-	  }
-	  */
 	  printf("min deviation %d\n", min_deviation);
 	} else {
 	  break;
@@ -1873,133 +1989,225 @@ void svs::flip(unsigned char* raw_image, unsigned char* flipped_frame_buf) {
   memcpy(raw_image, flipped_frame_buf, max * sizeof(unsigned char));
 }
 
-void svs::segment(unsigned char* rectified_frame_buf, int no_of_matches) {
+/* returns the root run of the region which the given run belongs to */
+static inline int region_root(int* parent, int run) {
+  int root = run;
+  while (parent[root] != root)
+    root = parent[root];
+  /* path compression */
+  while (parent[run] != root) {
+    int next = parent[run];
+    parent[run] = root;
+    run = next;
+  }
+  return (root);
+}
+
+/* merges the regions containing the two given runs.  The root is always
+   the earliest run, so that region IDs follow the order of appearance */
+static inline void region_union(int* parent, unsigned int* stats, int run0, int run1) {
+  int root0 = region_root(parent, run0);
+  int root1 = region_root(parent, run1);
+  if (root0 == root1) return;
+  if (root1 < root0) {
+    int temp = root0;
+    root0 = root1;
+    root1 = temp;
+  }
+  parent[root1] = root0;
+
+  /* combine the statistics of the two regions */
+  unsigned int* s0 = &stats[root0 * SVS_RUN_STATS];
+  unsigned int* s1 = &stats[root1 * SVS_RUN_STATS];
+  for (int i = 0; i < 7; i++)
+    s0[i] += s1[i];
+  if (s1[7] < s0[7]) s0[7] = s1[7];
+  if (s1[8] < s0[8]) s0[8] = s1[8];
+  if (s1[9] > s0[9]) s0[9] = s1[9];
+  if (s1[10] > s0[10]) s0[10] = s1[10];
+}
+
+/* Segments low contrast areas of the image into regions.
+   Runs of low contrast pixels along sampled rows are labelled using
+   union-find, where runs on consecutive sampled rows which overlap belong
+   to the same region.  Region statistics are accumulated during labelling.
+   For mono images (bytes_per_pixel = 1) the region colour is grey */
+void svs::segment(unsigned char* rectified_frame_buf, int no_of_matches, int bytes_per_pixel) {
   int x, y, n2, n, n3, ctr = 0, max_x, max_y, i, j;
-  int stride = imgWidth * SVS_VERTICAL_SAMPLING;
-  unsigned short ID = 0, next_ID = 0, v;
+  unsigned short ID = 0, next_ID = 0;
   int min_length = (int) imgWidth / 50;
-  unsigned short curr_ID[50];
-  unsigned short curr_ID_hits[50];
-  int dx, dy, min_dist, min_vol, prev_region_history_index, curr_ID_index = 0;
-  int r, g, b, tx, ty, bx, by, cx, cy, disp, best_disp, max_hits = 0;
+  int min_vol;
+  int tx, ty, bx, by, cx, cy, disp, best_disp, max_hits = 0;
   int above, below, left, right, vol;
-  int above_hits, below_hits, left_hits, right_hits, state;
+  int above_hits, below_hits, left_hits, right_hits;
+  int no_of_runs, prev_row_start, prev_row_end, prev_run, run, start;
+  int border = 2;
+  unsigned int region_pixels[SVS_MAX_REGIONS];
   no_of_regions = 0;
   if (enable_segmentation) {
     next_ID = 1;
     max_x = (int) imgWidth - 4;
     max_y = (int) imgHeight - (SVS_VERTICAL_SAMPLING * 5);
+
+    if (region_run == NULL) {
+      /* runs are longer than min_length and separated by at least one pixel */
+      max_region_runs = ((imgHeight / SVS_VERTICAL_SAMPLING) + 1) *
+	((imgWidth / (min_length + 2)) + 1);
+      region_run = new int[max_region_runs * 3];
+      region_run_parent = new int[max_region_runs];
+      region_run_stats = new unsigned int[max_region_runs * SVS_RUN_STATS];
+    }
+
+    /* first pass: find runs of low contrast pixels, merging each
+     * with any runs which it overlaps on the previous sampled row */
+    no_of_runs = 0;
+    prev_row_start = 0;
+    prev_row_end = 0;
     for (y = 4; y < max_y; y += SVS_VERTICAL_SAMPLING) {
+      prev_run = prev_row_start;
       n = y * imgWidth + 4;
-      state = 0;
-      for (x = 4; x < max_x; x++, n++, ctr++) {
-	v = low_contrast[n];
-	if (v != 0) {
-	  if (state == 0) {
-	    if (low_contrast[n - 1] == 0) {
-	      ctr = 0;
-	      curr_ID_index = 0;
-	      state = 1;
-	    }
-	  } else {
-	    if (v != 65535) {
-	      for (i = 0; i < curr_ID_index; i++) {
-		if (curr_ID[i] == v) {
-		  curr_ID_hits[i]++;
-		  break;
-		}
-	      }
-	      if (i == curr_ID_index) {
-		curr_ID[curr_ID_index] = v;
-		curr_ID_hits[curr_ID_index] = 1;
-		curr_ID_index++;
-		if (curr_ID_index > 49)
-		  curr_ID_index = 49;
-	      }
+      start = -1;
+      for (x = 4; x < max_x; x++, n++) {
+	if (low_contrast[n] == 0) continue;
+	if (start < 0) {
+	  if (low_contrast[n - 1] == 0) start = x;
+	  continue;
+	}
+	if (low_contrast[n + 1] != 0) continue;
+
+	/* end of a run */
+	ctr = x - start;
+	if ((ctr > min_length) && (no_of_runs < max_region_runs)) {
+	  run = no_of_runs++;
+	  region_run[run * 3] = y;
+	  region_run[run * 3 + 1] = start;
+	  region_run[run * 3 + 2] = x;
+	  region_run_parent[run] = run;
+
+	  /* statistics for the interior of the run */
+	  unsigned int* stats = &region_run_stats[run * SVS_RUN_STATS];
+	  int r = 0, g = 0, b = 0, pixels = 0;
+	  cx = 0;
+	  n3 = (y * imgWidth + start + border + 1) * bytes_per_pixel;
+	  if (bytes_per_pixel == 3) {
+	    for (i = start + border + 1; i < x - border; i++, pixels++) {
+	      cx += i;
+	      b += rectified_frame_buf[n3++];
+	      g += rectified_frame_buf[n3++];
+	      r += rectified_frame_buf[n3++];
 	    }
-	    if (low_contrast[n + 1] == 0) {
-	      if (ctr > min_length) {
-		if (curr_ID_index == 0) {
-		  ID = next_ID;
-		  region_volume[ID] = 0;
-		  region_centre[ID * 2] = 0;
-		  region_centre[ID * 2 + 1] = 0;
-		  region_bounding_box[ID * 4] = imgWidth;
-		  region_bounding_box[ID * 4 + 1] = imgHeight;
-		  region_bounding_box[ID * 4 + 2] = 0;
-		  region_bounding_box[ID * 4 + 3] = 0;
-		  region_colour[ID * 3] = 0;
-		  region_colour[ID * 3 + 1] = 0;
-		  region_colour[ID * 3 + 2] = 0;
-		  if (next_ID < SVS_MAX_REGIONS - 1)
-		    next_ID++;
-		} else {
-		  max_hits = -1;
-		  for (i = 0; i < curr_ID_index; i++) {
-		    if (curr_ID_hits[i] > max_hits) {
-		      max_hits = curr_ID_hits[i];
-		      ID = curr_ID[i];
-		    }
-		  }
-		}
-
-		/* update volume and bounding box */
-		region_volume[ID] += (unsigned short) ctr;
-		n2 = ID * 4;
-		if (x - ctr < region_bounding_box[n2])
-		  region_bounding_box[n2]
-		    = (unsigned short) x - ctr;
-		if (y < region_bounding_box[n2 + 1])
-		  region_bounding_box[n2 + 1]
-		    = (unsigned short) y;
-		if (x > region_bounding_box[n2 + 2])
-		  region_bounding_box[n2 + 2]
-		    = (unsigned short) x;
-		if (y > region_bounding_box[n2 + 3])
-		  region_bounding_box[n2 + 3]
-		    = (unsigned short) y;
-
-		r = 0;
-		g = 0;
-		b = 0;
-		cx = 0;
-		cy = 0;
-		int bord = 0, border = 2;
-		for (n2 = n - ctr; n2 <= n; n2++, bord++) {
-		  if ((bord > border)
-		      && (bord < ctr - border)) {
-		    low_contrast[n2] = ID;
-		    cx += x + n2 - n;
-		    cy += y;
-		    n3 = n2 * 3;
-		    b += rectified_frame_buf[n3++];
-		    g += rectified_frame_buf[n3++];
-		    r += rectified_frame_buf[n3++];
-		    if (low_contrast[n2 + stride] == 65535) {
-		      low_contrast[n2 + stride] = ID;
-		    }
-		  } else {
-		    low_contrast[n2] = 0;
-		  }
-
-		}
-		region_centre[ID * 2] += cx;
-		region_centre[ID * 2 + 1] += cy;
-		region_colour[ID * 3] += b;
-		region_colour[ID * 3 + 1] += g;
-		region_colour[ID * 3 + 2] += r;
-	      } else {
-		for (n2 = n - ctr; n2 <= n; n2++) {
-		  low_contrast[n2] = 0;
-		}
-	      }
-	      state = 0;
+	  }
+	  else {
+	    for (i = start + border + 1; i < x - border; i++, pixels++) {
+	      cx += i;
+	      b += rectified_frame_buf[n3++];
 	    }
+	    g = b;
+	    r = b;
+	  }
+	  stats[0] = ctr;
+	  stats[1] = cx;
+	  stats[2] = pixels * y;
+	  stats[3] = pixels;
+	  stats[4] = b;
+	  stats[5] = g;
+	  stats[6] = r;
+	  stats[7] = start;
+	  stats[8] = y;
+	  stats[9] = x;
+	  stats[10] = y;
+
+	  /* skip runs on the previous row which end before this one */
+	  while ((prev_run < prev_row_end) &&
+		 (region_run[prev_run * 3 + 2] - border - 1 < start + 1))
+	    prev_run++;
+
+	  /* merge with runs on the previous row whose interior
+	   * overlaps this run */
+	  for (j = prev_run; j < prev_row_end; j++) {
+	    if (region_run[j * 3 + 1] + border + 1 > x) break;
+	    region_union(region_run_parent, region_run_stats, j, run);
 	  }
 	}
+	else {
+	  /* too short to be a region */
+	  for (n2 = n - ctr; n2 <= n; n2++)
+	    low_contrast[n2] = 0;
+	}
+	start = -1;
+      }
+      prev_row_start = prev_row_end;
+      prev_row_end = no_of_runs;
+    }
+
+    /* second pass: give each region an ID in order of appearance.
+     * Runs always point to an earlier run, so a single sweep is enough
+     * to replace each parent with the ID of the region */
+    int last_region_used = 0;
+    region_volume[0] = 0;
+    for (run = 0; run < no_of_runs; run++) {
+      if (region_run_parent[run] != run) {
+	region_run_parent[run] = region_run_parent[region_run_parent[run]];
+	continue;
+      }
 
+      ID = next_ID;
+      if (next_ID < SVS_MAX_REGIONS - 1)
+	next_ID++;
+
+      if ((ID < SVS_MAX_REGIONS - 1) || (last_region_used == 0)) {
+	region_volume[ID] = 0;
+	region_pixels[ID] = 0;
+	region_centre[ID * 2] = 0;
+	region_centre[ID * 2 + 1] = 0;
+	region_bounding_box[ID * 4] = imgWidth;
+	region_bounding_box[ID * 4 + 1] = imgHeight;
+	region_bounding_box[ID * 4 + 2] = 0;
+	region_bounding_box[ID * 4 + 3] = 0;
+	region_colour[ID * 3] = 0;
+	region_colour[ID * 3 + 1] = 0;
+	region_colour[ID * 3 + 2] = 0;
+	if (ID == SVS_MAX_REGIONS - 1)
+	  last_region_used = 1;
       }
+
+      /* when out of IDs remaining regions are added to the last one */
+      unsigned int* s = &region_run_stats[run * SVS_RUN_STATS];
+      region_volume[ID] += s[0];
+      region_centre[ID * 2] += s[1];
+      region_centre[ID * 2 + 1] += s[2];
+      region_pixels[ID] += s[3];
+      region_colour[ID * 3] += s[4];
+      region_colour[ID * 3 + 1] += s[5];
+      region_colour[ID * 3 + 2] += s[6];
+      n2 = ID * 4;
+      if (s[7] < region_bounding_box[n2])
+	region_bounding_box[n2] = (unsigned short) s[7];
+      if (s[8] < region_bounding_box[n2 + 1])
+	region_bounding_box[n2 + 1] = (unsigned short) s[8];
+      if (s[9] > region_bounding_box[n2 + 2])
+	region_bounding_box[n2 + 2] = (unsigned short) s[9];
+      if (s[10] > region_bounding_box[n2 + 3])
+	region_bounding_box[n2 + 3] = (unsigned short) s[10];
+
+      region_run_parent[run] = -1 - (int) ID;
+    }
+
+    /* label the runs, clearing their borders */
+    for (run = 0; run < no_of_runs; run++) {
+      ID = (unsigned short) (-1 - region_run_parent[run]);
+      y = region_run[run * 3];
+      start = region_run[run * 3 + 1];
+      x = region_run[run * 3 + 2];
+      n = y * imgWidth;
+      for (n2 = n + start; n2 <= n + start + border; n2++)
+	low_contrast[n2] = 0;
+      for (; n2 < n + x - border; n2++)
+	low_contrast[n2] = ID;
+      for (; n2 <= n + x; n2++)
+	low_contrast[n2] = 0;
     }
+
     if (next_ID > 1) {
 
       region_history_index++;
@@ -2009,25 +2217,25 @@ void svs::segment(unsigned char* rectified_frame_buf, int no_of_matches) {
       min_vol = imgWidth * imgHeight * 1 / 500;
       n = 0;
       no_of_regions = next_ID;
-      for (i = 0; i < no_of_regions; i++) {
-	vol = region_volume[i];
+      for (i = 1; i < no_of_regions; i++) {
+	vol = region_pixels[i];
 	if (vol != 0) {
 	  region_centre[i * 2] /= vol;
 	  region_centre[i * 2 + 1] /= vol;
-	  if (vol > min_vol) {
-	    prev_region_centre[region_history_index][n * 4 + 1]
-	      = region_centre[i * 2];
-	    prev_region_centre[region_history_index][n * 4 + 2]
-	      = region_centre[i * 2 + 1];
-	    prev_region_centre[region_history_index][n * 4 + 3]
-	      = 65535;
-	    prev_region_centre[region_history_index][n * 4 + 4] = i;
-	    n++;
-	  }
 	  region_colour[i * 3] /= vol;
 	  region_colour[i * 3 + 1] /= vol;
 	  region_colour[i * 3 + 2] /= vol;
 	}
+	if ((int)region_volume[i] > min_vol) {
+	  prev_region_centre[region_history_index][n * 4 + 1]
+	    = region_centre[i * 2];
+	  prev_region_centre[region_history_index][n * 4 + 2]
+	    = region_centre[i * 2 + 1];
+	  prev_region_centre[region_history_index][n * 4 + 3]
+	    = 65535;
+	  prev_region_centre[region_history_index][n * 4 + 4] = i;
+	  n++;
+	}
       }
       prev_region_centre[region_history_index][0] = n;
 
@@ -2040,9 +2248,8 @@ void svs::segment(unsigned char* rectified_frame_buf, int no_of_matches) {
 	by = region_bounding_box[j * 4 + 3] + 20;
 	cx = tx + ((bx - tx) / 2);
 	cy = ty + ((by - ty) / 2);
-	if (max_hits > 0)
-	  memset((void*) disparity_histogram_plane, '\0',
-		 (SVS_MAX_IMAGE_WIDTH / 2) * sizeof(int));
+	memset((void*) disparity_histogram_plane, '\0',
+	       (SVS_MAX_IMAGE_WIDTH / 2) * sizeof(int));
 	max_hits = 0;
 	best_disp = 255;
 	above = 0;
@@ -2092,60 +2299,111 @@ void svs::segment(unsigned char* rectified_frame_buf, int no_of_matches) {
 	  int b = right - left;
 	  if ((b < 20) && (b > -20))
 	    region_disparity[j * 3 + 1] = 127 + b;
-
-	  //printf("slope: %d\n", left - right);
 	}
 	if ((above_hits > 0) && (below_hits > 0)) {
 	  above /= above_hits;
 	  below /= below_hits;
-	  b = below - above;
+	  int b = below - above;
 	  if ((b < 20) && (b > -20))
 	    region_disparity[j * 3 + 2] = 127 + b;
-	  //printf("slope: %d\n", above - below);
 	}
       }
 
       /* track regions */
       if (enable_region_tracking != 0) {
-	min_dist = imgWidth * 4 / 100;
-	for (i = 0; i < n; i++) {
-	  x = (int) prev_region_centre[region_history_index][i * 4
-							     + 1];
-	  y = (int) prev_region_centre[region_history_index][i * 4
-							     + 2];
-	  prev_region_history_index = region_history_index - 1;
-	  if (prev_region_history_index < 0)
-	    prev_region_history_index += SVS_REGION_HISTORY;
-	  ctr = 0;
-	  while (ctr < SVS_REGION_HISTORY * 3 / 4) {
-	    n2 = prev_region_centre[prev_region_history_index][0];
-	    for (j = 0; j < n2; j++) {
-	      dx
-		= (int) prev_region_centre[prev_region_history_index][j
-								      * 4 + 1] - x;
-	      if ((dx > -min_dist) && (dx < min_dist)) {
-		dy
-		  = (int) prev_region_centre[prev_region_history_index][j
-									* 4 + 2] - y;
-		if ((dy > -min_dist) && (dy < min_dist)) {
-		  prev_region_centre[region_history_index][i
-							   * 4 + 3]
-		    = prev_region_history_index;
-		  prev_region_centre[region_history_index][i
-							   * 4 + 4] = j;
-		  ctr = 9999;
-		  j = n2;
-		}
-	      }
-	    }
-	    prev_region_history_index--;
-	    if (prev_region_history_index < 0)
-	      prev_region_history_index += SVS_REGION_HISTORY;
-	    ctr++;
+	track_regions(n);
+      }
+    }
+  }
+}
+
+/* segments a planar mono image into regions */
+void svs::segment_mono(unsigned char* gray_frame_buf, int no_of_matches) {
+  segment(gray_frame_buf, no_of_matches, 1);
+}
+
+/* Links each region in the current history entry to the nearest region
+   centre seen within the previous SVS_REGION_TRACKING_FRAMES frames,
+   preferring the most recent frame.  Previous centres are bucketed into
+   a spatial hash grid with cells of min_dist, so that each region only
+   needs to be compared against centres within the neighbouring cells */
+void svs::track_regions(int no_of_current_regions) {
+  int i, j, k, x, y, dx, dy, cell, cell_x, cell_y, age, idx;
+  int min_dist = imgWidth * 4 / 100;
+  if (min_dist < 1) min_dist = 1;
+  int grid_width = (imgWidth / min_dist) + 1;
+  int grid_height = (imgHeight / min_dist) + 1;
+  int cells = grid_width * grid_height;
+
+  if (region_grid_start == NULL) {
+    /* cell offsets, followed by the fill position of each cell */
+    region_grid_start = new int[(cells + 1) * 2];
+    region_grid_entry = new int[SVS_REGION_TRACKING_FRAMES * SVS_MAX_REGIONS];
+  }
+
+  /* count the centres within each cell */
+  memset((void*)region_grid_start, '\0', (cells + 1) * sizeof(int));
+  for (age = 1; age <= SVS_REGION_TRACKING_FRAMES; age++) {
+    idx = region_history_index - age;
+    if (idx < 0) idx += SVS_REGION_HISTORY;
+    unsigned short* prev = prev_region_centre[idx];
+    for (j = 0; j < (int)prev[0]; j++) {
+      cell = ((int)prev[j * 4 + 2] / min_dist) * grid_width +
+	((int)prev[j * 4 + 1] / min_dist);
+      region_grid_start[cell + 1]++;
+    }
+  }
+  for (cell = 0; cell < cells; cell++)
+    region_grid_start[cell + 1] += region_grid_start[cell];
+
+  /* fill the cells.  Each entry is stored as age * SVS_MAX_REGIONS + index,
+   * so that the smallest entry is the most recent and earliest region */
+  int* fill = &region_grid_start[cells + 1];
+  memcpy((void*)fill, (void*)region_grid_start, cells * sizeof(int));
+  for (age = 1; age <= SVS_REGION_TRACKING_FRAMES; age++) {
+    idx = region_history_index - age;
+    if (idx < 0) idx += SVS_REGION_HISTORY;
+    unsigned short* prev = prev_region_centre[idx];
+    for (j = 0; j < (int)prev[0]; j++) {
+      cell = ((int)prev[j * 4 + 2] / min_dist) * grid_width +
+	((int)prev[j * 4 + 1] / min_dist);
+      region_grid_entry[fill[cell]++] = age * SVS_MAX_REGIONS + j;
+    }
+  }
+
+  /* find the best match for each current region */
+  unsigned short* curr = prev_region_centre[region_history_index];
+  for (i = 0; i < no_of_current_regions; i++) {
+    x = (int) curr[i * 4 + 1];
+    y = (int) curr[i * 4 + 2];
+    cell_x = x / min_dist;
+    cell_y = y / min_dist;
+    int best = -1;
+    for (int cy = cell_y - 1; cy <= cell_y + 1; cy++) {
+      if ((cy < 0) || (cy >= grid_height)) continue;
+      for (int cx = cell_x - 1; cx <= cell_x + 1; cx++) {
+	if ((cx < 0) || (cx >= grid_width)) continue;
+	cell = cy * grid_width + cx;
+	for (k = region_grid_start[cell]; k < region_grid_start[cell + 1]; k++) {
+	  int entry = region_grid_entry[k];
+	  if ((best > -1) && (entry >= best)) continue;
+	  idx = region_history_index - (entry / SVS_MAX_REGIONS);
+	  if (idx < 0) idx += SVS_REGION_HISTORY;
+	  j = entry % SVS_MAX_REGIONS;
+	  dx = (int) prev_region_centre[idx][j * 4 + 1] - x;
+	  if ((dx > -min_dist) && (dx < min_dist)) {
+	    dy = (int) prev_region_centre[idx][j * 4 + 2] - y;
+	    if ((dy > -min_dist) && (dy < min_dist))
+	      best = entry;
 	  }
 	}
       }
     }
+    if (best > -1) {
+      idx = region_history_index - (best / SVS_MAX_REGIONS);
+      if (idx < 0) idx += SVS_REGION_HISTORY;
+      curr[i * 4 + 3] = idx;
+      curr[i * 4 + 4] = best % SVS_MAX_REGIONS;
+    }
   }
 }
-
@@ -30,6 +30,7 @@
 #include <fstream>
 #include "polynomial.h"
 #include "linefit.h"
+#include "matchlog.h"
 
 #define SVS_MAX_FEATURES         8000
 #define SVS_MAX_MATCHES          2000
@@ -44,8 +45,14 @@
 #define SVS_SUB_PIXEL            32
 #define SVS_PEAK_WIDTH           6
 
+#define SVS_PLANE_HISTOGRAM_SIZE ((SVS_MAX_IMAGE_WIDTH/SVS_FILTER_SAMPLING)*(SVS_MAX_IMAGE_WIDTH/2))
+#define SVS_PLANE_FIT_BATCH      32
+#define SVS_PLANE_FIT_CONFIDENCE 0.99
+
 #define SVS_MAX_REGIONS          200
 #define SVS_REGION_HISTORY       100
+#define SVS_REGION_TRACKING_FRAMES (SVS_REGION_HISTORY*3/4)
+#define SVS_RUN_STATS            11
 
 #define pixindex(xx, yy)  ((yy * imgWidth + xx) * 3)
 
@@ -99,6 +106,21 @@ public:
     /* number of detected regions */
     int no_of_regions;
 
+    /* runs of low contrast pixels (y, start x, end x) found during segmentation */
+    int* region_run;
+    int max_region_runs;
+
+    /* union-find parent of each run */
+    int* region_run_parent;
+
+    /* volume, centre sums, interior pixels, colour sums and bounding box
+     * accumulated for each run during labelling */
+    unsigned int* region_run_stats;
+
+    /* spatial hash grid of previous region centres used for tracking */
+    int* region_grid_start;
+    int* region_grid_entry;
+
     /* buffer used to find peaks in edge space */
     unsigned int* row_peaks;
     unsigned int* temp_row_peaks;
@@ -114,6 +136,14 @@ public:
     int* disparity_histogram_plane;
     int* disparity_plane_fit;
 
+    /* per zone disparity histograms used by filter_plane */
+    int* plane_histogram;
+    int* plane_histogram_fit;
+
+    /* seed used to pick baselines within fit_plane.
+     * If non-zero the same planes are fitted on every run */
+    unsigned int plane_fit_seed;
+
     /* number of detected planes found during the filtering step */
     int no_of_planes;
     int* plane;
@@ -121,6 +151,9 @@ public:
     /* maps raw image pixels to rectified pixels */
     int* calibration_map;
 
+    /* log to which matches are appended by log_matches */
+    matchlogwriter* match_log;
+
     unsigned int av_peaks;
 
     /* non zero if ground plane is to be used */
@@ -130,15 +163,22 @@ public:
      * the ground plane position */
     int ground_y_percent;
 
-    int update_sums(int cols, int y, unsigned char* rectified_frame_buf, int segment);
+    int update_sums(int cols, int y, unsigned char* rectified_frame_buf, int segment, int bytes_per_pixel = 3);
     void non_max(int cols, int inhibition_radius, unsigned int min_response);
-    int compute_descriptor(int px, int py, unsigned char* rectified_frame_buf, int no_of_features, int row_mean);
-    int get_features_horizontal(unsigned char* rectified_frame_buf, int inhibition_radius, unsigned int minimum_response, int calibration_offset_x, int calibration_offset_y, int segment);
-    int get_features_vertical(unsigned char* rectified_frame_buf, int inhibition_radius, unsigned int minimum_response, int calibration_offset_x, int calibration_offset_y, int segment);
+    int compute_descriptor(int px, int py, unsigned char* rectified_frame_buf, int no_of_features, int row_mean, int bytes_per_pixel = 3);
+    int get_features_horizontal(unsigned char* rectified_frame_buf, int inhibition_radius, unsigned int minimum_response, int calibration_offset_x, int calibration_offset_y, int segment, int bytes_per_pixel = 3);
+    int get_features_vertical(unsigned char* rectified_frame_buf, int inhibition_radius, unsigned int minimum_response, int calibration_offset_x, int calibration_offset_y, int segment, int bytes_per_pixel = 3, unsigned char* colour_frame_buf = NULL);
+
+    /* feature detection on planar 8 bit mono images.  If the BGR frame which the
+     * mono image came from is given, descriptors are made from its colours */
+    int get_features_horizontal_mono(unsigned char* gray_frame_buf, int inhibition_radius, unsigned int minimum_response, int calibration_offset_x, int calibration_offset_y, int segment);
+    int get_features_vertical_mono(unsigned char* gray_frame_buf, int inhibition_radius, unsigned int minimum_response, int calibration_offset_x, int calibration_offset_y, int segment, unsigned char* colour_frame_buf = NULL);
     void filter_plane(int no_of_possible_matches, int max_disparity_pixels);
     int match(svs* other, int ideal_no_of_matches, int max_disparity_percent, int learnDesc, int learnLuma, int learnDisp, int learnGrad, int groundPrior, int use_priors);
     int fit_plane(int no_of_matches, int max_deviation, int no_of_samples);
-    void segment(unsigned char* rectified_frame_buf, int no_of_matches);
+    void segment(unsigned char* rectified_frame_buf, int no_of_matches, int bytes_per_pixel = 3);
+    void segment_mono(unsigned char* gray_frame_buf, int no_of_matches);
+    void track_regions(int no_of_current_regions);
 
     void calibrate_offsets(unsigned char* left_image, unsigned char* right_image, int x_range, int y_range, int& calibration_offset_x, int& calibration_offset_y);
     void make_map(float centre_of_distortion_x, float centre_of_distortion_y, float coeff_0, float coeff_1, float coeff_2, float rotation, float scale);
@@ -150,6 +190,7 @@ public:
     void save_matches(std::string filename, unsigned char* rectified_frame_buf, int no_of_matches, bool colour);
     bool log_matches(std::string filename, unsigned char* rectified_frame_buf, int no_of_matches, bool colour);
     static void histogram_equalise(IplImage* hist_image, unsigned char* img, int img_width, int img_height);
+    static void extract_channel(unsigned char* bgr, unsigned char* gray, int img_width, int img_height, int channel);
 
     svs(int width, int height);
     ~svs();
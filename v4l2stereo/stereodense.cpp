@@ -24,6 +24,19 @@
 
 #include "stereodense.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are compiled for that target individually and only used if the CPU supports them
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define STEREO_DENSE_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+// instruction set used by the matching kernels, or -1 if it has not yet been detected
+static int dense_instruction_set = -1;
+
 /*!
  * \brief an additional filtering step performed after disparity thresholding
  * \param disparity_map disparity map
@@ -31,8 +44,9 @@
  * \param disparity_map_height height of the disparity map
  * \param feature_size maximum size of features to be removed
  */
+template <typename map_type>
 void stereodense::post_threshold_filter(
-	unsigned int *disparity_map,
+	map_type *disparity_map,
 	int disparity_map_width,
 	int disparity_map_height,
 	int feature_size)
@@ -170,6 +184,72 @@ void stereodense::mean_row_reflectance(
 	mean_b_deviation /= img_width;
 }
 
+/*!
+ * \brief corrects the colours of one row of the right image so that they're similar to the corresponding row of the left image
+ * \param img_left left colour image
+ * \param img_right right colour image
+ * \param img_width width of the image
+ * \param y_left row within the left image
+ * \param y_right row within the right image
+ */
+void stereodense::colour_correction_row(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int y_left,
+	int y_right)
+{
+	// get the mean and standard deviation for the left image
+	int mean_r_left=0;
+	int mean_g_left=0;
+	int mean_b_left=0;
+	int mean_r_deviation_left=0;
+	int mean_g_deviation_left=0;
+	int mean_b_deviation_left=0;
+
+	mean_row_reflectance(
+		img_left,
+		img_width,
+		y_left,
+		mean_r_left,
+		mean_g_left,
+		mean_b_left,
+		mean_r_deviation_left,
+		mean_g_deviation_left,
+		mean_b_deviation_left);
+
+	// get the mean and standard deviation for the right image
+	int mean_r_right=0;
+	int mean_g_right=0;
+	int mean_b_right=0;
+	int mean_r_deviation_right=0;
+	int mean_g_deviation_right=0;
+	int mean_b_deviation_right=0;
+
+	mean_row_reflectance(
+		img_right,
+		img_width,
+		y_right,
+		mean_r_right,
+		mean_g_right,
+		mean_b_right,
+		mean_r_deviation_right,
+		mean_g_deviation_right,
+		mean_b_deviation_right);
+
+	// correct the colours of the right image so that they're similar to the left
+	if ((mean_r_deviation_right != 0) &&
+		(mean_g_deviation_right != 0) &&
+		(mean_b_deviation_right != 0)) {
+		int n = y_right*img_width*3;
+		for (int x = 0; x < img_width; x++, n += 3) {
+			img_right[n+2] = (unsigned char)(mean_r_left + ((img_right[n+2] - mean_r_right) *  mean_r_deviation_left / mean_r_deviation_right));
+			img_right[n+1] = (unsigned char)(mean_g_left + ((img_right[n+1] - mean_g_right) *  mean_g_deviation_left / mean_g_deviation_right));
+			img_right[n] = (unsigned char)(mean_b_left + ((img_right[n] - mean_b_right) *  mean_b_deviation_left / mean_b_deviation_right));
+		}
+	}
+}
+
 /*!
  * \brief performs colour correction on the right image.  This helps to improve matching performance.
  * \param img_left left colour image
@@ -189,56 +269,7 @@ void stereodense::colour_correction(
 	for (int y_left = 0; y_left < img_height; y_left++) {
 		int y_right = y_left - offset_y;
 		if ((y_right > -1) && (y_right < img_height)) {
-
-			// get the mean and standard deviation for the left image
-			int mean_r_left=0;
-			int mean_g_left=0;
-			int mean_b_left=0;
-			int mean_r_deviation_left=0;
-			int mean_g_deviation_left=0;
-			int mean_b_deviation_left=0;
-
-			mean_row_reflectance(
-				img_left,
-				img_width,
-				y_left,
-				mean_r_left,
-				mean_g_left,
-				mean_b_left,
-				mean_r_deviation_left,
-				mean_g_deviation_left,
-				mean_b_deviation_left);
-
-			// get the mean and standard deviation for the right image
-			int mean_r_right=0;
-			int mean_g_right=0;
-			int mean_b_right=0;
-			int mean_r_deviation_right=0;
-			int mean_g_deviation_right=0;
-			int mean_b_deviation_right=0;
-
-			mean_row_reflectance(
-				img_right,
-				img_width,
-				y_right,
-				mean_r_right,
-				mean_g_right,
-				mean_b_right,
-				mean_r_deviation_right,
-				mean_g_deviation_right,
-				mean_b_deviation_right);
-
-			// correct the colours of the right image so that they're similar to the left
-			if ((mean_r_deviation_right != 0) &&
-				(mean_g_deviation_right != 0) &&
-				(mean_b_deviation_right != 0)) {
-				int n = y_right*img_width*3;
-				for (int x = 0; x < img_width; x++, n += 3) {
-					img_right[n+2] = (unsigned char)(mean_r_left + ((img_right[n+2] - mean_r_right) *  mean_r_deviation_left / mean_r_deviation_right));
-					img_right[n+1] = (unsigned char)(mean_g_left + ((img_right[n+1] - mean_g_right) *  mean_g_deviation_left / mean_g_deviation_right));
-					img_right[n] = (unsigned char)(mean_b_left + ((img_right[n] - mean_b_right) *  mean_b_deviation_left / mean_b_deviation_right));
-				}
-			}
+			colour_correction_row(img_left, img_right, img_width, y_left, y_right);
 		}
 	}
 }
@@ -297,61 +328,307 @@ void stereodense::expand(
 	}
 }
 
+/* one despeckling pass over a row of disparities.  A disparity is removed if no more than one
+   of its eight neighbours lies within min_diff below it.  Returns true if any were removed */
+static bool despeckle_row_scalar(
+	unsigned short* above,
+	unsigned short* row,
+	unsigned short* below,
+	int x0,
+	int x1,
+	unsigned short min_diff,
+	unsigned short* result)
+{
+	bool removed = false;
+	for (int x = x0; x < x1; x++) {
+		unsigned short centre = row[x];
+		result[x] = centre;
+		if (centre == 0) continue;
+		int similar = 0;
+		for (int dx = -1; dx <= 1; dx++) {
+			if ((above[x+dx] <= centre) && (centre - above[x+dx] <= min_diff)) similar++;
+			if ((below[x+dx] <= centre) && (centre - below[x+dx] <= min_diff)) similar++;
+		}
+		if ((row[x-1] <= centre) && (centre - row[x-1] <= min_diff)) similar++;
+		if ((row[x+1] <= centre) && (centre - row[x+1] <= min_diff)) similar++;
+		if (similar <= 1) {
+			result[x] = 0;
+			removed = true;
+		}
+	}
+	return(removed);
+}
+
+#ifdef __SSE2__
+
+/* -1 in each lane where the neighbour lies within min_diff below the centre, otherwise 0 */
+static inline __m128i similar_sse2(
+	__m128i centre,
+	__m128i neighbour,
+	__m128i min_diff)
+{
+	__m128i outside = _mm_or_si128(
+		_mm_subs_epu16(neighbour, centre),
+		_mm_subs_epu16(_mm_subs_epu16(centre, neighbour), min_diff));
+	return(_mm_cmpeq_epi16(outside, _mm_setzero_si128()));
+}
+
+/* despeckles eight disparities, returning -1 in each lane which was removed */
+static inline __m128i despeckle_block_sse2(
+	unsigned short* above,
+	unsigned short* row,
+	unsigned short* below,
+	int x,
+	__m128i min_diff,
+	unsigned short* result)
+{
+	__m128i centre = _mm_loadu_si128((__m128i*)&row[x]);
+	__m128i similar = similar_sse2(centre, _mm_loadu_si128((__m128i*)&row[x-1]), min_diff);
+	similar = _mm_add_epi16(similar, similar_sse2(centre, _mm_loadu_si128((__m128i*)&row[x+1]), min_diff));
+	similar = _mm_add_epi16(similar, similar_sse2(centre, _mm_loadu_si128((__m128i*)&above[x-1]), min_diff));
+	similar = _mm_add_epi16(similar, similar_sse2(centre, _mm_loadu_si128((__m128i*)&above[x]), min_diff));
+	similar = _mm_add_epi16(similar, similar_sse2(centre, _mm_loadu_si128((__m128i*)&above[x+1]), min_diff));
+	similar = _mm_add_epi16(similar, similar_sse2(centre, _mm_loadu_si128((__m128i*)&below[x-1]), min_diff));
+	similar = _mm_add_epi16(similar, similar_sse2(centre, _mm_loadu_si128((__m128i*)&below[x]), min_diff));
+	similar = _mm_add_epi16(similar, similar_sse2(centre, _mm_loadu_si128((__m128i*)&below[x+1]), min_diff));
+
+	// no more than one similar neighbour
+	__m128i remove = _mm_andnot_si128(
+		_mm_cmpeq_epi16(centre, _mm_setzero_si128()),
+		_mm_cmpgt_epi16(similar, _mm_set1_epi16(-2)));
+	_mm_storeu_si128((__m128i*)&result[x], _mm_andnot_si128(remove, centre));
+	return(remove);
+}
+
+/* the last block overlaps the one before it rather than
+   leaving a remainder, since results go to a separate row */
+static bool despeckle_row_sse2(
+	unsigned short* above,
+	unsigned short* row,
+	unsigned short* below,
+	int x0,
+	int x1,
+	unsigned short min_diff,
+	unsigned short* result)
+{
+	if (x1 - x0 < 8) return(despeckle_row_scalar(above, row, below, x0, x1, min_diff, result));
+
+	const __m128i diff = _mm_set1_epi16((short)min_diff);
+	__m128i removed = _mm_setzero_si128();
+	int x = x0;
+	for (; x + 8 <= x1; x += 8) {
+		removed = _mm_or_si128(removed, despeckle_block_sse2(above, row, below, x, diff, result));
+	}
+	if (x < x1) {
+		removed = _mm_or_si128(removed, despeckle_block_sse2(above, row, below, x1 - 8, diff, result));
+	}
+	return(_mm_movemask_epi8(removed) != 0);
+}
+
+#endif
+
+#ifdef STEREO_DENSE_AVX2_TARGET
+
+STEREO_DENSE_AVX2_TARGET
+static inline __m256i similar_avx2(
+	__m256i centre,
+	__m256i neighbour,
+	__m256i min_diff)
+{
+	__m256i outside = _mm256_or_si256(
+		_mm256_subs_epu16(neighbour, centre),
+		_mm256_subs_epu16(_mm256_subs_epu16(centre, neighbour), min_diff));
+	return(_mm256_cmpeq_epi16(outside, _mm256_setzero_si256()));
+}
+
+STEREO_DENSE_AVX2_TARGET
+static inline __m256i despeckle_block_avx2(
+	unsigned short* above,
+	unsigned short* row,
+	unsigned short* below,
+	int x,
+	__m256i min_diff,
+	unsigned short* result)
+{
+	__m256i centre = _mm256_loadu_si256((__m256i*)&row[x]);
+	__m256i similar = similar_avx2(centre, _mm256_loadu_si256((__m256i*)&row[x-1]), min_diff);
+	similar = _mm256_add_epi16(similar, similar_avx2(centre, _mm256_loadu_si256((__m256i*)&row[x+1]), min_diff));
+	similar = _mm256_add_epi16(similar, similar_avx2(centre, _mm256_loadu_si256((__m256i*)&above[x-1]), min_diff));
+	similar = _mm256_add_epi16(similar, similar_avx2(centre, _mm256_loadu_si256((__m256i*)&above[x]), min_diff));
+	similar = _mm256_add_epi16(similar, similar_avx2(centre, _mm256_loadu_si256((__m256i*)&above[x+1]), min_diff));
+	similar = _mm256_add_epi16(similar, similar_avx2(centre, _mm256_loadu_si256((__m256i*)&below[x-1]), min_diff));
+	similar = _mm256_add_epi16(similar, similar_avx2(centre, _mm256_loadu_si256((__m256i*)&below[x]), min_diff));
+	similar = _mm256_add_epi16(similar, similar_avx2(centre, _mm256_loadu_si256((__m256i*)&below[x+1]), min_diff));
+
+	__m256i remove = _mm256_andnot_si256(
+		_mm256_cmpeq_epi16(centre, _mm256_setzero_si256()),
+		_mm256_cmpgt_epi16(similar, _mm256_set1_epi16(-2)));
+	_mm256_storeu_si256((__m256i*)&result[x], _mm256_andnot_si256(remove, centre));
+	return(remove);
+}
+
+STEREO_DENSE_AVX2_TARGET
+static bool despeckle_row_avx2(
+	unsigned short* above,
+	unsigned short* row,
+	unsigned short* below,
+	int x0,
+	int x1,
+	unsigned short min_diff,
+	unsigned short* result)
+{
+	if (x1 - x0 < 16) return(despeckle_row_sse2(above, row, below, x0, x1, min_diff, result));
+
+	const __m256i diff = _mm256_set1_epi16((short)min_diff);
+	__m256i removed = _mm256_setzero_si256();
+	int x = x0;
+	for (; x + 16 <= x1; x += 16) {
+		removed = _mm256_or_si256(removed, despeckle_block_avx2(above, row, below, x, diff, result));
+	}
+	if (x < x1) {
+		removed = _mm256_or_si256(removed, despeckle_block_avx2(above, row, below, x1 - 16, diff, result));
+	}
+	return(_mm256_movemask_epi8(removed) != 0);
+}
+
+#endif
+
+/* dispatch to the selected instruction set */
+static bool despeckle_row(
+	int level,
+	unsigned short* above,
+	unsigned short* row,
+	unsigned short* below,
+	int x0,
+	int x1,
+	unsigned short min_diff,
+	unsigned short* result)
+{
+	switch(level) {
+#ifdef STEREO_DENSE_AVX2_TARGET
+	    case STEREO_DENSE_AVX2: { return(despeckle_row_avx2(above, row, below, x0, x1, min_diff, result)); }
+#endif
+#ifdef __SSE2__
+	    case STEREO_DENSE_SSE2: { return(despeckle_row_sse2(above, row, below, x0, x1, min_diff, result)); }
+#endif
+	    default: { return(despeckle_row_scalar(above, row, below, x0, x1, min_diff, result)); }
+	}
+}
+
 /*!
- * \brief removes speckling from the disparity map
+ * \brief thresholds and removes speckling from the disparity map, then scales disparities to sub-pixel units.
+ *        The map is split into tiles of rows which are processed in parallel.  Every despeckling pass is
+ *        applied to a tile, together with enough rows either side of it, while it remains in cache.
+ *        Passes stop early once nothing more is removed, since further passes would make no difference.
+ *        Disparities in pixels are assumed to fit within 16 bits.
  * \param disparity_map_width width of the disparity map
  * \param disparity_map_height height of the disparity map
- * \param disparity_map disparity map data
  * \param max_disparity_pixels maximum disparity in pixels
+ * \param disparity_threshold_pixels disparities below this are removed before despeckling
+ * \param sub_pixel multiplier applied to disparities
+ * \param disparity_map disparity map data
  */
-bool stereodense::despeckle_disparity_map(
+template <typename map_type>
+void stereodense::despeckle_disparity_map(
 	int disparity_map_width,
 	int disparity_map_height,
-	unsigned int* disparity_map,
-	int max_disparity_pixels)
+	int max_disparity_pixels,
+	unsigned int disparity_threshold_pixels,
+	int sub_pixel,
+	map_type* disparity_map)
 {
-	bool pixels_removed = false;
-
-	unsigned int min_diff = (unsigned int)(max_disparity_pixels*5/100);
-	const int hits_threshold = 6;
+	const int passes = STEREO_DENSE_DESPECKLE_PASSES;
+	int w = disparity_map_width;
+	int h = disparity_map_height;
+	unsigned short min_diff = (unsigned short)(max_disparity_pixels*5/100);
+	int level = instruction_set();
+
+	// thresholded disparities.  Locations without a match never have a disparity
+	unsigned short* disparities = new unsigned short[w*h];
     #pragma omp parallel for
-	for (int y = 1; y < disparity_map_height-1; y++) {
-		for (int x = 1; x < disparity_map_width-1; x++) {
-			int n_map = (y*disparity_map_width + x)*2;
-            if (disparity_map[n_map+1] > 0) {
-            	int hits = 0;
-            	unsigned int centre_disparity = disparity_map[n_map+1];
-            	for (int yy = y-1; yy <= y+1; yy++) {
-            		int n_map2 = (yy*disparity_map_width + x - 1)*2;
-            		for (int xx = x-1; xx <= x+1; xx++, n_map2 += 2) {
-            			unsigned int diff = centre_disparity - disparity_map[n_map2+1];
-            			if (diff > min_diff) {
-            				hits++;
-            				if (hits > hits_threshold) {
-            					yy = y+2;
-            					break;
-            				}
-            			}
-            		}
-            	}
-            	if (hits > hits_threshold) {
-            		disparity_map[n_map] = 0;
-            		pixels_removed = true;
-            	}
-            }
+	for (int y = 0; y < h; y++) {
+		map_type* m = &disparity_map[y*w*2];
+		unsigned short* d = &disparities[y*w];
+		for (int x = 0; x < w; x++, m += 2) {
+			d[x] = ((m[0] == 0) || (m[1] < disparity_threshold_pixels)) ? 0 : (unsigned short)m[1];
 		}
 	}
 
-	for (int i = disparity_map_width*disparity_map_height*2-2; i >= 0; i -= 2) {
-		if (disparity_map[i] == 0) {
-			disparity_map[i + 1] = 0;
+	// each tile is small enough for the rows of every pass to stay in cache
+	int tile_rows = STEREO_DENSE_TILE_BYTES / (w*2*(int)sizeof(unsigned short));
+	int rows_per_thread = (h + omp_get_max_threads() - 1) / omp_get_max_threads();
+	if (tile_rows > rows_per_thread) tile_rows = rows_per_thread;
+	if (tile_rows < passes) tile_rows = passes;
+	int no_of_tiles = (h + tile_rows - 1) / tile_rows;
+
+    #pragma omp parallel
+	{
+		unsigned short* buffer[2];
+		buffer[0] = new unsigned short[(tile_rows + (passes*2))*w];
+		buffer[1] = new unsigned short[(tile_rows + (passes*2))*w];
+
+        #pragma omp for schedule(dynamic)
+		for (int tile = 0; tile < no_of_tiles; tile++) {
+			int tile_ty = tile*tile_rows;
+			int tile_by = tile_ty + tile_rows;
+			if (tile_by > h) tile_by = h;
+
+			// rows of the tile, together with the rows either side which affect it after every pass
+			int ty = tile_ty - passes;
+			int by = tile_by + passes;
+			if (ty < 0) ty = 0;
+			if (by > h) by = h;
+			memcpy((void*)buffer[0], (void*)&disparities[ty*w], (by-ty)*w*sizeof(unsigned short));
+
+			// each pass can only be applied to rows whose neighbours are known from the previous pass
+			int src = 0;
+			for (int pass = 1; pass <= passes; pass++) {
+				int py0 = tile_ty - (passes - pass);
+				int py1 = tile_by + (passes - pass);
+				if (py0 < ty) py0 = ty;
+				if (py1 > by) py1 = by;
+
+				unsigned short* source = buffer[src];
+				unsigned short* result = buffer[1-src];
+				bool removed = false;
+				for (int y = py0; y < py1; y++) {
+					unsigned short* row = &source[(y-ty)*w];
+					unsigned short* out = &result[(y-ty)*w];
+					out[0] = row[0];
+					out[w-1] = row[w-1];
+					if ((y == 0) || (y == h-1)) {
+						memcpy((void*)out, (void*)row, w*sizeof(unsigned short));
+					}
+					else {
+						if (despeckle_row(level, row - w, row, row + w, 1, w-1, min_diff, out)) removed = true;
+					}
+				}
+				src = 1-src;
+				if (!removed) break;
+			}
+
+			// update the tile within the disparity map
+			for (int y = tile_ty; y < tile_by; y++) {
+				unsigned short* d = &buffer[src][(y-ty)*w];
+				unsigned short* d0 = &disparities[y*w];
+				map_type* m = &disparity_map[y*w*2];
+				for (int x = 0; x < w; x++, m += 2) {
+					if ((d[x] == 0) && (d0[x] != 0)) m[0] = 0;
+					m[1] = (map_type)(d[x]*sub_pixel);
+				}
+			}
 		}
+
+		delete [] buffer[0];
+		delete [] buffer[1];
 	}
-	return(pixels_removed);
+
+	delete [] disparities;
 }
 
 /*!
- * \brief returns the sum of absolute differences for two image patches
+ * \brief returns the sum of absolute differences for two image patches.
+ *        This is the direct form of the calculation performed by update_disparity_space using integral images.
  * \param img_left left colour image
  * \param img_right right colour image
  * \param img_width width of the image
@@ -460,7 +737,8 @@ int stereodense::SAD(
 }
 
 /*!
- * \brief checks the given disparity by comparing pixels
+ * \brief checks the given disparity by comparing pixels.  The check fails if any of the pixels
+ *        compared, including those on the rows above and below, lie outside of the images
  * \param x disparity map x coordinate
  * \param y disparity map y coordinate
  * \param disparity possible disparity in pixels
@@ -497,8 +775,17 @@ bool stereodense::cross_check_pixel(
 	int x_right = x_left - disparity - offset_x;
 	int stride = img_width*3;
 
-	int n_left = (y_left*img_width + x_left)*3;
-	int n_right = (y_right*img_width + x_right)*3;
+	// the two samples and the rows either side of them must be within the images
+	int img_pixels = img_width*img_height;
+	int p_left = y_left*img_width + x_left;
+	int p_right = y_right*img_width + x_right;
+	if ((p_left - img_width < 0) || (p_left + 1 + img_width >= img_pixels) ||
+		(p_right - img_width < 0) || (p_right + 1 + img_width >= img_pixels)) {
+		return(false);
+	}
+
+	int n_left = p_left*3;
+	int n_right = p_right*3;
 	for (int samples = 0; samples < 2; samples++) {
 		check_ok = false;
 		// initial sanity check
@@ -528,261 +815,2471 @@ bool stereodense::cross_check_pixel(
 }
 
 /*!
- * \brief generates a disparity map from the disparity space
- * \param img_left left colour image
- * \param img_right right colour image
- * \param img_width width of the image
- * \param img_height height of the image
- * \param offset_x calibration x offset
- * \param offset_y calibration y offset
- * \param smoothing_radius smoothing radius for the disparity space
- * \param vertical_sampling vertical sampling rate
- * \param disparity_space disparity space containing correlation data for each pixel at each possible disparity
- * \param disparity_space_width width of the disparity space
- * \param disparity_space_height height of the disparity space
- * \param disparity_step disparity step size
- * \param no_of_disparities number of disparities within the disparity space
- * \param similarity_threshold maximum pixel difference when cross checking
- * \param disparity_map returned disparity map
+ * \brief returns the best instruction set supported by this CPU
+ * \return STEREO_DENSE_SCALAR, STEREO_DENSE_SSE2 or STEREO_DENSE_AVX2
  */
-void stereodense::disparity_map_from_disparity_space(
-	unsigned char* img_left,
-	unsigned char* img_right,
-	int img_width,
-	int img_height,
-	int offset_x,
-	int offset_y,
-	int smoothing_radius,
-	int vertical_sampling,
-	unsigned int* disparity_space,
-	int disparity_space_width,
-	int disparity_space_height,
-	int disparity_step,
-	int no_of_disparities,
-	int similarity_threshold,
-	unsigned int* disparity_map)
+static int supported_instruction_set()
 {
-	int disparity_space_pixels = disparity_space_width*disparity_space_height;
-	int disparity_space_width2 = disparity_space_width/STEREO_DENSE_OUTER_DIVISOR;
+	int level = STEREO_DENSE_SCALAR;
+#ifdef __SSE2__
+	level = STEREO_DENSE_SSE2;
+#endif
+#ifdef STEREO_DENSE_AVX2_TARGET
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) level = STEREO_DENSE_AVX2;
+#endif
+	return(level);
+}
 
-	// clear the disparity map
-	memset((void*)disparity_map,'\0',disparity_space_pixels*2*sizeof(unsigned int));
-
-	// process each disparity in parallel
-	for (int disparity_index = 0; disparity_index < no_of_disparities; disparity_index++) {
-		int disparity_space_offset = disparity_index*disparity_space_pixels*2;
-
-		// for every pixel at this disparity
-        #pragma omp parallel for
-		for (int y = 1; y < disparity_space_height-1; y++) {
-			int y2 = y/STEREO_DENSE_OUTER_DIVISOR;
-			int n_map = (y*disparity_space_width + 1)*2;
-			int n_space_inner = disparity_space_offset + (y*disparity_space_width) + 1;
-			for (int x = 1; x < disparity_space_width-1; x++, n_map += 2, n_space_inner++) {
-
-				int n_space_outer = disparity_space_pixels + disparity_space_offset + (y2*disparity_space_width2) + (x/STEREO_DENSE_OUTER_DIVISOR);
-
-				// small correlation window
-				unsigned int local_correlation_inner =
-					disparity_space[n_space_inner] +
-					disparity_space[n_space_inner-1] +
-					disparity_space[n_space_inner+1] +
-					disparity_space[n_space_inner-disparity_space_width] +
-					disparity_space[n_space_inner+disparity_space_width] +
-					disparity_space[n_space_inner+disparity_space_width-1] +
-					disparity_space[n_space_inner+disparity_space_width+1] +
-					disparity_space[n_space_inner-disparity_space_width-1] +
-					disparity_space[n_space_inner-disparity_space_width+1];
-
-				// large correlation window
-				unsigned int local_correlation_outer =
-					disparity_space[n_space_outer] +
-					disparity_space[n_space_outer-1] +
-					disparity_space[n_space_outer+1] +
-					disparity_space[n_space_outer-disparity_space_width2] +
-					disparity_space[n_space_outer+disparity_space_width2] +
-					disparity_space[n_space_outer+disparity_space_width2-1] +
-					disparity_space[n_space_outer+disparity_space_width2+1] +
-					disparity_space[n_space_outer-disparity_space_width2-1] +
-					disparity_space[n_space_outer-disparity_space_width2+1];
-
-				// combined correlation value
-				// more emphasis on the centre, less on the surround
-				unsigned int local_correlation = (local_correlation_inner*STEREO_DENSE_OUTER_DIVISOR) + local_correlation_outer;
-
-				// is this the best correlation value so far?
-				if ((local_correlation > 0) && ((disparity_map[n_map] == 0) ||
-					(disparity_map[n_map] < local_correlation))) {
-
-					for (int tries = 0; tries < 8; tries++) {
-
-						int disparity = (disparity_index*disparity_step) + tries;
+/*!
+ * \brief returns the instruction set used by the matching kernels
+ * \return STEREO_DENSE_SCALAR, STEREO_DENSE_SSE2 or STEREO_DENSE_AVX2
+ */
+int stereodense::instruction_set()
+{
+	if (dense_instruction_set < 0) {
+		dense_instruction_set = supported_instruction_set();
+	}
+	return(dense_instruction_set);
+}
 
-						// if the pixels look similar then this may be a valid match
-						if (cross_check_pixel(
-							x,
-							y,
-							disparity,
-							similarity_threshold,
-							img_left,
-							img_right,
-							img_width,
-							img_height,
-							offset_x,
-							offset_y,
-							smoothing_radius,
-							vertical_sampling)) {
+/*!
+ * \brief selects the instruction set used by the matching kernels.  All instruction sets give the same result.
+ * \param level STEREO_DENSE_SCALAR, STEREO_DENSE_SSE2 or STEREO_DENSE_AVX2
+ * \return the instruction set selected, which may be lower than requested if the CPU does not support it
+ */
+int stereodense::set_instruction_set(
+	int level)
+{
+	int supported = supported_instruction_set();
+	if (level > supported) level = supported;
+	if (level < STEREO_DENSE_SCALAR) level = STEREO_DENSE_SCALAR;
+	dense_instruction_set = level;
+	return(level);
+}
 
-						    // update the disparity map
-						    disparity_map[n_map] = local_correlation;
-						    disparity_map[n_map + 1] = disparity;
-						    break;
-						}
-					}
-				}
+/*!
+ * \brief splits a colour image into separate blue, green and red planes
+ * \param img colour image
+ * \param img_pixels number of pixels in the image
+ * \param planes returned planes, each of img_pixels bytes
+ */
+void stereodense::planar(
+	unsigned char* img,
+	int img_pixels,
+	unsigned char* planes)
+{
+	unsigned char* blue = planes;
+	unsigned char* green = &planes[img_pixels];
+	unsigned char* red = &planes[img_pixels*2];
+    #pragma omp parallel for
+	for (int i = 0; i < img_pixels; i++) {
+		blue[i] = img[i*3];
+		green[i] = img[i*3+1];
+		red[i] = img[i*3+2];
+	}
+}
 
-			}
-		}
+/* absolute differences summed over the colour planes, for n pixels */
+static void plane_difference_scalar(
+	unsigned char* left,
+	unsigned char* right,
+	int img_pixels,
+	int n,
+	unsigned short* difference)
+{
+	unsigned char* left_green = &left[img_pixels];
+	unsigned char* left_red = &left[img_pixels*2];
+	unsigned char* right_green = &right[img_pixels];
+	unsigned char* right_red = &right[img_pixels*2];
+	for (int i = 0; i < n; i++) {
+		difference[i] = (unsigned short)(
+			ABS(left[i] - right[i]) +
+			ABS(left_green[i] - right_green[i]) +
+			ABS(left_red[i] - right_red[i]));
 	}
+}
 
+/* adds the previous row of an integral image */
+static void add_row_scalar(
+	unsigned int* row,
+	unsigned int* above,
+	int n)
+{
+	for (int i = 0; i < n; i++) {
+		row[i] += above[i];
+	}
 }
 
-/*!
- * \brief updates the disparity space which contains matching correlation values for each possible disparity
- * \param img_left colour data for the left image2
- * \param img_right colour data for the right image
- * \param img_width width of the image
- * \param img_height height of the image
- * \param offset_x calibration offset x
- * \param offset_y calibration offset y
- * \param vertical_sampling vertical sampling rate - we don't need every row
- * \param max_disparity_percent maximum disparity as a percentage of image width
- * \param correlation_radius radius in pixels used for patch matching
- * \param smoothing_radius radius in pixels used for smoothing of the disparity space
- * \param disparity_step step size for sampling different disparities
- * \param disparity_space_width width of the disparity space
- * \param disparity_space_height height of the disparity space
- * \param disparity_space array used for the disparity space
- */
-void stereodense::update_disparity_space(
-	unsigned char* img_left,
-	unsigned char* img_right,
+/* first of eight disparities passing the cross check, given pixel
+   indexes of the left image and of the right image at the last disparity */
+static int cross_check_scalar(
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	int img_pixels,
 	int img_width,
-	int img_height,
-	int offset_x,
-	int offset_y,
-	int vertical_sampling,
-	int max_disparity_percent,
-	int correlation_radius,
-	int smoothing_radius,
-	int disparity_step,
-	int disparity_space_width,
-	int disparity_space_height,
-	unsigned int *disparity_space)
+	int n_left,
+	int n_right,
+	int similarity_threshold)
 {
-	int patch_pixels = correlation_radius*2+1;
-	patch_pixels *= patch_pixels;
-	unsigned int max_patch_value = (unsigned int)(3*255*patch_pixels);
-	int max_disparity = max_disparity_percent * img_width / 100;
+	for (int tries = 0; tries < STEREO_DENSE_CROSS_CHECK_TRIES; tries++) {
+		bool check_ok = true;
+		for (int row = -1; row <= 1; row++) {
+			for (int sample = 0; sample < 2; sample++) {
+				int nl = n_left + (row*img_width) + sample;
+				int nr = n_right + (row*img_width) + sample + (STEREO_DENSE_CROSS_CHECK_TRIES-1) - tries;
+				int diff = 0;
+				for (int c = 0; c < 3; c++, nl += img_pixels, nr += img_pixels) {
+					diff += ABS(planes_left[nl] - planes_right[nr]);
+				}
+				if (diff >= similarity_threshold) check_ok = false;
+			}
+		}
+		if (check_ok) return(tries);
+	}
+	return(-1);
+}
 
-	int img_height2 = img_height / vertical_sampling;
-	int width2 = img_width / smoothing_radius;
-	int height2 = img_height2 / STEREO_DENSE_SMOOTH_VERTICAL;
-	int width3 = img_width / (smoothing_radius*STEREO_DENSE_OUTER_DIVISOR);
+#ifdef __SSE2__
 
-	int ty = 0;
-	int by = img_height;
-	if (offset_y >= 0)
-		by = img_height - offset_y;
-	else
-		ty = -offset_y;
+static inline __m128i absolute_difference_sse2(
+	__m128i a,
+	__m128i b)
+{
+	return(_mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a)));
+}
 
-	int disparity_space_pixels = disparity_space_width*disparity_space_height;
-    int no_of_disparities = max_disparity / disparity_step;
+static void plane_difference_sse2(
+	unsigned char* left,
+	unsigned char* right,
+	int img_pixels,
+	int n,
+	unsigned short* difference)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i lo = zero;
+		__m128i hi = zero;
+		for (int c = 0; c < 3; c++) {
+			__m128i diff = absolute_difference_sse2(
+				_mm_loadu_si128((__m128i*)&left[i + c*img_pixels]),
+				_mm_loadu_si128((__m128i*)&right[i + c*img_pixels]));
+			lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(diff, zero));
+			hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(diff, zero));
+		}
+		_mm_storeu_si128((__m128i*)&difference[i], lo);
+		_mm_storeu_si128((__m128i*)&difference[i+8], hi);
+	}
+	plane_difference_scalar(&left[i], &right[i], img_pixels, n - i, &difference[i]);
+}
 
-	// clear disparity space
-	memset((void*)disparity_space,'\0', no_of_disparities*disparity_space_pixels*2*sizeof(unsigned int));
+static void add_row_sse2(
+	unsigned int* row,
+	unsigned int* above,
+	int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128((__m128i*)&row[i],
+			_mm_add_epi32(
+				_mm_loadu_si128((__m128i*)&row[i]),
+				_mm_loadu_si128((__m128i*)&above[i])));
+	}
+	add_row_scalar(&row[i], &above[i], n - i);
+}
 
-	// test a number of possible disparities in parallel
-    #pragma omp parallel for
-	for (int disparity_index = 0; disparity_index < no_of_disparities; disparity_index++) {
+/* lane k of each comparison holds try 7-k, so the first
+   try which passes is given by the highest lane set */
+static int cross_check_sse2(
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	int img_pixels,
+	int img_width,
+	int n_left,
+	int n_right,
+	int similarity_threshold)
+{
+	// differences never exceed 765, so the comparison can be signed 16 bit
+	if (similarity_threshold <= 0) return(-1);
+	if (similarity_threshold > 766) similarity_threshold = 766;
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i threshold = _mm_set1_epi16((short)similarity_threshold);
+	__m128i ok = _mm_set1_epi16(-1);
+	for (int row = -1; row <= 1; row++) {
+		for (int sample = 0; sample < 2; sample++) {
+			int nl = n_left + (row*img_width) + sample;
+			int nr = n_right + (row*img_width) + sample;
+			__m128i diff = zero;
+			for (int c = 0; c < 3; c++, nl += img_pixels, nr += img_pixels) {
+				diff = _mm_add_epi16(diff,
+					_mm_unpacklo_epi8(
+						absolute_difference_sse2(
+							_mm_set1_epi8((char)planes_left[nl]),
+							_mm_loadl_epi64((__m128i*)&planes_right[nr])),
+						zero));
+			}
+			ok = _mm_and_si128(ok, _mm_cmplt_epi16(diff, threshold));
+		}
+	}
+	int mask = _mm_movemask_epi8(ok);
+	if (mask == 0) return(-1);
+	return((STEREO_DENSE_CROSS_CHECK_TRIES-1) - ((31 - __builtin_clz(mask)) / 2));
+}
 
-		// disparity in pixels
-	    int disparity = disparity_index * disparity_step;
+#endif
 
-	    // offset within the disparity space array
-		int disparity_space_offset = disparity_index*disparity_space_pixels*2;
+#ifdef STEREO_DENSE_AVX2_TARGET
 
-		// insert correlation values into the disparity space
-        #pragma omp parallel for
-		for (int y2 = 0; y2 < by/vertical_sampling; y2++) {
-		    int y = y2*vertical_sampling;
+STEREO_DENSE_AVX2_TARGET
+static void plane_difference_avx2(
+	unsigned char* left,
+	unsigned char* right,
+	int img_pixels,
+	int n,
+	unsigned short* difference)
+{
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i lo = _mm256_setzero_si256();
+		__m256i hi = _mm256_setzero_si256();
+		for (int c = 0; c < 3; c++) {
+			__m256i a = _mm256_loadu_si256((__m256i*)&left[i + c*img_pixels]);
+			__m256i b = _mm256_loadu_si256((__m256i*)&right[i + c*img_pixels]);
+			__m256i diff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+			lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(diff)));
+			hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(diff, 1)));
+		}
+		_mm256_storeu_si256((__m256i*)&difference[i], lo);
+		_mm256_storeu_si256((__m256i*)&difference[i+16], hi);
+	}
+	plane_difference_scalar(&left[i], &right[i], img_pixels, n - i, &difference[i]);
+}
 
-			int yy = y2 / STEREO_DENSE_SMOOTH_VERTICAL;
-			if ((y >= ty) && (yy > 1) && (yy < height2-2)) {
+STEREO_DENSE_AVX2_TARGET
+static void add_row_avx2(
+	unsigned int* row,
+	unsigned int* above,
+	int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i*)&row[i],
+			_mm256_add_epi32(
+				_mm256_loadu_si256((__m256i*)&row[i]),
+				_mm256_loadu_si256((__m256i*)&above[i])));
+	}
+	add_row_scalar(&row[i], &above[i], n - i);
+}
 
-				int yy2 = yy/STEREO_DENSE_OUTER_DIVISOR;
-				int x_right = -offset_x - disparity + correlation_radius;
+/* as cross_check_sse2, with both samples along the row tested together.
+   The low half of each comparison is the first sample and the high half the second */
+STEREO_DENSE_AVX2_TARGET
+static int cross_check_avx2(
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	int img_pixels,
+	int img_width,
+	int n_left,
+	int n_right,
+	int similarity_threshold)
+{
+	if (similarity_threshold <= 0) return(-1);
+	if (similarity_threshold > 766) similarity_threshold = 766;
+
+	const __m256i threshold = _mm256_set1_epi16((short)similarity_threshold);
+	__m256i ok = _mm256_set1_epi16(-1);
+	for (int row = -1; row <= 1; row++) {
+		int nl = n_left + (row*img_width);
+		int nr = n_right + (row*img_width);
+		__m256i diff = _mm256_setzero_si256();
+		for (int c = 0; c < 3; c++, nl += img_pixels, nr += img_pixels) {
+			__m256i left = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_set1_epi16(planes_left[nl])),
+				_mm_set1_epi16(planes_left[nl+1]), 1);
+			__m256i right = _mm256_cvtepu8_epi16(
+				_mm_unpacklo_epi64(
+					_mm_loadl_epi64((__m128i*)&planes_right[nr]),
+					_mm_loadl_epi64((__m128i*)&planes_right[nr+1])));
+			diff = _mm256_add_epi16(diff, _mm256_abs_epi16(_mm256_sub_epi16(left, right)));
+		}
+		ok = _mm256_and_si256(ok, _mm256_cmpgt_epi16(threshold, diff));
+	}
+	int mask = _mm_movemask_epi8(
+		_mm_and_si128(_mm256_castsi256_si128(ok), _mm256_extracti128_si256(ok, 1)));
+	if (mask == 0) return(-1);
+	return((STEREO_DENSE_CROSS_CHECK_TRIES-1) - ((31 - __builtin_clz(mask)) / 2));
+}
 
-				int offsetx0 = x_right - correlation_radius;
-				if (offsetx0 < 0) {
-					offsetx0 = correlation_radius - offsetx0;
-				}
-				else {
-					offsetx0 = correlation_radius;
-				}
+#endif
 
-				int offsetx1 = img_width - offset_x - correlation_radius;
-				if (offsetx1 >= img_width-correlation_radius) {
-					offsetx1 = img_width-correlation_radius-1;
-				}
+/* dispatch to the selected instruction set */
+static void plane_difference(
+	int level,
+	unsigned char* left,
+	unsigned char* right,
+	int img_pixels,
+	int n,
+	unsigned short* difference)
+{
+	switch(level) {
+#ifdef STEREO_DENSE_AVX2_TARGET
+	    case STEREO_DENSE_AVX2: { plane_difference_avx2(left, right, img_pixels, n, difference); break; }
+#endif
+#ifdef __SSE2__
+	    case STEREO_DENSE_SSE2: { plane_difference_sse2(left, right, img_pixels, n, difference); break; }
+#endif
+	    default: { plane_difference_scalar(left, right, img_pixels, n, difference); break; }
+	}
+}
+
+static void add_row(
+	int level,
+	unsigned int* row,
+	unsigned int* above,
+	int n)
+{
+	switch(level) {
+#ifdef STEREO_DENSE_AVX2_TARGET
+	    case STEREO_DENSE_AVX2: { add_row_avx2(row, above, n); break; }
+#endif
+#ifdef __SSE2__
+	    case STEREO_DENSE_SSE2: { add_row_sse2(row, above, n); break; }
+#endif
+	    default: { add_row_scalar(row, above, n); break; }
+	}
+}
 
-				// for all pixels along the row
-				for (int x_left = offsetx0; x_left < offsetx1; x_left++, x_right++) {
+/* number of bits set in a census word */
+static inline int bit_count(
+	unsigned long long v)
+{
+#ifdef __GNUC__
+	return(__builtin_popcountll(v));
+#else
+	int bits = 0;
+	for (; v != 0; bits++) v &= v - 1;
+	return(bits);
+#endif
+}
 
-					int xx_inner = x_left / smoothing_radius;
-					if ((xx_inner > 1) && (xx_inner < width2-2)) {
+/* Hamming distances between census words, for n pixels */
+static void census_difference_scalar(
+	unsigned long long* left,
+	unsigned long long* right,
+	int n,
+	unsigned short* difference)
+{
+	for (int i = 0; i < n; i++) {
+		difference[i] = (unsigned short)bit_count(left[i] ^ right[i]);
+	}
+}
 
-						int sad = SAD(
-							img_left,img_right,img_width,img_height,
-							x_left, y,
-							x_right, y - offset_y, correlation_radius);
+#ifdef STEREO_DENSE_AVX2_TARGET
 
-						if (sad != BAD_MATCH) {
-							unsigned int v = max_patch_value - (unsigned int)sad;
+// every CPU supporting AVX2 also has the popcnt instruction
+__attribute__((target("popcnt")))
+static void census_difference_popcnt(
+	unsigned long long* left,
+	unsigned long long* right,
+	int n,
+	unsigned short* difference)
+{
+	for (int i = 0; i < n; i++) {
+		difference[i] = (unsigned short)__builtin_popcountll(left[i] ^ right[i]);
+	}
+}
 
-							int n_inner = (yy*width2 + xx_inner) + disparity_space_offset;
-							disparity_space[n_inner] += v;
+#endif
 
-							int n_outer = (yy2*width3 + (x_left / (smoothing_radius*STEREO_DENSE_OUTER_DIVISOR))) + disparity_space_offset + disparity_space_pixels;
-							disparity_space[n_outer] += v;
-						}
-					}
-				}
-			}
-		}
+static void census_difference(
+	int level,
+	unsigned long long* left,
+	unsigned long long* right,
+	int n,
+	unsigned short* difference)
+{
+#ifdef STEREO_DENSE_AVX2_TARGET
+	if (level == STEREO_DENSE_AVX2) {
+		census_difference_popcnt(left, right, n, difference);
+		return;
 	}
+#endif
+	census_difference_scalar(left, right, n, difference);
 }
 
 /*!
- * \brief calculates a disparity map given two images
- * \param img_left colour data for the left image2
- * \param img_right colour data for the right image
+ * \brief census transform of a colour image.  Each bit of the census word for a pixel
+ *        is set if the brightness of a pixel within the surrounding window is less than
+ *        that of the centre pixel.  Pixels beyond the edge of the image take the value
+ *        of the nearest edge pixel.
+ * \param img colour image
  * \param img_width width of the image
  * \param img_height height of the image
- * \param offset_x calibration offset x
- * \param offset_y calibration offset y
- * \param vertical_sampling vertical sampling rate - we don't need every row
- * \param max_disparity_percent maximum disparity as a percentage of image width
- * \param correlation_radius radius in pixels used for patch matching
- * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param census returned census words, one per pixel
+ */
+void stereodense::census_transform(
+	unsigned char* img,
+	int img_width,
+	int img_height,
+	unsigned long long* census)
+{
+	const int rx = STEREO_DENSE_CENSUS_WIDTH/2;
+	const int ry = STEREO_DENSE_CENSUS_HEIGHT/2;
+	int padded_width = img_width + (rx*2);
+	int padded_height = img_height + (ry*2);
+
+	// brightness, padded by repeating the edge pixels
+	unsigned short* brightness = new unsigned short[padded_width*padded_height];
+    #pragma omp parallel for
+	for (int y = 0; y < padded_height; y++) {
+		int yy = y - ry;
+		if (yy < 0) yy = 0;
+		if (yy > img_height-1) yy = img_height-1;
+		unsigned char* row = &img[yy*img_width*3];
+		unsigned short* b = &brightness[y*padded_width];
+		for (int x = 0; x < padded_width; x++) {
+			int xx = x - rx;
+			if (xx < 0) xx = 0;
+			if (xx > img_width-1) xx = img_width-1;
+			b[x] = (unsigned short)(row[xx*3] + row[xx*3+1] + row[xx*3+2]);
+		}
+	}
+
+    #pragma omp parallel for
+	for (int y = 0; y < img_height; y++) {
+		unsigned long long* c = &census[y*img_width];
+		unsigned short* centre = &brightness[(y+ry)*padded_width + rx];
+		memset((void*)c, '\0', img_width*sizeof(unsigned long long));
+		for (int dy = -ry; dy <= ry; dy++) {
+			for (int dx = -rx; dx <= rx; dx++) {
+				if ((dx == 0) && (dy == 0)) continue;
+				unsigned short* b = &centre[dy*padded_width + dx];
+				for (int x = 0; x < img_width; x++) {
+					c[x] = (c[x] << 1) | (unsigned long long)(b[x] < centre[x]);
+				}
+			}
+		}
+	}
+	delete [] brightness;
+}
+
+/*!
+ * \brief cross checks a run of consecutive disparities using the census words of the left and right images.
+ *        The census words either side of the location must be within the given Hamming distance.
+ * \param x disparity map x coordinate
+ * \param y disparity map y coordinate
+ * \param disparity first disparity in pixels
+ * \param similarity_threshold maximum Hamming distance between census words
+ * \param census_left census words for the left image
+ * \param census_right census words for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration x offset
+ * \param offset_y calibration y offset
+ * \param smoothing_radius smoothing radius for the disparity space
+ * \param vertical_sampling vertical sampling rate
+ * \return offset from the first disparity of the first one which passes, or -1
+ */
+int stereodense::cross_check_census(
+	int x,
+	int y,
+	int disparity,
+	int similarity_threshold,
+	unsigned long long* census_left,
+	unsigned long long* census_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int smoothing_radius,
+	int vertical_sampling)
+{
+	int y_left = y*STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling;
+	int y_right = y_left - offset_y;
+	int x_left = x*smoothing_radius;
+	if ((y_right < 0) || (y_right >= img_height) || (x_left + 1 >= img_width)) return(-1);
+
+	unsigned long long* left = &census_left[y_left*img_width + x_left];
+	unsigned long long* right = &census_right[y_right*img_width];
+	for (int tries = 0; tries < STEREO_DENSE_CROSS_CHECK_TRIES; tries++) {
+		int x_right = x_left - disparity - tries - offset_x;
+		if ((x_right < 0) || (x_right + 1 >= img_width)) continue;
+		if ((bit_count(left[0] ^ right[x_right]) < similarity_threshold) &&
+			(bit_count(left[1] ^ right[x_right+1]) < similarity_threshold)) {
+			return(tries);
+		}
+	}
+	return(-1);
+}
+
+/*!
+ * \brief cross checks a run of consecutive disparities, in the same way as calling cross_check_pixel for each of them
+ * \param x disparity map x coordinate
+ * \param y disparity map y coordinate
+ * \param disparity first disparity in pixels
+ * \param similarity_threshold maximum pixel difference
+ * \param img_left left colour image
+ * \param img_right right colour image
+ * \param planes_left left image split into colour planes
+ * \param planes_right right image split into colour planes
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration x offset
+ * \param offset_y calibration y offset
+ * \param smoothing_radius smoothing radius for the disparity space
+ * \param vertical_sampling vertical sampling rate
+ * \return offset from the first disparity of the first one which passes, or -1
+ */
+int stereodense::cross_check_disparities(
+	int x,
+	int y,
+	int disparity,
+	int similarity_threshold,
+	unsigned char* img_left,
+	unsigned char* img_right,
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int smoothing_radius,
+	int vertical_sampling)
+{
+	int img_pixels = img_width*img_height;
+	int y_left = y*STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling;
+	int y_right = y_left - offset_y;
+	int x_left = x*smoothing_radius;
+	int n_left = y_left*img_width + x_left;
+	int n_right = y_right*img_width + x_left - disparity - offset_x - (STEREO_DENSE_CROSS_CHECK_TRIES-1);
+
+	// the vector kernels read all tries at once, so they are only
+	// used where every pixel tested lies within the image
+	if ((n_left - img_width >= 0) &&
+		(n_left + img_width + 2 <= img_pixels) &&
+		(n_right - img_width >= 0) &&
+		(n_right + img_width + STEREO_DENSE_CROSS_CHECK_TRIES + 1 <= img_pixels)) {
+		switch(instruction_set()) {
+#ifdef STEREO_DENSE_AVX2_TARGET
+		    case STEREO_DENSE_AVX2: {
+		    	return(cross_check_avx2(planes_left, planes_right, img_pixels, img_width, n_left, n_right, similarity_threshold));
+		    }
+#endif
+#ifdef __SSE2__
+		    case STEREO_DENSE_SSE2: {
+		    	return(cross_check_sse2(planes_left, planes_right, img_pixels, img_width, n_left, n_right, similarity_threshold));
+		    }
+#endif
+		    default: {
+		    	return(cross_check_scalar(planes_left, planes_right, img_pixels, img_width, n_left, n_right, similarity_threshold));
+		    }
+		}
+	}
+
+	for (int tries = 0; tries < STEREO_DENSE_CROSS_CHECK_TRIES; tries++) {
+		if (cross_check_pixel(
+			x, y, disparity + tries, similarity_threshold,
+			img_left, img_right, img_width, img_height,
+			offset_x, offset_y, smoothing_radius, vertical_sampling)) {
+			return(tries);
+		}
+	}
+	return(-1);
+}
+
+/*!
+ * \brief updates the disparity map from the disparity space for a range of disparities.
+ *        Disparities must be supplied in increasing order, with the map cleared beforehand.
+ * \param img_left left colour image
+ * \param img_right right colour image
+ * \param planes_left left image split into colour planes
+ * \param planes_right right image split into colour planes
+ * \param census_left optional census words for the left image, used for cross checking instead of colours
+ * \param census_right optional census words for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration x offset
+ * \param offset_y calibration y offset
+ * \param smoothing_radius smoothing radius for the disparity space
+ * \param vertical_sampling vertical sampling rate
+ * \param disparity_space disparity space containing correlation data for each pixel, beginning at the first disparity
+ * \param disparity_space_width width of the disparity space
+ * \param disparity_space_height height of the disparity space
+ * \param first_row first row of the disparity map to be updated
+ * \param no_of_rows number of rows of the disparity map to be updated
+ * \param disparity_step disparity step size
+ * \param first_disparity_index index of the first disparity within the disparity space
+ * \param no_of_disparities number of disparities within the disparity space
+ * \param band optional minimum and maximum disparity index to be searched at each location
+ * \param similarity_threshold maximum pixel difference, or Hamming distance between census words, when cross checking
+ * \param confidence_shift right shift applied to correlation values before they are stored in the map
+ * \param disparity_map disparity map to be updated
+ */
+template <typename cost_type, typename map_type>
+void stereodense::select_disparities(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	unsigned long long* census_left,
+	unsigned long long* census_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int smoothing_radius,
+	int vertical_sampling,
+	cost_type* disparity_space,
+	int disparity_space_width,
+	int disparity_space_height,
+	int first_row,
+	int no_of_rows,
+	int disparity_step,
+	int first_disparity_index,
+	int no_of_disparities,
+	unsigned short* band,
+	int similarity_threshold,
+	int confidence_shift,
+	map_type* disparity_map)
+{
+	int disparity_space_pixels = disparity_space_width*disparity_space_height;
+	int disparity_space_width2 = disparity_space_width/STEREO_DENSE_OUTER_DIVISOR;
+
+	// largest confidence value which can be stored in the map
+	unsigned int max_confidence = (unsigned int)((map_type)-1);
+
+	// rows are split into tiles, small enough that the disparity map and disparity space
+	// rows for a tile stay in cache while every disparity is tested
+	// the edge rows of the disparity space have no neighbours
+	int ty = first_row;
+	int by = first_row + no_of_rows;
+	if (ty < 1) ty = 1;
+	if (by > disparity_space_height-1) by = disparity_space_height-1;
+	if (by <= ty) return;
+
+	int tile_rows = STEREO_DENSE_TILE_BYTES / (disparity_space_width*3*(int)sizeof(unsigned int));
+	int rows_per_thread = (by - ty + omp_get_max_threads() - 1) / omp_get_max_threads();
+	if (tile_rows > rows_per_thread) tile_rows = rows_per_thread;
+	if (tile_rows < 1) tile_rows = 1;
+	int no_of_tiles = (by - ty + tile_rows - 1) / tile_rows;
+
+	// process each tile in parallel
+    #pragma omp parallel for schedule(dynamic)
+	for (int tile = 0; tile < no_of_tiles; tile++) {
+		int tile_ty = ty + (tile*tile_rows);
+		int tile_by = tile_ty + tile_rows;
+		if (tile_by > by) tile_by = by;
+
+		for (int i = 0; i < no_of_disparities; i++) {
+			int disparity_index = first_disparity_index + i;
+			int disparity_space_offset = i*disparity_space_pixels*2;
+
+			// for every pixel in the tile at this disparity
+			for (int y = tile_ty; y < tile_by; y++) {
+				int y2 = y/STEREO_DENSE_OUTER_DIVISOR;
+				int n_map = (y*disparity_space_width + 1)*2;
+				int n_space_inner = disparity_space_offset + (y*disparity_space_width) + 1;
+				for (int x = 1; x < disparity_space_width-1; x++, n_map += 2, n_space_inner++) {
+
+					// is this disparity within the search band for this location?
+					if ((band != NULL) &&
+						((disparity_index < (int)band[n_map]) || (disparity_index > (int)band[n_map+1]))) {
+						continue;
+					}
+
+					int n_space_outer = disparity_space_pixels + disparity_space_offset + (y2*disparity_space_width2) + (x/STEREO_DENSE_OUTER_DIVISOR);
+
+					// small correlation window
+					unsigned int local_correlation_inner =
+						disparity_space[n_space_inner] +
+						disparity_space[n_space_inner-1] +
+						disparity_space[n_space_inner+1] +
+						disparity_space[n_space_inner-disparity_space_width] +
+						disparity_space[n_space_inner+disparity_space_width] +
+						disparity_space[n_space_inner+disparity_space_width-1] +
+						disparity_space[n_space_inner+disparity_space_width+1] +
+						disparity_space[n_space_inner-disparity_space_width-1] +
+						disparity_space[n_space_inner-disparity_space_width+1];
+
+					// large correlation window
+					unsigned int local_correlation_outer =
+						disparity_space[n_space_outer] +
+						disparity_space[n_space_outer-1] +
+						disparity_space[n_space_outer+1] +
+						disparity_space[n_space_outer-disparity_space_width2] +
+						disparity_space[n_space_outer+disparity_space_width2] +
+						disparity_space[n_space_outer+disparity_space_width2-1] +
+						disparity_space[n_space_outer+disparity_space_width2+1] +
+						disparity_space[n_space_outer-disparity_space_width2-1] +
+						disparity_space[n_space_outer-disparity_space_width2+1];
+
+					// combined correlation value
+					// more emphasis on the centre, less on the surround
+					unsigned int local_correlation = (local_correlation_inner*STEREO_DENSE_OUTER_DIVISOR) + local_correlation_outer;
+					if (local_correlation == 0) continue;
+
+					// scaled to the range of the map
+					local_correlation >>= confidence_shift;
+					if (local_correlation == 0) local_correlation = 1;
+					if (local_correlation > max_confidence) local_correlation = max_confidence;
+
+					// is this the best correlation value so far?
+					if ((disparity_map[n_map] == 0) ||
+						(disparity_map[n_map] < local_correlation)) {
+
+						// if the pixels look similar then this may be a valid match
+						int tries;
+						if (census_left != NULL) {
+							tries = cross_check_census(
+								x,
+								y,
+								disparity_index*disparity_step,
+								similarity_threshold,
+								census_left,
+								census_right,
+								img_width,
+								img_height,
+								offset_x,
+								offset_y,
+								smoothing_radius,
+								vertical_sampling);
+						}
+						else {
+							tries = cross_check_disparities(
+								x,
+								y,
+								disparity_index*disparity_step,
+								similarity_threshold,
+								img_left,
+								img_right,
+								planes_left,
+								planes_right,
+								img_width,
+								img_height,
+								offset_x,
+								offset_y,
+								smoothing_radius,
+								vertical_sampling);
+						}
+
+						if (tries > -1) {
+						    // update the disparity map
+						    disparity_map[n_map] = (map_type)local_correlation;
+						    disparity_map[n_map + 1] = (map_type)((disparity_index*disparity_step) + tries);
+						}
+					}
+
+				}
+			}
+		}
+	}
+
+}
+
+/*!
+ * \brief generates a disparity map from the disparity space
+ * \param img_left left colour image
+ * \param img_right right colour image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration x offset
+ * \param offset_y calibration y offset
+ * \param smoothing_radius smoothing radius for the disparity space
+ * \param vertical_sampling vertical sampling rate
+ * \param disparity_space disparity space containing correlation data for each pixel at each possible disparity
+ * \param disparity_space_width width of the disparity space
+ * \param disparity_space_height height of the disparity space
+ * \param disparity_step disparity step size
+ * \param no_of_disparities number of disparities within the disparity space
+ * \param similarity_threshold maximum pixel difference when cross checking
+ * \param disparity_map returned disparity map
+ */
+void stereodense::disparity_map_from_disparity_space(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int smoothing_radius,
+	int vertical_sampling,
+	unsigned int* disparity_space,
+	int disparity_space_width,
+	int disparity_space_height,
+	int disparity_step,
+	int no_of_disparities,
+	int similarity_threshold,
+	unsigned int* disparity_map)
+{
+	int img_pixels = img_width*img_height;
+
+	// clear the disparity map
+	memset((void*)disparity_map,'\0',disparity_space_width*disparity_space_height*2*sizeof(unsigned int));
+
+	// colour planes used for cross checking
+	instruction_set();
+	unsigned char* planes_left = new unsigned char[img_pixels*3];
+	unsigned char* planes_right = new unsigned char[img_pixels*3];
+	planar(img_left, img_pixels, planes_left);
+	planar(img_right, img_pixels, planes_right);
+
+	select_disparities(
+		img_left, img_right, planes_left, planes_right, NULL, NULL,
+		img_width, img_height, offset_x, offset_y,
+		smoothing_radius, vertical_sampling,
+		disparity_space, disparity_space_width, disparity_space_height, 0, disparity_space_height,
+		disparity_step, 0, no_of_disparities, NULL,
+		similarity_threshold, 0, disparity_map);
+
+	delete [] planes_left;
+	delete [] planes_right;
+}
+
+/*!
+ * \brief returns the sum of values within a window of a strided integral image.
+ *        Windows are defined on the flat pixel index (row*img_width + column), so columns
+ *        outside of the range 0..img_width-1 wrap onto neighbouring rows in the same way
+ *        as a direct scan of the image buffer does.
+ * \param integral strided integral image, as created by integral_channel or integral_difference
+ * \param lo first flat pixel index covered by the integral image
+ * \param hi last flat pixel index (exclusive) covered by the integral image
+ * \param img_width width of the image
+ * \param y0 top row of the window
+ * \param y1 bottom row of the window
+ * \param x0 left column of the window
+ * \param x1 right column of the window
+ * \return sum of values within the window
+ */
+static inline unsigned int window_sum(
+	unsigned int* integral,
+	int lo,
+	int hi,
+	int img_width,
+	int y0,
+	int y1,
+	int x0,
+	int x1)
+{
+	int n[4];
+	n[0] = y1*img_width + x1 + 1;
+	n[1] = (y0-1)*img_width + x1 + 1;
+	n[2] = y1*img_width + x0;
+	n[3] = (y0-1)*img_width + x0;
+
+	unsigned int v[4];
+	for (int i = 0; i < 4; i++) {
+		if (n[i] < lo)
+			v[i] = 0;
+		else if (n[i] > hi)
+			v[i] = integral[hi - lo];
+		else
+			v[i] = integral[n[i] - lo];
+	}
+
+	// unsigned arithmetic, so overflow of the running totals cancels out
+	return(v[0] - v[1] - v[2] + v[3]);
+}
+
+/*!
+ * \brief creates a strided integral image for one colour channel.
+ *        integral[i] is the sum of the running total of the image at i, i-img_width, i-2*img_width...
+ *        which allows the sum of any window to be found with four lookups.
+ * \param img colour image
+ * \param channel colour channel 0=blue 1=green 2=red
+ * \param img_width width of the image
+ * \param lo first flat pixel index
+ * \param hi last flat pixel index (exclusive)
+ * \param above optional img_width+1 entries of an integral image of the pixels before lo, ending at lo, which is then continued
+ * \param integral returned integral image with hi-lo+1 entries
+ */
+void stereodense::integral_channel(
+	unsigned char* img,
+	int channel,
+	int img_width,
+	int lo,
+	int hi,
+	unsigned int* above,
+	unsigned int* integral)
+{
+	unsigned int total = 0;
+	integral[0] = 0;
+	if (above != NULL) {
+		total = above[img_width] - above[0];
+		integral[0] = above[img_width];
+	}
+	for (int i = lo+1; i <= hi; i++) {
+		total += img[(i-1)*3 + channel];
+		integral[i - lo] = total;
+		if (i - img_width >= lo)
+			integral[i - lo] += integral[i - img_width - lo];
+		else if (above != NULL)
+			integral[i - lo] += above[i - lo];
+	}
+}
+
+/*!
+ * \brief creates an integral image of the absolute differences between a rectangle of the left
+ *        image and the right image shifted by the given number of pixels.  If census words are
+ *        given then the Hamming distances between them are used instead of colour differences.
+ * \param planes_left left image split into colour planes
+ * \param planes_right right image split into colour planes
+ * \param census_left optional census words for the left image
+ * \param census_right optional census words for the right image
+ * \param img_pixels number of pixels in each image
+ * \param img_width width of the image
+ * \param offset flat pixel index of the left image minus the corresponding index in the right image
+ * \param tx left column of the rectangle
+ * \param ty top row of the rectangle
+ * \param bx right column of the rectangle (exclusive)
+ * \param by bottom row of the rectangle (exclusive)
+ * \param difference buffer of img_width values used for the differences along each row
+ * \param integral returned integral image with (bx-tx+1)*(by-ty+1) entries, the first row and column being zero
+ */
+void stereodense::integral_difference(
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	unsigned long long* census_left,
+	unsigned long long* census_right,
+	int img_pixels,
+	int img_width,
+	int offset,
+	int tx,
+	int ty,
+	int bx,
+	int by,
+	unsigned short* difference,
+	unsigned int* integral)
+{
+	int level = instruction_set();
+	int w = bx - tx;
+	int stride = w + 1;
+
+	// range of left image pixels for which the right image pixel is inside the image
+	int valid0 = offset;
+	int valid1 = img_pixels + offset;
+
+	memset((void*)integral, '\0', stride*sizeof(unsigned int));
+	for (int y = ty; y < by; y++) {
+		int start = y*img_width + tx;
+		int end = start + w;
+
+		// absolute differences along the row
+		int v0 = start;
+		int v1 = end;
+		if (v0 < valid0) v0 = valid0;
+		if (v1 > valid1) v1 = valid1;
+		if (v1 > v0) {
+			memset((void*)difference, '\0', (v0 - start)*sizeof(unsigned short));
+			if (census_left != NULL)
+				census_difference(level, &census_left[v0], &census_right[v0 - offset], v1 - v0, &difference[v0 - start]);
+			else
+				plane_difference(level, &planes_left[v0], &planes_right[v0 - offset], img_pixels, v1 - v0, &difference[v0 - start]);
+			memset((void*)&difference[v1 - start], '\0', (end - v1)*sizeof(unsigned short));
+		}
+		else {
+			memset((void*)difference, '\0', w*sizeof(unsigned short));
+		}
+
+		// running total, plus the totals from the row above
+		unsigned int* row = &integral[(y - ty + 1)*stride];
+		unsigned int total = 0;
+		row[0] = 0;
+		for (int i = 0; i < w; i++) {
+			total += difference[i];
+			row[i+1] = total;
+		}
+		add_row(level, &row[1], &row[1 - stride], w);
+	}
+}
+
+/*!
+ * \brief returns the sum of values within a window of an integral image created by integral_difference.
+ *        Parts of the window outside of the rectangle are treated as zero.
+ * \param integral integral image
+ * \param tx left column of the rectangle
+ * \param ty top row of the rectangle
+ * \param bx right column of the rectangle (exclusive)
+ * \param by bottom row of the rectangle (exclusive)
+ * \param x0 left column of the window
+ * \param y0 top row of the window
+ * \param x1 right column of the window
+ * \param y1 bottom row of the window
+ * \return sum of values within the window
+ */
+static inline unsigned int rectangle_sum(
+	unsigned int* integral,
+	int tx,
+	int ty,
+	int bx,
+	int by,
+	int x0,
+	int y0,
+	int x1,
+	int y1)
+{
+	if (x0 < tx) x0 = tx;
+	if (y0 < ty) y0 = ty;
+	if (x1 >= bx) x1 = bx-1;
+	if (y1 >= by) y1 = by-1;
+	if ((x1 < x0) || (y1 < y0)) return(0);
+
+	int stride = bx - tx + 1;
+	int n0 = (y0 - ty)*stride;
+	int n1 = (y1 + 1 - ty)*stride;
+	return(integral[n1 + x1 + 1 - tx] - integral[n0 + x1 + 1 - tx] -
+		   integral[n1 + x0 - tx] + integral[n0 + x0 - tx]);
+}
+
+/*!
+ * \brief adds a region of outer cells to the list of regions to be matched
+ * \param oy0 top row of outer cells
+ * \param oy1 bottom row of outer cells
+ * \param ox0 left column of outer cells
+ * \param ox1 right column of outer cells (exclusive)
+ * \param disparity_space_width width of the disparity space
+ * \param disparity_space_height height of the disparity space
+ * \param regions list of regions
+ * \param no_of_regions number of regions in the list
+ * \return updated number of regions
+ */
+static inline int add_region(
+	int oy0,
+	int oy1,
+	int ox0,
+	int ox1,
+	int disparity_space_width,
+	int disparity_space_height,
+	int* regions,
+	int no_of_regions)
+{
+	int* region = &regions[no_of_regions*4];
+	region[0] = oy0*STEREO_DENSE_OUTER_DIVISOR;
+	region[1] = (oy1+1)*STEREO_DENSE_OUTER_DIVISOR - 1;
+	region[2] = ox0*STEREO_DENSE_OUTER_DIVISOR;
+	region[3] = ox1*STEREO_DENSE_OUTER_DIVISOR - 1;
+	if (region[1] > disparity_space_height-1) region[1] = disparity_space_height-1;
+	if (region[3] > disparity_space_width-1) region[3] = disparity_space_width-1;
+	return(no_of_regions+1);
+}
+
+/*!
+ * \brief finds the regions of the disparity space whose costs are needed by the winner-take-all at the given disparity.
+ *        Regions are vertical strips of outer cells, split into runs of the rows needed within each strip.
+ * \param band minimum and maximum disparity index for each location in the disparity space
+ * \param disparity_space_width width of the disparity space
+ * \param disparity_space_height height of the disparity space
+ * \param disparity_index disparity index
+ * \param needed buffer with one entry per outer cell
+ * \param regions returned top row, bottom row, left column and right column of each region, inclusive
+ * \return number of regions
+ */
+static int band_regions(
+	unsigned short* band,
+	int disparity_space_width,
+	int disparity_space_height,
+	int disparity_index,
+	unsigned char* needed,
+	int* regions)
+{
+	int outer_width = (disparity_space_width + STEREO_DENSE_OUTER_DIVISOR - 1) / STEREO_DENSE_OUTER_DIVISOR;
+	int outer_height = (disparity_space_height + STEREO_DENSE_OUTER_DIVISOR - 1) / STEREO_DENSE_OUTER_DIVISOR;
+
+	// outer cells containing a location which searches this disparity
+	memset((void*)needed, '\0', outer_width*outer_height);
+	for (int y = 0; y < disparity_space_height; y++) {
+		unsigned short* b = &band[y*disparity_space_width*2];
+		unsigned char* n = &needed[(y/STEREO_DENSE_OUTER_DIVISOR)*outer_width];
+		for (int x = 0; x < disparity_space_width; x++, b += 2) {
+			if ((disparity_index >= (int)b[0]) && (disparity_index <= (int)b[1])) {
+				n[x/STEREO_DENSE_OUTER_DIVISOR] = 1;
+			}
+		}
+	}
+
+	int no_of_regions = 0;
+	for (int sx = 0; sx < outer_width; sx += STEREO_DENSE_BAND_STRIP) {
+		int ex = sx + STEREO_DENSE_BAND_STRIP;
+
+		// the winner-take-all uses costs from neighbouring outer cells,
+		// so a strip is needed by locations up to one outer cell beyond it
+		int cx0 = sx - 1;
+		int cx1 = ex;
+		if (cx0 < 0) cx0 = 0;
+		if (cx1 > outer_width-1) cx1 = outer_width-1;
+		// runs of rows needed within the strip, extended by one outer cell above and below
+		int run_start = -1;
+		int run_end = -1;
+		for (int oy = 0; oy <= outer_height; oy++) {
+			bool strip_needed = false;
+			if (oy < outer_height) {
+				for (int ox = cx0; ox <= cx1; ox++) {
+					if (needed[oy*outer_width + ox] != 0) {
+						strip_needed = true;
+						break;
+					}
+				}
+			}
+			if (strip_needed) {
+				int oy0 = oy - 1;
+				if (oy0 < 0) oy0 = 0;
+				if ((run_start < 0) || (oy0 > run_end + 1)) {
+					if (run_start >= 0) {
+						no_of_regions = add_region(run_start, run_end, sx, ex, disparity_space_width, disparity_space_height, regions, no_of_regions);
+					}
+					run_start = oy0;
+				}
+				run_end = oy + 1;
+				if (run_end > outer_height-1) run_end = outer_height-1;
+			}
+		}
+		if (run_start >= 0) {
+			no_of_regions = add_region(run_start, run_end, sx, ex, disparity_space_width, disparity_space_height, regions, no_of_regions);
+		}
+	}
+	return(no_of_regions);
+}
+
+/* adds a matching score to the disparity space */
+static inline void add_cost(
+	unsigned int* cost,
+	unsigned int v,
+	int)
+{
+	*cost += v;
+}
+
+/* adds a matching score to a 16 bit disparity space, saturating rather than overflowing */
+static inline void add_cost(
+	unsigned short* cost,
+	unsigned int v,
+	int cost_shift)
+{
+	unsigned int total = (unsigned int)*cost + (v >> cost_shift);
+	*cost = (unsigned short)(total < 65535 ? total : 65535);
+}
+
+/*!
+ * \brief adds matching scores to the disparity space for a range of disparities.
+ *        Patch sums of absolute differences, together with the gradient and colour opponency
+ *        tests, are found from integral images, so that the cost per pixel does not depend upon
+ *        the correlation radius.  The result is the same as calling SAD for every pixel.
+ *        If census words are given then patch sums of Hamming distances between them are used
+ *        instead, without the gradient and colour opponency tests.
+ * \param planes_left left image split into colour planes
+ * \param planes_right right image split into colour planes
+ * \param census_left optional census words for the left image
+ * \param census_right optional census words for the right image
+ * \param channel_integral integral images for each colour channel of the left and right images, not needed with census words
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param disparity_space_width width of the disparity space
+ * \param disparity_space_height height of the disparity space
+ * \param first_row first row of the disparity space to be updated.  Rows of outer cells are cleared, so the rows should begin and end on outer cell boundaries
+ * \param no_of_rows number of rows of the disparity space to be updated
+ * \param first_disparity_index index of the first disparity to be matched
+ * \param no_of_disparities number of disparities to be matched
+ * \param band optional minimum and maximum disparity index for each location in the disparity space.  Rows are only matched at disparities needed by the winner-take-all for those locations
+ * \param cost_shift right shift applied to each score before it is added, so that 16 bit values do not saturate
+ * \param disparity_space array used for the disparity space, beginning at the first disparity
+ */
+template <typename cost_type>
+void stereodense::update_costs(
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	unsigned long long* census_left,
+	unsigned long long* census_right,
+	unsigned int** channel_integral,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int correlation_radius,
+	int smoothing_radius,
+	int disparity_step,
+	int disparity_space_width,
+	int disparity_space_height,
+	int first_row,
+	int no_of_rows,
+	int first_disparity_index,
+	int no_of_disparities,
+	unsigned short* band,
+	int cost_shift,
+	cost_type *disparity_space)
+{
+	int patch_pixels = correlation_radius*2+1;
+	patch_pixels *= patch_pixels;
+	unsigned int max_patch_value = (unsigned int)(3*255*patch_pixels);
+	if (census_left != NULL) max_patch_value = (unsigned int)(STEREO_DENSE_CENSUS_BITS*patch_pixels);
+
+	int img_height2 = img_height / vertical_sampling;
+	int width2 = img_width / smoothing_radius;
+	int height2 = img_height2 / STEREO_DENSE_SMOOTH_VERTICAL;
+	int width3 = img_width / (smoothing_radius*STEREO_DENSE_OUTER_DIVISOR);
+	int img_pixels = img_width*img_height;
+
+	int ty = 0;
+	int by = img_height;
+	if (offset_y >= 0)
+		by = img_height - offset_y;
+	else
+		ty = -offset_y;
+
+	int disparity_space_pixels = disparity_space_width*disparity_space_height;
+
+	// clear disparity space
+	int last_row = first_row + no_of_rows - 1;
+	if ((first_row == 0) && (last_row == disparity_space_height-1)) {
+		memset((void*)disparity_space,'\0', no_of_disparities*disparity_space_pixels*2*sizeof(cost_type));
+	}
+	else {
+		int first_row2 = first_row/STEREO_DENSE_OUTER_DIVISOR;
+		int last_row2 = last_row/STEREO_DENSE_OUTER_DIVISOR;
+		for (int i = 0; i < no_of_disparities; i++) {
+			cost_type* inner = &disparity_space[i*disparity_space_pixels*2];
+			memset((void*)&inner[first_row*disparity_space_width],'\0', no_of_rows*disparity_space_width*sizeof(cost_type));
+			memset((void*)&inner[disparity_space_pixels + (first_row2*width3)],'\0', (last_row2 - first_row2 + 1)*width3*sizeof(cost_type));
+		}
+	}
+
+	// range of rows to be matched
+	int min_y = img_height;
+	int max_y = -1;
+	for (int y2 = 0; y2 < by/vertical_sampling; y2++) {
+		int y = y2*vertical_sampling;
+		int yy = y2 / STEREO_DENSE_SMOOTH_VERTICAL;
+		if ((y >= ty) && (yy > 1) && (yy < height2-2) &&
+			(yy >= first_row) && (yy <= last_row)) {
+			if (y < min_y) min_y = y;
+			max_y = y;
+		}
+	}
+	if (max_y < 0) return;
+
+	// integral images used for the gradient and opponency tests
+	bool opponency_tests = (census_left == NULL);
+	unsigned int* left_blue = NULL;
+	unsigned int* left_green = NULL;
+	unsigned int* left_red = NULL;
+	unsigned int* right_blue = NULL;
+	unsigned int* right_green = NULL;
+	unsigned int* right_red = NULL;
+	if (opponency_tests) {
+		left_blue = channel_integral[0];
+		left_green = channel_integral[1];
+		left_red = channel_integral[2];
+		right_blue = channel_integral[3];
+		right_green = channel_integral[4];
+		right_red = channel_integral[5];
+	}
+
+	int outer_width = (disparity_space_width + STEREO_DENSE_OUTER_DIVISOR - 1) / STEREO_DENSE_OUTER_DIVISOR;
+	int outer_height = (disparity_space_height + STEREO_DENSE_OUTER_DIVISOR - 1) / STEREO_DENSE_OUTER_DIVISOR;
+	int max_regions = ((outer_width / STEREO_DENSE_BAND_STRIP) + 1) * outer_height;
+
+	// rows of the left image matched with each integral image of differences, so that
+	// it covers no more than STEREO_DENSE_DIFFERENCE_ROWS rows and stays in cache
+	int chunk_rows = (((STEREO_DENSE_DIFFERENCE_ROWS - (correlation_radius*2) - 1) / vertical_sampling) + 1)*vertical_sampling;
+	if (chunk_rows < vertical_sampling) chunk_rows = vertical_sampling;
+	int max_rows = max_y - min_y + (correlation_radius*2) + 1;
+	if (max_rows > chunk_rows - vertical_sampling + (correlation_radius*2) + 1)
+		max_rows = chunk_rows - vertical_sampling + (correlation_radius*2) + 1;
+	if (max_rows > img_height) max_rows = img_height;
+
+    #pragma omp parallel
+	{
+		unsigned int* difference_integral = new unsigned int[(max_rows+1)*(img_width+1)];
+		unsigned short* difference = new unsigned short[img_width];
+		int* regions = new int[max_regions*4];
+		unsigned char* needed = NULL;
+		if (band != NULL) needed = new unsigned char[outer_width*outer_height];
+
+		// test a number of possible disparities in parallel
+        #pragma omp for schedule(dynamic)
+		for (int i = 0; i < no_of_disparities; i++) {
+
+			// disparity in pixels
+			int disparity = (first_disparity_index + i) * disparity_step;
+
+			// offset within the disparity space array
+			int disparity_space_offset = i*disparity_space_pixels*2;
+
+			// position of the first pixel in the right image relative to the left
+			int x_right_start = -offset_x - disparity + correlation_radius;
+			int offsetx0 = x_right_start - correlation_radius;
+			if (offsetx0 < 0) {
+				offsetx0 = correlation_radius - offsetx0;
+			}
+			else {
+				offsetx0 = correlation_radius;
+			}
+
+			int offsetx1 = img_width - offset_x - correlation_radius;
+			if (offsetx1 >= img_width-correlation_radius) {
+				offsetx1 = img_width-correlation_radius-1;
+			}
+
+			// flat pixel index of the left image minus the corresponding index in the right image
+			int offset = (offset_y*img_width) + offsetx0 - x_right_start;
+
+			// regions of the disparity space to be matched at this disparity
+			int no_of_regions = 1;
+			regions[0] = 0;
+			regions[1] = height2-1;
+			regions[2] = 0;
+			regions[3] = width2-1;
+			if (band != NULL) {
+				no_of_regions = band_regions(
+					band, disparity_space_width, disparity_space_height,
+					first_disparity_index + i, needed, regions);
+			}
+
+			for (int r = 0; r < no_of_regions; r++) {
+				int* region = &regions[r*4];
+
+				// rows and columns of the left image within the region
+				int region_min_y = region[0]*STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling;
+				int region_max_y = ((region[1]+1)*STEREO_DENSE_SMOOTH_VERTICAL - 1)*vertical_sampling;
+				if (region_min_y < min_y) region_min_y = min_y;
+				if (region_max_y > max_y) region_max_y = max_y;
+				int region_x0 = region[2]*smoothing_radius;
+				int region_x1 = (region[3]+1)*smoothing_radius;
+				if (region_x0 < offsetx0) region_x0 = offsetx0;
+				if (region_x1 > offsetx1) region_x1 = offsetx1;
+				if ((region_max_y < region_min_y) || (region_x1 <= region_x0)) continue;
+
+				for (int chunk_min_y = region_min_y; chunk_min_y <= region_max_y; chunk_min_y += chunk_rows) {
+					int chunk_max_y = chunk_min_y + chunk_rows - vertical_sampling;
+					if (chunk_max_y > region_max_y) chunk_max_y = region_max_y;
+
+					// absolute differences between the left and right images at this disparity,
+					// for the rectangle covered by the correlation windows
+					int rect_tx = region_x0 - correlation_radius;
+					int rect_bx = region_x1 + correlation_radius;
+					int rect_ty = chunk_min_y - correlation_radius;
+					int rect_by = chunk_max_y + correlation_radius + 1;
+					if (rect_ty < 0) rect_ty = 0;
+					if (rect_by > img_height) rect_by = img_height;
+					integral_difference(
+						planes_left, planes_right, census_left, census_right, img_pixels, img_width, offset,
+						rect_tx, rect_ty, rect_bx, rect_by,
+						difference, difference_integral);
+
+					// insert correlation values into the disparity space
+					for (int y2 = chunk_min_y/vertical_sampling; y2 <= chunk_max_y/vertical_sampling; y2++) {
+						int y = y2*vertical_sampling;
+
+						int yy = y2 / STEREO_DENSE_SMOOTH_VERTICAL;
+						if ((y >= ty) && (y2 < by/vertical_sampling) && (yy > 1) && (yy < height2-2) &&
+							(yy >= region[0]) && (yy <= region[1])) {
+
+							int yy2 = yy/STEREO_DENSE_OUTER_DIVISOR;
+							int x_right = x_right_start + (region_x0 - offsetx0);
+							int y_right = y - offset_y;
+							int y0 = y - correlation_radius;
+							int y1 = y + correlation_radius;
+
+							// for all pixels along the row
+							for (int x_left = region_x0; x_left < region_x1; x_left++, x_right++) {
+
+								int xx_inner = x_left / smoothing_radius;
+								if ((xx_inner > 1) && (xx_inner < width2-2)) {
+
+									int x0 = x_left - correlation_radius;
+									int x1 = x_left + correlation_radius;
+									int sad = (int)rectangle_sum(difference_integral, rect_tx, rect_ty, rect_bx, rect_by, x0, y0, x1, y1);
+
+									// gradient and colour opponency tests, which census words make unnecessary
+									if (opponency_tests) {
+										int xr0 = x_right - correlation_radius;
+										int xr1 = x_right + correlation_radius;
+										int yr0 = y_right - correlation_radius;
+										int yr1 = y_right + correlation_radius;
+
+										int left_red_sum = (int)window_sum(left_red, 0, img_pixels, img_width, y0, y1, x0, x1);
+										int right_red_sum = (int)window_sum(right_red, 0, img_pixels, img_width, yr0, yr1, xr0, xr1);
+
+										// horizontal gradient
+										int left_horiz0 = (int)window_sum(left_red, 0, img_pixels, img_width, y0, y1, x0, x_left-1);
+										int right_horiz0 = (int)window_sum(right_red, 0, img_pixels, img_width, yr0, yr1, xr0, x_right-1);
+										int left_horiz = left_red_sum - (2*left_horiz0);
+										int right_horiz = right_red_sum - (2*right_horiz0);
+										if (((left_horiz < 0) && (right_horiz > 0)) ||
+											((left_horiz > 0) && (right_horiz < 0))) {
+											continue;
+										}
+
+										// vertical gradient
+										int left_vert0 = (int)window_sum(left_red, 0, img_pixels, img_width, y0, y-1, x0, x1);
+										int right_vert0 = (int)window_sum(right_red, 0, img_pixels, img_width, yr0, y_right-1, xr0, xr1);
+										int left_vert = left_red_sum - (2*left_vert0);
+										int right_vert = right_red_sum - (2*right_vert0);
+										if (((left_vert < 0) && (right_vert > 0)) ||
+											((left_vert > 0) && (right_vert < 0))) {
+											continue;
+										}
+
+										// red-green opponency
+										int left_green_sum = (int)window_sum(left_green, 0, img_pixels, img_width, y0, y1, x0, x1);
+										int right_green_sum = (int)window_sum(right_green, 0, img_pixels, img_width, yr0, yr1, xr0, xr1);
+										int left_RG = left_red_sum - left_green_sum;
+										int right_RG = right_red_sum - right_green_sum;
+										if (((left_RG < 0) && (right_RG > 0)) ||
+											((left_RG > 0) && (right_RG < 0))) {
+											continue;
+										}
+
+										// blue-yellow opponency
+										int left_blue_sum = (int)window_sum(left_blue, 0, img_pixels, img_width, y0, y1, x0, x1);
+										int right_blue_sum = (int)window_sum(right_blue, 0, img_pixels, img_width, yr0, yr1, xr0, xr1);
+										int left_BY = (left_blue_sum*2) - left_green_sum - left_red_sum;
+										int right_BY = (right_blue_sum*2) - right_green_sum - right_red_sum;
+										if (((left_BY < 0) && (right_BY > 0)) ||
+											((left_BY > 0) && (right_BY < 0))) {
+											continue;
+										}
+									}
+
+									unsigned int v = max_patch_value - (unsigned int)sad;
+
+									int n_inner = (yy*width2 + xx_inner) + disparity_space_offset;
+									add_cost(&disparity_space[n_inner], v, cost_shift);
+
+									int n_outer = (yy2*width3 + (x_left / (smoothing_radius*STEREO_DENSE_OUTER_DIVISOR))) + disparity_space_offset + disparity_space_pixels;
+									add_cost(&disparity_space[n_outer], v, cost_shift);
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+
+		delete [] difference_integral;
+		delete [] difference;
+		delete [] regions;
+		if (needed != NULL) delete [] needed;
+	}
+}
+
+
+/*!
+ * \brief splits the images into colour planes and creates integral images for each colour channel
+ * \param img_left left colour image
+ * \param img_right right colour image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param planes_left returned left image colour planes
+ * \param planes_right returned right image colour planes
+ * \param channel_integral six arrays of img_width*img_height+1 values, returning the blue, green and red integral images for the left then the right image
+ */
+void stereodense::matching_images(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	unsigned char* planes_left,
+	unsigned char* planes_right,
+	unsigned int** channel_integral)
+{
+	int img_pixels = img_width*img_height;
+	planar(img_left, img_pixels, planes_left);
+	planar(img_right, img_pixels, planes_right);
+    #pragma omp parallel for
+	for (int i = 0; i < 6; i++) {
+		integral_channel(i < 3 ? img_left : img_right, i % 3, img_width, 0, img_pixels, NULL, channel_integral[i]);
+	}
+}
+
+/*!
+ * \brief returns the size of the buffer holding the colour planes and integral images used for matching.
+ *        A buffer of this size can be passed to the update_disparity_map functions, so that it is kept
+ *        between frames rather than being allocated for each one.
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \return size of the buffer in bytes
+ */
+int stereodense::matching_buffer_size(
+	int img_width,
+	int img_height)
+{
+	int img_pixels = img_width*img_height;
+	int planes_bytes = ((img_pixels*6 + 15) / 16)*16;
+	return(planes_bytes + (6*(img_pixels+1)*(int)sizeof(unsigned int)));
+}
+
+/*!
+ * \brief returns the size of the scratch memory used by each thread while matching,
+ *        which is dominated by the integral image of differences
+ * \param img_width width of the image
+ * \return size of the scratch memory in bytes
+ */
+int stereodense::matching_scratch_size(
+	int img_width)
+{
+	return(((STEREO_DENSE_DIFFERENCE_ROWS+1)*(img_width+1)*(int)sizeof(unsigned int)) +
+		   (img_width*(int)sizeof(unsigned short)));
+}
+
+/*!
+ * \brief divides a buffer of matching_buffer_size bytes into colour planes and integral images
+ * \param matching_buffer buffer to be used, or NULL to allocate one
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param planes_left returned left image colour planes
+ * \param planes_right returned right image colour planes
+ * \param channel_integral returned integral images for each colour channel of the left and right images
+ * \return the buffer allocated, which should be deleted by the caller, or NULL if matching_buffer was given
+ */
+unsigned char* stereodense::matching_buffers(
+	unsigned char* matching_buffer,
+	int img_width,
+	int img_height,
+	unsigned char* &planes_left,
+	unsigned char* &planes_right,
+	unsigned int** channel_integral)
+{
+	unsigned char* allocated = NULL;
+	if (matching_buffer == NULL) {
+		allocated = new unsigned char[matching_buffer_size(img_width, img_height)];
+		matching_buffer = allocated;
+	}
+	int img_pixels = img_width*img_height;
+	planes_left = matching_buffer;
+	planes_right = &matching_buffer[img_pixels*3];
+	unsigned int* integral = (unsigned int*)&matching_buffer[((img_pixels*6 + 15) / 16)*16];
+	for (int i = 0; i < 6; i++) {
+		channel_integral[i] = &integral[i*(img_pixels+1)];
+	}
+	return(allocated);
+}
+
+/*!
+ * \brief updates the disparity space which contains matching correlation values for each possible disparity
+ * \param img_left colour data for the left image2
+ * \param img_right colour data for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param disparity_space_width width of the disparity space
+ * \param disparity_space_height height of the disparity space
+ * \param disparity_space array used for the disparity space
+ * \param matching_buffer optional buffer of matching_buffer_size bytes, returning the colour planes and integral images
+ */
+void stereodense::update_disparity_space(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int max_disparity_percent,
+	int correlation_radius,
+	int smoothing_radius,
+	int disparity_step,
+	int disparity_space_width,
+	int disparity_space_height,
+	unsigned int *disparity_space,
+	unsigned char *matching_buffer)
+{
+	int max_disparity = max_disparity_percent * img_width / 100;
+	int no_of_disparities = max_disparity / disparity_step;
+
+	instruction_set();
+	unsigned char* planes_left;
+	unsigned char* planes_right;
+	unsigned int* channel_integral[6];
+	unsigned char* allocated = matching_buffers(matching_buffer, img_width, img_height, planes_left, planes_right, channel_integral);
+	matching_images(img_left, img_right, img_width, img_height, planes_left, planes_right, channel_integral);
+
+	update_costs(
+		planes_left, planes_right, NULL, NULL, channel_integral,
+		img_width, img_height, offset_x, offset_y,
+		vertical_sampling, correlation_radius, smoothing_radius, disparity_step,
+		disparity_space_width, disparity_space_height, 0, disparity_space_height,
+		0, no_of_disparities, NULL, 0, disparity_space);
+
+	if (allocated != NULL) delete [] allocated;
+}
+
+/*!
+ * \brief calculates a disparity map given two images
+ * \param img_left colour data for the left image2
+ * \param img_right colour data for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param disparity_threshold_percent a threshold applied to the disparity map
+ * \param despeckle optionally apply despeckling to clean up the disparity map
+ * \param cross_checking_threshold maximum pixel difference when cross checking
+ * \param disparity_space array used for the disparity space
+ * \param disparity_map returned disparity map
+ * \param matching_buffer optional buffer of matching_buffer_size bytes, so that the colour planes and integral images are not allocated for each frame
+ */
+void stereodense::update_disparity_map(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int max_disparity_percent,
+	int correlation_radius,
+	int smoothing_radius,
+	int disparity_step,
+	int disparity_threshold_percent,
+	bool despeckle,
+	int cross_checking_threshold,
+	unsigned int *disparity_space,
+	unsigned int *disparity_map,
+	unsigned char *matching_buffer)
+{
+	int disparity_space_width = img_width/smoothing_radius;
+	int disparity_space_height = (img_height / vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+	int max_disparity_pixels = max_disparity_percent * img_width / 100;
+
+    // correct the colours of the right image so that they're similar to the left
+    colour_correction(
+	    img_left,
+	    img_right,
+	    img_width,
+	    img_height,
+	    offset_y);
+
+	instruction_set();
+	unsigned char* planes_left;
+	unsigned char* planes_right;
+	unsigned int* channel_integral[6];
+	unsigned char* allocated = matching_buffers(matching_buffer, img_width, img_height, planes_left, planes_right, channel_integral);
+	if (allocated != NULL) matching_buffer = allocated;
+
+	// create the disparity space
+	update_disparity_space(
+		img_left,
+		img_right,
+		img_width,
+		img_height,
+		offset_x,
+		offset_y,
+		vertical_sampling,
+		max_disparity_percent,
+		correlation_radius,
+		smoothing_radius,
+		disparity_step,
+		disparity_space_width,
+		disparity_space_height,
+		disparity_space,
+		matching_buffer);
+
+	// create the disparity map, cross checking with the colour planes of the disparity space
+	memset((void*)disparity_map,'\0',disparity_space_width*disparity_space_height*2*sizeof(unsigned int));
+	select_disparities(
+		img_left, img_right, planes_left, planes_right, NULL, NULL,
+		img_width, img_height, offset_x, offset_y,
+		smoothing_radius, vertical_sampling,
+		disparity_space, disparity_space_width, disparity_space_height, 0, disparity_space_height,
+		disparity_step, 0, max_disparity_pixels/disparity_step, NULL,
+		cross_checking_threshold, 0, disparity_map);
+	if (allocated != NULL) delete [] allocated;
+
+	// threshold, despeckle and scale the disparity map
+	post_process(
+		disparity_space_width,
+		disparity_space_height,
+		max_disparity_pixels,
+		disparity_threshold_percent,
+		despeckle,
+		STEREO_DENSE_SUB_PIXEL,
+		disparity_map);
+}
+
+/*!
+ * \brief calculates a disparity map given two images, using the Hamming distance between census
+ *        transformed images as the matching cost.  The census transform only depends upon the
+ *        ordering of brightness values, so unlike update_disparity_map no colour correction is needed.
+ *        Output is in the same format as update_disparity_map.
+ * \param img_left colour data for the left image
+ * \param img_right colour data for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param disparity_threshold_percent a threshold applied to the disparity map
+ * \param despeckle optionally apply despeckling to clean up the disparity map
+ * \param cross_checking_threshold maximum Hamming distance between census words when cross checking
+ * \param disparity_space array used for the disparity space, of the same size as for update_disparity_map
+ * \param disparity_map returned disparity map
+ */
+void stereodense::update_disparity_map_census(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int max_disparity_percent,
+	int correlation_radius,
+	int smoothing_radius,
+	int disparity_step,
+	int disparity_threshold_percent,
+	bool despeckle,
+	int cross_checking_threshold,
+	unsigned int *disparity_space,
+	unsigned int *disparity_map)
+{
+	int img_pixels = img_width*img_height;
+	int disparity_space_width = img_width/smoothing_radius;
+	int disparity_space_height = (img_height / vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+	int max_disparity_pixels = max_disparity_percent * img_width / 100;
+	int no_of_disparities = max_disparity_pixels / disparity_step;
+
+	instruction_set();
+	unsigned long long* census_left = new unsigned long long[img_pixels];
+	unsigned long long* census_right = new unsigned long long[img_pixels];
+	census_transform(img_left, img_width, img_height, census_left);
+	census_transform(img_right, img_width, img_height, census_right);
+
+	// create the disparity space
+	update_costs(
+		NULL, NULL, census_left, census_right, NULL,
+		img_width, img_height, offset_x, offset_y,
+		vertical_sampling, correlation_radius, smoothing_radius, disparity_step,
+		disparity_space_width, disparity_space_height, 0, disparity_space_height,
+		0, no_of_disparities, NULL, 0, disparity_space);
+
+	// create the disparity map
+	memset((void*)disparity_map,'\0',disparity_space_width*disparity_space_height*2*sizeof(unsigned int));
+	select_disparities(
+		img_left, img_right, NULL, NULL, census_left, census_right,
+		img_width, img_height, offset_x, offset_y,
+		smoothing_radius, vertical_sampling,
+		disparity_space, disparity_space_width, disparity_space_height, 0, disparity_space_height,
+		disparity_step, 0, no_of_disparities, NULL,
+		cross_checking_threshold, 0, disparity_map);
+
+	delete [] census_left;
+	delete [] census_right;
+
+	// threshold, despeckle and scale the disparity map
+	post_process(
+		disparity_space_width,
+		disparity_space_height,
+		max_disparity_pixels,
+		disparity_threshold_percent,
+		despeckle,
+		STEREO_DENSE_SUB_PIXEL,
+		disparity_map);
+}
+
+/*!
+ * \brief returns the number of values needed for the 16 bit disparity space used by update_disparity_map_compact
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param vertical_sampling vertical sampling rate
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param memory_budget maximum number of bytes used for matching.  This covers the disparity space, the colour
+ *        planes and integral images of matching_buffer_size bytes and the scratch memory of matching_scratch_size bytes
+ *        used by each thread.  At least one disparity is matched at a time, so budgets smaller than the memory
+ *        needed for that are exceeded.  The images, the disparity map and the temporary buffers used by post
+ *        processing are not included.
+ * \return number of unsigned short values in the disparity space
+ */
+int stereodense::compact_disparity_space_size(
+	int img_width,
+	int img_height,
+	int vertical_sampling,
+	int max_disparity_percent,
+	int smoothing_radius,
+	int disparity_step,
+	int memory_budget)
+{
+	int disparity_space_width = img_width/smoothing_radius;
+	int disparity_space_height = (img_height / vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+	int values_per_disparity = disparity_space_width*disparity_space_height*2;
+	int no_of_disparities = (max_disparity_percent * img_width / 100) / disparity_step;
+
+	// memory which does not depend upon the number of disparities matched at a time
+	long long fixed = (long long)matching_buffer_size(img_width, img_height) +
+		((long long)omp_get_max_threads()*matching_scratch_size(img_width));
+
+	int disparities = (int)(((long long)memory_budget - fixed) / (values_per_disparity*(int)sizeof(unsigned short)));
+	if (disparities > no_of_disparities) disparities = no_of_disparities;
+	if (disparities < 1) disparities = 1;
+	return(disparities*values_per_disparity);
+}
+
+/*!
+ * \brief calculates a disparity map given two images, using 16 bit values for the disparity space and the disparity map.
+ *        Disparities are matched in groups, so that the disparity space fits within the given memory budget.
+ *        Results are similar to update_disparity_map, but matching scores are scaled to fit into 16 bits.
+ * \param img_left colour data for the left image2
+ * \param img_right colour data for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param disparity_threshold_percent a threshold applied to the disparity map
+ * \param despeckle optionally apply despeckling to clean up the disparity map
+ * \param cross_checking_threshold maximum pixel difference when cross checking
+ * \param memory_budget maximum number of bytes used for matching, as described for compact_disparity_space_size
+ * \param disparity_space array used for the disparity space, with the number of values given by compact_disparity_space_size
+ * \param disparity_map returned disparity map containing a confidence and a disparity in 1/STEREO_DENSE_COMPACT_SUB_PIXEL pixel units for each location
+ * \param matching_buffer optional buffer of matching_buffer_size bytes, so that the colour planes and integral images are not allocated for each frame
+ */
+void stereodense::update_disparity_map_compact(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int max_disparity_percent,
+	int correlation_radius,
+	int smoothing_radius,
+	int disparity_step,
+	int disparity_threshold_percent,
+	bool despeckle,
+	int cross_checking_threshold,
+	int memory_budget,
+	unsigned short *disparity_space,
+	unsigned short *disparity_map,
+	unsigned char *matching_buffer)
+{
+	int disparity_space_width = img_width/smoothing_radius;
+	int disparity_space_height = (img_height / vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+	int disparity_space_pixels = disparity_space_width*disparity_space_height;
+	int max_disparity_pixels = max_disparity_percent * img_width / 100;
+	int no_of_disparities = max_disparity_pixels / disparity_step;
+
+	// number of disparities which fit within the memory budget
+	int disparities_per_pass =
+		compact_disparity_space_size(
+			img_width, img_height, vertical_sampling, max_disparity_percent,
+			smoothing_radius, disparity_step, memory_budget) / (disparity_space_pixels*2);
+
+	// scale matching scores so that the largest sums fit into 16 bits
+	int patch_pixels = correlation_radius*2+1;
+	patch_pixels *= patch_pixels;
+	unsigned long long max_patch_value = (unsigned long long)(3*255*patch_pixels);
+	unsigned long long inner_samples = smoothing_radius*STEREO_DENSE_SMOOTH_VERTICAL;
+	unsigned long long outer_samples = inner_samples*STEREO_DENSE_OUTER_DIVISOR*STEREO_DENSE_OUTER_DIVISOR;
+	int cost_shift = 0;
+	while (((max_patch_value >> cost_shift) * outer_samples) > 65535ULL) cost_shift++;
+
+	// scale correlation values so that they fit into the map
+	unsigned long long max_inner = (max_patch_value >> cost_shift) * inner_samples;
+	unsigned long long max_outer = (max_patch_value >> cost_shift) * outer_samples;
+	unsigned long long max_correlation = 9*((max_inner*STEREO_DENSE_OUTER_DIVISOR) + max_outer);
+	int confidence_shift = 0;
+	while ((max_correlation >> confidence_shift) > 65535ULL) confidence_shift++;
+
+    // correct the colours of the right image so that they're similar to the left
+    colour_correction(
+	    img_left,
+	    img_right,
+	    img_width,
+	    img_height,
+	    offset_y);
+
+	instruction_set();
+	unsigned char* planes_left;
+	unsigned char* planes_right;
+	unsigned int* channel_integral[6];
+	unsigned char* allocated = matching_buffers(matching_buffer, img_width, img_height, planes_left, planes_right, channel_integral);
+	matching_images(img_left, img_right, img_width, img_height, planes_left, planes_right, channel_integral);
+
+	memset((void*)disparity_map,'\0',disparity_space_pixels*2*sizeof(unsigned short));
+
+	for (int first = 0; first < no_of_disparities; first += disparities_per_pass) {
+		int disparities = no_of_disparities - first;
+		if (disparities > disparities_per_pass) disparities = disparities_per_pass;
+
+		// create the disparity space for this group of disparities
+		update_costs(
+			planes_left, planes_right, NULL, NULL, channel_integral,
+			img_width, img_height, offset_x, offset_y,
+			vertical_sampling, correlation_radius, smoothing_radius, disparity_step,
+			disparity_space_width, disparity_space_height, 0, disparity_space_height,
+			first, disparities, NULL, cost_shift, disparity_space);
+
+		// update the disparity map
+		select_disparities(
+			img_left, img_right, planes_left, planes_right, NULL, NULL,
+			img_width, img_height, offset_x, offset_y,
+			smoothing_radius, vertical_sampling,
+			disparity_space, disparity_space_width, disparity_space_height, 0, disparity_space_height,
+			disparity_step, first, disparities, NULL,
+			cross_checking_threshold, confidence_shift, disparity_map);
+	}
+
+	if (allocated != NULL) delete [] allocated;
+
+	// threshold, despeckle and scale the disparity map
+	post_process(
+		disparity_space_width,
+		disparity_space_height,
+		max_disparity_pixels,
+		disparity_threshold_percent,
+		despeckle,
+		STEREO_DENSE_COMPACT_SUB_PIXEL,
+		disparity_map);
+}
+
+/*!
+ * \brief halves the size of an image by averaging blocks of 2x2 pixels
+ * \param img colour image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param shrunk returned image of img_width/2 x img_height/2 pixels
+ */
+void stereodense::shrink(
+	unsigned char* img,
+	int img_width,
+	int img_height,
+	unsigned char* shrunk)
+{
+	int shrunk_width = img_width/2;
+	int shrunk_height = img_height/2;
+	int stride = img_width*3;
+    #pragma omp parallel for
+	for (int y = 0; y < shrunk_height; y++) {
+		int n_shrunk = y*shrunk_width*3;
+		int n = y*2*stride;
+		for (int x = 0; x < shrunk_width*3; x += 3, n_shrunk += 3, n += 6) {
+			for (int col = 0; col < 3; col++) {
+				shrunk[n_shrunk+col] = (unsigned char)(
+					(img[n+col] + img[n+col+3] +
+					 img[n+col+stride] + img[n+col+stride+3] + 2) / 4);
+			}
+		}
+	}
+}
+
+/*!
+ * \brief sets the disparities to be searched at each location from a disparity map at half the resolution.
+ *        The band covers the reliable coarse disparities around each location.  Where there are no
+ *        reliable coarse disparities nearby then all disparities are searched, so that thin structures
+ *        missed at the coarse resolution can still be found.
+ *        Locations at the edge of the disparity space, which are never matched, are given an empty band.
+ * \param coarse_map disparity map at half resolution, with disparities in pixels
+ * \param coarse_width width of the coarse disparity map
+ * \param coarse_height height of the coarse disparity map
+ * \param coarse_smoothing_radius smoothing radius used for the coarse disparity map
+ * \param smoothing_radius smoothing radius at this resolution
+ * \param vertical_sampling vertical sampling rate
+ * \param disparity_space_width width of the disparity space at this resolution
+ * \param disparity_space_height height of the disparity space at this resolution
+ * \param disparity_step disparity step size at this resolution
+ * \param no_of_disparities number of disparities at this resolution
+ * \param fallback_confidence_percent matches with a confidence below this percentage of the mean are treated as unreliable
+ * \param band returned minimum and maximum disparity index for each location
+ */
+void stereodense::disparity_band(
+	unsigned int* coarse_map,
+	int coarse_width,
+	int coarse_height,
+	int coarse_smoothing_radius,
+	int smoothing_radius,
+	int vertical_sampling,
+	int disparity_space_width,
+	int disparity_space_height,
+	int disparity_step,
+	int no_of_disparities,
+	int fallback_confidence_percent,
+	unsigned short* band)
+{
+	// mean confidence of the coarse matches
+	unsigned long long total_confidence = 0;
+	int hits = 0;
+	for (int i = coarse_width*coarse_height*2-2; i >= 0; i -= 2) {
+		if (coarse_map[i] > 0) {
+			total_confidence += coarse_map[i];
+			hits++;
+		}
+	}
+	unsigned int min_confidence = 1;
+	if (hits > 0) {
+		min_confidence = (unsigned int)(total_confidence * fallback_confidence_percent / (100ULL*hits));
+		if (min_confidence < 1) min_confidence = 1;
+	}
+
+	int row_height = STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling;
+	int margin = STEREO_DENSE_PYRAMID_MARGIN + STEREO_DENSE_CROSS_CHECK_TRIES - 1;
+
+    #pragma omp parallel for
+	for (int y = 0; y < disparity_space_height; y++) {
+		// location within the coarse disparity map
+		int cy = ((y*row_height)/2) / row_height;
+		unsigned short* b = &band[y*disparity_space_width*2];
+		for (int x = 0; x < disparity_space_width; x++, b += 2) {
+			int cx = ((x*smoothing_radius)/2) / coarse_smoothing_radius;
+
+			// locations at the edge of the disparity space are never matched
+			if ((x == 0) || (x == disparity_space_width-1) ||
+				(y == 0) || (y == disparity_space_height-1)) {
+				b[0] = 1;
+				b[1] = 0;
+				continue;
+			}
+
+			// range of reliable disparities within the neighbourhood.  Where there are none
+			// the neighbourhood is enlarged, so that gaps in the coarse map are filled in
+			int min_disparity = -1;
+			int max_disparity = -1;
+			for (int radius = 1; radius <= STEREO_DENSE_PYRAMID_RADIUS; radius++) {
+				for (int yy = cy-radius; yy <= cy+radius; yy++) {
+					if ((yy < 0) || (yy >= coarse_height)) continue;
+					for (int xx = cx-radius; xx <= cx+radius; xx++) {
+						if ((xx < 0) || (xx >= coarse_width)) continue;
+						int n = (yy*coarse_width + xx)*2;
+						if (coarse_map[n] < min_confidence) continue;
+						int disparity = (int)coarse_map[n+1]*2;
+						if ((min_disparity < 0) || (disparity < min_disparity)) min_disparity = disparity;
+						if (disparity > max_disparity) max_disparity = disparity;
+					}
+				}
+				if (min_disparity >= 0) break;
+			}
+
+			if (min_disparity < 0) {
+				// search everything
+				b[0] = 0;
+				b[1] = (unsigned short)(no_of_disparities-1);
+			}
+			else {
+				// search around the coarse disparities.  The cross check tries several
+				// disparities above each index, so the lower bound is extended by that amount
+				int min_index = min_disparity - margin;
+				if (min_index < 0) min_index = 0;
+				min_index /= disparity_step;
+				int max_index = (max_disparity + STEREO_DENSE_PYRAMID_MARGIN) / disparity_step;
+				if (max_index > no_of_disparities-1) max_index = no_of_disparities-1;
+				b[0] = (unsigned short)min_index;
+				b[1] = (unsigned short)max_index;
+			}
+		}
+	}
+}
+
+/*!
+ * \brief calculates a disparity map given two images, using a coarse to fine search.
+ *        The full range of disparities is searched at a quarter of the image resolution, then
+ *        at half and full resolution only a band of disparities around the coarser result is
+ *        searched.  Output is in the same format as update_disparity_map.
+ * \param img_left colour data for the left image
+ * \param img_right colour data for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param disparity_threshold_percent a threshold applied to the disparity map
+ * \param despeckle optionally apply despeckling to clean up the disparity map
+ * \param cross_checking_threshold maximum pixel difference when cross checking
+ * \param fallback_confidence_percent coarse matches with a confidence below this percentage of the mean are not used to set the search band
+ * \param disparity_space array used for the disparity space, of the same size as for update_disparity_map
+ * \param disparity_map returned disparity map
+ * \param matching_buffer optional buffer of matching_buffer_size bytes, so that the colour planes and integral images are not allocated for each frame
+ */
+void stereodense::update_disparity_map_pyramid(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int max_disparity_percent,
+	int correlation_radius,
+	int smoothing_radius,
+	int disparity_step,
+	int disparity_threshold_percent,
+	bool despeckle,
+	int cross_checking_threshold,
+	int fallback_confidence_percent,
+	unsigned int *disparity_space,
+	unsigned int *disparity_map,
+	unsigned char *matching_buffer)
+{
+	unsigned char* level_left[STEREO_DENSE_PYRAMID_LEVELS];
+	unsigned char* level_right[STEREO_DENSE_PYRAMID_LEVELS];
+	unsigned int* level_map[STEREO_DENSE_PYRAMID_LEVELS];
+	int level_width[STEREO_DENSE_PYRAMID_LEVELS];
+	int level_height[STEREO_DENSE_PYRAMID_LEVELS];
+	int level_smoothing_radius[STEREO_DENSE_PYRAMID_LEVELS];
+	int level_map_width[STEREO_DENSE_PYRAMID_LEVELS];
+	int level_map_height[STEREO_DENSE_PYRAMID_LEVELS];
+
+    // correct the colours of the right image so that they're similar to the left
+    colour_correction(
+	    img_left,
+	    img_right,
+	    img_width,
+	    img_height,
+	    offset_y);
+
+	// image pyramid
+	level_left[0] = img_left;
+	level_right[0] = img_right;
+	level_width[0] = img_width;
+	level_height[0] = img_height;
+	for (int level = 1; level < STEREO_DENSE_PYRAMID_LEVELS; level++) {
+		level_width[level] = level_width[level-1]/2;
+		level_height[level] = level_height[level-1]/2;
+		level_left[level] = new unsigned char[level_width[level]*level_height[level]*3];
+		level_right[level] = new unsigned char[level_width[level]*level_height[level]*3];
+		shrink(level_left[level-1], level_width[level-1], level_height[level-1], level_left[level]);
+		shrink(level_right[level-1], level_width[level-1], level_height[level-1], level_right[level]);
+	}
+
+	// the colour planes and integral images of the full resolution images are large enough for every level
+	instruction_set();
+	unsigned char* planes_left;
+	unsigned char* planes_right;
+	unsigned int* channel_integral[6];
+	unsigned char* allocated = matching_buffers(matching_buffer, img_width, img_height, planes_left, planes_right, channel_integral);
+	if (allocated != NULL) matching_buffer = allocated;
+
+	unsigned short* band = NULL;
+	for (int level = STEREO_DENSE_PYRAMID_LEVELS-1; level >= 0; level--) {
+		int w = level_width[level];
+		int h = level_height[level];
+		int level_correlation_radius = correlation_radius >> level;
+		int level_disparity_step = disparity_step >> level;
+		if (level_disparity_step < 1) level_disparity_step = 1;
+		level_smoothing_radius[level] = smoothing_radius >> level;
+		if (level_smoothing_radius[level] < 1) level_smoothing_radius[level] = 1;
+		int disparity_space_width = w/level_smoothing_radius[level];
+		int disparity_space_height = (h / vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+		int max_disparity_pixels = max_disparity_percent * w / 100;
+		int no_of_disparities = max_disparity_pixels / level_disparity_step;
+		level_map_width[level] = disparity_space_width;
+		level_map_height[level] = disparity_space_height;
+
+		// search band from the coarser level
+		if (level < STEREO_DENSE_PYRAMID_LEVELS-1) {
+			band = new unsigned short[disparity_space_width*disparity_space_height*2];
+			disparity_band(
+				level_map[level+1],
+				level_map_width[level+1],
+				level_map_height[level+1],
+				level_smoothing_radius[level+1],
+				level_smoothing_radius[level],
+				vertical_sampling,
+				disparity_space_width,
+				disparity_space_height,
+				level_disparity_step,
+				no_of_disparities,
+				fallback_confidence_percent,
+				band);
+			delete [] level_map[level+1];
+		}
+
+		if (level == 0)
+			level_map[level] = disparity_map;
+		else
+			level_map[level] = new unsigned int[disparity_space_width*disparity_space_height*2];
+		memset((void*)level_map[level],'\0',disparity_space_width*disparity_space_height*2*sizeof(unsigned int));
+
+		matching_buffers(matching_buffer, w, h, planes_left, planes_right, channel_integral);
+		matching_images(level_left[level], level_right[level], w, h, planes_left, planes_right, channel_integral);
+
+		update_costs(
+			planes_left, planes_right, NULL, NULL, channel_integral,
+			w, h, offset_x >> level, offset_y >> level,
+			vertical_sampling, level_correlation_radius, level_smoothing_radius[level], level_disparity_step,
+			disparity_space_width, disparity_space_height, 0, disparity_space_height,
+			0, no_of_disparities, band, 0, disparity_space);
+
+		select_disparities(
+			level_left[level], level_right[level], planes_left, planes_right, NULL, NULL,
+			w, h, offset_x >> level, offset_y >> level,
+			level_smoothing_radius[level], vertical_sampling,
+			disparity_space, disparity_space_width, disparity_space_height, 0, disparity_space_height,
+			level_disparity_step, 0, no_of_disparities, band,
+			cross_checking_threshold, 0, level_map[level]);
+
+		if (band != NULL) {
+			delete [] band;
+			band = NULL;
+		}
+
+		// coarse levels are despeckled but not thresholded, so that only
+		// reliable disparities are used to guide the next level
+		if (level > 0) {
+			post_process(
+				disparity_space_width,
+				disparity_space_height,
+				max_disparity_pixels,
+				0, true, 1,
+				level_map[level]);
+		}
+		else {
+			post_process(
+				disparity_space_width,
+				disparity_space_height,
+				max_disparity_pixels,
+				disparity_threshold_percent,
+				despeckle,
+				STEREO_DENSE_SUB_PIXEL,
+				disparity_map);
+		}
+	}
+
+	for (int level = 1; level < STEREO_DENSE_PYRAMID_LEVELS; level++) {
+		delete [] level_left[level];
+		delete [] level_right[level];
+	}
+	if (allocated != NULL) delete [] allocated;
+}
+
+/* returns true if the colour of a pixel differs from the previous frame by more than the threshold */
+static inline bool pixel_changed(
+	unsigned char* img,
+	unsigned char* previous_img,
+	int n,
+	int change_threshold)
+{
+	int diff =
+		ABS((int)img[n] - (int)previous_img[n]) +
+		ABS((int)img[n+1] - (int)previous_img[n+1]) +
+		ABS((int)img[n+2] - (int)previous_img[n+2]);
+	return(diff > change_threshold);
+}
+
+/*!
+ * \brief sets the disparities to be searched at each location from the differences between the current
+ *        and previous frames.  Changed pixels are found at the full image resolution, and every tile of the
+ *        disparity space which lies within a safety border of them is given the full band of disparities.
+ *        Other tiles are given an empty band, so that their previous disparities can be reused.
+ *        Changes below the threshold, and the effect of row-wise colour correction on unchanged
+ *        tiles, are not detected.
+ *        The border covers the correlation window and the outer smoothing window, and a change within the
+ *        right image also affects every left image location which could be matched to it.
+ * \param img_left colour data for the left image
+ * \param img_right colour data for the right image
+ * \param previous_left left image from the previous frame
+ * \param previous_right right image from the previous frame
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param max_disparity_pixels maximum disparity in pixels
+ * \param disparity_step disparity step size
+ * \param disparity_space_width width of the disparity space
+ * \param disparity_space_height height of the disparity space
+ * \param no_of_disparities number of disparities
+ * \param change_threshold sum of the absolute differences of the colour channels above which a pixel has changed
+ * \param band returned minimum and maximum disparity index for each location
+ * \return number of locations to be recomputed
+ */
+int stereodense::temporal_band(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	unsigned char* previous_left,
+	unsigned char* previous_right,
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int correlation_radius,
+	int smoothing_radius,
+	int max_disparity_pixels,
+	int disparity_step,
+	int disparity_space_width,
+	int disparity_space_height,
+	int no_of_disparities,
+	int change_threshold,
+	unsigned short* band)
+{
+	int row_height = STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling;
+	int stride = img_width*3;
+
+	// locations to the right of a changed right image pixel which could be matched to it,
+	// including the disparities tried by the cross check
+	int reach = max_disparity_pixels + (STEREO_DENSE_CROSS_CHECK_TRIES*disparity_step) + correlation_radius;
+	int reach_locations = (reach + smoothing_radius - 1) / smoothing_radius;
+
+	// locations changed directly
+	unsigned char* changed = new unsigned char[disparity_space_width*disparity_space_height];
+    #pragma omp parallel for
+	for (int y = 0; y < disparity_space_height; y++) {
+		unsigned char* c = &changed[y*disparity_space_width];
+		memset((void*)c, '\0', disparity_space_width);
+		for (int yy = y*row_height; yy < (y+1)*row_height; yy++) {
+			if (yy < img_height) {
+				int n = yy*stride;
+				for (int x = 0; x < img_width; x++, n += 3) {
+					if (pixel_changed(img_left, previous_left, n, change_threshold)) {
+						int xx = x / smoothing_radius;
+						if (xx < disparity_space_width) c[xx] |= 1;
+					}
+				}
+			}
+
+			// row of the right image matched with this row of the left image
+			int yr = yy - offset_y;
+			if ((yr >= 0) && (yr < img_height)) {
+				int n = yr*stride;
+				for (int x = 0; x < img_width; x++, n += 3) {
+					if (pixel_changed(img_right, previous_right, n, change_threshold)) {
+						int xl = x + offset_x;
+						if (xl < 0) xl = 0;
+						int xx = xl / smoothing_radius;
+						if (xx < disparity_space_width) c[xx] |= 2;
+					}
+				}
+			}
+		}
+
+		// spread right image changes over the locations which could be matched to them
+		int remaining = 0;
+		for (int x = 0; x < disparity_space_width; x++) {
+			if (c[x] & 2) remaining = reach_locations + 1;
+			if (remaining > 0) {
+				c[x] = 1;
+				remaining--;
+			}
+		}
+	}
+
+	// safety border around changed locations, covering the correlation window
+	// and the outer window used by the winner-take-all
+	int border_x = ((correlation_radius + smoothing_radius - 1) / smoothing_radius) + (2*STEREO_DENSE_OUTER_DIVISOR);
+	int border_y = ((correlation_radius + row_height - 1) / row_height) + (2*STEREO_DENSE_OUTER_DIVISOR);
+
+	// tiles to be recomputed
+	int tiles_across = (disparity_space_width + STEREO_DENSE_TEMPORAL_TILE - 1) / STEREO_DENSE_TEMPORAL_TILE;
+	int tiles_down = (disparity_space_height + STEREO_DENSE_TEMPORAL_TILE - 1) / STEREO_DENSE_TEMPORAL_TILE;
+	unsigned char* tiles = new unsigned char[tiles_across*tiles_down];
+	memset((void*)tiles, '\0', tiles_across*tiles_down);
+	for (int y = 0; y < disparity_space_height; y++) {
+		unsigned char* c = &changed[y*disparity_space_width];
+		int ty = (y - border_y) / STEREO_DENSE_TEMPORAL_TILE;
+		int by = (y + border_y) / STEREO_DENSE_TEMPORAL_TILE;
+		if (y - border_y < 0) ty = 0;
+		if (by > tiles_down-1) by = tiles_down-1;
+		for (int x = 0; x < disparity_space_width; x++) {
+			if (c[x] == 0) continue;
+			int tx = (x - border_x) / STEREO_DENSE_TEMPORAL_TILE;
+			int bx = (x + border_x) / STEREO_DENSE_TEMPORAL_TILE;
+			if (x - border_x < 0) tx = 0;
+			if (bx > tiles_across-1) bx = tiles_across-1;
+			for (int yy = ty; yy <= by; yy++) {
+				memset((void*)&tiles[yy*tiles_across + tx], 1, bx - tx + 1);
+			}
+		}
+	}
+
+	// search every disparity within changed tiles, and none elsewhere.
+	// Locations at the edge of the disparity space are never matched
+	int recomputed = 0;
+	for (int y = 0; y < disparity_space_height; y++) {
+		unsigned short* b = &band[y*disparity_space_width*2];
+		unsigned char* t = &tiles[(y / STEREO_DENSE_TEMPORAL_TILE)*tiles_across];
+		for (int x = 0; x < disparity_space_width; x++, b += 2) {
+			if ((t[x / STEREO_DENSE_TEMPORAL_TILE] != 0) &&
+				(x > 0) && (x < disparity_space_width-1) &&
+				(y > 0) && (y < disparity_space_height-1)) {
+				b[0] = 0;
+				b[1] = (unsigned short)(no_of_disparities-1);
+				recomputed++;
+			}
+			else {
+				b[0] = 1;
+				b[1] = 0;
+			}
+		}
+	}
+
+	delete [] changed;
+	delete [] tiles;
+	return(recomputed);
+}
+
+/*!
+ * \brief calculates a disparity map given two images, recomputing only the parts of the scene which have
+ *        changed since the previous frame.  This suits static cameras viewing mostly static scenes.
+ *        Tiles of the disparity space near to pixels which have changed are matched again, and elsewhere
+ *        the disparities from the previous frame are reused.  Every refresh_interval frames the whole
+ *        disparity map is recomputed, so that slow changes in lighting are not missed.
+ *        Reused disparities are not guaranteed to be the same as those of a full update.  Pixels which
+ *        change by no more than change_threshold, such as with sensor noise, are treated as unchanged, and
+ *        colour correction scales each row of the right image by statistics of the whole row, so that a
+ *        change anywhere within a row slightly alters the corrected colours of the unchanged tiles on it.
+ *        Typically a small fraction of a percent of locations differ from a full update, and the
+ *        differences are removed at the next refresh.
+ *        Output is in the same format as update_disparity_map.
+ * \param img_left colour data for the left image
+ * \param img_right colour data for the right image
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
  * \param disparity_step step size for sampling different disparities
  * \param disparity_threshold_percent a threshold applied to the disparity map
  * \param despeckle optionally apply despeckling to clean up the disparity map
- * \param disparity_space array used for the disparity space
+ * \param cross_checking_threshold maximum pixel difference when cross checking
+ * \param change_threshold sum of the absolute differences of the colour channels above which a pixel has changed
+ * \param refresh_interval number of frames between full updates of the disparity map
+ * \param frame_count number of frames processed so far, which should be zero for the first frame
+ * \param previous_left array of img_width*img_height*3 bytes holding the previous left image
+ * \param previous_right array of img_width*img_height*3 bytes holding the previous right image
+ * \param previous_map disparity map before post processing, of the same size as disparity_map, which is kept between frames
+ * \param disparity_space array used for the disparity space, of the same size as for update_disparity_map
  * \param disparity_map returned disparity map
+ * \param matching_buffer optional buffer of matching_buffer_size bytes, so that the colour planes and integral images are not allocated for each frame
+ * \return percentage of the disparity map which was recomputed
  */
-void stereodense::update_disparity_map(
+int stereodense::update_disparity_map_temporal(
 	unsigned char* img_left,
 	unsigned char* img_right,
 	int img_width,
@@ -797,87 +3294,157 @@ void stereodense::update_disparity_map(
 	int disparity_threshold_percent,
 	bool despeckle,
 	int cross_checking_threshold,
+	int change_threshold,
+	int refresh_interval,
+	int &frame_count,
+	unsigned char *previous_left,
+	unsigned char *previous_right,
+	unsigned int *previous_map,
 	unsigned int *disparity_space,
-	unsigned int *disparity_map)
+	unsigned int *disparity_map,
+	unsigned char *matching_buffer)
 {
+	int img_pixels = img_width*img_height;
 	int disparity_space_width = img_width/smoothing_radius;
 	int disparity_space_height = (img_height / vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+	int disparity_space_pixels = disparity_space_width*disparity_space_height;
 	int max_disparity_pixels = max_disparity_percent * img_width / 100;
+	int no_of_disparities = max_disparity_pixels / disparity_step;
+
+	// is the whole disparity map to be recomputed?
+	bool refresh = ((frame_count <= 0) || (refresh_interval <= 1) || (frame_count % refresh_interval == 0));
+	frame_count++;
+
+	// find the tiles which have changed since the previous frame
+	unsigned short* band = NULL;
+	int recomputed = disparity_space_pixels;
+	if (!refresh) {
+		band = new unsigned short[disparity_space_pixels*2];
+		recomputed = temporal_band(
+			img_left, img_right, previous_left, previous_right,
+			img_width, img_height, offset_x, offset_y,
+			vertical_sampling, correlation_radius, smoothing_radius,
+			max_disparity_pixels, disparity_step,
+			disparity_space_width, disparity_space_height,
+			no_of_disparities, change_threshold, band);
+	}
 
-    // correct the colours of the right image so that they're similar to the left
-    colour_correction(
-	    img_left,
-	    img_right,
-	    img_width,
-	    img_height,
-	    offset_y);
+	// store the images as they were captured, before colour correction
+	memcpy((void*)previous_left, (void*)img_left, img_pixels*3);
+	memcpy((void*)previous_right, (void*)img_right, img_pixels*3);
+
+	if (recomputed > 0) {
+	    // correct the colours of the right image so that they're similar to the left
+	    colour_correction(
+		    img_left,
+		    img_right,
+		    img_width,
+		    img_height,
+		    offset_y);
+
+		// clear the locations to be recomputed
+		if (band == NULL) {
+			memset((void*)previous_map,'\0',disparity_space_pixels*2*sizeof(unsigned int));
+		}
+		else {
+			for (int i = 0; i < disparity_space_pixels; i++) {
+				if (band[i*2] <= band[i*2+1]) {
+					previous_map[i*2] = 0;
+					previous_map[i*2+1] = 0;
+				}
+			}
+		}
 
-	// create the disparity space
-	update_disparity_space(
-		img_left,
-		img_right,
-		img_width,
-		img_height,
-		offset_x,
-		offset_y,
-		vertical_sampling,
-		max_disparity_percent,
-		correlation_radius,
-		smoothing_radius,
-		disparity_step,
-		disparity_space_width,
-		disparity_space_height,
-		disparity_space);
+		instruction_set();
+		unsigned char* planes_left;
+		unsigned char* planes_right;
+		unsigned int* channel_integral[6];
+		unsigned char* allocated = matching_buffers(matching_buffer, img_width, img_height, planes_left, planes_right, channel_integral);
+		matching_images(img_left, img_right, img_width, img_height, planes_left, planes_right, channel_integral);
+
+		update_costs(
+			planes_left, planes_right, NULL, NULL, channel_integral,
+			img_width, img_height, offset_x, offset_y,
+			vertical_sampling, correlation_radius, smoothing_radius, disparity_step,
+			disparity_space_width, disparity_space_height, 0, disparity_space_height,
+			0, no_of_disparities, band, 0, disparity_space);
+
+		select_disparities(
+			img_left, img_right, planes_left, planes_right, NULL, NULL,
+			img_width, img_height, offset_x, offset_y,
+			smoothing_radius, vertical_sampling,
+			disparity_space, disparity_space_width, disparity_space_height, 0, disparity_space_height,
+			disparity_step, 0, no_of_disparities, band,
+			cross_checking_threshold, 0, previous_map);
+
+		if (allocated != NULL) delete [] allocated;
+	}
+	if (band != NULL) delete [] band;
 
-	// create the disparity map
-	disparity_map_from_disparity_space(
-		img_left,
-		img_right,
-		img_width,
-		img_height,
-		offset_x,
-		offset_y,
-		smoothing_radius,
-		vertical_sampling,
-		disparity_space,
+	// threshold, despeckle and scale a copy of the disparity map,
+	// so that the unprocessed disparities can be reused by the next frame
+	memcpy((void*)disparity_map, (void*)previous_map, disparity_space_pixels*2*sizeof(unsigned int));
+	post_process(
 		disparity_space_width,
 		disparity_space_height,
-		disparity_step,
-		max_disparity_pixels/disparity_step,
-		cross_checking_threshold,
+		max_disparity_pixels,
+		disparity_threshold_percent,
+		despeckle,
+		STEREO_DENSE_SUB_PIXEL,
 		disparity_map);
 
-	// optionally apply a threshold to the disparity map
+	return(recomputed * 100 / disparity_space_pixels);
+}
+
+/*!
+ * \brief thresholds and despeckles the disparity map, then scales disparities to sub-pixel units
+ * \param disparity_map_width width of the disparity map
+ * \param disparity_map_height height of the disparity map
+ * \param max_disparity_pixels maximum disparity in pixels
+ * \param disparity_threshold_percent a threshold applied to the disparity map
+ * \param despeckle optionally apply despeckling to clean up the disparity map
+ * \param sub_pixel multiplier applied to disparities
+ * \param disparity_map disparity map
+ */
+template <typename map_type>
+void stereodense::post_process(
+	int disparity_map_width,
+	int disparity_map_height,
+	int max_disparity_pixels,
+	int disparity_threshold_percent,
+	bool despeckle,
+	int sub_pixel,
+	map_type* disparity_map)
+{
+	unsigned int disparity_threshold_pixels = 0;
 	if (disparity_threshold_percent > 0) {
-		unsigned int disparity_threshold_pixels = (unsigned int)(disparity_threshold_percent * max_disparity_pixels / 100);
-	    for (int i = disparity_space_width*disparity_space_height*2-2; i >= 0; i -= 2) {
-		    if (disparity_map[i+1] < disparity_threshold_pixels) {
-		    	disparity_map[i+1] = 0;
-		    }
-	    }
+		disparity_threshold_pixels = (unsigned int)(disparity_threshold_percent * max_disparity_pixels / 100);
 	}
 
-	// clean up the disparity map
 	if (despeckle) {
-		int pass = 0;
-	    while (despeckle_disparity_map(
-		    disparity_space_width,
-		    disparity_space_height,
-		    disparity_map,
-		    max_disparity_pixels)) {
-	    	pass++;
-	    	if (pass > 5) break;
-	    }
+		// threshold, clean up and scale the disparity map in one pass over each tile
+		despeckle_disparity_map(
+			disparity_map_width,
+			disparity_map_height,
+			max_disparity_pixels,
+			disparity_threshold_pixels,
+			sub_pixel,
+			disparity_map);
 	    if (disparity_threshold_percent > 0) {
-	    	post_threshold_filter(disparity_map, disparity_space_width, disparity_space_height, 6);
+	    	post_threshold_filter(disparity_map, disparity_map_width, disparity_map_height, 6);
 	    }
 	}
-
-	// multiply disparity values so that sub-pixel interpolation is possible
-	for (int i = disparity_space_width*disparity_space_height*2-2; i >= 0; i -= 2) {
-		disparity_map[i + 1] *= STEREO_DENSE_SUB_PIXEL;
+	else {
+		// optionally apply a threshold, and multiply disparity values so that sub-pixel interpolation is possible
+	    #pragma omp parallel for
+		for (int i = 0; i < disparity_map_width*disparity_map_height; i++) {
+			map_type* m = &disparity_map[i*2];
+			if (m[1] < disparity_threshold_pixels)
+				m[1] = 0;
+			else
+				m[1] *= sub_pixel;
+		}
 	}
-
 }
 
 /*!
@@ -888,18 +3455,21 @@ void stereodense::update_disparity_map(
  * \param vertical_sampling vertical sampling rate
  * \param smoothing_radius radius in pixels used for disparity space smoothing
  * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param sub_pixel sub-pixel multiplier used for disparities in the map
  * \param disparity_map disparity map to be shown
  */
-void stereodense::show(
+template <typename map_type>
+void stereodense::show_disparities(
 	unsigned char* img,
 	int img_width,
 	int img_height,
 	int vertical_sampling,
 	int smoothing_radius,
 	int max_disparity_percent,
-	unsigned int *disparity_map)
+	int sub_pixel,
+	map_type *disparity_map)
 {
-	int max_disparity_pixels = img_width * max_disparity_percent * STEREO_DENSE_SUB_PIXEL / 100;
+	int max_disparity_pixels = img_width * max_disparity_percent * sub_pixel / 100;
 	int width2 = img_width/smoothing_radius;
 
 	for (int y = 0; y < img_height; y++) {
@@ -915,3 +3485,350 @@ void stereodense::show(
 	}
 }
 
+/*!
+ * \brief show the disparity map
+ * \param img colour image data
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param vertical_sampling vertical sampling rate
+ * \param smoothing_radius radius in pixels used for disparity space smoothing
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param disparity_map disparity map to be shown
+ */
+void stereodense::show(
+	unsigned char* img,
+	int img_width,
+	int img_height,
+	int vertical_sampling,
+	int smoothing_radius,
+	int max_disparity_percent,
+	unsigned int *disparity_map)
+{
+	show_disparities(img, img_width, img_height, vertical_sampling, smoothing_radius, max_disparity_percent, STEREO_DENSE_SUB_PIXEL, disparity_map);
+}
+
+/*!
+ * \brief show a disparity map produced by update_disparity_map_compact
+ * \param img colour image data
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param vertical_sampling vertical sampling rate
+ * \param smoothing_radius radius in pixels used for disparity space smoothing
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param disparity_map disparity map to be shown
+ */
+void stereodense::show(
+	unsigned char* img,
+	int img_width,
+	int img_height,
+	int vertical_sampling,
+	int smoothing_radius,
+	int max_disparity_percent,
+	unsigned short *disparity_map)
+{
+	show_disparities(img, img_width, img_height, vertical_sampling, smoothing_radius, max_disparity_percent, STEREO_DENSE_COMPACT_SUB_PIXEL, disparity_map);
+}
+
+/*!
+ * \brief creates a streaming dense stereo matcher.  Parameters are the same as for stereodense::update_disparity_map
+ * \param img_width width of the image
+ * \param img_height height of the image
+ * \param offset_x calibration offset x
+ * \param offset_y calibration offset y
+ * \param vertical_sampling vertical sampling rate - we don't need every row
+ * \param max_disparity_percent maximum disparity as a percentage of image width
+ * \param correlation_radius radius in pixels used for patch matching
+ * \param smoothing_radius radius in pixels used for smoothing of the disparity space
+ * \param disparity_step step size for sampling different disparities
+ * \param disparity_threshold_percent a threshold applied to the disparity map
+ * \param despeckle optionally apply despeckling to clean up the disparity map
+ * \param cross_checking_threshold maximum pixel difference when cross checking
+ */
+stereodensestream::stereodensestream(
+	int img_width,
+	int img_height,
+	int offset_x,
+	int offset_y,
+	int vertical_sampling,
+	int max_disparity_percent,
+	int correlation_radius,
+	int smoothing_radius,
+	int disparity_step,
+	int disparity_threshold_percent,
+	bool despeckle,
+	int cross_checking_threshold)
+{
+	this->img_width = img_width;
+	this->img_height = img_height;
+	this->offset_x = offset_x;
+	this->offset_y = offset_y;
+	this->vertical_sampling = vertical_sampling;
+	this->correlation_radius = correlation_radius;
+	this->smoothing_radius = smoothing_radius;
+	this->disparity_step = disparity_step;
+	this->disparity_threshold_percent = disparity_threshold_percent;
+	this->despeckle = despeckle;
+	this->cross_checking_threshold = cross_checking_threshold;
+
+	max_disparity_pixels = max_disparity_percent * img_width / 100;
+	no_of_disparities = max_disparity_pixels / disparity_step;
+	disparity_space_width = img_width/smoothing_radius;
+	disparity_space_height = (img_height / vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+
+	// the band always begins on a row of outer cells, so that it can be
+	// moved without changing the layout of the disparity space
+	outer_rows = STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling*STEREO_DENSE_OUTER_DIVISOR;
+
+	// rows of the disparity space within two rows of the edge of the image are not matched,
+	// and each correlation window may wrap onto the next row of the image
+	margin = (2*STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling) + correlation_radius + ABS(offset_y) + 1;
+	int margin_outer_rows = (margin + outer_rows - 1) / outer_rows;
+
+	// the winner-take-all uses outer cells up to two rows above, since the ends of
+	// each row of outer cells wrap onto the next, and cross checks image rows below them
+	keep = margin_outer_rows + 2;
+	if (keep < 4) keep = 4;
+
+	// room for the rows kept, the row being matched, its margin and some rows arriving
+	band_rows = (keep + margin_outer_rows + 3)*outer_rows;
+	if (band_rows > img_height) band_rows = img_height;
+	band_space_rows = band_rows / (STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling);
+
+	int band_pixels = band_rows*img_width;
+	band_left = new unsigned char[band_pixels*3];
+	band_right = new unsigned char[band_pixels*3];
+	planes_left = new unsigned char[band_pixels*3];
+	planes_right = new unsigned char[band_pixels*3];
+	for (int i = 0; i < 6; i++) {
+		channel_integral[i] = new unsigned int[band_pixels+1];
+		integral_above[i] = new unsigned int[img_width+1];
+	}
+	disparity_space = new unsigned int[no_of_disparities*disparity_space_width*band_space_rows*2];
+	selected_map = new unsigned int[disparity_space_width*disparity_space_height*2];
+
+	begin_frame();
+}
+
+stereodensestream::~stereodensestream()
+{
+	delete [] band_left;
+	delete [] band_right;
+	delete [] planes_left;
+	delete [] planes_right;
+	for (int i = 0; i < 6; i++) {
+		delete [] channel_integral[i];
+		delete [] integral_above[i];
+	}
+	delete [] disparity_space;
+	delete [] selected_map;
+}
+
+/*!
+ * \brief starts a new frame, discarding any rows of the current one.
+ *        This happens automatically when rows are pushed after a frame has been completed.
+ */
+void stereodensestream::begin_frame()
+{
+	band_top = 0;
+	rows_received = 0;
+	rows_corrected = 0;
+	next_outer_row = 0;
+	next_selected_row = 1;
+	rows_completed = 0;
+
+	// rows of the disparity space which are never matched are read as zero
+	memset((void*)disparity_space, '\0', no_of_disparities*disparity_space_width*band_space_rows*2*sizeof(unsigned int));
+	memset((void*)selected_map, '\0', disparity_space_width*disparity_space_height*2*sizeof(unsigned int));
+}
+
+/*!
+ * \brief moves the band down the image, discarding the rows above it
+ * \param top new top row of the band, on a row of outer cells
+ */
+void stereodensestream::move_band(
+	int top)
+{
+	int rows = top - band_top;
+
+	// integral images of the rows leaving the band, so that windows which extend beyond
+	// the bottom of the image give the same sums as for the complete image
+    #pragma omp parallel for
+	for (int i = 0; i < 6; i++) {
+		stereodense::integral_channel(
+			i < 3 ? band_left : band_right, i % 3, img_width, 0, rows*img_width,
+			(band_top > 0) ? integral_above[i] : NULL, channel_integral[i]);
+		memcpy((void*)integral_above[i], (void*)&channel_integral[i][(rows-1)*img_width], (img_width+1)*sizeof(unsigned int));
+	}
+
+	memmove((void*)band_left, (void*)&band_left[rows*img_width*3], (rows_received - top)*img_width*3);
+	memmove((void*)band_right, (void*)&band_right[rows*img_width*3], (rows_received - top)*img_width*3);
+
+	// rows of the disparity space which have been matched move with the band,
+	// and the rows uncovered at the bottom are cleared
+	int space_pixels = disparity_space_width*band_space_rows;
+	int inner = (rows / (STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling))*disparity_space_width;
+	int outer = (rows / outer_rows)*(img_width / (smoothing_radius*STEREO_DENSE_OUTER_DIVISOR));
+	for (int i = 0; i < no_of_disparities*2; i++) {
+		unsigned int* plane = &disparity_space[i*space_pixels];
+		int n = ((i & 1) == 0) ? inner : outer;
+		memmove((void*)plane, (void*)&plane[n], (space_pixels - n)*sizeof(unsigned int));
+		memset((void*)&plane[space_pixels - n], '\0', n*sizeof(unsigned int));
+	}
+	band_top = top;
+}
+
+/*!
+ * \brief matches any rows of outer cells whose correlation windows are complete,
+ *        then selects disparities for the rows of the map whose neighbouring outer cells have all been matched
+ */
+void stereodensestream::match_rows()
+{
+	int last_outer_row = (disparity_space_height - 1) / STEREO_DENSE_OUTER_DIVISOR;
+	int end_outer_row = next_outer_row;
+	while (end_outer_row <= last_outer_row) {
+		int needed = (end_outer_row + 1)*outer_rows + margin;
+		if (needed > img_height) needed = img_height;
+		if (rows_received < needed) break;
+		end_outer_row++;
+	}
+	if (end_outer_row == next_outer_row) return;
+
+	// the band is matched as if it were a complete image beginning at the top of the band
+	int band_height = rows_received - band_top;
+	int band_space_top = band_top / (STEREO_DENSE_SMOOTH_VERTICAL*vertical_sampling);
+	int band_pixels = band_height*img_width;
+	stereodense::instruction_set();
+	stereodense::planar(band_left, band_pixels, planes_left);
+	stereodense::planar(band_right, band_pixels, planes_right);
+    #pragma omp parallel for
+	for (int i = 0; i < 6; i++) {
+		stereodense::integral_channel(
+			i < 3 ? band_left : band_right, i % 3, img_width, 0, band_pixels,
+			(band_top > 0) ? integral_above[i] : NULL, channel_integral[i]);
+	}
+
+	int first_row = next_outer_row*STEREO_DENSE_OUTER_DIVISOR;
+	int end_row = end_outer_row*STEREO_DENSE_OUTER_DIVISOR;
+	if (end_row > disparity_space_height) end_row = disparity_space_height;
+	stereodense::update_costs(
+		planes_left, planes_right, NULL, NULL, channel_integral,
+		img_width, band_height, offset_x, offset_y,
+		vertical_sampling, correlation_radius, smoothing_radius, disparity_step,
+		disparity_space_width, band_space_rows, first_row - band_space_top, end_row - first_row,
+		0, no_of_disparities, NULL, 0, disparity_space);
+	next_outer_row = end_outer_row;
+
+	// the winner-take-all uses outer cells up to two rows below
+	int selected_row = disparity_space_height - 1;
+	if (next_outer_row <= last_outer_row) {
+		if (selected_row > (next_outer_row - 2)*STEREO_DENSE_OUTER_DIVISOR) {
+			selected_row = (next_outer_row - 2)*STEREO_DENSE_OUTER_DIVISOR;
+		}
+	}
+	if (selected_row > next_selected_row) {
+		stereodense::select_disparities(
+			band_left, band_right, planes_left, planes_right, NULL, NULL,
+			img_width, band_height, offset_x, offset_y,
+			smoothing_radius, vertical_sampling,
+			disparity_space, disparity_space_width, band_space_rows,
+			next_selected_row - band_space_top, selected_row - next_selected_row,
+			disparity_step, 0, no_of_disparities, NULL,
+			cross_checking_threshold, 0, &selected_map[band_space_top*disparity_space_width*2]);
+		next_selected_row = selected_row;
+	}
+}
+
+/*!
+ * \brief thresholds, despeckles and scales the rows of the map which can no longer be changed by despeckling
+ * \param disparity_map disparity map to be updated
+ */
+void stereodensestream::complete_rows(
+	unsigned int* disparity_map)
+{
+	int passes = despeckle ? STEREO_DENSE_DESPECKLE_PASSES : 0;
+	int completed = next_selected_row - passes;
+	if (next_outer_row > (disparity_space_height - 1) / STEREO_DENSE_OUTER_DIVISOR) {
+		completed = disparity_space_height;
+	}
+	if (completed <= rows_completed) return;
+
+	unsigned int disparity_threshold_pixels = 0;
+	if (disparity_threshold_percent > 0) {
+		disparity_threshold_pixels = (unsigned int)(disparity_threshold_percent * max_disparity_pixels / 100);
+	}
+
+	int w = disparity_space_width;
+	if (despeckle) {
+		// each despeckling pass reaches one row further, so the rows either side are included
+		int ty = rows_completed - passes;
+		int by = completed + passes;
+		if (ty < 0) ty = 0;
+		if (by > disparity_space_height) by = disparity_space_height;
+		unsigned int* rows = new unsigned int[(by - ty)*w*2];
+		memcpy((void*)rows, (void*)&selected_map[ty*w*2], (by - ty)*w*2*sizeof(unsigned int));
+		stereodense::despeckle_disparity_map(
+			w, by - ty, max_disparity_pixels, disparity_threshold_pixels, STEREO_DENSE_SUB_PIXEL, rows);
+		memcpy((void*)&disparity_map[rows_completed*w*2], (void*)&rows[(rows_completed - ty)*w*2], (completed - rows_completed)*w*2*sizeof(unsigned int));
+		delete [] rows;
+	}
+	else {
+		for (int i = rows_completed*w; i < completed*w; i++) {
+			unsigned int* m = &selected_map[i*2];
+			disparity_map[i*2] = m[0];
+			disparity_map[i*2 + 1] = (m[1] < disparity_threshold_pixels) ? 0 : m[1]*STEREO_DENSE_SUB_PIXEL;
+		}
+	}
+	rows_completed = completed;
+}
+
+/*!
+ * \brief adds rectified rows to the current frame, updating the disparity map for any rows which can now be completed.
+ *        The result is the same as stereodense::update_disparity_map, except that the additional filtering applied
+ *        after thresholding a despeckled map is not performed, since it needs complete columns of the map.
+ * \param left_rows colour data for the next rows of the left image
+ * \param right_rows colour data for the next rows of the right image
+ * \param no_of_rows number of rows
+ * \param disparity_map disparity map which is updated as rows are completed
+ * \return number of rows of the disparity map which have been completed for this frame
+ */
+int stereodensestream::push_rows(
+	unsigned char* left_rows,
+	unsigned char* right_rows,
+	int no_of_rows,
+	unsigned int* disparity_map)
+{
+	if (rows_received == img_height) begin_frame();
+	if (no_of_rows > img_height - rows_received) no_of_rows = img_height - rows_received;
+
+	int row_bytes = img_width*3;
+	for (int i = 0; i < no_of_rows; i++) {
+
+		// make room for the row by moving the band down
+		if (rows_received - band_top == band_rows) {
+			match_rows();
+			complete_rows(disparity_map);
+			int top = (next_outer_row - keep)*outer_rows;
+			int waiting = rows_corrected + ((offset_y < 0) ? offset_y : 0);
+			if (top > waiting) top = (waiting / outer_rows)*outer_rows;
+			if (top > band_top) move_band(top);
+		}
+
+		memcpy((void*)&band_left[(rows_received - band_top)*row_bytes], (void*)&left_rows[i*row_bytes], row_bytes);
+		memcpy((void*)&band_right[(rows_received - band_top)*row_bytes], (void*)&right_rows[i*row_bytes], row_bytes);
+		rows_received++;
+
+		// correct the colours of right rows once the corresponding left row has arrived
+		while ((rows_corrected < rows_received) && (rows_corrected + offset_y < rows_received)) {
+			int y_left = rows_corrected + offset_y;
+			if ((y_left > -1) && (y_left < img_height)) {
+				stereodense::colour_correction_row(
+					band_left, band_right, img_width, y_left - band_top, rows_corrected - band_top);
+			}
+			rows_corrected++;
+		}
+	}
+
+	match_rows();
+	complete_rows(disparity_map);
+	return(rows_completed);
+}
@@ -27,9 +27,48 @@
 
 #define STEREO_DENSE_SMOOTH_VERTICAL  2
 #define STEREO_DENSE_SUB_PIXEL        100
+#define STEREO_DENSE_COMPACT_SUB_PIXEL 16
 #define STEREO_DENSE_OUTER_DIVISOR    4
 #define BAD_MATCH                     -1
 
+// number of consecutive disparities cross checked when searching for a valid match
+#define STEREO_DENSE_CROSS_CHECK_TRIES 8
+
+// approximate number of bytes of the disparity map and disparity space processed by each thread at a time
+#define STEREO_DENSE_TILE_BYTES       (128*1024)
+
+// number of resolutions used by the coarse to fine search
+#define STEREO_DENSE_PYRAMID_LEVELS   3
+
+// disparities in pixels searched either side of the coarse result at each finer resolution
+#define STEREO_DENSE_PYRAMID_MARGIN   4
+
+// maximum radius in coarse cells searched for reliable disparities when setting the band at each location
+#define STEREO_DENSE_PYRAMID_RADIUS   4
+
+// width in outer cells of the vertical strips matched when the disparities searched are limited to a band
+#define STEREO_DENSE_BAND_STRIP       2
+
+// number of image rows, including the correlation window either side, covered by the integral image
+// of differences which each thread builds while matching
+#define STEREO_DENSE_DIFFERENCE_ROWS  64
+
+// maximum number of despeckling passes over the disparity map
+#define STEREO_DENSE_DESPECKLE_PASSES 6
+
+// width and height in disparity space locations of the tiles recomputed when part of the scene changes
+#define STEREO_DENSE_TEMPORAL_TILE    8
+
+// size of the window used for the census transform, giving one bit per pixel other than the centre
+#define STEREO_DENSE_CENSUS_WIDTH     9
+#define STEREO_DENSE_CENSUS_HEIGHT    7
+#define STEREO_DENSE_CENSUS_BITS      ((STEREO_DENSE_CENSUS_WIDTH*STEREO_DENSE_CENSUS_HEIGHT)-1)
+
+// instruction sets used by the matching kernels
+#define STEREO_DENSE_SCALAR           0
+#define STEREO_DENSE_SSE2             1
+#define STEREO_DENSE_AVX2             2
+
 #ifndef ABS
 #define ABS(a) ((a)<0?-(a):(a))
 #endif
@@ -45,10 +84,13 @@
 using namespace std;
 
 class stereodense {
+	friend class stereodensestream;
+
 protected:
 
+	template <typename map_type>
 	static void post_threshold_filter(
-		unsigned int *disparity_map,
+		map_type *disparity_map,
 		int disparity_map_width,
 		int disparity_map_height,
 		int feature_size);
@@ -64,6 +106,13 @@ protected:
 	    int &mean_g_deviation,
 	    int &mean_b_deviation);
 
+	static void colour_correction_row(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		int img_width,
+		int y_left,
+		int y_right);
+
 	static void colour_correction(
 		unsigned char* img_left,
 		unsigned char* img_right,
@@ -71,11 +120,14 @@ protected:
 		int img_height,
 		int offset_y);
 
-	static bool despeckle_disparity_map(
+	template <typename map_type>
+	static void despeckle_disparity_map(
 		int disparity_map_width,
 		int disparity_map_height,
-		unsigned int* disparity_map,
-		int max_disparity_pixels);
+		int max_disparity_pixels,
+		unsigned int disparity_threshold_pixels,
+		int sub_pixel,
+		map_type* disparity_map);
 
 	static int SAD(
 		unsigned char* img_left,
@@ -88,6 +140,71 @@ protected:
 		int y_right,
 		int radius);
 
+	static void integral_channel(
+		unsigned char* img,
+		int channel,
+		int img_width,
+		int lo,
+		int hi,
+		unsigned int* above,
+		unsigned int* integral);
+
+	static void integral_difference(
+		unsigned char* planes_left,
+		unsigned char* planes_right,
+		unsigned long long* census_left,
+		unsigned long long* census_right,
+		int img_pixels,
+		int img_width,
+		int offset,
+		int tx,
+		int ty,
+		int bx,
+		int by,
+		unsigned short* difference,
+		unsigned int* integral);
+
+	static void census_transform(
+		unsigned char* img,
+		int img_width,
+		int img_height,
+		unsigned long long* census);
+
+	static int cross_check_census(
+		int x,
+		int y,
+		int disparity,
+		int similarity_threshold,
+		unsigned long long* census_left,
+		unsigned long long* census_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int smoothing_radius,
+		int vertical_sampling);
+
+	static void planar(
+		unsigned char* img,
+		int img_pixels,
+		unsigned char* planes);
+
+	static int cross_check_disparities(
+		int x,
+		int y,
+		int disparity,
+		int similarity_threshold,
+		unsigned char* img_left,
+		unsigned char* img_right,
+		unsigned char* planes_left,
+		unsigned char* planes_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int smoothing_radius,
+		int vertical_sampling);
+
 	static bool cross_check_pixel(
 		int x,
 		int y,
@@ -102,6 +219,136 @@ protected:
 		int smoothing_radius,
 		int vertical_sampling);
 
+	static void matching_images(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		int img_width,
+		int img_height,
+		unsigned char* planes_left,
+		unsigned char* planes_right,
+		unsigned int** channel_integral);
+
+	static unsigned char* matching_buffers(
+		unsigned char* matching_buffer,
+		int img_width,
+		int img_height,
+		unsigned char* &planes_left,
+		unsigned char* &planes_right,
+		unsigned int** channel_integral);
+
+	template <typename cost_type>
+	static void update_costs(
+		unsigned char* planes_left,
+		unsigned char* planes_right,
+		unsigned long long* census_left,
+		unsigned long long* census_right,
+		unsigned int** channel_integral,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int vertical_sampling,
+		int correlation_radius,
+		int smoothing_radius,
+		int disparity_step,
+		int disparity_space_width,
+		int disparity_space_height,
+		int first_row,
+		int no_of_rows,
+		int first_disparity_index,
+		int no_of_disparities,
+		unsigned short* band,
+		int cost_shift,
+		cost_type *disparity_space);
+
+	template <typename cost_type, typename map_type>
+	static void select_disparities(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		unsigned char* planes_left,
+		unsigned char* planes_right,
+		unsigned long long* census_left,
+		unsigned long long* census_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int smoothing_radius,
+		int vertical_sampling,
+		cost_type* disparity_space,
+		int disparity_space_width,
+		int disparity_space_height,
+		int first_row,
+		int no_of_rows,
+		int disparity_step,
+		int first_disparity_index,
+		int no_of_disparities,
+		unsigned short* band,
+		int similarity_threshold,
+		int confidence_shift,
+		map_type* disparity_map);
+
+	template <typename map_type>
+	static void post_process(
+		int disparity_map_width,
+		int disparity_map_height,
+		int max_disparity_pixels,
+		int disparity_threshold_percent,
+		bool despeckle,
+		int sub_pixel,
+		map_type* disparity_map);
+
+	template <typename map_type>
+	static void show_disparities(
+		unsigned char* img,
+		int img_width,
+		int img_height,
+		int vertical_sampling,
+		int smoothing_radius,
+		int max_disparity_percent,
+		int sub_pixel,
+		map_type *disparity_map);
+
+	static void shrink(
+		unsigned char* img,
+		int img_width,
+		int img_height,
+		unsigned char* shrunk);
+
+	static void disparity_band(
+		unsigned int* coarse_map,
+		int coarse_width,
+		int coarse_height,
+		int coarse_smoothing_radius,
+		int smoothing_radius,
+		int vertical_sampling,
+		int disparity_space_width,
+		int disparity_space_height,
+		int disparity_step,
+		int no_of_disparities,
+		int fallback_confidence_percent,
+		unsigned short* band);
+
+	static int temporal_band(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		unsigned char* previous_left,
+		unsigned char* previous_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int vertical_sampling,
+		int correlation_radius,
+		int smoothing_radius,
+		int max_disparity_pixels,
+		int disparity_step,
+		int disparity_space_width,
+		int disparity_space_height,
+		int no_of_disparities,
+		int change_threshold,
+		unsigned short* band);
+
 	static void update_disparity_space(
 		unsigned char* img_left,
 		unsigned char* img_right,
@@ -116,10 +363,21 @@ protected:
 		int disparity_step,
 		int disparity_space_width,
 		int disparity_space_height,
-		unsigned int *disparity_space);
+		unsigned int *disparity_space,
+		unsigned char *matching_buffer = NULL);
 
 public:
 
+	static int matching_buffer_size(
+		int img_width,
+		int img_height);
+
+	static int matching_scratch_size(
+		int img_width);
+
+	static int instruction_set();
+	static int set_instruction_set(int level);
+
 	static void expand(
 		unsigned char *img,
 		int img_width,
@@ -148,6 +406,25 @@ public:
 		unsigned int* disparity_map);
 
 	static void update_disparity_map(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int vertical_sampling,
+		int max_disparity_percent,
+		int correlation_radius,
+		int smoothing_radius,
+		int disparity_step,
+		int disparity_threshold_percent,
+		bool despeckle,
+		int cross_checking_threshold,
+		unsigned int *disparity_space,
+		unsigned int *disparity_map,
+		unsigned char *matching_buffer = NULL);
+
+	static void update_disparity_map_census(
 		unsigned char* img_left,
 		unsigned char* img_right,
 		int img_width,
@@ -165,6 +442,80 @@ public:
 		unsigned int *disparity_space,
 		unsigned int *disparity_map);
 
+	static void update_disparity_map_pyramid(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int vertical_sampling,
+		int max_disparity_percent,
+		int correlation_radius,
+		int smoothing_radius,
+		int disparity_step,
+		int disparity_threshold_percent,
+		bool despeckle,
+		int cross_checking_threshold,
+		int fallback_confidence_percent,
+		unsigned int *disparity_space,
+		unsigned int *disparity_map,
+		unsigned char *matching_buffer = NULL);
+
+	static int update_disparity_map_temporal(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int vertical_sampling,
+		int max_disparity_percent,
+		int correlation_radius,
+		int smoothing_radius,
+		int disparity_step,
+		int disparity_threshold_percent,
+		bool despeckle,
+		int cross_checking_threshold,
+		int change_threshold,
+		int refresh_interval,
+		int &frame_count,
+		unsigned char *previous_left,
+		unsigned char *previous_right,
+		unsigned int *previous_map,
+		unsigned int *disparity_space,
+		unsigned int *disparity_map,
+		unsigned char *matching_buffer = NULL);
+
+	static int compact_disparity_space_size(
+		int img_width,
+		int img_height,
+		int vertical_sampling,
+		int max_disparity_percent,
+		int smoothing_radius,
+		int disparity_step,
+		int memory_budget);
+
+	static void update_disparity_map_compact(
+		unsigned char* img_left,
+		unsigned char* img_right,
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int vertical_sampling,
+		int max_disparity_percent,
+		int correlation_radius,
+		int smoothing_radius,
+		int disparity_step,
+		int disparity_threshold_percent,
+		bool despeckle,
+		int cross_checking_threshold,
+		int memory_budget,
+		unsigned short *disparity_space,
+		unsigned short *disparity_map,
+		unsigned char *matching_buffer = NULL);
+
 	static void show(
 		unsigned char* img,
 		int img_width,
@@ -173,6 +524,98 @@ public:
 		int smoothing_radius,
 		int max_disparity_percent,
 		unsigned int *disparity_map);
+
+	static void show(
+		unsigned char* img,
+		int img_width,
+		int img_height,
+		int vertical_sampling,
+		int smoothing_radius,
+		int max_disparity_percent,
+		unsigned short *disparity_map);
+};
+
+/* calculates a disparity map in the same way as stereodense::update_disparity_map,
+   from rectified rows which are pushed as they become available.  Rows of the
+   disparity map are returned as soon as all of the image rows which they depend
+   upon have arrived, and only a band of rows is held at any time */
+class stereodensestream {
+protected:
+	int img_width;
+	int img_height;
+	int offset_x;
+	int offset_y;
+	int vertical_sampling;
+	int correlation_radius;
+	int smoothing_radius;
+	int disparity_step;
+	int disparity_threshold_percent;
+	bool despeckle;
+	int cross_checking_threshold;
+	int max_disparity_pixels;
+	int no_of_disparities;
+	int disparity_space_width;
+	int disparity_space_height;
+
+	// image rows for each row of outer cells in the disparity space
+	int outer_rows;
+
+	// image rows needed below a row of outer cells before it can be matched
+	int margin;
+
+	// rows of outer cells kept above the next one to be matched when the band moves down
+	int keep;
+
+	// number of image rows and disparity space rows within the band
+	int band_rows;
+	int band_space_rows;
+
+	// position of the band and progress through the current frame
+	int band_top;
+	int rows_received;
+	int rows_corrected;
+	int next_outer_row;
+	int next_selected_row;
+	int rows_completed;
+
+	unsigned char* band_left;
+	unsigned char* band_right;
+	unsigned char* planes_left;
+	unsigned char* planes_right;
+	unsigned int* channel_integral[6];
+	unsigned int* disparity_space;
+	unsigned int* selected_map;
+
+	// last row of the integral images above the band, which those of the band continue
+	unsigned int* integral_above[6];
+
+	void move_band(int top);
+	void match_rows();
+	void complete_rows(unsigned int* disparity_map);
+
+public:
+	void begin_frame();
+
+	int push_rows(
+		unsigned char* left_rows,
+		unsigned char* right_rows,
+		int no_of_rows,
+		unsigned int* disparity_map);
+
+	stereodensestream(
+		int img_width,
+		int img_height,
+		int offset_x,
+		int offset_y,
+		int vertical_sampling,
+		int max_disparity_percent,
+		int correlation_radius,
+		int smoothing_radius,
+		int disparity_step,
+		int disparity_threshold_percent,
+		bool despeckle,
+		int cross_checking_threshold);
+	~stereodensestream();
 };
 
 #endif /* STEREODENSE_H_ */
@@ -0,0 +1,146 @@
+/*
+    sparse stereo tests, which are run by "make test"
+    Copyright (C) 2011 Bob Mottram
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../stereo.h"
+
+/* colour images in which the three channels differ, with vertical edges
+   to be matched.  The right image is shifted by a disparity which
+   increases towards the bottom of the image */
+static void stereo_pair(
+  unsigned char* img_left,
+  unsigned char* img_right,
+  int img_width,
+  int img_height)
+{
+  srand(1);
+  for (int y = 0; y < img_height; y++) {
+    for (int x = 0; x < img_width; x++) {
+      int n = (y*img_width + x)*3;
+      img_left[n] = (unsigned char)(((x/19)*53 + (y/23)*29) & 255);
+      img_left[n+1] = (unsigned char)(((x/29)*97 + (y/31)*31) & 255);
+      img_left[n+2] = (unsigned char)(((x/23)*71 + (y/37)*43 + (rand()%8)) & 255);
+    }
+  }
+  for (int y = 0; y < img_height; y++) {
+    int disparity = 8 + (y*16/img_height);
+    for (int x = 0; x < img_width; x++) {
+      int xl = x + disparity;
+      if (xl > img_width - 1) xl = img_width - 1;
+      for (int c = 0; c < 3; c++) {
+        img_right[(y*img_width + x)*3 + c] = img_left[(y*img_width + xl)*3 + c];
+      }
+    }
+  }
+}
+
+/* returns the number of differences between the features found by two cameras */
+static int compare_features(
+  svs* a,
+  svs* b,
+  int no_of_features_a,
+  int no_of_features_b,
+  const char* name)
+{
+  if (no_of_features_a != no_of_features_b) {
+    printf("%s: %d features from BGR, %d from mono\n", name, no_of_features_a, no_of_features_b);
+    return 1;
+  }
+  int differences = 0;
+  for (int i = 0; i < no_of_features_a; i++) {
+    if ((a->feature_x[i] != b->feature_x[i]) ||
+        (a->descriptor[i] != b->descriptor[i]) ||
+        (a->mean[i] != b->mean[i])) {
+      differences++;
+    }
+  }
+  if (differences > 0) {
+    printf("%s: %d of %d features differ\n", name, differences, no_of_features_a);
+  }
+  return differences;
+}
+
+int main(int argc, char* argv[])
+{
+  const int img_width = 320;
+  const int img_height = 240;
+  const int inhibition_radius = 6;
+  const unsigned int minimum_response = 25;
+  int failures = 0;
+
+  unsigned char* img_left = new unsigned char[img_width*img_height*3];
+  unsigned char* img_right = new unsigned char[img_width*img_height*3];
+  unsigned char* gray_left = new unsigned char[img_width*img_height];
+  unsigned char* gray_right = new unsigned char[img_width*img_height];
+  stereo_pair(img_left, img_right, img_width, img_height);
+
+  /* features and descriptors from the BGR frames */
+  svs* lcam = new svs(img_width, img_height);
+  svs* rcam = new svs(img_width, img_height);
+  int left_features = lcam->get_features_vertical(img_left, inhibition_radius, minimum_response, 0, 0, 0);
+  int right_features = rcam->get_features_vertical(img_right, inhibition_radius, minimum_response, 0, 0, 0);
+  lcam->get_features_horizontal(img_left, inhibition_radius, minimum_response, 0, 0, 0);
+
+  /* the same from the red channel, with descriptors from the BGR frames, as used by main */
+  svs* lcam_mono = new svs(img_width, img_height);
+  svs* rcam_mono = new svs(img_width, img_height);
+  svs::extract_channel(img_left, gray_left, img_width, img_height, 2);
+  svs::extract_channel(img_right, gray_right, img_width, img_height, 2);
+  int left_features_mono = lcam_mono->get_features_vertical_mono(gray_left, inhibition_radius, minimum_response, 0, 0, 0, img_left);
+  int right_features_mono = rcam_mono->get_features_vertical_mono(gray_right, inhibition_radius, minimum_response, 0, 0, 0, img_right);
+  lcam_mono->get_features_horizontal_mono(gray_left, inhibition_radius, minimum_response, 0, 0, 0);
+
+  if (left_features == 0) {
+    printf("no features were found\n");
+    failures++;
+  }
+  failures += compare_features(lcam, lcam_mono, left_features, left_features_mono, "left");
+  failures += compare_features(rcam, rcam_mono, right_features, right_features_mono, "right");
+
+  /* matches */
+  int matches = lcam->match(rcam, 400, 20, 18*5, 7*5, 1, 4, 200, 0);
+  int matches_mono = lcam_mono->match(rcam_mono, 400, 20, 18*5, 7*5, 1, 4, 200, 0);
+  if (matches == 0) {
+    printf("no matches were found\n");
+    failures++;
+  }
+  if (matches != matches_mono) {
+    printf("%d matches from BGR, %d from mono\n", matches, matches_mono);
+    failures++;
+  }
+  else if (memcmp(lcam->svs_matches, lcam_mono->svs_matches, matches*5*sizeof(unsigned int)) != 0) {
+    printf("matches differ\n");
+    failures++;
+  }
+
+  delete lcam;
+  delete rcam;
+  delete lcam_mono;
+  delete rcam_mono;
+  delete [] img_left;
+  delete [] img_right;
+  delete [] gray_left;
+  delete [] gray_right;
+
+  if (failures > 0) {
+    printf("stereo: %d failures\n", failures);
+    return 1;
+  }
+  printf("stereo: ok (%d features, %d matches)\n", left_features, matches);
+  return 0;
+}
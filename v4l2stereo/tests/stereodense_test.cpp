@@ -0,0 +1,182 @@
+/*
+    dense stereo tests, which are run with the address sanitizer by "make test"
+    Copyright (C) 2011 Bob Mottram
+    fuzzgun@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../stereodense.h"
+
+/* textured colour images, with the right image shifted by the disparity and the calibration offsets */
+static void stereo_pair(
+	unsigned char* img_left,
+	unsigned char* img_right,
+	int img_width,
+	int img_height,
+	int disparity,
+	int offset_x,
+	int offset_y)
+{
+	srand(1);
+	for (int y = 0; y < img_height; y++) {
+		for (int x = 0; x < img_width; x++) {
+			for (int c = 0; c < 3; c++) {
+				int v = (int)(128 + 60*sin(x*0.13*(c+1) + y*0.07) + 40*cos(y*0.21 - x*0.05*c)) + (rand()%8);
+				img_left[(y*img_width + x)*3 + c] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+			}
+		}
+	}
+	for (int y = 0; y < img_height; y++) {
+		int yl = y + offset_y;
+		for (int x = 0; x < img_width; x++) {
+			int xl = x + disparity + offset_x;
+			for (int c = 0; c < 3; c++) {
+				unsigned char v = 0;
+				if ((yl >= 0) && (yl < img_height) && (xl >= 0) && (xl < img_width)) {
+					v = img_left[(yl*img_width + xl)*3 + c];
+				}
+				img_right[(y*img_width + x)*3 + c] = v;
+			}
+		}
+	}
+}
+
+/* matches one image pair with the full, compact and streamed versions, returning the number of failures */
+static int test_offsets(
+	int offset_x,
+	int offset_y)
+{
+	const int img_width = 320;
+	const int img_height = 240;
+	const int vertical_sampling = 1;
+	const int max_disparity_percent = 13;
+	const int correlation_radius = 5;
+	const int smoothing_radius = 4;
+	const int disparity_step = 2;
+	const int disparity_threshold_percent = 0;
+	const int cross_checking_threshold = 50;
+	const int memory_budget = 1024*1024;
+
+	int disparity_space_width = img_width/smoothing_radius;
+	int disparity_space_height = (img_height/vertical_sampling)/STEREO_DENSE_SMOOTH_VERTICAL;
+	int disparity_space_pixels = disparity_space_width*disparity_space_height;
+	int no_of_disparities = (max_disparity_percent*img_width/100)/disparity_step;
+	int failures = 0;
+
+	unsigned char* img_left = new unsigned char[img_width*img_height*3];
+	unsigned char* img_right = new unsigned char[img_width*img_height*3];
+	unsigned char* left = new unsigned char[img_width*img_height*3];
+	unsigned char* right = new unsigned char[img_width*img_height*3];
+	stereo_pair(img_left, img_right, img_width, img_height, 12, offset_x, offset_y);
+
+	// full disparity space
+	unsigned int* disparity_space = new unsigned int[no_of_disparities*disparity_space_pixels*2];
+	unsigned int* disparity_map = new unsigned int[disparity_space_pixels*2];
+	memcpy(left, img_left, img_width*img_height*3);
+	memcpy(right, img_right, img_width*img_height*3);
+	stereodense::update_disparity_map(
+		left, right, img_width, img_height, offset_x, offset_y,
+		vertical_sampling, max_disparity_percent, correlation_radius, smoothing_radius,
+		disparity_step, disparity_threshold_percent, false, cross_checking_threshold,
+		disparity_space, disparity_map);
+
+	int matched = 0;
+	for (int i = 0; i < disparity_space_pixels; i++) {
+		if (disparity_map[i*2 + 1] > 0) matched++;
+	}
+	if (matched == 0) {
+		printf("offset %d,%d: no disparities were found\n", offset_x, offset_y);
+		failures++;
+	}
+
+	// compact disparity space, matched within a memory budget
+	int compact_size = stereodense::compact_disparity_space_size(
+		img_width, img_height, vertical_sampling, max_disparity_percent,
+		smoothing_radius, disparity_step, memory_budget);
+	unsigned short* compact_space = new unsigned short[compact_size];
+	unsigned short* compact_map = new unsigned short[disparity_space_pixels*2];
+	memcpy(left, img_left, img_width*img_height*3);
+	memcpy(right, img_right, img_width*img_height*3);
+	stereodense::update_disparity_map_compact(
+		left, right, img_width, img_height, offset_x, offset_y,
+		vertical_sampling, max_disparity_percent, correlation_radius, smoothing_radius,
+		disparity_step, disparity_threshold_percent, false, cross_checking_threshold,
+		memory_budget, compact_space, compact_map);
+
+	// rows pushed a few at a time, which should give the same map as the full version
+	unsigned int* stream_map = new unsigned int[disparity_space_pixels*2];
+	memset((void*)stream_map, '\0', disparity_space_pixels*2*sizeof(unsigned int));
+	stereodensestream* stream = new stereodensestream(
+		img_width, img_height, offset_x, offset_y,
+		vertical_sampling, max_disparity_percent, correlation_radius, smoothing_radius,
+		disparity_step, disparity_threshold_percent, false, cross_checking_threshold);
+	stream->begin_frame();
+	int completed = 0;
+	for (int y = 0; y < img_height; y += 7) {
+		int rows = (y + 7 > img_height) ? img_height - y : 7;
+		completed = stream->push_rows(
+			&img_left[y*img_width*3], &img_right[y*img_width*3], rows, stream_map);
+	}
+	delete stream;
+
+	if (completed != disparity_space_height) {
+		printf("offset %d,%d: %d of %d streamed rows were completed\n",
+			offset_x, offset_y, completed, disparity_space_height);
+		failures++;
+	}
+	int differences = 0;
+	for (int i = 0; i < disparity_space_pixels*2; i++) {
+		if (stream_map[i] != disparity_map[i]) differences++;
+	}
+	if (differences > 0) {
+		printf("offset %d,%d: %d streamed values differ from the full disparity map\n",
+			offset_x, offset_y, differences);
+		failures++;
+	}
+
+	delete [] img_left;
+	delete [] img_right;
+	delete [] left;
+	delete [] right;
+	delete [] disparity_space;
+	delete [] disparity_map;
+	delete [] compact_space;
+	delete [] compact_map;
+	delete [] stream_map;
+	return(failures);
+}
+
+int main(int argc, char* argv[])
+{
+	// vertical calibration offsets of both signs move the rows being
+	// compared past the top or bottom of the right image
+	const int offsets[][2] = {
+		{0, 0}, {0, 3}, {0, 5}, {0, 10}, {0, 20}, {0, -10}, {0, -20}, {4, 7}, {-4, -7}
+	};
+	int failures = 0;
+	for (int i = 0; i < (int)(sizeof(offsets)/sizeof(offsets[0])); i++) {
+		failures += test_offsets(offsets[i][0], offsets[i][1]);
+	}
+	if (failures > 0) {
+		printf("stereodense: %d failures\n", failures);
+		return(1);
+	}
+	printf("stereodense: ok\n");
+	return(0);
+}